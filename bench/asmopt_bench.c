@@ -0,0 +1,489 @@
+/*
+ * asmopt_bench.c - Micro-benchmarks for the asmopt pipeline
+ *
+ * Generates synthetic Intel and AT&T inputs that mix every peephole pattern
+ * with ordinary code, then times each phase of the library separately:
+ *
+ *   parse     asmopt_parse_string
+ *   analyze   IR + CFG construction, as the profiler times it in asmopt_optimize
+ *   optimize  asmopt_optimize (IR + CFG + peephole)
+ *   emit      asmopt_generate_assembly
+ *
+ * For every phase it reports lines/s and heap allocations, plus peak RSS per
+ * input size, each size running in a process of its own. --json writes one
+ * JSON object per measurement for regression tracking.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+/* wait4 */
+#define _DEFAULT_SOURCE
+
+#include "asmopt.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if !defined(_WIN32)
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#define ASMOPT_BENCH_MAX_SIZES 16
+
+typedef struct {
+    size_t sizes[ASMOPT_BENCH_MAX_SIZES];
+    size_t size_count;
+    int repeat;
+    bool intel;
+    bool att;
+    const char* json_path;
+} asmopt_bench_options;
+
+typedef struct {
+    const char* name;
+    double seconds;
+    long allocations;
+} asmopt_bench_phase;
+
+#if defined(ASMOPT_BENCH_COUNT_ALLOCS)
+/* Linked with -Wl,--wrap so every allocation in the library passes through here. */
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+static long asmopt_bench_alloc_count = 0;
+
+void* __wrap_malloc(size_t size) {
+    asmopt_bench_alloc_count++;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+    asmopt_bench_alloc_count++;
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+    asmopt_bench_alloc_count++;
+    return __real_realloc(ptr, size);
+}
+
+static long asmopt_bench_allocations(void) {
+    return asmopt_bench_alloc_count;
+}
+#else
+static long asmopt_bench_allocations(void) {
+    return -1;
+}
+#endif
+
+static double asmopt_bench_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+/*
+ * Snippets are weighted so roughly a third of the lines trigger a pattern,
+ * the rest being loads, stores, calls, comments, directives and labels.
+ * "@" is replaced by a per-snippet label number.
+ */
+static const char* const INTEL_SNIPPETS[] = {
+    "    mov rax, rax",
+    "    mov rax, 0",
+    "    imul rbx, 1",
+    "    imul rcx, 8",
+    "    add rdx, 0",
+    "    shl rsi, 0",
+    "    or rdi, 0",
+    "    xor r8, 0",
+    "    and r9, -1",
+    "    add r10, 1",
+    "    sub r11, 1",
+    "    sub rax, rax",
+    "    and rbx, 0",
+    "    cmp rcx, 0",
+    "    or rdx, rdx",
+    "    add rsi, -1",
+    "    sub rdi, -1",
+    "    and r8, r8",
+    "    cmp r9, r9",
+    "    lea rax, [rax]",
+    "    bsf rax, rbx",
+    "    mov rax, rbx\n    mov rbx, rax",
+    "    mov rax, rbx\n    mov rax, rcx",
+    "    mov r12, r13\n    mov r14, r15",
+    "    mov rax, [rbp-8]\n    add rax, 4\n    mov [rbp-8], rax",
+    "    jmp L@\nL@:",
+    "    jz La@\n    jmp Lb@\nLa@:\nLb@:",
+    "    test rax, rax\n    jz Lz@\n    mov rax, 0\nLz@:",
+    ".hot_loop:",
+    "    mov rax, [rsi+8]",
+    "    mov [rdi+16], rcx",
+    "    add rax, rbx",
+    "    imul rdx, rcx",
+    "    call helper",
+    "    ret",
+    "    mov eax, dword ptr [rsp+4]    ; reload",
+    "; loop body",
+    "    .p2align 4",
+    "",
+    "f@:",
+    "    lea rcx, [rax+rbx*4]",
+    "    cmp rax, rbx\n    jne L@\nL@:",
+};
+
+static const char* const ATT_SNIPPETS[] = {
+    "    movq %rax, %rax",
+    "    movq $0, %rax",
+    "    imulq $1, %rbx",
+    "    imulq $8, %rcx",
+    "    addq $0, %rdx",
+    "    shlq $0, %rsi",
+    "    orq $0, %rdi",
+    "    xorq $0, %r8",
+    "    andq $-1, %r9",
+    "    addq $1, %r10",
+    "    subq $1, %r11",
+    "    subq %rax, %rax",
+    "    andq $0, %rbx",
+    "    cmpq $0, %rcx",
+    "    orq %rdx, %rdx",
+    "    addq $-1, %rsi",
+    "    subq $-1, %rdi",
+    "    andq %r8, %r8",
+    "    cmpq %r9, %r9",
+    "    leaq (%rax), %rax",
+    "    bsfq %rbx, %rax",
+    "    movq %rbx, %rax\n    movq %rax, %rbx",
+    "    movq %rbx, %rax\n    movq %rcx, %rax",
+    "    movq %r13, %r12\n    movq %r15, %r14",
+    "    movq -8(%rbp), %rax\n    addq $4, %rax\n    movq %rax, -8(%rbp)",
+    "    jmp L@\nL@:",
+    "    jz La@\n    jmp Lb@\nLa@:\nLb@:",
+    "    testq %rax, %rax\n    jz Lz@\n    movq $0, %rax\nLz@:",
+    ".hot_loop:",
+    "    movq 8(%rsi), %rax",
+    "    movq %rcx, 16(%rdi)",
+    "    addq %rbx, %rax",
+    "    imulq %rcx, %rdx",
+    "    call helper",
+    "    ret",
+    "    movl 4(%rsp), %eax    # reload",
+    "# loop body",
+    "    .p2align 4",
+    "",
+    "f@:",
+    "    leaq (%rax,%rbx,4), %rcx",
+    "    cmpq %rbx, %rax\n    jne L@\nL@:",
+};
+
+#define ASMOPT_BENCH_SNIPPETS (sizeof(INTEL_SNIPPETS) / sizeof(INTEL_SNIPPETS[0]))
+
+/* Deterministic xorshift so every run measures the same input. */
+static uint32_t asmopt_bench_next(uint32_t* state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+/* Copy snippet into line, replacing every "@" with the label number. */
+static size_t asmopt_bench_expand(char* line, size_t size, const char* snippet, size_t label) {
+    char number[24];
+    int number_len = snprintf(number, sizeof(number), "%zu", label);
+    size_t len = 0;
+    for (const char* ptr = snippet; *ptr && len + (size_t)number_len + 1 < size; ptr++) {
+        if (*ptr == '@') {
+            memcpy(line + len, number, (size_t)number_len);
+            len += (size_t)number_len;
+        } else {
+            line[len++] = *ptr;
+        }
+    }
+    line[len] = '\0';
+    return len;
+}
+
+/* Build about line_count lines; returns the text and stores the exact count. */
+static char* asmopt_bench_generate(size_t line_count, bool att, size_t* lines_out) {
+    const char* const* snippets = att ? ATT_SNIPPETS : INTEL_SNIPPETS;
+    size_t capacity = line_count * 24 + 256;
+    size_t length = 0;
+    char* text = malloc(capacity);
+    if (!text) {
+        return NULL;
+    }
+    uint32_t state = 0x9e3779b9u;
+    size_t lines = 0;
+    size_t label = 0;
+    while (lines < line_count) {
+        const char* snippet = snippets[asmopt_bench_next(&state) % ASMOPT_BENCH_SNIPPETS];
+        char line[256];
+        size_t len = asmopt_bench_expand(line, sizeof(line), snippet, label++);
+        if (length + len + 2 > capacity) {
+            capacity = capacity * 2 + len + 2;
+            char* next = realloc(text, capacity);
+            if (!next) {
+                free(text);
+                return NULL;
+            }
+            text = next;
+        }
+        memcpy(text + length, line, len);
+        length += len;
+        text[length++] = '\n';
+        for (size_t i = 0; i < len; i++) {
+            lines += line[i] == '\n';
+        }
+        lines++;
+    }
+    text[length] = '\0';
+    *lines_out = lines;
+    return text;
+}
+
+static bool asmopt_bench_run(const char* text, bool att, asmopt_bench_phase* phases) {
+    asmopt_context* ctx = asmopt_create("x86-64");
+    if (!ctx) {
+        return false;
+    }
+    asmopt_set_format(ctx, att ? "att" : "intel");
+    asmopt_set_target_cpu(ctx, "zen3");
+    asmopt_set_option(ctx, "hot_align", "1");
+    bool ok = true;
+
+    long allocs = asmopt_bench_allocations();
+    double start = asmopt_bench_now();
+    ok = ok && asmopt_parse_string(ctx, text) == 0;
+    phases[0].seconds = asmopt_bench_now() - start;
+    phases[0].allocations = asmopt_bench_allocations() - allocs;
+
+    /*
+     * IR and CFG are only built inside a full optimize, so the profiler times
+     * them there; allocations cannot be told apart from the peephole ones. With
+     * the profiler compiled out, time a CFG dump instead, which builds both.
+     */
+    asmopt_profile profile;
+    asmopt_set_option(ctx, "profile", "1");
+    ok = ok && asmopt_optimize(ctx) == 0;
+    if (asmopt_get_profile(ctx, &profile) == 0) {
+        phases[1].seconds = profile.ir_seconds + profile.cfg_seconds;
+        phases[1].allocations = -1;
+    } else {
+        ok = ok && asmopt_parse_string(ctx, text) == 0;
+        allocs = asmopt_bench_allocations();
+        start = asmopt_bench_now();
+        char* dump = asmopt_dump_cfg_text(ctx);
+        phases[1].seconds = asmopt_bench_now() - start;
+        phases[1].allocations = asmopt_bench_allocations() - allocs;
+        ok = ok && dump != NULL;
+        free(dump);
+    }
+    asmopt_set_option(ctx, "profile", "0");
+
+    /* asmopt_optimize appends to the output, so start again from a fresh parse. */
+    ok = ok && asmopt_parse_string(ctx, text) == 0;
+    allocs = asmopt_bench_allocations();
+    start = asmopt_bench_now();
+    ok = ok && asmopt_optimize(ctx) == 0;
+    phases[2].seconds = asmopt_bench_now() - start;
+    phases[2].allocations = asmopt_bench_allocations() - allocs;
+
+    allocs = asmopt_bench_allocations();
+    start = asmopt_bench_now();
+    char* output = asmopt_generate_assembly(ctx);
+    phases[3].seconds = asmopt_bench_now() - start;
+    phases[3].allocations = asmopt_bench_allocations() - allocs;
+    ok = ok && output != NULL;
+
+    free(output);
+    asmopt_destroy(ctx);
+    return ok;
+}
+
+/* Best-of-repeat phase figures for one input size. */
+typedef struct {
+    size_t lines;
+    double seconds[4];
+    long allocations[4];
+} asmopt_bench_result;
+
+/* Generate size lines and keep the fastest of repeat runs of each phase. */
+static bool asmopt_bench_size(size_t size, bool att, int repeat, asmopt_bench_result* result) {
+    char* text = asmopt_bench_generate(size, att, &result->lines);
+    if (!text) {
+        fprintf(stderr, "Failed to generate %zu lines\n", size);
+        return false;
+    }
+    for (int r = 0; r < repeat; r++) {
+        asmopt_bench_phase run[4] = {{"parse", 0, 0}, {"analyze", 0, 0}, {"optimize", 0, 0}, {"emit", 0, 0}};
+        if (!asmopt_bench_run(text, att, run)) {
+            fprintf(stderr, "Benchmark run failed at %zu lines\n", result->lines);
+            free(text);
+            return false;
+        }
+        for (size_t p = 0; p < 4; p++) {
+            if (r == 0 || run[p].seconds < result->seconds[p]) {
+                result->seconds[p] = run[p].seconds;
+                result->allocations[p] = run[p].allocations;
+            }
+        }
+    }
+    free(text);
+    return true;
+}
+
+/*
+ * ru_maxrss never goes down within a process, so each size runs in a child of
+ * its own and wait4 reports that child's peak RSS; the figures come back
+ * through a pipe. Without fork the size runs here and *rss_kb stays -1.
+ */
+static bool asmopt_bench_measure(size_t size, bool att, int repeat, asmopt_bench_result* result, long* rss_kb) {
+    memset(result, 0, sizeof(*result));
+#if !defined(_WIN32)
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        return false;
+    }
+    fflush(NULL);
+    pid_t child = fork();
+    if (child < 0) {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    if (child == 0) {
+        close(fds[0]);
+        bool ok = asmopt_bench_size(size, att, repeat, result) &&
+                  write(fds[1], result, sizeof(*result)) == (ssize_t)sizeof(*result);
+        _exit(ok ? 0 : 1);
+    }
+    close(fds[1]);
+    ssize_t received = read(fds[0], result, sizeof(*result));
+    close(fds[0]);
+    int status = 0;
+    struct rusage usage;
+    if (wait4(child, &status, 0, &usage) != child || !WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+        received != (ssize_t)sizeof(*result)) {
+        return false;
+    }
+    *rss_kb = usage.ru_maxrss;
+    return true;
+#else
+    return asmopt_bench_size(size, att, repeat, result);
+#endif
+}
+
+static void asmopt_bench_usage(const char* prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "Options:\n"
+            "  --max-lines <n>          Largest input size (default 1000000; sizes step by 10x from 1000)\n"
+            "  --lines <n>              Benchmark one input size (repeatable)\n"
+            "  --repeat <n>             Runs per size; the fastest run is reported (default 3)\n"
+            "  --syntax <intel|att|both> Input syntax (default both)\n"
+            "  --json <file>            Write JSON lines results (\"-\" for stdout)\n",
+            prog);
+}
+
+static bool asmopt_bench_parse_args(int argc, char** argv, asmopt_bench_options* options) {
+    size_t max_lines = 1000000;
+    options->repeat = 3;
+    options->intel = true;
+    options->att = true;
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        if (i + 1 >= argc) {
+            return false;
+        }
+        const char* value = argv[++i];
+        if (strcmp(arg, "--max-lines") == 0) {
+            max_lines = strtoull(value, NULL, 10);
+        } else if (strcmp(arg, "--lines") == 0) {
+            if (options->size_count == ASMOPT_BENCH_MAX_SIZES) {
+                return false;
+            }
+            options->sizes[options->size_count++] = strtoull(value, NULL, 10);
+        } else if (strcmp(arg, "--repeat") == 0) {
+            options->repeat = atoi(value);
+        } else if (strcmp(arg, "--syntax") == 0) {
+            options->intel = strcmp(value, "intel") == 0 || strcmp(value, "both") == 0;
+            options->att = strcmp(value, "att") == 0 || strcmp(value, "both") == 0;
+        } else if (strcmp(arg, "--json") == 0) {
+            options->json_path = value;
+        } else {
+            return false;
+        }
+    }
+    if (options->size_count == 0) {
+        for (size_t size = 1000; size <= max_lines && options->size_count < ASMOPT_BENCH_MAX_SIZES; size *= 10) {
+            options->sizes[options->size_count++] = size;
+        }
+    }
+    return options->repeat > 0 && (options->intel || options->att);
+}
+
+static void asmopt_bench_report(FILE* json, const char* syntax, size_t lines, const asmopt_bench_phase* phases,
+                                size_t phase_count, long rss_kb) {
+    for (size_t i = 0; i < phase_count; i++) {
+        double rate = phases[i].seconds > 0 ? (double)lines / phases[i].seconds : 0.0;
+        printf("%-6s %10zu  %-9s %10.4f s %14.0f lines/s %12ld allocs\n", syntax, lines, phases[i].name,
+               phases[i].seconds, rate, phases[i].allocations);
+        if (json) {
+            fprintf(json,
+                    "{\"syntax\":\"%s\",\"lines\":%zu,\"phase\":\"%s\",\"seconds\":%.6f,"
+                    "\"lines_per_second\":%.0f,\"allocations\":%ld,\"peak_rss_kb\":%ld}\n",
+                    syntax, lines, phases[i].name, phases[i].seconds, rate, phases[i].allocations, rss_kb);
+        }
+    }
+    printf("%-6s %10zu  peak RSS %ld KB\n", syntax, lines, rss_kb);
+}
+
+int main(int argc, char** argv) {
+    asmopt_bench_options options = {0};
+    if (!asmopt_bench_parse_args(argc, argv, &options)) {
+        asmopt_bench_usage(argv[0]);
+        return 1;
+    }
+    FILE* json = NULL;
+    if (options.json_path) {
+        json = strcmp(options.json_path, "-") == 0 ? stdout : fopen(options.json_path, "w");
+        if (!json) {
+            fprintf(stderr, "Failed to open %s\n", options.json_path);
+            return 1;
+        }
+    }
+    int exit_code = 0;
+    for (int s = 0; s < 2 && exit_code == 0; s++) {
+        bool att = s == 1;
+        if ((att && !options.att) || (!att && !options.intel)) {
+            continue;
+        }
+        for (size_t i = 0; i < options.size_count; i++) {
+            asmopt_bench_result result;
+            long rss_kb = -1;
+            if (!asmopt_bench_measure(options.sizes[i], att, options.repeat, &result, &rss_kb)) {
+                exit_code = 1;
+                break;
+            }
+            asmopt_bench_phase best[4] = {{"parse", 0, 0}, {"analyze", 0, 0}, {"optimize", 0, 0}, {"emit", 0, 0}};
+            for (size_t p = 0; p < 4; p++) {
+                best[p].seconds = result.seconds[p];
+                best[p].allocations = result.allocations[p];
+            }
+            asmopt_bench_report(json, att ? "att" : "intel", result.lines, best, 4, rss_kb);
+        }
+    }
+    if (json && json != stdout) {
+        fclose(json);
+    }
+    return exit_code;
+}
@@ -2,6 +2,7 @@
 #define ASMOPT_H
 
 #include <stddef.h>
+#include <stdio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -9,18 +10,55 @@ extern "C" {
 
 #define ASMOPT_HOT_LOOP_ALIGNMENT 64
 
+/* asmopt_set_optimization_level value for -Os: -O2's passes, with rewrites ranked by encoded size. */
+#define ASMOPT_LEVEL_SIZE 's'
+
 typedef struct asmopt_context asmopt_context;
 
+#define ASMOPT_PROFILE_MAX_PATTERNS 64
+
+/* Filled by asmopt_get_profile when the "profile" option is "1". Times are monotonic seconds. */
+typedef struct {
+    double parse_seconds;
+    double ir_seconds;
+    double cfg_seconds;
+    double peephole_seconds;
+    double emit_seconds;
+    /* Time in the handlers with multi-line patterns: mov/jmp/jcc, vector moves and loads (summed over threads). */
+    double lookahead_seconds;
+    /* Heap bytes requested for input, line tables, IR, CFG, output and report storage. */
+    size_t bytes_allocated;
+    size_t lines_examined;
+    size_t lookahead_attempts;
+    size_t lookahead_hits;
+    size_t pattern_count;
+    const char* pattern_names[ASMOPT_PROFILE_MAX_PATTERNS];
+    size_t pattern_attempts[ASMOPT_PROFILE_MAX_PATTERNS];
+    size_t pattern_hits[ASMOPT_PROFILE_MAX_PATTERNS];
+} asmopt_profile;
+
 asmopt_context* asmopt_create(const char* architecture);
 void asmopt_set_option(asmopt_context* ctx, const char* option, const char* value);
 void asmopt_set_optimization_level(asmopt_context* ctx, int level);
 void asmopt_set_target_cpu(asmopt_context* ctx, const char* cpu);
 int asmopt_parse_file(asmopt_context* ctx, const char* filename);
 int asmopt_parse_string(asmopt_context* ctx, const char* assembly);
+/* Drops the input and results but keeps the configuration and allocated storage for the next parse. */
+void asmopt_reset(asmopt_context* ctx);
 int asmopt_optimize(asmopt_context* ctx);
+/* Replaces `removed` lines from first_line (1-based) with the lines of new_text and optimizes again,
+ * re-running only the functions whose text changed. Returns -1 for a range outside the input. */
+int asmopt_apply_edit(asmopt_context* ctx, size_t first_line, size_t removed, const char* new_text);
 char* asmopt_generate_assembly(asmopt_context* ctx);
+/* Writes the output into a caller buffer; *length gets the required size (without NUL). Returns -1 if it does not fit. */
+int asmopt_generate_assembly_into(asmopt_context* ctx, char* buffer, size_t capacity, size_t* length);
 char* asmopt_generate_report(asmopt_context* ctx);
+/* Writes the report to output as "text" (asmopt_generate_report), "json", "jsonl" or "binary";
+ * all but text go out event by event. Returns -1 for an unknown format or a write error. */
+int asmopt_write_report(asmopt_context* ctx, FILE* output, const char* format);
 void asmopt_get_stats(asmopt_context* ctx, size_t* original, size_t* optimized, size_t* replacements, size_t* removals);
+/* Returns -1 (with zeroed counters) unless profiling is enabled and compiled in. */
+int asmopt_get_profile(asmopt_context* ctx, asmopt_profile* profile);
 void asmopt_destroy(asmopt_context* ctx);
 void asmopt_enable_optimization(asmopt_context* ctx, const char* name);
 void asmopt_disable_optimization(asmopt_context* ctx, const char* name);
@@ -31,6 +69,14 @@ void asmopt_set_amd_optimizations(asmopt_context* ctx, int enabled);
 char* asmopt_dump_ir_text(asmopt_context* ctx);
 char* asmopt_dump_cfg_text(asmopt_context* ctx);
 char* asmopt_dump_cfg_dot(asmopt_context* ctx);
+/* Optimizes inputs[i] into outputs[i] with ctx's settings, threads=N files at a time.
+ * Stats in ctx become the totals; returns the number of failed files, or -1 on bad arguments. */
+int asmopt_optimize_files(asmopt_context* ctx, const char* const* inputs, const char* const* outputs, size_t count);
+/* 0 if inputs[index] of the last asmopt_optimize_files call was written, -1 if it failed or index is out of range. */
+int asmopt_get_file_result(asmopt_context* ctx, size_t index);
+/* Optimizes input to output through a small sliding window, writing lines as soon as they are final.
+ * Only stats are kept (no per-line report events, IR or CFG); returns -1 on read/write failure. */
+int asmopt_optimize_stream(asmopt_context* ctx, FILE* input, FILE* output);
 
 #ifdef __cplusplus
 }
@@ -25,17 +25,120 @@
  *   - Processes thousands of instructions efficiently
  */
 
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+/* clock_gettime(CLOCK_MONOTONIC) for the phase profiler. */
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include "asmopt.h"
 
 #include <ctype.h>
+#include <limits.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "asmopt.h"
 
+#if !defined(_WIN32) && !defined(__STDC_NO_ATOMICS__)
+#define ASMOPT_HAVE_THREADS 1
+#include <pthread.h>
+#include <stdatomic.h>
+#else
+#define ASMOPT_HAVE_THREADS 0
+#endif
+
+#if !defined(_WIN32)
+#define ASMOPT_HAVE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define ASMOPT_HAVE_MMAP 0
+#endif
+
+/*
+ * Vector byte scanners: SSE2 is part of x86-64, AVX2 is picked at run time.
+ * Build with -DASMOPT_ENABLE_SIMD=0 to keep only the scalar loops.
+ */
+#ifndef ASMOPT_ENABLE_SIMD
+#define ASMOPT_ENABLE_SIMD 1
+#endif
+#if ASMOPT_ENABLE_SIMD && (defined(__x86_64__) || defined(_M_X64))
+#define ASMOPT_HAVE_SSE2 1
+#include <emmintrin.h>
+#else
+#define ASMOPT_HAVE_SSE2 0
+#endif
+#if ASMOPT_HAVE_SSE2 && (defined(__GNUC__) || defined(__clang__))
+#define ASMOPT_HAVE_AVX2 1
+#include <immintrin.h>
+#else
+#define ASMOPT_HAVE_AVX2 0
+#endif
+#if ASMOPT_HAVE_SSE2 && defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#endif
+
 #define IMMEDIATE_BUFFER_SIZE 64
 #define ZERO_GUARD_PATTERN_LINES 3
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ASMOPT_MAX_THREADS 256
+#define ASMOPT_CHUNKS_PER_THREAD 8
+#define ASMOPT_MIN_CHUNK_LINES 1024
+#define READ_CHUNK_SIZE (64 * 1024)
+#define ASMOPT_NO_BLOCK ((size_t)-1)
+/* Input bytes asmopt_detect_syntax looks at before settling on the syntax. */
+#define ASMOPT_SYNTAX_SAMPLE (8 * 1024)
+
+/* Build with -DASMOPT_ENABLE_PROFILE=0 to compile the profiler hooks out entirely. */
+#ifndef ASMOPT_ENABLE_PROFILE
+#define ASMOPT_ENABLE_PROFILE 1
+#endif
+#define ASMOPT_PROFILING(ctx) (ASMOPT_ENABLE_PROFILE && (ctx)->profiling)
+#define ASMOPT_PROFILE_BYTES(ctx, bytes) \
+    do { \
+        if (ASMOPT_PROFILING(ctx)) { \
+            (ctx)->profile.bytes_allocated += (bytes); \
+        } \
+    } while (0)
+/* Streaming window: lines buffered ahead of output, plus the context patterns look at. */
+#define ASMOPT_STREAM_WINDOW 256
+#define ASMOPT_STREAM_HISTORY ZERO_GUARD_PATTERN_LINES
+#define ASMOPT_STREAM_LOOKAHEAD 2
+/* How far a pattern reads around its first line; bounds what a rewrite can affect. */
+#define ASMOPT_PATTERN_READ_AHEAD ASMOPT_STREAM_LOOKAHEAD
+#define ASMOPT_PATTERN_READ_BEHIND ZERO_GUARD_PATTERN_LINES
+#define ASMOPT_MAX_PASSES 8
+/* Longest run of instructions the list scheduler reorders at once. */
+#define ASMOPT_SCHED_WINDOW 32
+#define ASMOPT_SCHED_ISSUE_WIDTH 4
+/* Zen front end: 32-byte fetch windows, 64-byte op-cache lines. */
+#define ASMOPT_FETCH_WINDOW 32
+#define ASMOPT_OP_CACHE_WINDOW 64
+/* Most padding executed on the way into an aligned loop. */
+#define ASMOPT_LOOP_ALIGN_MAX_PADDING 15
+
+/* Execution pipes of the Zen integer and FP clusters, as bits of asmopt_form_cost.ports. */
+#define ASMOPT_PIPE_ALU0 0x001u
+#define ASMOPT_PIPE_ALU1 0x002u
+#define ASMOPT_PIPE_ALU2 0x004u
+#define ASMOPT_PIPE_ALU3 0x008u
+#define ASMOPT_PIPE_AGU0 0x010u
+#define ASMOPT_PIPE_AGU1 0x020u
+#define ASMOPT_PIPE_AGU2 0x040u
+#define ASMOPT_PIPE_FP0 0x080u
+#define ASMOPT_PIPE_FP1 0x100u
+#define ASMOPT_PIPE_FP2 0x200u
+#define ASMOPT_PIPE_FP3 0x400u
+#define ASMOPT_PIPE_ALU (ASMOPT_PIPE_ALU0 | ASMOPT_PIPE_ALU1 | ASMOPT_PIPE_ALU2 | ASMOPT_PIPE_ALU3)
+#define ASMOPT_PIPE_AGU01 (ASMOPT_PIPE_AGU0 | ASMOPT_PIPE_AGU1)
+#define ASMOPT_PIPE_AGU (ASMOPT_PIPE_AGU0 | ASMOPT_PIPE_AGU1 | ASMOPT_PIPE_AGU2)
+#define ASMOPT_PIPE_COUNT 11
 
 typedef struct {
     size_t original_lines;
@@ -46,41 +149,476 @@ typedef struct {
 
 typedef struct {
     size_t line_no;
-    char* pattern_name;
-    char* original;
-    char* optimized;
+    const char* pattern_name;
+    const char* original;
+    const char* optimized;
 } asmopt_optimization_event;
 
+/* Non-owning slice of the input text; ptr is not NUL-terminated at len. */
+typedef struct {
+    const char* ptr;
+    size_t len;
+} asmopt_view;
+
+#define ASMOPT_VIEW_LIT(text) ((asmopt_view){(text), sizeof(text) - 1})
+
+typedef enum {
+    ASMOPT_LINE_BLANK,
+    ASMOPT_LINE_DIRECTIVE,
+    ASMOPT_LINE_LABEL,
+    ASMOPT_LINE_INSTRUCTION,
+    ASMOPT_LINE_TEXT
+} asmopt_line_kind;
+
+/* Base mnemonics the peephole patterns dispatch on; AT&T size suffixes are stripped. */
+typedef enum {
+    ASMOPT_MN_OTHER,
+    ASMOPT_MN_MOV,
+    ASMOPT_MN_LEA,
+    ASMOPT_MN_ADD,
+    ASMOPT_MN_SUB,
+    ASMOPT_MN_AND,
+    ASMOPT_MN_OR,
+    ASMOPT_MN_XOR,
+    ASMOPT_MN_CMP,
+    ASMOPT_MN_TEST,
+    ASMOPT_MN_SHL,
+    ASMOPT_MN_SHR,
+    ASMOPT_MN_SAL,
+    ASMOPT_MN_SAR,
+    ASMOPT_MN_IMUL,
+    ASMOPT_MN_BSF,
+    ASMOPT_MN_JMP,
+    ASMOPT_MN_JCC,
+    ASMOPT_MN_RET,
+    /* pxor/xorps/xorpd and their VEX and EVEX forms. */
+    ASMOPT_MN_VXOR,
+    /* Full-register vector moves: movdqa/movdqu/movaps/movups/movapd/movupd, v and EVEX forms. */
+    ASMOPT_MN_VMOV,
+    /* Scalar vector loads: movd/movss/movsd and vmovd/vmovq/vmovss/vmovsd. */
+    ASMOPT_MN_VLOAD,
+    ASMOPT_MN_COUNT
+} asmopt_mnemonic;
+
+typedef enum {
+    ASMOPT_OPERAND_NONE,
+    ASMOPT_OPERAND_REG,
+    ASMOPT_OPERAND_IMM,
+    ASMOPT_OPERAND_MEM,
+    ASMOPT_OPERAND_LABEL,
+    ASMOPT_OPERAND_OTHER
+} asmopt_operand_kind;
+
+/*
+ * Registers as one 64-bit set: bits 0-15 are the general-purpose registers
+ * (every width of a register shares its bit), bit 16 the flags as a whole and
+ * bits 32-63 the vector registers, xmmN/ymmN/zmmN sharing bit 32 + N.
+ */
+typedef uint64_t asmopt_regset;
+#define ASMOPT_REGSET_BIT(reg) ((asmopt_regset)1 << (reg))
+#define ASMOPT_REGSET_GPRS ((asmopt_regset)0xffff)
+#define ASMOPT_REGSET_FLAGS ASMOPT_REGSET_BIT(16)
+#define ASMOPT_REGSET_VECTORS ((asmopt_regset)0xffffffff << 32)
+#define ASMOPT_REGSET_ALL (ASMOPT_REGSET_GPRS | ASMOPT_REGSET_FLAGS | ASMOPT_REGSET_VECTORS)
+#define ASMOPT_REG_RAX 0
+#define ASMOPT_REG_RSP 4
+#define ASMOPT_REG_VECTOR0 32
+/* System V AMD64 convention: rbx, rsp, rbp, r12-r15 survive calls; rax, rdx, xmm0-1 return values. */
+#define ASMOPT_REGSET_CALLEE_SAVED ((asmopt_regset)0xf038)
+#define ASMOPT_REGSET_RETURN ((asmopt_regset)0x0005 | ((asmopt_regset)0x3 << ASMOPT_REG_VECTOR0))
+/* rdi, rsi, rdx, rcx, r8, r9, xmm0-7, plus al (vector count) and r10 (static chain). */
+#define ASMOPT_REGSET_ARGUMENTS ((asmopt_regset)0x07c7 | ((asmopt_regset)0xff << ASMOPT_REG_VECTOR0))
+#define ASMOPT_REGSET_CALL_CLOBBERED ((asmopt_regset)0x0fc7 | ASMOPT_REGSET_FLAGS | ASMOPT_REGSET_VECTORS)
+
+/*
+ * What liveness assumes where control leaves the input: the registers a call
+ * reads and clobbers, and the ones a return hands back or must preserve.
+ * Selected by the "abi" option; "none" keeps every register but the flags
+ * live there.
+ */
+typedef struct {
+    const char* name;
+    asmopt_regset arguments;
+    asmopt_regset call_clobbered;
+    asmopt_regset returned;
+    asmopt_regset callee_saved;
+} asmopt_abi;
+
+static const asmopt_abi ASMOPT_ABIS[] = {
+    {"sysv", ASMOPT_REGSET_ARGUMENTS, ASMOPT_REGSET_CALL_CLOBBERED, ASMOPT_REGSET_RETURN, ASMOPT_REGSET_CALLEE_SAVED},
+    /* Microsoft x64: rcx, rdx, r8, r9, xmm0-3 in; rax, xmm0 out; rbx, rsp, rbp, rsi, rdi, r12-r15, xmm6-15 kept. */
+    {"win64", (asmopt_regset)0x0306 | ((asmopt_regset)0xf << ASMOPT_REG_VECTOR0),
+     (asmopt_regset)0x0f07 | ASMOPT_REGSET_FLAGS | ((asmopt_regset)0xffff003f << ASMOPT_REG_VECTOR0),
+     (asmopt_regset)0x0001 | ASMOPT_REGSET_BIT(ASMOPT_REG_VECTOR0),
+     (asmopt_regset)0xf0f8 | ((asmopt_regset)0xffc0 << ASMOPT_REG_VECTOR0)},
+    {"none", ASMOPT_REGSET_ALL, 0, ASMOPT_REGSET_ALL & ~ASMOPT_REGSET_FLAGS, ASMOPT_REGSET_ALL & ~ASMOPT_REGSET_FLAGS},
+};
+
+/*
+ * Memory operand decoded once by the tokenizer. base and index are register
+ * classes (see asmopt_reg_class), -1 when absent; simple is false when the
+ * address also names a symbol, a segment or an unmodelled register, and then
+ * only uses is meaningful.
+ */
+typedef struct {
+    /* Registers the address reads; uses_known is false if one is not modelled. */
+    asmopt_regset uses;
+    int32_t disp;
+    signed char base;
+    signed char index;
+    unsigned char base_width;
+    unsigned char scale;
+    bool simple;
+    bool uses_known;
+} asmopt_address;
+
+typedef struct {
+    asmopt_operand_kind kind;
+    /* Interned id for register-like operands (case-insensitive), -1 otherwise. */
+    int reg;
+    asmopt_view text;
+    bool has_imm;
+    /* Register class and width in bits of a modelled register operand; reg_class is -1 otherwise. */
+    signed char reg_class;
+    unsigned short reg_width;
+    long imm;
+    asmopt_address mem;
+} asmopt_operand;
+
+/*
+ * Fixed-layout record produced once per line by the tokenizer. Every view
+ * points into original_text, so the peephole engine can match and re-emit
+ * lines without re-splitting them or allocating.
+ */
+typedef struct {
+    asmopt_line_kind kind;
+    /* Candidate for peephole rewriting (not a directive/label, mnemonic parsed). */
+    bool is_instruction;
+    bool has_label;
+    bool two_operands;
+    asmopt_mnemonic mnemonic;
+    char suffix;
+    asmopt_view code;
+    asmopt_view label;
+    asmopt_view indent;
+    asmopt_view mnemonic_text;
+    asmopt_view spacing;
+    asmopt_view operands;
+    asmopt_view operands_trimmed;
+    asmopt_view comment;
+    asmopt_view pre_space;
+    asmopt_view post_space;
+    size_t operand_count;
+    /* Operands in textual order; dest/src index them according to the syntax. */
+    asmopt_operand ops[2];
+    unsigned char dest;
+    unsigned char src;
+} asmopt_insn;
+
+/* What one instruction reads and writes; partial register writes count as reads too. */
+typedef struct {
+    asmopt_regset uses;
+    asmopt_regset defs;
+    bool load;
+    bool store;
+} asmopt_effects;
+
+/*
+ * Instruction forms the replacement patterns choose between and the scheduler
+ * prices. Costs describe the 64-bit register form with an 8-bit immediate where
+ * one applies.
+ */
+typedef enum {
+    ASMOPT_FORM_MOV_IMM,
+    ASMOPT_FORM_ALU_IMM,
+    ASMOPT_FORM_ALU_REG,
+    ASMOPT_FORM_ZERO_IDIOM,
+    ASMOPT_FORM_TEST_REG,
+    ASMOPT_FORM_INC_DEC,
+    ASMOPT_FORM_IMUL_IMM,
+    ASMOPT_FORM_SHIFT_IMM,
+    ASMOPT_FORM_BSF,
+    ASMOPT_FORM_TZCNT,
+    /* Forms only the scheduler and the lea patterns price. */
+    ASMOPT_FORM_MOV_REG,
+    ASMOPT_FORM_LOAD,
+    ASMOPT_FORM_STORE,
+    ASMOPT_FORM_LEA,
+    /* lea with a scaled index, and lea adding base, index and displacement. */
+    ASMOPT_FORM_LEA_SCALED,
+    ASMOPT_FORM_LEA_COMPLEX,
+    /* Selects if-conversion emits in place of a branch. */
+    ASMOPT_FORM_CMOV,
+    ASMOPT_FORM_SETCC,
+    ASMOPT_FORM_COUNT
+} asmopt_form;
+
+typedef struct {
+    /* Latency and reciprocal throughput in hundredths of a cycle. */
+    uint16_t latency;
+    uint16_t rthroughput;
+    /* ASMOPT_PIPE_* bits the uops may issue to; zero for rename-eliminated forms. */
+    uint16_t ports;
+    uint8_t uops;
+    /* Encoded bytes; zero when the CPU does not implement the form. */
+    uint8_t size;
+} asmopt_form_cost;
+
+/* Flag producers a CPU fuses with a directly following conditional jump into one macro-op. */
+#define ASMOPT_FUSE_CMP_TEST 0x1u
+#define ASMOPT_FUSE_ALU 0x2u
+
+typedef struct {
+    const char* name;
+    asmopt_form_cost forms[ASMOPT_FORM_COUNT];
+    /* ASMOPT_FUSE_* classes that fuse with a following jcc. */
+    unsigned fusion;
+    /* Cycles a mispredicted branch costs; if-conversion spends up to a quarter of it. */
+    unsigned branch_miss;
+    /* Width of the vector datapath; wider operations are split into that many bits at a time. */
+    unsigned vector_bits;
+    /* Widest vector register the CPU has: a VEX write zeroes the bits above its own width up to this. */
+    unsigned max_vector_bits;
+} asmopt_cpu_model;
+
+typedef enum {
+    ASMOPT_PATTERN_REDUNDANT_MOV,
+    ASMOPT_PATTERN_MOV_ZERO_TO_XOR,
+    ASMOPT_PATTERN_MUL_BY_ONE,
+    ASMOPT_PATTERN_MUL_POWER_OF_2_TO_SHIFT,
+    ASMOPT_PATTERN_ADD_SUB_ZERO,
+    ASMOPT_PATTERN_SHIFT_BY_ZERO,
+    ASMOPT_PATTERN_OR_ZERO,
+    ASMOPT_PATTERN_XOR_ZERO,
+    ASMOPT_PATTERN_AND_MINUS_ONE,
+    ASMOPT_PATTERN_ADD_ONE_TO_INC,
+    ASMOPT_PATTERN_SUB_ONE_TO_DEC,
+    ASMOPT_PATTERN_REDUNDANT_MOVE_PAIR,
+    ASMOPT_PATTERN_SUB_SELF_TO_XOR,
+    ASMOPT_PATTERN_AND_ZERO_TO_XOR,
+    ASMOPT_PATTERN_CMP_ZERO_TO_TEST,
+    ASMOPT_PATTERN_OR_SELF_TO_TEST,
+    ASMOPT_PATTERN_ADD_MINUS_ONE_TO_DEC,
+    ASMOPT_PATTERN_SUB_MINUS_ONE_TO_INC,
+    ASMOPT_PATTERN_AND_SELF_TO_TEST,
+    ASMOPT_PATTERN_CMP_SELF_TO_TEST,
+    ASMOPT_PATTERN_FALLTHROUGH_JUMP,
+    ASMOPT_PATTERN_HOT_LOOP_ALIGN,
+    ASMOPT_PATTERN_BSF_TO_TZCNT,
+    ASMOPT_PATTERN_REDUNDANT_LEA,
+    ASMOPT_PATTERN_INVERT_CONDITIONAL_JUMP,
+    ASMOPT_PATTERN_DEAD_STORE_MOVE,
+    ASMOPT_PATTERN_SCHEDULE_SWAP_MOVE,
+    ASMOPT_PATTERN_LOAD_MODIFY_STORE,
+    ASMOPT_PATTERN_CONSTANT_FOLD,
+    ASMOPT_PATTERN_LEA_SPLIT,
+    ASMOPT_PATTERN_LEA_MERGE,
+    ASMOPT_PATTERN_ADDRESS_FOLD,
+    ASMOPT_PATTERN_VECTOR_ZERO_IDIOM,
+    ASMOPT_PATTERN_VECTOR_REDUNDANT_MOVE,
+    ASMOPT_PATTERN_BROADCAST_LOAD_FOLD,
+    ASMOPT_PATTERN_COUNT
+} asmopt_pattern;
+
+#define ASMOPT_PATTERN_BIT(pattern) ((uint64_t)1 << (pattern))
+#define ASMOPT_PATTERN_ALL (ASMOPT_PATTERN_BIT(ASMOPT_PATTERN_COUNT) - 1)
+
+/* Open-addressing table mapping operand text to dense ids. */
+typedef struct {
+    asmopt_view* names;
+    size_t count;
+    size_t capacity;
+    uint32_t* slots;
+    size_t slot_count;
+    bool fold_case;
+} asmopt_intern_table;
+
+/*
+ * One record per input line. The optimizer only reads insn; the string
+ * fields are filled in lazily for the IR and CFG dumps.
+ */
 typedef struct {
     size_t line_no;
-    char* kind;
     char* text;
     char* mnemonic;
     char** operands;
     size_t operand_count;
+    asmopt_insn insn;
 } asmopt_ir_line;
 
 typedef struct {
     char* name;
     asmopt_ir_line** instructions;
     size_t instruction_count;
+    /* Outgoing edges are cfg_edges[succ_begin, succ_begin + succ_count). */
+    size_t succ_begin;
+    size_t succ_count;
+    /* Incoming edge ids are cfg_pred_edges[pred_begin, pred_begin + pred_count). */
+    size_t pred_begin;
+    size_t pred_count;
+    /* Next block with the same name, or ASMOPT_NO_BLOCK; dumps merge such blocks like DOT does. */
+    size_t same_name_next;
+    /* 1-based input line of the block's label, 0 for unnamed blocks. */
+    size_t label_line;
 } asmopt_cfg_block;
 
+/* Edge between two cfg_blocks indices. */
 typedef struct {
-    char* source;
-    char* target;
+    size_t source;
+    size_t target;
 } asmopt_cfg_edge;
 
+/* One reordered run of instructions, for the report; lines are 1-based output lines. */
+typedef struct {
+    size_t first_line;
+    size_t last_line;
+    unsigned cycles_before;
+    unsigned cycles_after;
+} asmopt_schedule_event;
+
+/* A conditional jump the output fused or unfused; line_no is its input line, branch lives in line_arena. */
+typedef struct {
+    size_t line_no;
+    const char* branch;
+    bool fused;
+} asmopt_fusion_event;
+
+/* One branch if-conversion removed; line_no is the jump's input line, branch and select live in line_arena. */
+typedef struct {
+    size_t line_no;
+    const char* branch;
+    const char* select;
+    unsigned cycles;
+    bool diamond;
+} asmopt_if_convert_event;
+
+/* One aligned loop for the report; label and directive live in line_arena. */
+typedef struct {
+    size_t line_no;
+    const char* label;
+    unsigned bytes;
+    const char* directive;
+} asmopt_loop_align_event;
+
+/*
+ * One instruction the loop pass hoisted (after is NULL) or strength-reduced;
+ * line_no is its input line, or the loop label's when a peephole rewrote it.
+ * label, before and after live in line_arena.
+ */
+typedef struct {
+    size_t line_no;
+    const char* label;
+    const char* before;
+    const char* after;
+} asmopt_loop_opt_event;
+
+/*
+ * A legacy SSE instruction, call or ret reached while a VEX instruction has
+ * left the upper vector halves dirty (avx_line) with no vzeroupper in between.
+ * instruction lives in line_arena.
+ */
+typedef struct {
+    size_t line_no;
+    size_t avx_line;
+    const char* instruction;
+} asmopt_vex_transition_event;
+
+/* One function whose encoded size changed; label points into its input line. */
+typedef struct {
+    size_t line_no;
+    asmopt_view label;
+    size_t bytes_before;
+    size_t bytes_after;
+} asmopt_size_event;
+
+/* Storage of a spliced cache entry: a read-only mapping, or heap memory when map_length is 0. */
+typedef struct {
+    char* data;
+    size_t map_length;
+} asmopt_cache_data;
+
+/* A unit result kept in memory by incremental mode, found by the hash of its key and text. */
+typedef struct {
+    uint64_t hash;
+    char* data;
+    size_t length;
+    /* Spliced into the current output; entries left unused by a run are dropped after it. */
+    bool used;
+} asmopt_unit_memo;
+
 typedef struct {
     char* key;
     char* value;
 } asmopt_option;
 
+/*
+ * Bump allocator for strings whose lifetime matches the parsed input.
+ * Blocks are chained and released together, so per-line text costs one
+ * pointer bump instead of a malloc/free pair.
+ */
+typedef struct asmopt_arena_block {
+    struct asmopt_arena_block* next;
+    size_t used;
+    size_t size;
+    char data[];
+} asmopt_arena_block;
+
+/*
+ * Bookkeeping for the fixpoint passes of asmopt_optimize. The input side says
+ * which lines of the current pass to examine and where they came from; the
+ * output side records, per optimized line, the input line it was copied or
+ * rewritten from and whether a pattern produced it.
+ */
+typedef struct {
+    bool enabled;
+    /* Original line number of each input line; NULL when the input is the original text. */
+    const size_t* origins;
+    /* Input lines to run the patterns on; NULL examines every line. */
+    const bool* visit;
+    /* Input line index each optimized line was copied or rewritten from. */
+    size_t* sources;
+    /* optimized_count + 1 entries: a removal with no output marks the position after it. */
+    bool* touched;
+    size_t capacity;
+} asmopt_worklist;
+
+typedef struct {
+    asmopt_arena_block* head;
+    /* Block bytes obtained since the last asmopt_reset_lines, for the profiler. */
+    size_t allocated;
+} asmopt_arena;
+
+/* Append-only string builder; the tail is tracked so appends never rescan. */
+typedef struct {
+    char* data;
+    size_t length;
+    size_t capacity;
+    bool failed;
+} asmopt_buffer;
+
+/* General-purpose register values known at the current line of the peephole walk. */
+typedef struct {
+    asmopt_regset known;
+    /* Whole 64-bit register contents, by register class. */
+    uint64_t values[16];
+} asmopt_consts;
+
+/* Widest byte scanner the CPU (and the "simd" option) allows. */
+typedef enum {
+    ASMOPT_SCAN_SCALAR,
+    ASMOPT_SCAN_SSE2,
+    ASMOPT_SCAN_AVX2
+} asmopt_scan_level;
+
 struct asmopt_context {
     char* architecture;
     char* target_cpu;
+    /* Cost table for target_cpu, resolved when optimization starts. */
+    const asmopt_cpu_model* cpu_model;
     char* format;
     int optimization_level;
+    /* -Os: optimization_level is 2, and rewrites are ranked by bytes first. */
+    bool optimize_size;
     bool amd_optimizations;
     bool no_optimize;
     bool preserve_all;
@@ -90,27 +628,152 @@ struct asmopt_context {
     size_t disabled_count;
     asmopt_option* options;
     size_t option_count;
+    /* Input text; original_lines are NUL-terminated slices into it. */
     char* original_text;
+    size_t original_length;
+    /* Non-zero when original_text is a private file mapping of this size. */
+    size_t original_map_length;
+    /* Size of a heap original_text, which asmopt_reset keeps for the next parse_string. */
+    size_t text_capacity;
     char** original_lines;
     size_t original_count;
+    size_t original_capacity;
     char** optimized_lines;
     size_t optimized_count;
+    size_t optimized_capacity;
+    /*
+     * IR index of each optimized line the passes copied through, ir_count for
+     * lines they wrote. Only valid while line_origin_count == optimized_count.
+     */
+    size_t* line_origins;
+    size_t line_origin_count;
+    size_t line_origin_capacity;
+    /* Owns optimized line text and event strings. */
+    asmopt_arena line_arena;
+    /* Owns IR strings; released whenever the IR is rebuilt. */
+    asmopt_arena ir_arena;
+    /* Register-like operand ids for the current IR. */
+    asmopt_intern_table operand_names;
     asmopt_stats stats;
     asmopt_ir_line* ir;
     size_t ir_count;
+    size_t ir_capacity;
+    /* The IR strings the dumps print have been filled in. */
+    bool ir_text_ready;
+    /* The IR was tokenized as AT&T; asmopt_optimize reuses an edited IR only for the same syntax. */
+    bool ir_att;
+    /* cfg_blocks describes the current IR; dumps build it on demand. */
+    bool cfg_ready;
     asmopt_cfg_block* cfg_blocks;
     size_t cfg_block_count;
     asmopt_cfg_edge* cfg_edges;
     size_t cfg_edge_count;
+    size_t cfg_edge_capacity;
+    size_t* cfg_pred_edges;
+    /* Block names; cfg_label_blocks[id] is the first block carrying name id. */
+    asmopt_intern_table cfg_labels;
+    size_t* cfg_label_blocks;
+    /*
+     * Liveness over the CFG, indexed by IR line: registers live after the line
+     * and the block holding it (ASMOPT_NO_BLOCK outside blocks). NULL when not
+     * computed, as in streaming mode.
+     */
+    asmopt_regset* live_after;
+    size_t* line_blocks;
+    /* Lines the liveness describes; later passes trust it only for lines still identical to these. */
+    char** live_lines;
+    size_t live_count;
     bool trailing_newline;
     asmopt_optimization_event* opt_events;
     size_t opt_event_count;
     size_t opt_event_capacity;
+    asmopt_schedule_event* schedule_events;
+    size_t schedule_event_count;
+    size_t schedule_event_capacity;
+    asmopt_loop_align_event* loop_align_events;
+    size_t loop_align_event_count;
+    size_t loop_align_event_capacity;
+    asmopt_fusion_event* fusion_events;
+    size_t fusion_event_count;
+    size_t fusion_event_capacity;
+    asmopt_if_convert_event* if_convert_events;
+    size_t if_convert_event_count;
+    size_t if_convert_event_capacity;
+    asmopt_loop_opt_event* loop_opt_events;
+    size_t loop_opt_event_count;
+    size_t loop_opt_event_capacity;
+    asmopt_vex_transition_event* vex_transition_events;
+    size_t vex_transition_event_count;
+    size_t vex_transition_event_capacity;
+    /* Per-function sizes, measured when a report first asks for them. */
+    asmopt_size_event* size_events;
+    size_t size_event_count;
+    size_t size_event_capacity;
+    size_t code_bytes_before;
+    size_t code_bytes_after;
+    bool sizes_ready;
+    /* Fused flag producer + jcc pairs in the input and in the scheduled output. */
+    size_t fusion_pairs_before;
+    size_t fusion_pairs_after;
+    /* Cache entries that optimized lines and event strings point into. */
+    asmopt_cache_data* cache_data;
+    size_t cache_data_count;
+    size_t cache_data_capacity;
+    /*
+     * Set by asmopt_apply_edit: asmopt_optimize keeps the IR and optimizes the
+     * input unit by unit through unit_memo, whose first unit_memo_sorted
+     * entries are sorted by hash.
+     */
+    bool incremental;
+    asmopt_unit_memo* unit_memo;
+    size_t unit_memo_count;
+    size_t unit_memo_sorted;
+    size_t unit_memo_capacity;
     /* Flag to enable hot loop alignment when hot_align option is set */
     bool insert_hot_align;
     size_t skip_lines;
+    /* Values constant_fold tracks through the current block; only kept while liveness is available. */
+    asmopt_consts consts;
+    /* Bit per asmopt_pattern; resolved from --enable/--disable names when they are set. */
+    uint64_t pattern_mask;
+    /* Enabled while asmopt_optimize runs more than one pass. */
+    asmopt_worklist worklist;
+    /* Per-file results of the last asmopt_optimize_files call. */
+    int* file_results;
+    size_t file_result_count;
+    /* Set while asmopt_optimize_stream runs; per-line events are not retained. */
+    bool streaming;
+    /* "profile" option; ASMOPT_PROFILING gates every hook on it. */
+    bool profiling;
+    asmopt_scan_level scan_level;
+    /* "abi" option; unknown names select the conservative "none". */
+    const asmopt_abi* abi;
+    asmopt_profile profile;
 };
 
+/* Per-line state shared by the pattern handlers of one mnemonic family. */
+typedef struct {
+    asmopt_context* ctx;
+    size_t line_no;
+    const char* line;
+    const asmopt_insn* insn;
+    const asmopt_insn* next;
+    const asmopt_insn* after_next;
+    const asmopt_operand* dest;
+    const asmopt_operand* src;
+    bool dest_reg;
+    bool src_reg;
+    bool att;
+    /* Nothing reads the flags this line leaves (or liveness is off), so patterns may change them. */
+    bool flags_dead;
+    bool replaced;
+    bool removed;
+    /* Pattern that fired, for the profiler's hit counts. */
+    asmopt_pattern hit;
+} asmopt_match;
+
+typedef bool (*asmopt_pattern_handler)(asmopt_match* match);
+
 /* Instruction mnemonics that can have AT&T syntax suffixes (b, w, l, q) */
 static const char* const SUFFIX_MNEMONICS[] = {
     "mov", "lea", "add", "sub", "xor", "and", "or", "cmp", "test", 
@@ -118,6 +781,46 @@ static const char* const SUFFIX_MNEMONICS[] = {
 };
 static const size_t SUFFIX_MNEMONICS_COUNT = sizeof(SUFFIX_MNEMONICS) / sizeof(SUFFIX_MNEMONICS[0]);
 
+/* Report and --enable/--disable names, indexed by asmopt_pattern. */
+static const char* const PATTERN_NAMES[ASMOPT_PATTERN_COUNT] = {
+    "redundant_mov", "mov_zero_to_xor", "mul_by_one", "mul_power_of_2_to_shift", "add_sub_zero",
+    "shift_by_zero", "or_zero", "xor_zero", "and_minus_one", "add_one_to_inc", "sub_one_to_dec",
+    "redundant_move_pair", "sub_self_to_xor", "and_zero_to_xor", "cmp_zero_to_test", "or_self_to_test",
+    "add_minus_one_to_dec", "sub_minus_one_to_inc", "and_self_to_test", "cmp_self_to_test",
+    "fallthrough_jump", "hot_loop_align", "bsf_to_tzcnt", "redundant_lea", "invert_conditional_jump",
+    "dead_store_move", "schedule_swap_move", "load_modify_store", "constant_fold", "lea_split", "lea_merge",
+    "address_fold", "vector_zero_idiom", "vector_redundant_move", "broadcast_load_fold"
+};
+
+/* Patterns that inspect the lines after the current one. */
+#define ASMOPT_LOOKAHEAD_PATTERNS \
+    (ASMOPT_PATTERN_BIT(ASMOPT_PATTERN_REDUNDANT_MOVE_PAIR) | ASMOPT_PATTERN_BIT(ASMOPT_PATTERN_FALLTHROUGH_JUMP) | \
+     ASMOPT_PATTERN_BIT(ASMOPT_PATTERN_INVERT_CONDITIONAL_JUMP) | ASMOPT_PATTERN_BIT(ASMOPT_PATTERN_DEAD_STORE_MOVE) | \
+     ASMOPT_PATTERN_BIT(ASMOPT_PATTERN_SCHEDULE_SWAP_MOVE) | ASMOPT_PATTERN_BIT(ASMOPT_PATTERN_LOAD_MODIFY_STORE) | \
+     ASMOPT_PATTERN_BIT(ASMOPT_PATTERN_CONSTANT_FOLD) | ASMOPT_PATTERN_BIT(ASMOPT_PATTERN_LEA_MERGE) | \
+     ASMOPT_PATTERN_BIT(ASMOPT_PATTERN_ADDRESS_FOLD) | ASMOPT_PATTERN_BIT(ASMOPT_PATTERN_VECTOR_REDUNDANT_MOVE) | \
+     ASMOPT_PATTERN_BIT(ASMOPT_PATTERN_BROADCAST_LOAD_FOLD))
+
+/* Patterns whose replacement leaves different flags behind; they need the flags dead. */
+#define ASMOPT_FLAG_CLOBBER_PATTERNS \
+    (ASMOPT_PATTERN_BIT(ASMOPT_PATTERN_MOV_ZERO_TO_XOR) | ASMOPT_PATTERN_BIT(ASMOPT_PATTERN_MUL_BY_ONE) | \
+     ASMOPT_PATTERN_BIT(ASMOPT_PATTERN_MUL_POWER_OF_2_TO_SHIFT) | ASMOPT_PATTERN_BIT(ASMOPT_PATTERN_ADD_SUB_ZERO) | \
+     ASMOPT_PATTERN_BIT(ASMOPT_PATTERN_OR_ZERO) | ASMOPT_PATTERN_BIT(ASMOPT_PATTERN_XOR_ZERO) | \
+     ASMOPT_PATTERN_BIT(ASMOPT_PATTERN_AND_MINUS_ONE) | ASMOPT_PATTERN_BIT(ASMOPT_PATTERN_ADD_ONE_TO_INC) | \
+     ASMOPT_PATTERN_BIT(ASMOPT_PATTERN_SUB_ONE_TO_DEC) | ASMOPT_PATTERN_BIT(ASMOPT_PATTERN_ADD_MINUS_ONE_TO_DEC) | \
+     ASMOPT_PATTERN_BIT(ASMOPT_PATTERN_SUB_MINUS_ONE_TO_INC) | ASMOPT_PATTERN_BIT(ASMOPT_PATTERN_CMP_SELF_TO_TEST) | \
+     ASMOPT_PATTERN_BIT(ASMOPT_PATTERN_BSF_TO_TZCNT) | ASMOPT_PATTERN_BIT(ASMOPT_PATTERN_LEA_SPLIT))
+
+static double asmopt_now(void) {
+#if defined(CLOCK_MONOTONIC)
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
 static char* asmopt_strdup(const char* value) {
     if (!value) {
         return NULL;
@@ -131,27 +834,173 @@ static char* asmopt_strdup(const char* value) {
     return copy;
 }
 
-static bool asmopt_starts_with(const char* value, const char* prefix) {
-    if (!value || !prefix) {
-        return false;
+static char* asmopt_view_strdup(asmopt_view view) {
+    char* copy = malloc(view.len + 1);
+    if (!copy) {
+        return NULL;
     }
-    size_t len = strlen(prefix);
-    return strncmp(value, prefix, len) == 0;
+    if (view.len > 0) {
+        memcpy(copy, view.ptr, view.len);
+    }
+    copy[view.len] = '\0';
+    return copy;
+}
+
+static void* asmopt_arena_alloc(asmopt_arena* arena, size_t size) {
+    if (!arena) {
+        return NULL;
+    }
+    /* Keep every allocation pointer-aligned so arrays can live here too. */
+    size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    asmopt_arena_block* block = arena->head;
+    if (!block || block->size - block->used < size) {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        asmopt_arena_block* next = malloc(sizeof(asmopt_arena_block) + block_size);
+        if (!next) {
+            return NULL;
+        }
+        next->used = 0;
+        next->size = block_size;
+        next->next = block;
+        arena->allocated += sizeof(asmopt_arena_block) + block_size;
+        arena->head = next;
+        block = next;
+    }
+    void* result = block->data + block->used;
+    block->used += size;
+    return result;
+}
+
+static char* asmopt_arena_strndup(asmopt_arena* arena, const char* value, size_t len) {
+    if (!value) {
+        return NULL;
+    }
+    char* copy = asmopt_arena_alloc(arena, len + 1);
+    if (!copy) {
+        return NULL;
+    }
+    memcpy(copy, value, len);
+    copy[len] = '\0';
+    return copy;
 }
 
-static bool asmopt_is_blank(const char* value) {
+static char* asmopt_arena_strdup(asmopt_arena* arena, const char* value) {
     if (!value) {
+        return NULL;
+    }
+    return asmopt_arena_strndup(arena, value, strlen(value));
+}
+
+static void asmopt_arena_release(asmopt_arena* arena) {
+    if (!arena) {
+        return;
+    }
+    asmopt_arena_block* block = arena->head;
+    while (block) {
+        asmopt_arena_block* next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->head = NULL;
+}
+
+/* Drop all strings but keep the newest block for reuse. */
+static void asmopt_arena_rewind(asmopt_arena* arena) {
+    asmopt_arena_block* head = arena->head;
+    if (!head) {
+        return;
+    }
+    arena->head = head->next;
+    asmopt_arena_release(arena);
+    head->next = NULL;
+    head->used = 0;
+    arena->head = head;
+}
+
+static bool asmopt_buffer_reserve(asmopt_buffer* buffer, size_t extra) {
+    if (buffer->failed) {
+        return false;
+    }
+    if (buffer->length + extra + 1 <= buffer->capacity) {
         return true;
     }
-    while (*value) {
-        if (!isspace((unsigned char)*value)) {
-            return false;
-        }
-        value++;
+    size_t next = buffer->capacity == 0 ? 256 : buffer->capacity * 2;
+    while (next < buffer->length + extra + 1) {
+        next *= 2;
     }
+    char* resized = realloc(buffer->data, next);
+    if (!resized) {
+        buffer->failed = true;
+        return false;
+    }
+    buffer->data = resized;
+    buffer->capacity = next;
     return true;
 }
 
+static void asmopt_buffer_append_n(asmopt_buffer* buffer, const char* text, size_t len) {
+    if (!text || !asmopt_buffer_reserve(buffer, len)) {
+        return;
+    }
+    memcpy(buffer->data + buffer->length, text, len);
+    buffer->length += len;
+    buffer->data[buffer->length] = '\0';
+}
+
+static void asmopt_buffer_append(asmopt_buffer* buffer, const char* text) {
+    if (!text) {
+        return;
+    }
+    asmopt_buffer_append_n(buffer, text, strlen(text));
+}
+
+static void asmopt_buffer_appendf(asmopt_buffer* buffer, const char* format, ...) {
+    if (buffer->failed) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    va_list retry;
+    va_copy(retry, args);
+    size_t available = buffer->capacity > buffer->length ? buffer->capacity - buffer->length : 0;
+    int written = vsnprintf(available ? buffer->data + buffer->length : NULL, available, format, args);
+    va_end(args);
+    if (written < 0) {
+        buffer->failed = true;
+    } else if ((size_t)written >= available) {
+        if (asmopt_buffer_reserve(buffer, (size_t)written)) {
+            vsnprintf(buffer->data + buffer->length, (size_t)written + 1, format, retry);
+            buffer->length += (size_t)written;
+        }
+    } else {
+        buffer->length += (size_t)written;
+    }
+    va_end(retry);
+}
+
+/* Hand ownership of the built string to the caller; NULL if any append failed. */
+static char* asmopt_buffer_finish(asmopt_buffer* buffer) {
+    if (buffer->failed || !asmopt_buffer_reserve(buffer, 0)) {
+        free(buffer->data);
+        buffer->data = NULL;
+        return NULL;
+    }
+    buffer->data[buffer->length] = '\0';
+    char* result = buffer->data;
+    buffer->data = NULL;
+    buffer->length = 0;
+    buffer->capacity = 0;
+    return result;
+}
+
+static bool asmopt_starts_with(const char* value, const char* prefix) {
+    if (!value || !prefix) {
+        return false;
+    }
+    size_t len = strlen(prefix);
+    return strncmp(value, prefix, len) == 0;
+}
+
 static void asmopt_free_string_array(char** values, size_t count) {
     if (!values) {
         return;
@@ -162,35 +1011,38 @@ static void asmopt_free_string_array(char** values, size_t count) {
     free(values);
 }
 
+/* Drop all events; the arrays keep their capacity. Event strings live in line_arena. */
 static void asmopt_reset_opt_events(asmopt_context* ctx) {
     if (!ctx) {
         return;
     }
-    for (size_t i = 0; i < ctx->opt_event_count; i++) {
-        free(ctx->opt_events[i].pattern_name);
-        free(ctx->opt_events[i].original);
-        free(ctx->opt_events[i].optimized);
-    }
-    free(ctx->opt_events);
-    ctx->opt_events = NULL;
     ctx->opt_event_count = 0;
-    ctx->opt_event_capacity = 0;
+    ctx->schedule_event_count = 0;
+    ctx->loop_align_event_count = 0;
+    ctx->fusion_event_count = 0;
+    ctx->if_convert_event_count = 0;
+    ctx->loop_opt_event_count = 0;
+    ctx->vex_transition_event_count = 0;
+    ctx->size_event_count = 0;
+    ctx->code_bytes_before = 0;
+    ctx->code_bytes_after = 0;
+    ctx->sizes_ready = false;
+    ctx->fusion_pairs_before = 0;
+    ctx->fusion_pairs_after = 0;
 }
 
+static void asmopt_intern_reset(asmopt_intern_table* table);
+static void asmopt_intern_release(asmopt_intern_table* table);
+
+/* Drop the IR records and their strings, keeping the array and one arena block for the next build. */
 static void asmopt_reset_ir(asmopt_context* ctx) {
     if (!ctx) {
         return;
     }
-    for (size_t i = 0; i < ctx->ir_count; i++) {
-        asmopt_ir_line* line = &ctx->ir[i];
-        free(line->kind);
-        free(line->text);
-        free(line->mnemonic);
-        asmopt_free_string_array(line->operands, line->operand_count);
-    }
-    free(ctx->ir);
-    ctx->ir = NULL;
     ctx->ir_count = 0;
+    ctx->ir_text_ready = false;
+    asmopt_arena_rewind(&ctx->ir_arena);
+    asmopt_intern_reset(&ctx->operand_names);
 }
 
 static void asmopt_reset_cfg(asmopt_context* ctx) {
@@ -206,44 +1058,153 @@ static void asmopt_reset_cfg(asmopt_context* ctx) {
         }
         free(block->instructions);
     }
-    for (size_t i = 0; i < ctx->cfg_edge_count; i++) {
-        free(ctx->cfg_edges[i].source);
-        free(ctx->cfg_edges[i].target);
-    }
     free(ctx->cfg_blocks);
     free(ctx->cfg_edges);
+    free(ctx->cfg_pred_edges);
+    free(ctx->cfg_label_blocks);
     ctx->cfg_blocks = NULL;
     ctx->cfg_block_count = 0;
     ctx->cfg_edges = NULL;
     ctx->cfg_edge_count = 0;
+    ctx->cfg_edge_capacity = 0;
+    ctx->cfg_pred_edges = NULL;
+    ctx->cfg_label_blocks = NULL;
+    asmopt_intern_reset(&ctx->cfg_labels);
+    free(ctx->live_after);
+    free(ctx->line_blocks);
+    ctx->live_after = NULL;
+    ctx->line_blocks = NULL;
+    ctx->live_lines = NULL;
+    ctx->live_count = 0;
+    ctx->cfg_ready = false;
 }
 
-static void asmopt_reset_lines(asmopt_context* ctx) {
-    asmopt_free_string_array(ctx->original_lines, ctx->original_count);
-    asmopt_free_string_array(ctx->optimized_lines, ctx->optimized_count);
-    ctx->original_lines = NULL;
-    ctx->optimized_lines = NULL;
-    ctx->original_count = 0;
+static void asmopt_cache_release(asmopt_cache_data* entry) {
+#if ASMOPT_HAVE_MMAP
+    if (entry->map_length > 0) {
+        munmap(entry->data, entry->map_length);
+        return;
+    }
+#endif
+    free(entry->data);
+}
+
+/* Forget the last run's output, CFG, events, spliced cache entries, stats and profile; the input and IR stay. */
+static void asmopt_reset_output(asmopt_context* ctx) {
     ctx->optimized_count = 0;
-    free(ctx->original_text);
-    ctx->original_text = NULL;
-    ctx->trailing_newline = false;
-    asmopt_reset_ir(ctx);
+    ctx->line_origin_count = 0;
     asmopt_reset_cfg(ctx);
     asmopt_reset_opt_events(ctx);
+    for (size_t i = 0; i < ctx->cache_data_count; i++) {
+        asmopt_cache_release(&ctx->cache_data[i]);
+    }
+    free(ctx->cache_data);
+    ctx->cache_data = NULL;
+    ctx->cache_data_count = 0;
+    ctx->cache_data_capacity = 0;
+    asmopt_arena_rewind(&ctx->line_arena);
+    ctx->line_arena.allocated = 0;
     memset(&ctx->stats, 0, sizeof(ctx->stats));
+    memset(&ctx->profile, 0, sizeof(ctx->profile));
 }
 
-static bool asmopt_option_enabled(asmopt_context* ctx, const char* key) {
+/*
+ * Forget the input and everything derived from it. Line tables, IR, event
+ * arrays, a heap input buffer and the newest arena blocks keep their storage,
+ * so the next parse of a similar input allocates next to nothing;
+ * asmopt_release_lines frees them too.
+ */
+static void asmopt_reset_lines(asmopt_context* ctx) {
+    /* Line text is owned by original_text and line_arena, not by the arrays. */
+    ctx->original_count = 0;
+#if ASMOPT_HAVE_MMAP
+    if (ctx->original_map_length > 0) {
+        munmap(ctx->original_text, ctx->original_map_length);
+        ctx->original_text = NULL;
+        ctx->text_capacity = 0;
+    }
+#endif
+    ctx->original_length = 0;
+    ctx->original_map_length = 0;
+    ctx->trailing_newline = false;
+    asmopt_reset_ir(ctx);
+    asmopt_reset_output(ctx);
+    ctx->ir_arena.allocated = 0;
+    /* A new input leaves incremental mode; its memo describes the old one. */
+    ctx->incremental = false;
+    for (size_t i = 0; i < ctx->unit_memo_count; i++) {
+        free(ctx->unit_memo[i].data);
+    }
+    ctx->unit_memo_count = 0;
+    ctx->unit_memo_sorted = 0;
+}
+
+/* asmopt_reset_lines, then free the storage it keeps for reuse. */
+static void asmopt_release_lines(asmopt_context* ctx) {
+    asmopt_reset_lines(ctx);
+    free(ctx->original_text);
+    free(ctx->original_lines);
+    free(ctx->optimized_lines);
+    free(ctx->line_origins);
+    free(ctx->ir);
+    ctx->original_text = NULL;
+    ctx->text_capacity = 0;
+    ctx->original_lines = NULL;
+    ctx->original_capacity = 0;
+    ctx->optimized_lines = NULL;
+    ctx->optimized_capacity = 0;
+    ctx->line_origins = NULL;
+    ctx->line_origin_capacity = 0;
+    ctx->ir = NULL;
+    ctx->ir_capacity = 0;
+    free(ctx->unit_memo);
+    ctx->unit_memo = NULL;
+    ctx->unit_memo_capacity = 0;
+    free(ctx->opt_events);
+    free(ctx->schedule_events);
+    free(ctx->loop_align_events);
+    free(ctx->fusion_events);
+    free(ctx->if_convert_events);
+    free(ctx->loop_opt_events);
+    free(ctx->vex_transition_events);
+    free(ctx->size_events);
+    ctx->opt_events = NULL;
+    ctx->opt_event_capacity = 0;
+    ctx->schedule_events = NULL;
+    ctx->schedule_event_capacity = 0;
+    ctx->loop_align_events = NULL;
+    ctx->loop_align_event_capacity = 0;
+    ctx->fusion_events = NULL;
+    ctx->fusion_event_capacity = 0;
+    ctx->if_convert_events = NULL;
+    ctx->if_convert_event_capacity = 0;
+    ctx->loop_opt_events = NULL;
+    ctx->loop_opt_event_capacity = 0;
+    ctx->vex_transition_events = NULL;
+    ctx->vex_transition_event_capacity = 0;
+    ctx->size_events = NULL;
+    ctx->size_event_capacity = 0;
+    asmopt_intern_release(&ctx->operand_names);
+    asmopt_intern_release(&ctx->cfg_labels);
+    asmopt_arena_release(&ctx->ir_arena);
+    asmopt_arena_release(&ctx->line_arena);
+}
+
+static const char* asmopt_option_value(asmopt_context* ctx, const char* key) {
     if (!ctx || !key) {
-        return false;
+        return NULL;
     }
     for (size_t i = 0; i < ctx->option_count; i++) {
         if (ctx->options[i].key && strcmp(ctx->options[i].key, key) == 0) {
-            return ctx->options[i].value && strcmp(ctx->options[i].value, "1") == 0;
+            return ctx->options[i].value;
         }
     }
-    return false;
+    return NULL;
+}
+
+static bool asmopt_option_enabled(asmopt_context* ctx, const char* key) {
+    const char* value = asmopt_option_value(ctx, key);
+    return value && strcmp(value, "1") == 0;
 }
 
 static void asmopt_add_option(asmopt_context* ctx, const char* key, const char* value) {
@@ -334,45 +1295,153 @@ static bool asmopt_is_disabled(asmopt_context* ctx, const char* name) {
     return asmopt_has_opt(ctx->disabled_opts, ctx->disabled_count, name);
 }
 
-static void asmopt_split_lines(asmopt_context* ctx, const char* text) {
-    size_t length = strlen(text);
-    ctx->trailing_newline = length > 0 && text[length - 1] == '\n';
-    size_t capacity = 16;
-    ctx->original_lines = malloc(sizeof(char*) * capacity);
-    if (!ctx->original_lines) {
-        ctx->original_count = 0;
-        return;
+static asmopt_scan_level asmopt_cpu_scan_level(void) {
+#if ASMOPT_HAVE_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        return ASMOPT_SCAN_AVX2;
     }
-    ctx->original_count = 0;
-    size_t start = 0;
-    for (size_t i = 0; i <= length; i++) {
-        if (text[i] == '\n' || text[i] == '\0') {
-            size_t line_len = i - start;
-            char* line = malloc(line_len + 1);
-            if (!line) {
-                break;
-            }
-            memcpy(line, text + start, line_len);
-            line[line_len] = '\0';
-            if (ctx->original_count == capacity) {
-                capacity *= 2;
-                char** next = realloc(ctx->original_lines, sizeof(char*) * capacity);
-                if (!next) {
-                    free(line);
-                    break;
-                }
-                ctx->original_lines = next;
-            }
-            ctx->original_lines[ctx->original_count++] = line;
-            start = i + 1;
+#endif
+    return ASMOPT_HAVE_SSE2 ? ASMOPT_SCAN_SSE2 : ASMOPT_SCAN_SCALAR;
+}
+
+#if ASMOPT_HAVE_SSE2
+static unsigned asmopt_ctz(unsigned mask) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (unsigned)index;
+#else
+    return (unsigned)__builtin_ctz(mask);
+#endif
+}
+#endif
+
+/* Append the start of the next input line, growing original_lines by doubling. */
+static bool asmopt_push_original_line(asmopt_context* ctx, char* line) {
+    if (ctx->original_count == ctx->original_capacity) {
+        size_t capacity = ctx->original_capacity * 2;
+        char** next = realloc(ctx->original_lines, sizeof(char*) * capacity);
+        if (!next) {
+            return false;
         }
+        ctx->original_lines = next;
+        ctx->original_capacity = capacity;
+        ASMOPT_PROFILE_BYTES(ctx, sizeof(char*) * capacity);
     }
+    ctx->original_lines[ctx->original_count++] = line;
+    return true;
 }
 
-static char* asmopt_join_lines(char** lines, size_t count, bool trailing_newline) {
-    if (!lines || count == 0) {
-        return asmopt_strdup(trailing_newline ? "\n" : "");
+/*
+ * Newline kernels: terminate each '\n' among the whole vectors of
+ * text[*pos, length) and record the line after it. *pos is left at the
+ * unscanned tail; false means original_lines could not grow.
+ */
+#if ASMOPT_HAVE_SSE2
+static bool asmopt_split_sse2(asmopt_context* ctx, char* text, size_t length, size_t* pos) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t i = *pos;
+    for (; length - i >= 16; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(text + i));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+        for (; mask != 0; mask &= mask - 1) {
+            size_t at = i + asmopt_ctz(mask);
+            text[at] = '\0';
+            if (!asmopt_push_original_line(ctx, text + at + 1)) {
+                return false;
+            }
+        }
+    }
+    *pos = i;
+    return true;
+}
+#endif
+
+#if ASMOPT_HAVE_AVX2
+__attribute__((target("avx2")))
+static bool asmopt_split_avx2(asmopt_context* ctx, char* text, size_t length, size_t* pos) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t i = *pos;
+    for (; length - i >= 32; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)(text + i));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, newline));
+        for (; mask != 0; mask &= mask - 1) {
+            size_t at = i + asmopt_ctz(mask);
+            text[at] = '\0';
+            if (!asmopt_push_original_line(ctx, text + at + 1)) {
+                return false;
+            }
+        }
+    }
+    *pos = i;
+    return true;
+}
+#endif
+
+/* Offset of the first ';' or '#' in line[0, length), or length. */
+static size_t asmopt_find_comment(const asmopt_context* ctx, const char* line, size_t length) {
+    size_t i = 0;
+#if ASMOPT_HAVE_SSE2
+    if (ctx->scan_level >= ASMOPT_SCAN_SSE2) {
+        const __m128i semicolon = _mm_set1_epi8(';');
+        const __m128i hash = _mm_set1_epi8('#');
+        for (; length - i >= 16; i += 16) {
+            __m128i chunk = _mm_loadu_si128((const __m128i*)(line + i));
+            __m128i hits = _mm_or_si128(_mm_cmpeq_epi8(chunk, semicolon), _mm_cmpeq_epi8(chunk, hash));
+            unsigned mask = (unsigned)_mm_movemask_epi8(hits);
+            if (mask != 0) {
+                return i + asmopt_ctz(mask);
+            }
+        }
+    }
+#else
+    (void)ctx;
+#endif
+    for (; i < length; i++) {
+        if (line[i] == ';' || line[i] == '#') {
+            return i;
+        }
+    }
+    return length;
+}
+
+/* Slice original_text in place: each newline becomes the terminator of its line. */
+static void asmopt_split_lines(asmopt_context* ctx) {
+    char* text = ctx->original_text;
+    size_t length = ctx->original_length;
+    ctx->trailing_newline = length > 0 && text[length - 1] == '\n';
+    ctx->original_count = 0;
+    if (!ctx->original_lines) {
+        ctx->original_lines = malloc(sizeof(char*) * 16);
+        if (!ctx->original_lines) {
+            return;
+        }
+        ctx->original_capacity = 16;
+        ASMOPT_PROFILE_BYTES(ctx, sizeof(char*) * 16);
+    }
+    /* text ends at its first NUL, so only newlines split it; text[length] ends the last line. */
+    ctx->original_lines[ctx->original_count++] = text;
+    size_t i = 0;
+    bool grown = true;
+#if ASMOPT_HAVE_AVX2
+    if (ctx->scan_level >= ASMOPT_SCAN_AVX2) {
+        grown = asmopt_split_avx2(ctx, text, length, &i);
+    }
+#endif
+#if ASMOPT_HAVE_SSE2
+    if (grown && ctx->scan_level >= ASMOPT_SCAN_SSE2) {
+        grown = asmopt_split_sse2(ctx, text, length, &i);
+    }
+#endif
+    for (; grown && i < length; i++) {
+        if (text[i] == '\n') {
+            text[i] = '\0';
+            grown = asmopt_push_original_line(ctx, text + i + 1);
+        }
     }
+}
+
+static size_t asmopt_joined_length(char** lines, size_t count, bool trailing_newline) {
     size_t total = 0;
     for (size_t i = 0; i < count; i++) {
         total += strlen(lines[i]);
@@ -381,283 +1450,90 @@ static char* asmopt_join_lines(char** lines, size_t count, bool trailing_newline
     if (trailing_newline) {
         total += 1;
     }
-    char* buffer = malloc(total + 1);
-    if (!buffer) {
-        return NULL;
-    }
-    buffer[0] = '\0';
+    return total;
+}
+
+/* Write the joined lines into out, which must hold asmopt_joined_length() + 1 bytes. */
+static void asmopt_join_lines_into(char** lines, size_t count, bool trailing_newline, char* out) {
+    char* tail = out;
     for (size_t i = 0; i < count; i++) {
-        strcat(buffer, lines[i]);
+        size_t len = strlen(lines[i]);
+        memcpy(tail, lines[i], len);
+        tail += len;
         if (i + 1 < count) {
-            strcat(buffer, "\n");
+            *tail++ = '\n';
         }
     }
     if (trailing_newline) {
-        strcat(buffer, "\n");
+        *tail++ = '\n';
     }
-    return buffer;
+    *tail = '\0';
 }
 
-static void asmopt_split_comment(const char* line, char** code, char** comment) {
-    if (!line) {
-        *code = asmopt_strdup("");
-        *comment = asmopt_strdup("");
-        return;
-    }
-    const char* markers = ";#";
-    const char* comment_pos = NULL;
-    for (const char* ptr = line; *ptr; ptr++) {
-        if (strchr(markers, *ptr)) {
-            comment_pos = ptr;
-            break;
-        }
-    }
-    if (!comment_pos) {
-        *code = asmopt_strdup(line);
-        *comment = asmopt_strdup("");
-        return;
+static char* asmopt_join_lines(char** lines, size_t count, bool trailing_newline) {
+    if (!lines || count == 0) {
+        return asmopt_strdup(trailing_newline ? "\n" : "");
     }
-    size_t code_len = (size_t)(comment_pos - line);
-    *code = malloc(code_len + 1);
-    if (*code) {
-        memcpy(*code, line, code_len);
-        (*code)[code_len] = '\0';
+    size_t total = asmopt_joined_length(lines, count, trailing_newline);
+    char* buffer = malloc(total + 1);
+    if (!buffer) {
+        return NULL;
     }
-    *comment = asmopt_strdup(comment_pos);
+    asmopt_join_lines_into(lines, count, trailing_newline, buffer);
+    return buffer;
 }
 
-static bool asmopt_is_directive_or_label(const char* code) {
-    if (!code) {
-        return true;
-    }
-    const char* trimmed = code;
-    while (*trimmed && isspace((unsigned char)*trimmed)) {
-        trimmed++;
-    }
-    if (*trimmed == '\0') {
-        return true;
-    }
-    if (*trimmed == '.') {
-        return true;
-    }
-    size_t len = strlen(trimmed);
-    if (len > 0 && trimmed[len - 1] == ':') {
-        return true;
-    }
-    return false;
+static asmopt_view asmopt_view_of(const char* text) {
+    asmopt_view view = {text, text ? strlen(text) : 0};
+    return view;
 }
 
-static bool asmopt_parse_instruction(const char* code, char** indent, char** mnemonic, char** spacing, char** operands) {
-    if (!code) {
-        return false;
-    }
-    const char* ptr = code;
-    while (*ptr && isspace((unsigned char)*ptr)) {
-        ptr++;
-    }
-    size_t indent_len = (size_t)(ptr - code);
-    const char* mstart = ptr;
-    if (!isalpha((unsigned char)*mstart)) {
-        return false;
-    }
-    while (*ptr && (isalnum((unsigned char)*ptr) || *ptr == '.')) {
-        ptr++;
-    }
-    size_t mnemonic_len = (size_t)(ptr - mstart);
-    const char* sstart = ptr;
-    while (*ptr && isspace((unsigned char)*ptr)) {
-        ptr++;
-    }
-    size_t spacing_len = (size_t)(ptr - sstart);
-    const char* operands_start = ptr;
-    *indent = malloc(indent_len + 1);
-    *mnemonic = malloc(mnemonic_len + 1);
-    *spacing = malloc(spacing_len + 1);
-    *operands = asmopt_strdup(operands_start);
-    if (!*indent || !*mnemonic || !*spacing || !*operands) {
-        free(*indent);
-        free(*mnemonic);
-        free(*spacing);
-        free(*operands);
-        return false;
-    }
-    memcpy(*indent, code, indent_len);
-    (*indent)[indent_len] = '\0';
-    memcpy(*mnemonic, mstart, mnemonic_len);
-    (*mnemonic)[mnemonic_len] = '\0';
-    memcpy(*spacing, sstart, spacing_len);
-    (*spacing)[spacing_len] = '\0';
-    return true;
+static size_t asmopt_view_copy(asmopt_view view, char* buffer, size_t size) {
+    size_t len = view.len < size ? view.len : size - 1;
+    memcpy(buffer, view.ptr, len);
+    buffer[len] = '\0';
+    return len;
 }
 
-static char* asmopt_strip(const char* value) {
-    if (!value) {
-        return asmopt_strdup("");
-    }
-    const char* start = value;
-    while (*start && isspace((unsigned char)*start)) {
-        start++;
-    }
-    const char* end = value + strlen(value);
-    while (end > start && isspace((unsigned char)*(end - 1))) {
-        end--;
-    }
-    size_t len = (size_t)(end - start);
-    char* result = malloc(len + 1);
-    if (!result) {
-        return NULL;
-    }
-    memcpy(result, start, len);
-    result[len] = '\0';
-    return result;
+static bool asmopt_is_jump_mnemonic(const char* mnemonic);
+static bool asmopt_is_conditional_jump(const char* mnemonic);
+static bool asmopt_is_unconditional_jump(const char* mnemonic);
+static bool asmopt_invert_conditional_jump(const char* mnemonic, char* buffer, size_t size);
+static bool asmopt_is_return(const char* mnemonic);
+
+static bool asmopt_view_equal(asmopt_view left, asmopt_view right) {
+    return left.len == right.len && (left.len == 0 || memcmp(left.ptr, right.ptr, left.len) == 0);
 }
 
-static bool asmopt_parse_operands(const char* operands, char** op1, char** op2, char** pre_space, char** post_space) {
-    if (!operands) {
+static bool asmopt_view_caseeq(asmopt_view left, asmopt_view right) {
+    if (left.len != right.len) {
         return false;
     }
-    const char* comma = NULL;
-    int paren_depth = 0;
-    int bracket_depth = 0;
-    bool invalid_depth = false;
-    for (const char* ptr = operands; *ptr; ptr++) {
-        if (*ptr == '(') {
-            paren_depth++;
-        } else if (*ptr == ')') {
-            paren_depth--;
-            if (paren_depth < 0) {
-                invalid_depth = true;
-                break;
-            }
-        } else if (*ptr == '[') {
-            bracket_depth++;
-        } else if (*ptr == ']') {
-            bracket_depth--;
-            if (bracket_depth < 0) {
-                invalid_depth = true;
-                break;
-            }
-        } else if (*ptr == ',' && paren_depth == 0 && bracket_depth == 0) {
-            comma = ptr;
-            break;
+    for (size_t i = 0; i < left.len; i++) {
+        if (tolower((unsigned char)left.ptr[i]) != tolower((unsigned char)right.ptr[i])) {
+            return false;
         }
     }
-    if (invalid_depth || paren_depth != 0 || bracket_depth != 0 || !comma) {
-        return false;
-    }
-    size_t left_len = (size_t)(comma - operands);
-    char* left = malloc(left_len + 1);
-    if (!left) {
-        return false;
-    }
-    memcpy(left, operands, left_len);
-    left[left_len] = '\0';
-    char* right = asmopt_strdup(comma + 1);
-    if (!right) {
-        free(left);
-        return false;
-    }
-    size_t left_trimmed = strlen(left);
-    while (left_trimmed > 0 && isspace((unsigned char)left[left_trimmed - 1])) {
-        left_trimmed--;
-    }
-    size_t right_trimmed = 0;
-    while (right[right_trimmed] && isspace((unsigned char)right[right_trimmed])) {
-        right_trimmed++;
-    }
-    *pre_space = asmopt_strdup(left + left_trimmed);
-    *post_space = asmopt_strdup(right);
-    if (!*pre_space || !*post_space) {
-        free(*pre_space);
-        free(*post_space);
-        free(left);
-        free(right);
-        return false;
-    }
-    (*post_space)[right_trimmed] = '\0';
-    *op1 = asmopt_strip(left);
-    *op2 = asmopt_strip(right);
-    free(left);
-    free(right);
-    return *op1 && *op2 && *pre_space && *post_space;
+    return true;
 }
 
-static char* asmopt_trim_comment(const char* value) {
-    if (!value) {
-        return asmopt_strdup("");
-    }
-    const char* start = value;
-    while (*start && isspace((unsigned char)*start)) {
-        start++;
-    }
-    return asmopt_strdup(start);
+static bool asmopt_view_is(asmopt_view view, const char* text) {
+    return asmopt_view_caseeq(view, asmopt_view_of(text));
 }
 
-static bool asmopt_is_register(const char* operand, const char* syntax) {
-    if (!operand || !*operand) {
-        return false;
-    }
-    while (isspace((unsigned char)*operand)) {
-        operand++;
-    }
-    const char* op = operand;
-    if (syntax && strcmp(syntax, "att") == 0) {
-        if (op[0] != '%') {
-            return false;
-        }
-        op++;
-    }
-    if (op[0] == '$' || op[0] == '*' || strchr(op, '[') || strchr(op, '(')) {
-        return false;
-    }
-    for (const char* ptr = op; *ptr; ptr++) {
-        if (!isalnum((unsigned char)*ptr) && *ptr != '_') {
-            return false;
-        }
-    }
-    return true;
+static bool asmopt_view_contains(asmopt_view view, char ch) {
+    return view.len > 0 && memchr(view.ptr, ch, view.len) != NULL;
 }
 
-static bool asmopt_is_immediate_zero(const char* operand, const char* syntax) {
-    if (!operand) {
-        return false;
-    }
-    while (isspace((unsigned char)*operand)) {
-        operand++;
-    }
-    const char* op = operand;
-    if (syntax && strcmp(syntax, "att") == 0) {
-        if (op[0] != '$') {
-            return false;
-        }
-        op++;
-    }
-    while (*op && isspace((unsigned char)*op)) {
-        op++;
+static asmopt_view asmopt_view_strip(asmopt_view view) {
+    while (view.len > 0 && isspace((unsigned char)view.ptr[0])) {
+        view.ptr++;
+        view.len--;
     }
-    if (*op == '\0') {
-        return false;
-    }
-    if (asmopt_starts_with(op, "0x")) {
-        char* end = NULL;
-        long value = strtol(op, &end, 16);
-        return end != op && *end == '\0' && value == 0;
-    }
-    if (op[strlen(op) - 1] == 'h') {
-        char buffer[64];
-        size_t len = strlen(op) - 1;
-        if (len >= sizeof(buffer)) {
-            return false;
-        }
-        memcpy(buffer, op, len);
-        buffer[len] = '\0';
-        char* end = NULL;
-        long value = strtol(buffer, &end, 16);
-        return end != buffer && *end == '\0' && value == 0;
+    while (view.len > 0 && isspace((unsigned char)view.ptr[view.len - 1])) {
+        view.len--;
     }
-    char* end = NULL;
-    long value = strtol(op, &end, 10);
-    return end != op && *end == '\0' && value == 0;
+    return view;
 }
 
 static char* asmopt_detect_syntax(asmopt_context* ctx) {
@@ -667,10 +1543,28 @@ static char* asmopt_detect_syntax(asmopt_context* ctx) {
     if (ctx->format) {
         return asmopt_strdup(ctx->format);
     }
-    for (size_t i = 0; i < ctx->original_count; i++) {
-        if (strchr(ctx->original_lines[i], '%')) {
+    /*
+     * The head of a file settles it: a .intel_syntax/.att_syntax directive,
+     * else any '%' (AT&T register prefix). String data further down, such as
+     * .string "%d", no longer flips an Intel file.
+     */
+    size_t sampled = 0;
+    for (size_t i = 0; i < ctx->original_count && sampled < ASMOPT_SYNTAX_SAMPLE; i++) {
+        const char* line = ctx->original_lines[i];
+        const char* lead = line;
+        while (*lead == ' ' || *lead == '\t') {
+            lead++;
+        }
+        if (asmopt_starts_with(lead, ".intel_syntax")) {
+            return asmopt_strdup("intel");
+        }
+        if (asmopt_starts_with(lead, ".att_syntax")) {
             return asmopt_strdup("att");
         }
+        if (strchr(lead, '%')) {
+            return asmopt_strdup("att");
+        }
+        sampled += strlen(line) + 1;
     }
     return asmopt_strdup("intel");
 }
@@ -679,17 +1573,45 @@ static void asmopt_store_optimized_line(asmopt_context* ctx, const char* line) {
     if (!ctx || !line) {
         return;
     }
-    char** next = realloc(ctx->optimized_lines, sizeof(char*) * (ctx->optimized_count + 1));
-    if (!next) {
+    if (ctx->optimized_count >= ctx->optimized_capacity) {
+        size_t new_capacity = ctx->optimized_capacity == 0 ? 16 : ctx->optimized_capacity * 2;
+        char** next = realloc(ctx->optimized_lines, sizeof(char*) * new_capacity);
+        if (!next) {
+            return;
+        }
+        ctx->optimized_lines = next;
+        ctx->optimized_capacity = new_capacity;
+        ASMOPT_PROFILE_BYTES(ctx, sizeof(char*) * new_capacity);
+    }
+    /* Lines are either input lines or were emitted into line_arena; neither needs copying. */
+    ctx->optimized_lines[ctx->optimized_count++] = (char*)line;
+}
+
+/*
+ * Record that the last optimized line stored came from IR line origin, or was
+ * written when origin is ir_count. A line stored without one leaves the
+ * origins unknown until the output is rebuilt.
+ */
+static void asmopt_trace_line_origin(asmopt_context* ctx, size_t origin) {
+    if (ctx->line_origin_count + 1 != ctx->optimized_count) {
         return;
     }
-    ctx->optimized_lines = next;
-    ctx->optimized_lines[ctx->optimized_count++] = asmopt_strdup(line);
+    if (ctx->line_origin_count >= ctx->line_origin_capacity) {
+        size_t new_capacity = ctx->optimized_capacity > 16 ? ctx->optimized_capacity : 16;
+        size_t* next = realloc(ctx->line_origins, sizeof(size_t) * new_capacity);
+        if (!next) {
+            return;
+        }
+        ctx->line_origins = next;
+        ctx->line_origin_capacity = new_capacity;
+        ASMOPT_PROFILE_BYTES(ctx, sizeof(size_t) * new_capacity);
+    }
+    ctx->line_origins[ctx->line_origin_count++] = origin;
 }
 
 static void asmopt_record_optimization(asmopt_context* ctx, size_t line_no, const char* pattern, 
                                        const char* original, const char* optimized) {
-    if (!ctx || !pattern) {
+    if (!ctx || !pattern || ctx->streaming) {
         return;
     }
     
@@ -703,58 +1625,21 @@ static void asmopt_record_optimization(asmopt_context* ctx, size_t line_no, cons
         }
         ctx->opt_events = next;
         ctx->opt_event_capacity = new_capacity;
+        ASMOPT_PROFILE_BYTES(ctx, sizeof(asmopt_optimization_event) * new_capacity);
     }
     
+    /* Later passes read earlier output; report the line it originally came from. */
+    if (ctx->worklist.origins && line_no > 0) {
+        line_no = ctx->worklist.origins[line_no - 1];
+    }
+    /* Pattern names are string literals; event text is an input line or arena-owned. */
     ctx->opt_events[ctx->opt_event_count].line_no = line_no;
-    ctx->opt_events[ctx->opt_event_count].pattern_name = asmopt_strdup(pattern);
-    ctx->opt_events[ctx->opt_event_count].original = asmopt_strdup(original ? original : "");
-    ctx->opt_events[ctx->opt_event_count].optimized = asmopt_strdup(optimized ? optimized : "(removed)");
+    ctx->opt_events[ctx->opt_event_count].pattern_name = pattern;
+    ctx->opt_events[ctx->opt_event_count].original = original ? original : "";
+    ctx->opt_events[ctx->opt_event_count].optimized = optimized ? optimized : "(removed)";
     ctx->opt_event_count++;
 }
 
-static bool asmopt_is_immediate_one(const char* operand, const char* syntax) {
-    if (!operand) {
-        return false;
-    }
-    while (isspace((unsigned char)*operand)) {
-        operand++;
-    }
-    const char* op = operand;
-    if (syntax && strcmp(syntax, "att") == 0) {
-        if (op[0] != '$') {
-            return false;
-        }
-        op++;
-    }
-    while (*op && isspace((unsigned char)*op)) {
-        op++;
-    }
-    if (*op == '\0') {
-        return false;
-    }
-    if (asmopt_starts_with(op, "0x")) {
-        char* end = NULL;
-        long value = strtol(op, &end, 16);
-        return end != op && *end == '\0' && value == 1;
-    }
-    size_t op_len = strlen(op);
-    if (op_len > 0 && op[op_len - 1] == 'h') {
-        char buffer[IMMEDIATE_BUFFER_SIZE];
-        size_t len = op_len - 1;
-        if (len >= IMMEDIATE_BUFFER_SIZE) {
-            return false;
-        }
-        memcpy(buffer, op, len);
-        buffer[len] = '\0';
-        char* end = NULL;
-        long value = strtol(buffer, &end, 16);
-        return end != buffer && *end == '\0' && value == 1;
-    }
-    char* end = NULL;
-    long value = strtol(op, &end, 10);
-    return end != op && *end == '\0' && value == 1;
-}
-
 static long asmopt_parse_immediate(const char* operand, const char* syntax, bool* success) {
     *success = false;
     if (!operand) {
@@ -786,7 +1671,9 @@ static long asmopt_parse_immediate(const char* operand, const char* syntax, bool
         value = strtol(op, &end, 16);
     } else {
         size_t op_len = strlen(op);
-        if (op_len > 0 && op[op_len - 1] == 'h') {
+        /* MASM hex ("0ffh") starts with a digit, so ah/bh/ch/dh stay registers. */
+        const char* digits = op[0] == '-' || op[0] == '+' ? op + 1 : op;
+        if (op_len > 0 && op[op_len - 1] == 'h' && isdigit((unsigned char)digits[0])) {
             char buffer[IMMEDIATE_BUFFER_SIZE];
             size_t len = op_len - 1;
             if (len >= IMMEDIATE_BUFFER_SIZE) {
@@ -809,2398 +1696,8216 @@ static long asmopt_parse_immediate(const char* operand, const char* syntax, bool
     return value;
 }
 
-static bool asmopt_is_immediate_minus_one(const char* operand, const char* syntax) {
-    bool success = false;
-    long value = asmopt_parse_immediate(operand, syntax, &success);
-    return success && value == -1;
+static long asmopt_parse_immediate_view(asmopt_view text, const char* syntax, bool* success) {
+    char buffer[IMMEDIATE_BUFFER_SIZE];
+    *success = false;
+    if (text.len >= sizeof(buffer)) {
+        return 0;
+    }
+    memcpy(buffer, text.ptr, text.len);
+    buffer[text.len] = '\0';
+    return asmopt_parse_immediate(buffer, syntax, success);
 }
 
-/* Check if displacement represents zero (empty is zero for AT&T base-only syntax). */
-static bool asmopt_is_zero_displacement(const char* value) {
-    char* trimmed = asmopt_strip(value);
-    if (!trimmed) {
+/* Mirrors the historical string predicate: any bare identifier counts, '%'-prefixed in AT&T. */
+static bool asmopt_is_register_view(asmopt_view op, bool att) {
+    if (op.len == 0) {
         return false;
     }
-    bool zero = false;
-    if (*trimmed == '\0') {
-        /* Empty displacement in AT&T syntax implies zero. */
-        zero = true;
-    } else {
-        bool success = false;
-        long disp = asmopt_parse_immediate(trimmed, NULL, &success);
-        zero = success && disp == 0;
+    const char* ptr = op.ptr;
+    const char* end = op.ptr + op.len;
+    if (att) {
+        if (*ptr != '%') {
+            return false;
+        }
+        ptr++;
+    }
+    for (; ptr < end; ptr++) {
+        if (!isalnum((unsigned char)*ptr) && *ptr != '_') {
+            return false;
+        }
     }
-    free(trimmed);
-    return zero;
+    return true;
 }
 
-/* Detect LEA identity: src memory uses base == dest with zero displacement (Intel or AT&T). */
-static bool asmopt_is_identity_lea(const char* src, const char* dest, const char* syntax) {
-    if (!src || !dest || !asmopt_is_register(dest, syntax)) {
-        return false;
+static bool asmopt_is_label_view(asmopt_view op) {
+    const char* ptr = op.ptr;
+    const char* end = op.ptr + op.len;
+    while (ptr < end && *ptr == '*') {
+        ptr++;
     }
-    char* trimmed = asmopt_strip(src);
-    if (!trimmed) {
+    if (ptr == end || (!isalpha((unsigned char)*ptr) && *ptr != '_' && *ptr != '.')) {
         return false;
     }
-    bool matches = false;
-    if (syntax && strcmp(syntax, "att") == 0) {
-        if (!strchr(trimmed, '(')) {
-            free(trimmed);
+    for (; ptr < end; ptr++) {
+        if (!isalnum((unsigned char)*ptr) && *ptr != '_' && *ptr != '.') {
             return false;
         }
-        const char* open = strchr(trimmed, '(');
-        if (open) {
-            const char* close = strchr(open + 1, ')');
-            if (close) {
-                const char* tail = close + 1;
-                while (*tail && isspace((unsigned char)*tail)) {
-                    tail++;
-                }
-                if (*tail == '\0') {
-                    size_t disp_len = (size_t)(open - trimmed);
-                    char* disp = malloc(disp_len + 1);
-                    if (disp) {
-                        memcpy(disp, trimmed, disp_len);
-                        disp[disp_len] = '\0';
-                        if (asmopt_is_zero_displacement(disp)) {
-                            size_t len = (size_t)(close - (open + 1));
-                            char* base = malloc(len + 1);
-                            if (base) {
-                                memcpy(base, open + 1, len);
-                                base[len] = '\0';
-                                char* inner = asmopt_strip(base);
-                                if (inner) {
-                                    matches = asmopt_casecmp(inner, dest) == 0;
-                                }
-                                free(inner);
-                                free(base);
-                            }
-                        }
-                        free(disp);
-                    }
-                }
-            }
-        }
-    } else {
-        size_t len = strlen(trimmed);
-        if (len >= 2 && trimmed[0] == '[' && trimmed[len - 1] == ']') {
-            size_t inner_len = len - 2;
-            char* base = malloc(inner_len + 1);
-            if (base) {
-                memcpy(base, trimmed + 1, inner_len);
-                base[inner_len] = '\0';
-                char* inner = asmopt_strip(base);
-                if (inner) {
-                    matches = asmopt_casecmp(inner, dest) == 0;
-                }
-                free(inner);
-                free(base);
-            }
-        }
     }
-    free(trimmed);
-    return matches;
+    return true;
 }
 
-static void asmopt_build_suffixed_name(char* buffer, size_t size, const char* base, char suffix) {
-    if (suffix != '\0') {
-        snprintf(buffer, size, "%s%c", base, suffix);
-    } else {
-        snprintf(buffer, size, "%s", base);
-    }
+static uint32_t asmopt_hash_view(asmopt_view text, bool fold_case) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < text.len; i++) {
+        unsigned char ch = (unsigned char)text.ptr[i];
+        hash ^= fold_case ? (unsigned char)tolower(ch) : ch;
+        hash *= 16777619u;
+    }
+    return hash;
 }
 
-static bool asmopt_is_target_zen(asmopt_context* ctx) {
-    if (!ctx || !ctx->target_cpu) {
-        return false;
+/* Forget every name but keep the storage. */
+static void asmopt_intern_reset(asmopt_intern_table* table) {
+    if (table->count > 0) {
+        memset(table->slots, 0, sizeof(uint32_t) * table->slot_count);
     }
-    if (!ctx->amd_optimizations) {
+    table->count = 0;
+}
+
+static void asmopt_intern_release(asmopt_intern_table* table) {
+    free(table->names);
+    free(table->slots);
+    table->names = NULL;
+    table->slots = NULL;
+    table->count = 0;
+    table->capacity = 0;
+    table->slot_count = 0;
+}
+
+static bool asmopt_intern_rehash(asmopt_intern_table* table, size_t slot_count) {
+    uint32_t* slots = calloc(slot_count, sizeof(uint32_t));
+    if (!slots) {
         return false;
     }
-    const size_t prefix_len = strlen("zen");
-    if (strlen(ctx->target_cpu) < prefix_len) {
-        return false;
-    }
-    if (strncasecmp(ctx->target_cpu, "zen", prefix_len) != 0) {
-        return false;
-    }
-    char next = ctx->target_cpu[prefix_len];
-    return next == '\0' || isdigit((unsigned char)next);
-}
-
-static bool asmopt_is_zero_guarded(asmopt_context* ctx, size_t line_no, const char* src, const char* syntax) {
-    if (!ctx || !src || line_no < ZERO_GUARD_PATTERN_LINES) {
-        return false;
-    }
-    size_t jump_index = line_no - 2;
-    size_t test_index = line_no - 3;
-    if (jump_index >= ctx->original_count || test_index >= ctx->original_count) {
-        return false;
-    }
-    char* jump_code = NULL;
-    char* jump_comment = NULL;
-    asmopt_split_comment(ctx->original_lines[jump_index], &jump_code, &jump_comment);
-    if (!jump_code || asmopt_is_directive_or_label(jump_code)) {
-        free(jump_code);
-        free(jump_comment);
-        return false;
-    }
-    char* jump_indent = NULL;
-    char* jump_mnemonic = NULL;
-    char* jump_spacing = NULL;
-    char* jump_operands = NULL;
-    bool jump_ok = asmopt_parse_instruction(jump_code, &jump_indent, &jump_mnemonic, &jump_spacing, &jump_operands);
-    bool is_jump = false;
-    if (jump_ok && jump_mnemonic) {
-        is_jump = asmopt_casecmp(jump_mnemonic, "jz") == 0 || asmopt_casecmp(jump_mnemonic, "je") == 0;
-    }
-    free(jump_indent);
-    free(jump_mnemonic);
-    free(jump_spacing);
-    free(jump_operands);
-    free(jump_code);
-    free(jump_comment);
-    if (!is_jump) {
-        return false;
-    }
-    char* test_code = NULL;
-    char* test_comment = NULL;
-    asmopt_split_comment(ctx->original_lines[test_index], &test_code, &test_comment);
-    if (!test_code || asmopt_is_directive_or_label(test_code)) {
-        free(test_code);
-        free(test_comment);
-        return false;
-    }
-    char* test_indent = NULL;
-    char* test_mnemonic = NULL;
-    char* test_spacing = NULL;
-    char* test_operands = NULL;
-    bool test_ok = asmopt_parse_instruction(test_code, &test_indent, &test_mnemonic, &test_spacing, &test_operands);
-    bool guarded = false;
-    if (test_ok && test_mnemonic && test_operands) {
-        char* op1 = NULL;
-        char* op2 = NULL;
-        char* pre = NULL;
-        char* post = NULL;
-        if (asmopt_parse_operands(test_operands, &op1, &op2, &pre, &post)) {
-            if (asmopt_casecmp(test_mnemonic, "test") == 0) {
-                bool reg1 = asmopt_is_register(op1, syntax);
-                bool reg2 = asmopt_is_register(op2, syntax);
-                guarded = reg1 && reg2 &&
-                          asmopt_casecmp(op1, src) == 0 &&
-                          asmopt_casecmp(op2, src) == 0;
-            } else if (asmopt_casecmp(test_mnemonic, "cmp") == 0) {
-                const char* dest = NULL;
-                const char* cmp_src = NULL;
-                if (syntax && strcmp(syntax, "att") == 0) {
-                    cmp_src = op1;
-                    dest = op2;
-                } else {
-                    dest = op1;
-                    cmp_src = op2;
-                }
-                if (dest && cmp_src) {
-                    guarded = asmopt_is_register(dest, syntax) &&
-                              asmopt_casecmp(dest, src) == 0 &&
-                              asmopt_is_immediate_zero(cmp_src, syntax);
-                }
-            }
+    for (size_t id = 0; id < table->count; id++) {
+        size_t slot = asmopt_hash_view(table->names[id], table->fold_case) & (slot_count - 1);
+        while (slots[slot] != 0) {
+            slot = (slot + 1) & (slot_count - 1);
         }
-        free(op1);
-        free(op2);
-        free(pre);
-        free(post);
+        slots[slot] = (uint32_t)id + 1;
     }
-    free(test_indent);
-    free(test_mnemonic);
-    free(test_spacing);
-    free(test_operands);
-    free(test_code);
-    free(test_comment);
-    return guarded;
+    free(table->slots);
+    table->slots = slots;
+    table->slot_count = slot_count;
+    return true;
 }
 
-static bool asmopt_is_power_of_two(long value) {
-    return value > 0 && (value & (value - 1)) == 0;
+/* Slot holding text, or the empty slot where it would go; the table must have slots. */
+static size_t asmopt_intern_slot(const asmopt_intern_table* table, asmopt_view text) {
+    size_t slot = asmopt_hash_view(text, table->fold_case) & (table->slot_count - 1);
+    while (table->slots[slot] != 0) {
+        asmopt_view existing = table->names[table->slots[slot] - 1];
+        if (table->fold_case ? asmopt_view_caseeq(existing, text) : asmopt_view_equal(existing, text)) {
+            break;
+        }
+        slot = (slot + 1) & (table->slot_count - 1);
+    }
+    return slot;
 }
 
-static int asmopt_log2(long value) {
-    int log = 0;
-    while (value > 1) {
-        value >>= 1;
-        log++;
+/* Id of text if it was interned, otherwise -1. */
+static int asmopt_intern_find(const asmopt_intern_table* table, asmopt_view text) {
+    if (table->slot_count == 0) {
+        return -1;
     }
-    return log;
+    return (int)table->slots[asmopt_intern_slot(table, text)] - 1;
 }
 
-static bool asmopt_is_jump_mnemonic(const char* mnemonic);
-static bool asmopt_is_conditional_jump(const char* mnemonic);
-static bool asmopt_is_unconditional_jump(const char* mnemonic);
-static bool asmopt_invert_conditional_jump(const char* mnemonic, char* buffer, size_t size);
-static bool asmopt_is_label_operand(const char* operand);
-
-static void asmopt_handle_identity_removal(asmopt_context* ctx, size_t line_no, const char* pattern_name,
-                                           const char* line, const char* comment, const char* indent, bool* removed) {
-    asmopt_record_optimization(ctx, line_no, pattern_name, line, NULL);
-    if (!asmopt_is_blank(comment)) {
-        char* trimmed = asmopt_trim_comment(comment);
-        size_t len = strlen(indent) + strlen(trimmed) + 1;
-        char* newline = malloc(len + 1);
-        if (newline) {
-            snprintf(newline, len + 1, "%s%s", indent, trimmed);
-            asmopt_store_optimized_line(ctx, newline);
-            free(newline);
+/* Map text to a dense id; equal text (modulo case when fold_case) always yields the same id. */
+static int asmopt_intern(asmopt_intern_table* table, asmopt_view text) {
+    if ((table->count + 1) * 2 > table->slot_count) {
+        if (!asmopt_intern_rehash(table, table->slot_count == 0 ? 64 : table->slot_count * 2)) {
+            return -1;
         }
-        free(trimmed);
     }
-    *removed = true;
+    size_t slot = asmopt_intern_slot(table, text);
+    if (table->slots[slot] != 0) {
+        return (int)table->slots[slot] - 1;
+    }
+    if (table->count == table->capacity) {
+        size_t capacity = table->capacity == 0 ? 32 : table->capacity * 2;
+        asmopt_view* names = realloc(table->names, sizeof(asmopt_view) * capacity);
+        if (!names) {
+            return -1;
+        }
+        table->names = names;
+        table->capacity = capacity;
+    }
+    /* Names are views; the caller keeps the text alive for the table's lifetime. */
+    table->names[table->count] = text;
+    table->slots[slot] = (uint32_t)table->count + 1;
+    return (int)table->count++;
 }
 
-static bool asmopt_is_mov_no_comment(const char* line, const char* syntax, char** dest, char** src) {
-    if (dest) {
-        *dest = NULL;
-    }
-    if (src) {
-        *src = NULL;
+static const struct {
+    const char* name;
+    asmopt_mnemonic id;
+} MNEMONIC_TABLE[] = {
+    {"mov", ASMOPT_MN_MOV}, {"lea", ASMOPT_MN_LEA}, {"add", ASMOPT_MN_ADD}, {"sub", ASMOPT_MN_SUB},
+    {"and", ASMOPT_MN_AND}, {"or", ASMOPT_MN_OR}, {"xor", ASMOPT_MN_XOR}, {"cmp", ASMOPT_MN_CMP},
+    {"test", ASMOPT_MN_TEST}, {"shl", ASMOPT_MN_SHL}, {"shr", ASMOPT_MN_SHR}, {"sal", ASMOPT_MN_SAL},
+    {"sar", ASMOPT_MN_SAR}, {"imul", ASMOPT_MN_IMUL}, {"bsf", ASMOPT_MN_BSF}
+};
+
+/* Vector families, only searched for names that can start one. */
+static const struct {
+    const char* name;
+    asmopt_mnemonic id;
+} VECTOR_MNEMONIC_TABLE[] = {
+    {"pxor", ASMOPT_MN_VXOR}, {"vpxor", ASMOPT_MN_VXOR}, {"vpxord", ASMOPT_MN_VXOR}, {"vpxorq", ASMOPT_MN_VXOR},
+    {"xorps", ASMOPT_MN_VXOR}, {"vxorps", ASMOPT_MN_VXOR}, {"xorpd", ASMOPT_MN_VXOR}, {"vxorpd", ASMOPT_MN_VXOR},
+    {"movdqa", ASMOPT_MN_VMOV}, {"vmovdqa", ASMOPT_MN_VMOV}, {"vmovdqa32", ASMOPT_MN_VMOV},
+    {"vmovdqa64", ASMOPT_MN_VMOV}, {"movdqu", ASMOPT_MN_VMOV}, {"vmovdqu", ASMOPT_MN_VMOV},
+    {"vmovdqu8", ASMOPT_MN_VMOV}, {"vmovdqu16", ASMOPT_MN_VMOV}, {"vmovdqu32", ASMOPT_MN_VMOV},
+    {"vmovdqu64", ASMOPT_MN_VMOV}, {"movaps", ASMOPT_MN_VMOV}, {"vmovaps", ASMOPT_MN_VMOV},
+    {"movups", ASMOPT_MN_VMOV}, {"vmovups", ASMOPT_MN_VMOV}, {"movapd", ASMOPT_MN_VMOV},
+    {"vmovapd", ASMOPT_MN_VMOV}, {"movupd", ASMOPT_MN_VMOV}, {"vmovupd", ASMOPT_MN_VMOV},
+    {"movd", ASMOPT_MN_VLOAD}, {"vmovd", ASMOPT_MN_VLOAD}, {"vmovq", ASMOPT_MN_VLOAD}, {"movss", ASMOPT_MN_VLOAD},
+    {"vmovss", ASMOPT_MN_VLOAD}, {"movsd", ASMOPT_MN_VLOAD}, {"vmovsd", ASMOPT_MN_VLOAD}
+};
+
+static asmopt_mnemonic asmopt_lookup_mnemonic(const char* base) {
+    for (size_t i = 0; i < sizeof(MNEMONIC_TABLE) / sizeof(MNEMONIC_TABLE[0]); i++) {
+        if (strcmp(base, MNEMONIC_TABLE[i].name) == 0) {
+            return MNEMONIC_TABLE[i].id;
+        }
     }
-    if (!line) {
-        return false;
+    if (base[0] == 'v' || base[0] == 'p' || base[0] == 'x' || base[0] == 'm') {
+        for (size_t i = 0; i < sizeof(VECTOR_MNEMONIC_TABLE) / sizeof(VECTOR_MNEMONIC_TABLE[0]); i++) {
+            if (strcmp(base, VECTOR_MNEMONIC_TABLE[i].name) == 0) {
+                return VECTOR_MNEMONIC_TABLE[i].id;
+            }
+        }
     }
-    char* code = NULL;
-    char* comment = NULL;
-    asmopt_split_comment(line, &code, &comment);
-    if (!code || !comment) {
-        free(code);
-        free(comment);
-        return false;
+    if (asmopt_is_conditional_jump(base)) {
+        return ASMOPT_MN_JCC;
     }
-    if (!asmopt_is_blank(comment)) {
-        free(code);
-        free(comment);
-        return false;
+    if (asmopt_is_unconditional_jump(base)) {
+        return ASMOPT_MN_JMP;
     }
-    if (asmopt_is_directive_or_label(code)) {
-        free(code);
-        free(comment);
-        return false;
+    if (asmopt_is_return(base)) {
+        return ASMOPT_MN_RET;
     }
-    char* indent = NULL;
-    char* mnemonic = NULL;
-    char* spacing = NULL;
-    char* operands = NULL;
-    if (!asmopt_parse_instruction(code, &indent, &mnemonic, &spacing, &operands)) {
-        free(code);
-        free(comment);
-        return false;
+    return ASMOPT_MN_OTHER;
+}
+
+/* Lowercase the mnemonic and split off an AT&T size suffix for the families that take one. */
+static void asmopt_classify_mnemonic(asmopt_view mnemonic, asmopt_insn* insn) {
+    char lower[32];
+    size_t len = mnemonic.len;
+    if (len >= sizeof(lower)) {
+        len = sizeof(lower) - 1;
+    }
+    for (size_t i = 0; i < len; i++) {
+        lower[i] = (char)tolower((unsigned char)mnemonic.ptr[i]);
+    }
+    lower[len] = '\0';
+    insn->suffix = '\0';
+    if (len >= 4) {
+        char last_char = lower[len - 1];
+        bool can_have_suffix = false;
+        for (size_t i = 0; i < SUFFIX_MNEMONICS_COUNT; i++) {
+            size_t base_len = strlen(SUFFIX_MNEMONICS[i]);
+            if (len == base_len + 1 && strncmp(lower, SUFFIX_MNEMONICS[i], base_len) == 0) {
+                can_have_suffix = true;
+                break;
+            }
+        }
+        if (can_have_suffix && (last_char == 'b' || last_char == 'w' || last_char == 'l' || last_char == 'q')) {
+            insn->suffix = last_char;
+            lower[len - 1] = '\0';
+        }
     }
-    char mnemonic_lower[32];
-    size_t mlen = strlen(mnemonic);
-    if (mlen >= sizeof(mnemonic_lower)) {
-        mlen = sizeof(mnemonic_lower) - 1;
+    insn->mnemonic = asmopt_lookup_mnemonic(lower);
+}
+
+static const struct {
+    const char* name;
+    unsigned char reg_class;
+    unsigned char width;
+} GPR_NAMES[] = {
+    {"rax", 0, 64}, {"eax", 0, 32}, {"ax", 0, 16}, {"al", 0, 8}, {"ah", 0, 8},
+    {"rcx", 1, 64}, {"ecx", 1, 32}, {"cx", 1, 16}, {"cl", 1, 8}, {"ch", 1, 8},
+    {"rdx", 2, 64}, {"edx", 2, 32}, {"dx", 2, 16}, {"dl", 2, 8}, {"dh", 2, 8},
+    {"rbx", 3, 64}, {"ebx", 3, 32}, {"bx", 3, 16}, {"bl", 3, 8}, {"bh", 3, 8},
+    {"rsp", 4, 64}, {"esp", 4, 32}, {"sp", 4, 16}, {"spl", 4, 8},
+    {"rbp", 5, 64}, {"ebp", 5, 32}, {"bp", 5, 16}, {"bpl", 5, 8},
+    {"rsi", 6, 64}, {"esi", 6, 32}, {"si", 6, 16}, {"sil", 6, 8},
+    {"rdi", 7, 64}, {"edi", 7, 32}, {"di", 7, 16}, {"dil", 7, 8},
+};
+
+/* Register class of a name: 0-15 general-purpose, 32-63 vector (ASMOPT_REG_VECTOR0 + N), -1 otherwise. */
+static int asmopt_reg_class(asmopt_view name, unsigned* width) {
+    if (name.len > 0 && name.ptr[0] == '%') {
+        name.ptr++;
+        name.len--;
+    }
+    char lower[8];
+    if (name.len == 0 || name.len >= sizeof(lower)) {
+        return -1;
     }
-    for (size_t i = 0; i < mlen; i++) {
-        mnemonic_lower[i] = (char)tolower((unsigned char)mnemonic[i]);
+    for (size_t i = 0; i < name.len; i++) {
+        lower[i] = (char)tolower((unsigned char)name.ptr[i]);
     }
-    mnemonic_lower[mlen] = '\0';
-    char base_mnemonic[32] = {0};
-    size_t mlen_actual = strlen(mnemonic_lower);
-    bool can_have_suffix = false;
-    for (size_t i = 0; i < SUFFIX_MNEMONICS_COUNT; i++) {
-        size_t base_len = strlen(SUFFIX_MNEMONICS[i]);
-        if (mlen_actual == base_len + 1 && strncmp(mnemonic_lower, SUFFIX_MNEMONICS[i], base_len) == 0) {
-            can_have_suffix = true;
-            break;
+    lower[name.len] = '\0';
+    for (size_t i = 0; i < sizeof(GPR_NAMES) / sizeof(GPR_NAMES[0]); i++) {
+        if (GPR_NAMES[i].name[0] == lower[0] && strcmp(lower, GPR_NAMES[i].name) == 0) {
+            *width = GPR_NAMES[i].width;
+            return GPR_NAMES[i].reg_class;
         }
     }
-    if (can_have_suffix && mlen_actual >= 4) {
-        char last_char = mnemonic_lower[mlen_actual - 1];
-        if (last_char == 'b' || last_char == 'w' || last_char == 'l' || last_char == 'q') {
-            strncpy(base_mnemonic, mnemonic_lower, mlen_actual - 1);
-            base_mnemonic[mlen_actual - 1] = '\0';
-        } else {
-            strcpy(base_mnemonic, mnemonic_lower);
+    char* end = NULL;
+    if (strchr("xyz", lower[0]) && lower[1] == 'm' && lower[2] == 'm' && isdigit((unsigned char)lower[3])) {
+        long number = strtol(lower + 3, &end, 10);
+        if (*end != '\0' || number > 31) {
+            return -1;
         }
+        *width = lower[0] == 'x' ? 128 : lower[0] == 'y' ? 256 : 512;
+        return ASMOPT_REG_VECTOR0 + (int)number;
+    }
+    /* r8-r15 with an optional d/w/b (or l) width suffix. */
+    if (lower[0] != 'r' || !isdigit((unsigned char)lower[1])) {
+        return -1;
+    }
+    long number = strtol(lower + 1, &end, 10);
+    if (number < 8 || number > 15) {
+        return -1;
+    }
+    if (*end == '\0') {
+        *width = 64;
+    } else if (strcmp(end, "d") == 0) {
+        *width = 32;
+    } else if (strcmp(end, "w") == 0) {
+        *width = 16;
+    } else if (strcmp(end, "b") == 0 || strcmp(end, "l") == 0) {
+        *width = 8;
     } else {
-        strcpy(base_mnemonic, mnemonic_lower);
-    }
-    bool result = false;
-    char* op1 = NULL;
-    char* op2 = NULL;
-    char* pre_space = NULL;
-    char* post_space = NULL;
-    bool has_two_ops = asmopt_parse_operands(operands, &op1, &op2, &pre_space, &post_space);
-    if (has_two_ops && strcmp(base_mnemonic, "mov") == 0) {
-        const char* dest_op = NULL;
-        const char* src_op = NULL;
-        if (syntax && strcmp(syntax, "att") == 0) {
-            src_op = op1;
-            dest_op = op2;
-        } else {
-            dest_op = op1;
-            src_op = op2;
-        }
-        if (dest_op && src_op && asmopt_is_register(dest_op, syntax) && asmopt_is_register(src_op, syntax)) {
-            if (dest) {
-                *dest = asmopt_strdup(dest_op);
+        return -1;
+    }
+    return (int)number;
+}
+
+/* Registers named in an operand's text (a memory address, an indirect target); false if one is not modelled. */
+static bool asmopt_address_uses(asmopt_view text, asmopt_regset* uses) {
+    const char* ptr = text.ptr;
+    const char* end = text.ptr + text.len;
+    while (ptr < end) {
+        if (isalpha((unsigned char)*ptr) || *ptr == '_' || *ptr == '%' || *ptr == '.') {
+            const char* start = ptr++;
+            while (ptr < end && (isalnum((unsigned char)*ptr) || *ptr == '_' || *ptr == '.')) {
+                ptr++;
             }
-            if (src) {
-                *src = asmopt_strdup(src_op);
+            asmopt_view name = {start, (size_t)(ptr - start)};
+            unsigned width = 0;
+            int reg_class = asmopt_reg_class(name, &width);
+            if (reg_class >= 0) {
+                *uses |= ASMOPT_REGSET_BIT(reg_class);
+            } else if (*start == '%' && !asmopt_view_caseeq(name, ASMOPT_VIEW_LIT("%rip"))) {
+                /* Segment or mask registers: leave the line alone. Bare words are symbols. */
+                return false;
             }
-            result = true;
+            continue;
         }
+        ptr++;
     }
-    free(op1);
-    free(op2);
-    free(pre_space);
-    free(post_space);
-    free(indent);
-    free(mnemonic);
-    free(spacing);
-    free(operands);
-    free(code);
-    free(comment);
-    if (!result) {
-        if (dest && *dest) {
-            free(*dest);
-            *dest = NULL;
-        }
-        if (src && *src) {
-            free(*src);
-            *src = NULL;
+    return true;
+}
+
+/* Split an operand list at top-level commas; returns the number of pieces, or max + 1 if there are more. */
+static size_t asmopt_split_operand_list(asmopt_view operands, asmopt_view* pieces, size_t max) {
+    size_t count = 0;
+    int depth = 0;
+    const char* start = operands.ptr;
+    const char* end = operands.ptr + operands.len;
+    for (const char* ptr = operands.ptr; ptr <= end; ptr++) {
+        if (ptr < end && (*ptr == '(' || *ptr == '[')) {
+            depth++;
+        } else if (ptr < end && (*ptr == ')' || *ptr == ']')) {
+            depth--;
+        } else if (ptr == end || (*ptr == ',' && depth == 0)) {
+            if (count == max) {
+                return max + 1;
+            }
+            pieces[count++] = asmopt_view_strip((asmopt_view){start, (size_t)(ptr - start)});
+            start = ptr + 1;
         }
     }
-    return result;
+    return count;
 }
 
-static void asmopt_peephole_line(asmopt_context* ctx, size_t line_no, const char* line, const char* syntax, bool* replaced, bool* removed) {
-    /*
-     * Peephole Optimizer - Pattern Matching Engine
-     * 
-     * This function implements 28 optimization patterns for x86-64 assembly:
-     * (8 identity + 1 redundant move + 12 instruction replacements + 2 control-flow
-     *  + 1 dead-store + 1 scheduling + 1 cache-aware + 1 architecture-aware + 1 load-modify-store)
-     * 
-     * Identity/No-op Eliminations (8 patterns):
-     *   Pattern 1: mov rax, rax            → (removed)        - Redundant self-move
-     *   Pattern 3: imul rax, 1             → (removed)        - Identity multiplication
-     *   Pattern 5: add/sub rax, 0          → (removed)        - Identity addition/subtraction
-     *   Pattern 6: shl/shr/sal/sar rax, 0  → (removed)        - Identity shift
-     *   Pattern 7: or rax, 0               → (removed)        - Identity OR
-     *   Pattern 8: xor rax, 0              → (removed)        - Identity XOR (immediate only)
-     *   Pattern 9: and rax, -1             → (removed)        - Identity AND (all bits)
-     *   Pattern 24: lea rax, [rax]         → (removed)        - Redundant address calc
-     * 
-     * Redundant Move Elimination (1 pattern):
-     *   Pattern 12: mov a, b + mov b, a    → mov a, b         - Remove redundant move
-     * 
-     * Instruction Replacements (12 patterns):
-     *   Pattern 2: mov rax, 0              → xor rax, rax     - Smaller encoding, breaks deps
-     *   Pattern 4: imul rax, 8             → shl rax, 3       - Faster shift for power-of-2
-     *   Pattern 10: add rax, 1             → inc rax          - Size opt (note: flag deps on P4+)
-     *   Pattern 11: sub rax, 1             → dec rax          - Size opt (note: flag deps on P4+)
-     *   Pattern 13: sub rax, rax           → xor rax, rax     - Zero idiom
-     *   Pattern 14: and rax, 0             → xor rax, rax     - Zero idiom
-     *   Pattern 15: cmp rax, 0             → test rax, rax    - Zero compare
-     *   Pattern 16: or rax, rax            → test rax, rax    - Flag-only
-     *   Pattern 17: add rax, -1            → dec rax          - Negative add
-     *   Pattern 18: sub rax, -1            → inc rax          - Negative sub
-     *   Pattern 19: and rax, rax           → test rax, rax    - Flag-only
-     *   Pattern 20: cmp rax, rax           → test rax, rax    - Self-compare
-     * 
-     * Control-flow (2 patterns):
-     *   Pattern 21: jmp next_label         → (removed)        - Fallthrough jump
-     *   Pattern 25: jcc label + jmp next   → j!cc next        - Branch inversion
-     * 
-     * Dead code elimination (1 pattern):
-     *   Pattern 26: mov r1, r2 + mov r1, r3 → mov r1, r3        - Dead store
-     * 
-     * Scheduling (1 pattern):
-     *   Pattern 27: mov r1, r2 + mov r3, r4 → mov r3, r4 + mov r1, r2 - Move hoist
-     * 
-     * Load-modify-store (1 pattern):
-     *   Pattern 28: mov r1, [mem] + add r1, imm + mov [mem], r1 → add [mem], imm
-     * 
-     * Cache-aware (1 pattern):
-     *   Pattern 22: .hot_loop:             → .align 64 + label - Align hot loop headers
-     * 
-     * Architecture-aware (1 pattern):
-     *   Pattern 23: bsf reg, reg           → tzcnt reg, reg    - Zen BMI1 preference
-     * 
-     * Note: inc/dec create false dependencies on flags register (Pentium 4+), so patterns
-     * 10-11 optimize for size. Future: make configurable (-Os vs -O3).
-     * 
-     * All patterns preserve comments and handle both Intel and AT&T syntax.
-     */
-    *replaced = false;
-    *removed = false;
-    ctx->skip_lines = 0;
-    char* code = NULL;
-    char* comment = NULL;
-    asmopt_split_comment(line, &code, &comment);
-    if (!code || !comment) {
-        free(code);
-        free(comment);
-        asmopt_store_optimized_line(ctx, line);
-        return;
-    }
-    if (asmopt_is_directive_or_label(code)) {
-        char* trimmed = asmopt_strip(code);
-        if (trimmed) {
-            if (ctx->insert_hot_align && strcmp(trimmed, ".hot_loop:") == 0) {
-                char align_line[32];
-                snprintf(align_line, sizeof(align_line), "    .align %d", ASMOPT_HOT_LOOP_ALIGNMENT);
-                asmopt_store_optimized_line(ctx, align_line);
-                char align_report[128];
-                snprintf(align_report, sizeof(align_report), "    .align %d\n.hot_loop:", ASMOPT_HOT_LOOP_ALIGNMENT);
-                asmopt_record_optimization(ctx, line_no, "hot_loop_align", line, align_report);
-                asmopt_store_optimized_line(ctx, line);
-                free(trimmed);
-                free(code);
-                free(comment);
-                return;
-            }
-            free(trimmed);
+/* Starts like a number, so that symbols such as "each" are not read as hex with an h suffix. */
+static bool asmopt_is_number_view(asmopt_view text) {
+    size_t sign = text.len > 0 && text.ptr[0] == '-' ? 1 : 0;
+    return text.len > sign && isdigit((unsigned char)text.ptr[sign]);
+}
+
+/* Add one register or constant term of an address; false for anything else (symbols, bad scales). */
+static bool asmopt_address_term(asmopt_view term, bool negative, asmopt_address* mem) {
+    term = asmopt_view_strip(term);
+    const char* star = term.len > 0 ? memchr(term.ptr, '*', term.len) : NULL;
+    asmopt_view reg = term;
+    long scale = 1;
+    if (star) {
+        asmopt_view left = asmopt_view_strip((asmopt_view){term.ptr, (size_t)(star - term.ptr)});
+        asmopt_view right = asmopt_view_strip((asmopt_view){star + 1, (size_t)(term.ptr + term.len - star - 1)});
+        bool success = false;
+        scale = asmopt_parse_immediate_view(right, NULL, &success);
+        reg = left;
+        if (!success) {
+            scale = asmopt_parse_immediate_view(left, NULL, &success);
+            reg = right;
+        }
+        if (!success || (scale != 1 && scale != 2 && scale != 4 && scale != 8)) {
+            return false;
         }
-        asmopt_store_optimized_line(ctx, line);
-        free(code);
-        free(comment);
-        return;
     }
-    char* indent = NULL;
-    char* mnemonic = NULL;
-    char* spacing = NULL;
-    char* operands = NULL;
-    if (!asmopt_parse_instruction(code, &indent, &mnemonic, &spacing, &operands)) {
-        asmopt_store_optimized_line(ctx, line);
-        free(code);
-        free(comment);
-        return;
+    unsigned width = 0;
+    int reg_class = asmopt_reg_class(reg, &width);
+    if (reg_class >= 0) {
+        if (negative || reg_class >= ASMOPT_REG_VECTOR0) {
+            return false;
+        }
+        if (!star && mem->base < 0) {
+            mem->base = (signed char)reg_class;
+            mem->base_width = (unsigned char)width;
+        } else if (mem->index < 0) {
+            mem->index = (signed char)reg_class;
+            mem->scale = (unsigned char)scale;
+        } else {
+            return false;
+        }
+        return true;
     }
-    
-    /* Convert mnemonic to lowercase for matching */
-    char mnemonic_lower[32];
-    size_t mlen = strlen(mnemonic);
-    if (mlen >= sizeof(mnemonic_lower)) {
-        mlen = sizeof(mnemonic_lower) - 1;
+    bool success = false;
+    long value = star || !asmopt_is_number_view(term) ? 0 : asmopt_parse_immediate_view(term, NULL, &success);
+    if (!success) {
+        return false;
     }
-    for (size_t i = 0; i < mlen; i++) {
-        mnemonic_lower[i] = (char)tolower((unsigned char)mnemonic[i]);
+    long disp = (long)mem->disp + (negative ? -value : value);
+    if (disp < INT32_MIN || disp > INT32_MAX) {
+        return false;
     }
-    mnemonic_lower[mlen] = '\0';
-    
-    /* Extract suffix for AT&T syntax (e.g., movl, movq, addl, subl) */
-    char suffix = '\0';
-    char base_mnemonic[32] = {0};
-    size_t mlen_actual = strlen(mnemonic_lower);
-    
-    /* Only strip suffix for known instruction families that use them */
-    bool can_have_suffix = false;
-    for (size_t i = 0; i < SUFFIX_MNEMONICS_COUNT; i++) {
-        size_t base_len = strlen(SUFFIX_MNEMONICS[i]);
-        if (mlen_actual == base_len + 1 && strncmp(mnemonic_lower, SUFFIX_MNEMONICS[i], base_len) == 0) {
-            can_have_suffix = true;
-            break;
+    mem->disp = (int32_t)disp;
+    return true;
+}
+
+/* Intel size keywords that may precede a bracketed address. */
+static bool asmopt_is_size_keyword(asmopt_view word) {
+    static const char* const keywords[] = {"byte", "word", "dword", "qword", "tbyte", "oword",
+                                           "xmmword", "ymmword", "zmmword", "ptr"};
+    for (size_t i = 0; i < sizeof(keywords) / sizeof(keywords[0]); i++) {
+        if (asmopt_view_is(word, keywords[i])) {
+            return true;
         }
     }
-    
-    if (can_have_suffix && mlen_actual >= 4) {
-        char last_char = mnemonic_lower[mlen_actual - 1];
-        if (last_char == 'b' || last_char == 'w' || last_char == 'l' || last_char == 'q') {
-            suffix = last_char;
-            strncpy(base_mnemonic, mnemonic_lower, mlen_actual - 1);
-            base_mnemonic[mlen_actual - 1] = '\0';
-        } else {
-            strcpy(base_mnemonic, mnemonic_lower);
-        }
-    } else {
-        strcpy(base_mnemonic, mnemonic_lower);
+    return false;
+}
+
+/* base + index * scale + disp of "QWORD PTR -8[rbp+rcx*4]" / "[rbp-8]"; false unless that is all there is. */
+static bool asmopt_decode_intel_address(asmopt_view text, asmopt_address* mem) {
+    const char* open = memchr(text.ptr, '[', text.len);
+    const char* end = text.ptr + text.len;
+    if (!open || end[-1] != ']') {
+        return false;
     }
-    
-    /* Try to parse operands for two-operand instructions */
-    char* op1 = NULL;
-    char* op2 = NULL;
-    char* pre_space = NULL;
-    char* post_space = NULL;
-    bool has_two_ops = asmopt_parse_operands(operands, &op1, &op2, &pre_space, &post_space);
-    
-    /* Determine dest/src based on syntax */
-    const char* dest = NULL;
-    const char* src = NULL;
-    bool dest_reg = false;
-    bool src_reg = false;
-    if (has_two_ops) {
-        if (syntax && strcmp(syntax, "att") == 0) {
-            src = op1;
-            dest = op2;
-        } else {
-            dest = op1;
-            src = op2;
+    const char* ptr = text.ptr;
+    while (ptr < open) {
+        while (ptr < open && isspace((unsigned char)*ptr)) {
+            ptr++;
+        }
+        const char* word = ptr;
+        while (ptr < open && !isspace((unsigned char)*ptr)) {
+            ptr++;
+        }
+        asmopt_view token = {word, (size_t)(ptr - word)};
+        if (token.len == 0 || asmopt_is_size_keyword(token)) {
+            continue;
+        }
+        /* gcc puts a constant displacement in front of the brackets; segments and symbols stay unmodelled. */
+        if (ptr != open && asmopt_view_strip((asmopt_view){ptr, (size_t)(open - ptr)}).len > 0) {
+            return false;
+        }
+        if (!asmopt_address_term(token, false, mem)) {
+            return false;
         }
-        dest_reg = asmopt_is_register(dest, syntax);
-        src_reg = asmopt_is_register(src, syntax);
     }
-    
-    /* Pattern 1: mov rax, rax -> remove */
-    if ((strcmp(base_mnemonic, "mov") == 0 || strcmp(mnemonic_lower, "mov") == 0) && has_two_ops) {
-        if (dest_reg && src_reg && asmopt_casecmp(dest, src) == 0) {
-            asmopt_handle_identity_removal(ctx, line_no, "redundant_mov", line, comment, indent, removed);
-            goto cleanup;
-        }
-        
-        /* Pattern 2: mov rax, 0 -> xor rax, rax */
-        if (dest_reg && asmopt_is_immediate_zero(src, syntax)) {
-            char xor_name[8];
-            if (suffix) {
-                snprintf(xor_name, sizeof(xor_name), "xor%c", suffix);
-            } else {
-                snprintf(xor_name, sizeof(xor_name), "xor");
-            }
-            char* trimmed_comment = asmopt_trim_comment(comment);
-            size_t new_len = strlen(indent) + strlen(xor_name) + strlen(spacing) + 
-                            strlen(dest) + strlen(pre_space) + strlen(post_space) + strlen(dest) + 2;
-            if (!asmopt_is_blank(trimmed_comment)) {
-                new_len += strlen(trimmed_comment) + 1;
+    const char* term = open + 1;
+    bool negative = false;
+    for (const char* scan = term; scan < end; scan++) {
+        if (*scan == '+' || *scan == '-' || *scan == ']') {
+            asmopt_view piece = asmopt_view_strip((asmopt_view){term, (size_t)(scan - term)});
+            if (piece.len == 0 ? scan != term || *scan == ']' : !asmopt_address_term(piece, negative, mem)) {
+                return false;
             }
-            char* newline = malloc(new_len + 1);
-            if (newline) {
-                if (!asmopt_is_blank(trimmed_comment)) {
-                    snprintf(newline, new_len + 1, "%s%s%s%s%s,%s%s %s", 
-                            indent, xor_name, spacing, dest, pre_space, post_space, dest, trimmed_comment);
-                } else {
-                    snprintf(newline, new_len + 1, "%s%s%s%s%s,%s%s", 
-                            indent, xor_name, spacing, dest, pre_space, post_space, dest);
-                }
-                asmopt_record_optimization(ctx, line_no, "mov_zero_to_xor", line, newline);
-                asmopt_store_optimized_line(ctx, newline);
-                free(newline);
-                *replaced = true;
-            }
-            free(trimmed_comment);
-            goto cleanup;
-        }
-    }
-
-    /* Pattern 24: lea rax, [rax] -> remove (identity) */
-    if (strcmp(base_mnemonic, "lea") == 0 && has_two_ops) {
-        if (dest && src && asmopt_is_identity_lea(src, dest, syntax)) {
-            *replaced = false;
-            asmopt_handle_identity_removal(ctx, line_no, "redundant_lea", line, comment, indent, removed);
-            goto cleanup;
-        }
-    }
-
-    /* Pattern 26: mov rax, rbx / mov rax, rcx -> remove dead store */
-    if (strcmp(base_mnemonic, "mov") == 0 && has_two_ops && dest_reg && src_reg) {
-        size_t next_index = line_no;
-        if (next_index < ctx->original_count) {
-            const char* next_line = ctx->original_lines[next_index];
-            char* next_dest = NULL;
-            char* next_src = NULL;
-            if (asmopt_is_mov_no_comment(next_line, syntax, &next_dest, &next_src)) {
-                bool dead_store = next_dest && asmopt_casecmp(dest, next_dest) == 0 &&
-                                  next_src && asmopt_casecmp(src, next_src) != 0;
-                if (dead_store) {
-                    size_t combo_len = strlen(line) + strlen(next_line) + 2;
-                    char* combined = malloc(combo_len + 1);
-                    if (combined) {
-                        snprintf(combined, combo_len + 1, "%s\n%s", line, next_line);
-                        asmopt_record_optimization(ctx, line_no, "dead_store_move", combined, next_line);
-                        free(combined);
-                    } else {
-                        asmopt_record_optimization(ctx, line_no, "dead_store_move", line, next_line);
-                    }
-                    asmopt_store_optimized_line(ctx, next_line);
-                    *removed = true;
-                    *replaced = true;
-                    ctx->skip_lines = 1;
-                    free(next_dest);
-                    free(next_src);
-                    goto cleanup;
-                }
+            if (*scan == ']') {
+                return scan + 1 == end;
             }
-            free(next_dest);
-            free(next_src);
+            negative = *scan == '-';
+            term = scan + 1;
         }
     }
+    return false;
+}
 
-    /* Pattern 27: mov rax, rbx / mov rcx, rdx -> reorder for scheduling */
-    if (strcmp(base_mnemonic, "mov") == 0 && has_two_ops && dest_reg && src_reg) {
-        size_t next_index = line_no;
-        if (next_index < ctx->original_count) {
-            const char* next_line = ctx->original_lines[next_index];
-            char* next_dest = NULL;
-            char* next_src = NULL;
-            if (asmopt_is_mov_no_comment(next_line, syntax, &next_dest, &next_src)) {
-                bool independent = next_dest && next_src &&
-                                   asmopt_casecmp(dest, next_dest) != 0 &&
-                                   asmopt_casecmp(dest, next_src) != 0 &&
-                                   asmopt_casecmp(src, next_dest) != 0 &&
-                                   asmopt_casecmp(src, next_src) != 0;
-                if (independent) {
-                    asmopt_record_optimization(ctx, line_no, "schedule_swap_move", line, next_line);
-                    asmopt_store_optimized_line(ctx, next_line);
-                    asmopt_store_optimized_line(ctx, line);
-                    *replaced = true;
-                    ctx->skip_lines = 1;
-                    free(next_dest);
-                    free(next_src);
-                    goto cleanup;
-                }
-            }
-            free(next_dest);
-            free(next_src);
-        }
+/* disp(base, index, scale) in AT&T syntax; false for symbolic or segmented addresses. */
+static bool asmopt_decode_att_address(asmopt_view text, asmopt_address* mem) {
+    const char* open = memchr(text.ptr, '(', text.len);
+    const char* end = text.ptr + text.len;
+    if (!open || end[-1] != ')') {
+        return false;
     }
-
-    /* Pattern 28: mov rax, [mem] / add rax, imm / mov [mem], rax -> add [mem], imm */
-    if (strcmp(base_mnemonic, "mov") == 0 && has_two_ops && dest_reg && src && !src_reg) {
-        size_t add_index = line_no;
-        size_t store_index = line_no + 1;
-        if (add_index < ctx->original_count && store_index < ctx->original_count) {
-            const char* add_line = ctx->original_lines[add_index];
-            const char* store_line = ctx->original_lines[store_index];
-            char* add_code = NULL;
-            char* add_comment = NULL;
-            asmopt_split_comment(add_line, &add_code, &add_comment);
-            if (add_code && !asmopt_is_directive_or_label(add_code)) {
-                char* add_indent = NULL;
-                char* add_mnemonic = NULL;
-                char* add_spacing = NULL;
-                char* add_operands = NULL;
-                if (asmopt_parse_instruction(add_code, &add_indent, &add_mnemonic, &add_spacing, &add_operands)) {
-                    char add_lower[32];
-                    size_t add_len = strlen(add_mnemonic);
-                    if (add_len >= sizeof(add_lower)) {
-                        add_len = sizeof(add_lower) - 1;
-                    }
-                    for (size_t i = 0; i < add_len; i++) {
-                        add_lower[i] = (char)tolower((unsigned char)add_mnemonic[i]);
-                    }
-                    add_lower[add_len] = '\0';
-                    char add_suffix = '\0';
-                    char add_base[32] = {0};
-                    size_t add_actual = strlen(add_lower);
-                    bool add_can_suffix = false;
-                    for (size_t i = 0; i < SUFFIX_MNEMONICS_COUNT; i++) {
-                        size_t base_len = strlen(SUFFIX_MNEMONICS[i]);
-                        if (add_actual == base_len + 1 &&
-                            strncmp(add_lower, SUFFIX_MNEMONICS[i], base_len) == 0) {
-                            add_can_suffix = true;
-                            break;
-                        }
-                    }
-                    if (add_can_suffix && add_actual >= 4) {
-                        char last_char = add_lower[add_actual - 1];
-                        if (last_char == 'b' || last_char == 'w' || last_char == 'l' || last_char == 'q') {
-                            add_suffix = last_char;
-                            strncpy(add_base, add_lower, add_actual - 1);
-                            add_base[add_actual - 1] = '\0';
-                        } else {
-                            strcpy(add_base, add_lower);
-                        }
-                    } else {
-                        strcpy(add_base, add_lower);
-                    }
-                    char* add_op1 = NULL;
-                    char* add_op2 = NULL;
-                    char* add_pre = NULL;
-                    char* add_post = NULL;
-                    bool add_two_ops = asmopt_parse_operands(add_operands, &add_op1, &add_op2, &add_pre, &add_post);
-                    if (add_two_ops && strcmp(add_base, "add") == 0) {
-                        const char* add_dest = NULL;
-                        const char* add_src = NULL;
-                        if (syntax && strcmp(syntax, "att") == 0) {
-                            add_src = add_op1;
-                            add_dest = add_op2;
-                        } else {
-                            add_dest = add_op1;
-                            add_src = add_op2;
-                        }
-                        bool add_immediate = false;
-                        asmopt_parse_immediate(add_src, syntax, &add_immediate);
-                        if (add_dest && add_src && asmopt_is_register(add_dest, syntax) &&
-                            asmopt_casecmp(add_dest, dest) == 0 && add_immediate) {
-                            char* store_code = NULL;
-                            char* store_comment = NULL;
-                            asmopt_split_comment(store_line, &store_code, &store_comment);
-                            if (store_code && !asmopt_is_directive_or_label(store_code)) {
-                                char* store_indent = NULL;
-                                char* store_mnemonic = NULL;
-                                char* store_spacing = NULL;
-                                char* store_operands = NULL;
-                                if (asmopt_parse_instruction(store_code, &store_indent, &store_mnemonic, &store_spacing, &store_operands)) {
-                                    char store_lower[32];
-                                    size_t store_len = strlen(store_mnemonic);
-                                    if (store_len >= sizeof(store_lower)) {
-                                        store_len = sizeof(store_lower) - 1;
-                                    }
-                                    for (size_t i = 0; i < store_len; i++) {
-                                        store_lower[i] = (char)tolower((unsigned char)store_mnemonic[i]);
-                                    }
-                                    store_lower[store_len] = '\0';
-                                    char store_base[32] = {0};
-                                    size_t store_actual = strlen(store_lower);
-                                    bool store_can_suffix = false;
-                                    for (size_t i = 0; i < SUFFIX_MNEMONICS_COUNT; i++) {
-                                        size_t base_len = strlen(SUFFIX_MNEMONICS[i]);
-                                        if (store_actual == base_len + 1 &&
-                                            strncmp(store_lower, SUFFIX_MNEMONICS[i], base_len) == 0) {
-                                            store_can_suffix = true;
-                                            break;
-                                        }
-                                    }
-                                    if (store_can_suffix && store_actual >= 4) {
-                                        char last_char = store_lower[store_actual - 1];
-                                        if (last_char == 'b' || last_char == 'w' || last_char == 'l' || last_char == 'q') {
-                                            strncpy(store_base, store_lower, store_actual - 1);
-                                            store_base[store_actual - 1] = '\0';
-                                        } else {
-                                            strcpy(store_base, store_lower);
-                                        }
-                                    } else {
-                                        strcpy(store_base, store_lower);
-                                    }
-                                    char* store_op1 = NULL;
-                                    char* store_op2 = NULL;
-                                    char* store_pre = NULL;
-                                    char* store_post = NULL;
-                                    bool store_two_ops = asmopt_parse_operands(store_operands, &store_op1, &store_op2, &store_pre, &store_post);
-                                    if (store_two_ops && strcmp(store_base, "mov") == 0) {
-                                        const char* store_dest = NULL;
-                                        const char* store_src = NULL;
-                                        if (syntax && strcmp(syntax, "att") == 0) {
-                                            store_src = store_op1;
-                                            store_dest = store_op2;
-                                        } else {
-                                            store_dest = store_op1;
-                                            store_src = store_op2;
-                                        }
-                                        if (store_dest && store_src &&
-                                            asmopt_is_register(store_src, syntax) &&
-                                            asmopt_casecmp(store_src, dest) == 0 &&
-                                            asmopt_casecmp(store_dest, src) == 0) {
-                                            char add_name[8];
-                                            asmopt_build_suffixed_name(add_name, sizeof(add_name), "add", add_suffix);
-                                            char* trimmed_comment = asmopt_trim_comment(comment);
-                                            const char* first_op = store_dest;
-                                            const char* second_op = add_src;
-                                            if (syntax && strcmp(syntax, "att") == 0) {
-                                                first_op = add_src;
-                                                second_op = store_dest;
-                                            }
-                                            const size_t comma_len = 1;
-                                            size_t new_len = strlen(indent) + strlen(add_name) + strlen(spacing) +
-                                                             strlen(first_op) + strlen(add_pre) + strlen(add_post) +
-                                                             strlen(second_op) + comma_len;
-                                            if (!asmopt_is_blank(trimmed_comment)) {
-                                                new_len += strlen(trimmed_comment) + 1;
-                                            }
-                                            size_t buffer_len = new_len + 1;
-                                            char* newline = malloc(buffer_len);
-                                            if (newline) {
-                                                if (!asmopt_is_blank(trimmed_comment)) {
-                                                    snprintf(newline, buffer_len, "%s%s%s%s%s,%s%s %s",
-                                                             indent, add_name, spacing, first_op, add_pre, add_post, second_op, trimmed_comment);
-                                                } else {
-                                                    snprintf(newline, buffer_len, "%s%s%s%s%s,%s%s",
-                                                             indent, add_name, spacing, first_op, add_pre, add_post, second_op);
-                                                }
-                                                size_t combo_len = strlen(line) + strlen(add_line) + strlen(store_line) + 2;
-                                                char* combined = malloc(combo_len + 1);
-                                                if (combined) {
-                                                    snprintf(combined, combo_len + 1, "%s\n%s\n%s", line, add_line, store_line);
-                                                    asmopt_record_optimization(ctx, line_no, "load_modify_store", combined, newline);
-                                                    free(combined);
-                                                } else {
-                                                    asmopt_record_optimization(ctx, line_no, "load_modify_store", line, newline);
-                                                }
-                                                asmopt_store_optimized_line(ctx, newline);
-                                                free(newline);
-                                                if (!asmopt_is_blank(add_comment)) {
-                                                    char* trimmed_add_comment = asmopt_trim_comment(add_comment);
-                                                    size_t add_len = strlen(add_indent) + strlen(trimmed_add_comment) + 1;
-                                                    char* add_comment_line = malloc(add_len + 1);
-                                                    if (add_comment_line) {
-                                                        snprintf(add_comment_line, add_len + 1, "%s%s", add_indent, trimmed_add_comment);
-                                                        asmopt_store_optimized_line(ctx, add_comment_line);
-                                                        free(add_comment_line);
-                                                    }
-                                                    free(trimmed_add_comment);
-                                                }
-                                                if (!asmopt_is_blank(store_comment)) {
-                                                    char* trimmed_store_comment = asmopt_trim_comment(store_comment);
-                                                    size_t store_len = strlen(store_indent) + strlen(trimmed_store_comment) + 1;
-                                                    char* store_comment_line = malloc(store_len + 1);
-                                                    if (store_comment_line) {
-                                                        snprintf(store_comment_line, store_len + 1, "%s%s", store_indent, trimmed_store_comment);
-                                                        asmopt_store_optimized_line(ctx, store_comment_line);
-                                                        free(store_comment_line);
-                                                    }
-                                                    free(trimmed_store_comment);
-                                                }
-                                                *replaced = true;
-                                                *removed = true;
-                                                ctx->skip_lines = 2;
-                                                free(trimmed_comment);
-                                                free(store_op1);
-                                                free(store_op2);
-                                                free(store_pre);
-                                                free(store_post);
-                                                free(store_indent);
-                                                free(store_mnemonic);
-                                                free(store_spacing);
-                                                free(store_operands);
-                                                free(store_code);
-                                                free(store_comment);
-                                                free(add_op1);
-                                                free(add_op2);
-                                                free(add_pre);
-                                                free(add_post);
-                                                free(add_indent);
-                                                free(add_mnemonic);
-                                                free(add_spacing);
-                                                free(add_operands);
-                                                free(add_code);
-                                                free(add_comment);
-                                                goto cleanup;
-                                            }
-                                            free(trimmed_comment);
-                                        }
-                                    }
-                                    free(store_op1);
-                                    free(store_op2);
-                                    free(store_pre);
-                                    free(store_post);
-                                }
-                                free(store_indent);
-                                free(store_mnemonic);
-                                free(store_spacing);
-                                free(store_operands);
-                            }
-                            free(store_code);
-                            free(store_comment);
-                        }
-                    }
-                    free(add_op1);
-                    free(add_op2);
-                    free(add_pre);
-                    free(add_post);
-                }
-                free(add_indent);
-                free(add_mnemonic);
-                free(add_spacing);
-                free(add_operands);
-            }
-            free(add_code);
-            free(add_comment);
+    asmopt_view disp = asmopt_view_strip((asmopt_view){text.ptr, (size_t)(open - text.ptr)});
+    if (disp.len > 0) {
+        bool success = false;
+        long value = asmopt_is_number_view(disp) ? asmopt_parse_immediate_view(disp, NULL, &success) : 0;
+        if (!success || value < INT32_MIN || value > INT32_MAX) {
+            return false;
         }
+        mem->disp = (int32_t)value;
     }
-
-    /* Pattern 12: mov rax, rbx / mov rbx, rax -> remove redundant move */
-    if (strcmp(base_mnemonic, "mov") == 0 && has_two_ops && dest_reg && src_reg) {
-        if (line_no < ctx->original_count) {
-            const char* next_line = ctx->original_lines[line_no];
-            char* next_code = NULL;
-            char* next_comment = NULL;
-            asmopt_split_comment(next_line, &next_code, &next_comment);
-            if (next_code && !asmopt_is_directive_or_label(next_code)) {
-                char* next_indent = NULL;
-                char* next_mnemonic = NULL;
-                char* next_spacing = NULL;
-                char* next_operands = NULL;
-                if (asmopt_parse_instruction(next_code, &next_indent, &next_mnemonic, &next_spacing, &next_operands)) {
-                    char next_lower[32];
-                    size_t next_len = strlen(next_mnemonic);
-                    if (next_len >= sizeof(next_lower)) {
-                        next_len = sizeof(next_lower) - 1;
-                    }
-                    for (size_t i = 0; i < next_len; i++) {
-                        next_lower[i] = (char)tolower((unsigned char)next_mnemonic[i]);
-                    }
-                    next_lower[next_len] = '\0';
-                    char next_suffix = '\0';
-                    char next_base[32] = {0};
-                    size_t next_actual = strlen(next_lower);
-                    bool next_can_suffix = false;
-                    for (size_t i = 0; i < SUFFIX_MNEMONICS_COUNT; i++) {
-                        size_t base_len = strlen(SUFFIX_MNEMONICS[i]);
-                        if (next_actual == base_len + 1 &&
-                            strncmp(next_lower, SUFFIX_MNEMONICS[i], base_len) == 0) {
-                            next_can_suffix = true;
-                            break;
-                        }
-                    }
-                    if (next_can_suffix && next_actual >= 4) {
-                        char last_char = next_lower[next_actual - 1];
-                        if (last_char == 'b' || last_char == 'w' || last_char == 'l' || last_char == 'q') {
-                            next_suffix = last_char;
-                            strncpy(next_base, next_lower, next_actual - 1);
-                            next_base[next_actual - 1] = '\0';
-                        } else {
-                            strcpy(next_base, next_lower);
-                        }
-                    } else {
-                        strcpy(next_base, next_lower);
-                    }
-                    char* next_op1 = NULL;
-                    char* next_op2 = NULL;
-                    char* next_pre = NULL;
-                    char* next_post = NULL;
-                    bool next_two = asmopt_parse_operands(next_operands, &next_op1, &next_op2, &next_pre, &next_post);
-                    if (next_two && strcmp(next_base, "mov") == 0) {
-                        const char* next_dest = NULL;
-                        const char* next_src = NULL;
-                        if (syntax && strcmp(syntax, "att") == 0) {
-                            next_src = next_op1;
-                            next_dest = next_op2;
-                        } else {
-                            next_dest = next_op1;
-                            next_src = next_op2;
-                        }
-                        if (next_dest && next_src) {
-                            bool next_dest_reg = asmopt_is_register(next_dest, syntax);
-                            bool next_src_reg = asmopt_is_register(next_src, syntax);
-                            bool swapped = next_dest_reg && next_src_reg &&
-                                           asmopt_casecmp(dest, next_src) == 0 &&
-                                           asmopt_casecmp(src, next_dest) == 0;
-                            if (swapped) {
-                                size_t combo_len = strlen(line) + strlen(next_line) + 2;
-                                char* combined = malloc(combo_len + 1);
-                                if (combined) {
-                                    snprintf(combined, combo_len + 1, "%s\n%s", line, next_line);
-                                    asmopt_record_optimization(ctx, line_no, "redundant_move_pair", combined, line);
-                                    free(combined);
-                                }
-                                asmopt_store_optimized_line(ctx, line);
-                                *replaced = true;
-                                if (!asmopt_is_blank(next_comment)) {
-                                    char* trimmed_next = asmopt_trim_comment(next_comment);
-                                    size_t next_len = strlen(next_indent) + strlen(trimmed_next) + 1;
-                                    char* comment_line = malloc(next_len + 1);
-                                    if (comment_line) {
-                                        snprintf(comment_line, next_len + 1, "%s%s", next_indent, trimmed_next);
-                                        asmopt_store_optimized_line(ctx, comment_line);
-                                        free(comment_line);
-                                    }
-                                    free(trimmed_next);
-                                }
-                                asmopt_record_optimization(ctx, line_no + 1, "redundant_move_pair", next_line, NULL);
-                                *removed = true;
-                                ctx->skip_lines = 1;
-                                free(next_op1);
-                                free(next_op2);
-                                free(next_pre);
-                                free(next_post);
-                                free(next_indent);
-                                free(next_mnemonic);
-                                free(next_spacing);
-                                free(next_operands);
-                                free(next_code);
-                                free(next_comment);
-                                goto cleanup;
-                            }
-                        }
-                    }
-                    free(next_op1);
-                    free(next_op2);
-                    free(next_pre);
-                    free(next_post);
-                }
-                free(next_indent);
-                free(next_mnemonic);
-                free(next_spacing);
-                free(next_operands);
-            }
-            free(next_code);
-            free(next_comment);
+    asmopt_view pieces[3];
+    size_t count = asmopt_split_operand_list((asmopt_view){open + 1, (size_t)(end - open - 2)}, pieces, 3);
+    if (count > 3) {
+        return false;
+    }
+    unsigned width = 0;
+    if (pieces[0].len > 0) {
+        int base = asmopt_reg_class(pieces[0], &width);
+        if (base < 0 || base >= ASMOPT_REG_VECTOR0) {
+            return false;
         }
+        mem->base = (signed char)base;
+        mem->base_width = (unsigned char)width;
     }
-    
-    /* Pattern 13: sub rax, rax -> xor rax, rax */
-    if (strcmp(base_mnemonic, "sub") == 0 && has_two_ops && dest_reg && src_reg) {
-        if (asmopt_casecmp(dest, src) == 0) {
-            char xor_name[8];
-            if (suffix) {
-                snprintf(xor_name, sizeof(xor_name), "xor%c", suffix);
-            } else {
-                snprintf(xor_name, sizeof(xor_name), "xor");
-            }
-            char* trimmed_comment = asmopt_trim_comment(comment);
-            size_t new_len = strlen(indent) + strlen(xor_name) + strlen(spacing) +
-                             strlen(dest) + strlen(pre_space) + strlen(post_space) + strlen(dest) + 2;
-            if (!asmopt_is_blank(trimmed_comment)) {
-                new_len += strlen(trimmed_comment) + 1;
-            }
-            char* newline = malloc(new_len + 1);
-            if (newline) {
-                if (!asmopt_is_blank(trimmed_comment)) {
-                    snprintf(newline, new_len + 1, "%s%s%s%s%s,%s%s %s",
-                             indent, xor_name, spacing, dest, pre_space, post_space, dest, trimmed_comment);
-                } else {
-                    snprintf(newline, new_len + 1, "%s%s%s%s%s,%s%s",
-                             indent, xor_name, spacing, dest, pre_space, post_space, dest);
-                }
-                asmopt_record_optimization(ctx, line_no, "sub_self_to_xor", line, newline);
-                asmopt_store_optimized_line(ctx, newline);
-                free(newline);
-                *replaced = true;
-            }
-            free(trimmed_comment);
-            goto cleanup;
+    if (count >= 2) {
+        int index = asmopt_reg_class(pieces[1], &width);
+        if (index < 0 || index >= ASMOPT_REG_VECTOR0) {
+            return false;
         }
+        mem->index = (signed char)index;
     }
-
-    /* Pattern 14: and rax, 0 -> xor rax, rax */
-    if (strcmp(base_mnemonic, "and") == 0 && has_two_ops && dest_reg) {
-        if (asmopt_is_immediate_zero(src, syntax)) {
-            char xor_name[8];
-            if (suffix) {
-                snprintf(xor_name, sizeof(xor_name), "xor%c", suffix);
-            } else {
-                snprintf(xor_name, sizeof(xor_name), "xor");
-            }
-            char* trimmed_comment = asmopt_trim_comment(comment);
-            size_t new_len = strlen(indent) + strlen(xor_name) + strlen(spacing) +
-                             strlen(dest) + strlen(pre_space) + strlen(post_space) + strlen(dest) + 2;
-            if (!asmopt_is_blank(trimmed_comment)) {
-                new_len += strlen(trimmed_comment) + 1;
-            }
-            char* newline = malloc(new_len + 1);
-            if (newline) {
-                if (!asmopt_is_blank(trimmed_comment)) {
-                    snprintf(newline, new_len + 1, "%s%s%s%s%s,%s%s %s",
-                             indent, xor_name, spacing, dest, pre_space, post_space, dest, trimmed_comment);
-                } else {
-                    snprintf(newline, new_len + 1, "%s%s%s%s%s,%s%s",
-                             indent, xor_name, spacing, dest, pre_space, post_space, dest);
-                }
-                asmopt_record_optimization(ctx, line_no, "and_zero_to_xor", line, newline);
-                asmopt_store_optimized_line(ctx, newline);
-                free(newline);
-                *replaced = true;
-            }
-            free(trimmed_comment);
-            goto cleanup;
+    if (count == 3) {
+        bool success = false;
+        long scale = asmopt_parse_immediate_view(pieces[2], NULL, &success);
+        if (!success || (scale != 1 && scale != 2 && scale != 4 && scale != 8)) {
+            return false;
         }
+        mem->scale = (unsigned char)scale;
     }
+    return true;
+}
 
-    /* Pattern 15: cmp rax, 0 -> test rax, rax */
-    if (strcmp(base_mnemonic, "cmp") == 0 && has_two_ops && dest_reg) {
-        if (asmopt_is_immediate_zero(src, syntax)) {
-            char test_name[8];
-            if (suffix) {
-                snprintf(test_name, sizeof(test_name), "test%c", suffix);
-            } else {
-                snprintf(test_name, sizeof(test_name), "test");
-            }
-            char* trimmed_comment = asmopt_trim_comment(comment);
-            size_t new_len = strlen(indent) + strlen(test_name) + strlen(spacing) +
-                             strlen(dest) + strlen(pre_space) + strlen(post_space) + strlen(dest) + 2;
-            if (!asmopt_is_blank(trimmed_comment)) {
-                new_len += strlen(trimmed_comment) + 1;
-            }
-            char* newline = malloc(new_len + 1);
-            if (newline) {
-                if (!asmopt_is_blank(trimmed_comment)) {
-                    snprintf(newline, new_len + 1, "%s%s%s%s%s,%s%s %s",
-                             indent, test_name, spacing, dest, pre_space, post_space, dest, trimmed_comment);
-                } else {
-                    snprintf(newline, new_len + 1, "%s%s%s%s%s,%s%s",
-                             indent, test_name, spacing, dest, pre_space, post_space, dest);
-                }
-                asmopt_record_optimization(ctx, line_no, "cmp_zero_to_test", line, newline);
-                asmopt_store_optimized_line(ctx, newline);
-                free(newline);
-                *replaced = true;
-            }
-            free(trimmed_comment);
-            goto cleanup;
-        }
+/* Decode a memory operand once: the registers it reads and, when it has one, its base/index/scale/disp form. */
+static void asmopt_decode_address(asmopt_view text, bool att, asmopt_address* mem) {
+    memset(mem, 0, sizeof(*mem));
+    mem->base = -1;
+    mem->index = -1;
+    mem->scale = 1;
+    if (text.len > 0) {
+        mem->simple = att ? asmopt_decode_att_address(text, mem) : asmopt_decode_intel_address(text, mem);
+    }
+    if (mem->simple) {
+        mem->uses_known = true;
+        mem->uses = (mem->base >= 0 ? ASMOPT_REGSET_BIT(mem->base) : 0) |
+                    (mem->index >= 0 ? ASMOPT_REGSET_BIT(mem->index) : 0);
+        return;
     }
+    mem->base = -1;
+    mem->index = -1;
+    mem->scale = 1;
+    mem->disp = 0;
+    mem->uses_known = asmopt_address_uses(text, &mem->uses);
+}
 
+static void asmopt_decode_operand(asmopt_context* ctx, asmopt_view text, const char* syntax, bool att,
+                                  asmopt_operand* op) {
+    op->text = text;
+    op->reg = -1;
+    op->reg_class = -1;
+    op->reg_width = 0;
+    op->imm = asmopt_parse_immediate_view(text, syntax, &op->has_imm);
+    if (asmopt_is_register_view(text, att)) {
+        op->reg = asmopt_intern(&ctx->operand_names, text);
+    }
+    if (op->has_imm) {
+        op->kind = ASMOPT_OPERAND_IMM;
+    } else if (asmopt_view_contains(text, '[') || asmopt_view_contains(text, '(')) {
+        op->kind = ASMOPT_OPERAND_MEM;
+        asmopt_decode_address(text, att, &op->mem);
+    } else if (op->reg >= 0) {
+        op->kind = ASMOPT_OPERAND_REG;
+        unsigned width = 0;
+        op->reg_class = (signed char)asmopt_reg_class(text, &width);
+        op->reg_width = (unsigned short)width;
+    } else if (asmopt_is_label_view(text)) {
+        op->kind = ASMOPT_OPERAND_LABEL;
+    } else {
+        op->kind = ASMOPT_OPERAND_OTHER;
+    }
+}
+
+/* Split "a, b" at the first top-level comma, keeping the spacing around it for re-emission. */
+static void asmopt_split_operands(asmopt_context* ctx, asmopt_insn* insn, const char* syntax, bool att) {
+    const char* start = insn->operands.ptr;
+    const char* end = start + insn->operands.len;
+    const char* comma = NULL;
+    int paren_depth = 0;
+    int bracket_depth = 0;
+    for (const char* ptr = start; ptr < end; ptr++) {
+        if (*ptr == '(') {
+            paren_depth++;
+        } else if (*ptr == ')') {
+            if (--paren_depth < 0) {
+                break;
+            }
+        } else if (*ptr == '[') {
+            bracket_depth++;
+        } else if (*ptr == ']') {
+            if (--bracket_depth < 0) {
+                break;
+            }
+        } else if (*ptr == ',' && paren_depth == 0 && bracket_depth == 0) {
+            comma = ptr;
+            break;
+        }
+    }
+    if (!comma) {
+        if (insn->operands_trimmed.len > 0) {
+            insn->operand_count = 1;
+            asmopt_decode_operand(ctx, insn->operands_trimmed, syntax, att, &insn->ops[0]);
+        }
+        return;
+    }
+    asmopt_view left = {start, (size_t)(comma - start)};
+    asmopt_view right = {comma + 1, (size_t)(end - comma - 1)};
+    asmopt_view left_op = asmopt_view_strip(left);
+    asmopt_view right_op = asmopt_view_strip(right);
+    const char* left_tail = left.ptr + left.len;
+    while (left_tail > left.ptr && isspace((unsigned char)*(left_tail - 1))) {
+        left_tail--;
+    }
+    insn->pre_space = (asmopt_view){left_tail, (size_t)(left.ptr + left.len - left_tail)};
+    size_t post_len = 0;
+    while (post_len < right.len && isspace((unsigned char)right.ptr[post_len])) {
+        post_len++;
+    }
+    insn->post_space = (asmopt_view){right.ptr, post_len};
+    insn->two_operands = true;
+    insn->operand_count = 2;
+    asmopt_decode_operand(ctx, left_op, syntax, att, &insn->ops[0]);
+    asmopt_decode_operand(ctx, right_op, syntax, att, &insn->ops[1]);
+    insn->dest = att ? 1 : 0;
+    insn->src = att ? 0 : 1;
+}
+
+/* Tokenize one line into views over the input buffer; nothing here allocates per line. */
+static void asmopt_tokenize_line(asmopt_context* ctx, const char* line, const char* syntax, asmopt_insn* insn) {
+    bool att = syntax && strcmp(syntax, "att") == 0;
+    memset(insn, 0, sizeof(*insn));
+    insn->ops[0].reg = -1;
+    insn->ops[1].reg = -1;
+    insn->ops[0].reg_class = -1;
+    insn->ops[1].reg_class = -1;
+    size_t length = strlen(line);
+    const char* code_end = line + asmopt_find_comment(ctx, line, length);
+    insn->comment = (asmopt_view){code_end, (size_t)(line + length - code_end)};
+    const char* lead = line;
+    while (lead < code_end && isspace((unsigned char)*lead)) {
+        lead++;
+    }
+    insn->code = asmopt_view_strip((asmopt_view){line, (size_t)(code_end - line)});
+    if (insn->code.len > 0 && insn->code.ptr[insn->code.len - 1] == ':') {
+        insn->has_label = true;
+        insn->label = (asmopt_view){insn->code.ptr, insn->code.len - 1};
+    }
+    if (insn->code.len == 0) {
+        insn->kind = ASMOPT_LINE_BLANK;
+    } else if (insn->has_label && !asmopt_view_contains(insn->code, ' ') && !asmopt_view_contains(insn->code, '\t')) {
+        /* Local labels (.L2:) start with a dot like directives do. */
+        insn->kind = ASMOPT_LINE_LABEL;
+    } else if (insn->code.ptr[0] == '.') {
+        insn->kind = ASMOPT_LINE_DIRECTIVE;
+    } else if (insn->has_label) {
+        insn->kind = ASMOPT_LINE_LABEL;
+    } else {
+        insn->kind = ASMOPT_LINE_TEXT;
+    }
+    /* The peephole engine only trims leading space when deciding whether a line is a directive/label. */
+    bool directive_or_label = lead == code_end || *lead == '.' || *(code_end - 1) == ':';
+    if (lead == code_end || !isalpha((unsigned char)*lead)) {
+        return;
+    }
+    const char* ptr = lead;
+    while (ptr < code_end && (isalnum((unsigned char)*ptr) || *ptr == '.')) {
+        ptr++;
+    }
+    insn->indent = (asmopt_view){line, (size_t)(lead - line)};
+    insn->mnemonic_text = (asmopt_view){lead, (size_t)(ptr - lead)};
+    const char* spacing = ptr;
+    while (ptr < code_end && isspace((unsigned char)*ptr)) {
+        ptr++;
+    }
+    insn->spacing = (asmopt_view){spacing, (size_t)(ptr - spacing)};
+    insn->operands = (asmopt_view){ptr, (size_t)(code_end - ptr)};
+    insn->operands_trimmed = asmopt_view_strip(insn->operands);
+    if (insn->kind == ASMOPT_LINE_TEXT) {
+        insn->kind = ASMOPT_LINE_INSTRUCTION;
+    }
+    insn->is_instruction = !directive_or_label;
+    asmopt_classify_mnemonic(insn->mnemonic_text, insn);
+    asmopt_split_operands(ctx, insn, syntax, att);
+}
+
+/* Concatenate views into a new line owned by line_arena. */
+static const char* asmopt_emit(asmopt_context* ctx, const asmopt_view* parts, size_t count) {
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        total += parts[i].len;
+    }
+    char* out = asmopt_arena_alloc(&ctx->line_arena, total + 1);
+    if (!out) {
+        return NULL;
+    }
+    char* tail = out;
+    for (size_t i = 0; i < count; i++) {
+        if (parts[i].len > 0) {
+            memcpy(tail, parts[i].ptr, parts[i].len);
+            tail += parts[i].len;
+        }
+    }
+    *tail = '\0';
+    return out;
+}
+
+static const char* asmopt_emit_joined(asmopt_context* ctx, const char* first, const char* second, const char* third) {
+    asmopt_view parts[] = {
+        asmopt_view_of(first), ASMOPT_VIEW_LIT("\n"), asmopt_view_of(second),
+        ASMOPT_VIEW_LIT("\n"), asmopt_view_of(third ? third : "")
+    };
+    return asmopt_emit(ctx, parts, third ? 5 : 3);
+}
+
+/* "<indent><name><spacing><first><pre>,<post><second>[ <comment>]" using layout's indent/spacing/comment. */
+static const char* asmopt_emit_binary(asmopt_context* ctx, const asmopt_insn* layout, const asmopt_insn* separators,
+                                      asmopt_view name, asmopt_view first, asmopt_view second) {
+    asmopt_view parts[10] = {
+        layout->indent, name, layout->spacing, first, separators->pre_space, ASMOPT_VIEW_LIT(","),
+        separators->post_space, second
+    };
+    size_t count = 8;
+    if (layout->comment.len > 0) {
+        parts[count++] = ASMOPT_VIEW_LIT(" ");
+        parts[count++] = layout->comment;
+    }
+    return asmopt_emit(ctx, parts, count);
+}
+
+static const char* asmopt_emit_unary(asmopt_context* ctx, const asmopt_insn* layout, asmopt_view name, asmopt_view operand) {
+    asmopt_view parts[6] = {layout->indent, name, layout->spacing, operand};
+    size_t count = 4;
+    if (layout->comment.len > 0) {
+        parts[count++] = ASMOPT_VIEW_LIT(" ");
+        parts[count++] = layout->comment;
+    }
+    return asmopt_emit(ctx, parts, count);
+}
+
+/* Keep the comment of a removed instruction on its own line. */
+static void asmopt_store_comment_line(asmopt_context* ctx, const asmopt_insn* insn) {
+    if (insn->comment.len == 0) {
+        return;
+    }
+    asmopt_view parts[] = {insn->indent, insn->comment};
+    const char* line = asmopt_emit(ctx, parts, 2);
+    if (line) {
+        asmopt_store_optimized_line(ctx, line);
+    }
+}
+
+static asmopt_view asmopt_suffixed_name(char* buffer, size_t size, const char* base, char suffix) {
+    if (suffix != '\0') {
+        snprintf(buffer, size, "%s%c", base, suffix);
+    } else {
+        snprintf(buffer, size, "%s", base);
+    }
+    return asmopt_view_of(buffer);
+}
+
+/* 8-, 32- or 64-bit name of a general-purpose register class, with AT&T's "%" when att; empty outside 0-15. */
+static asmopt_view asmopt_gpr_name(char* buffer, size_t size, int reg_class, unsigned width, bool att) {
+    static const char* const legacy[] = {"ax", "cx", "dx", "bx", "sp", "bp", "si", "di"};
+    static const char* const low[] = {"al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil"};
+    static const char* const numbered[] = {"r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"};
+    if (reg_class < 0 || reg_class > 15) {
+        buffer[0] = '\0';
+        return asmopt_view_of(buffer);
+    }
+    if (reg_class < 8) {
+        if (width == 8) {
+            snprintf(buffer, size, "%s%s", att ? "%" : "", low[reg_class]);
+        } else {
+            snprintf(buffer, size, "%s%c%s", att ? "%" : "", width == 64 ? 'r' : 'e', legacy[reg_class]);
+        }
+    } else {
+        snprintf(buffer, size, "%s%s%s", att ? "%" : "", numbered[reg_class - 8],
+                 width == 8 ? "b" : width == 64 ? "" : "d");
+    }
+    return asmopt_view_of(buffer);
+}
+
+/* "[base+index*scale+disp]" or "disp(%base,%index,scale)" over 64-bit registers; base or index may be -1. */
+static asmopt_view asmopt_format_address(char* buffer, size_t size, bool att, int base, int index, unsigned scale,
+                                         long disp) {
+    char base_name[8] = "";
+    char index_name[8] = "";
+    /* ",4294967295" is the longest scale an unsigned can print. */
+    char scale_text[12] = "";
+    char disp_text[24] = "";
+    if (base >= 0) {
+        asmopt_gpr_name(base_name, sizeof(base_name), base, 64, att);
+    }
+    if (index >= 0) {
+        asmopt_gpr_name(index_name, sizeof(index_name), index, 64, att);
+    }
+    if (att) {
+        if (index >= 0 && scale > 1) {
+            snprintf(scale_text, sizeof(scale_text), ",%u", scale);
+        }
+        if (disp != 0) {
+            snprintf(disp_text, sizeof(disp_text), "%ld", disp);
+        }
+        snprintf(buffer, size, "%s(%s%s%s%s)", disp_text, base_name, index >= 0 ? "," : "", index_name, scale_text);
+    } else {
+        if (index >= 0 && scale > 1) {
+            snprintf(scale_text, sizeof(scale_text), "*%u", scale);
+        }
+        if (disp != 0) {
+            snprintf(disp_text, sizeof(disp_text), "%+ld", disp);
+        }
+        snprintf(buffer, size, "[%s%s%s%s%s]", base_name, base >= 0 && index >= 0 ? "+" : "", index_name,
+                 scale_text, disp_text);
+    }
+    return asmopt_view_of(buffer);
+}
+
+static const asmopt_operand* asmopt_insn_dest(const asmopt_insn* insn) {
+    return &insn->ops[insn->dest];
+}
+
+static const asmopt_operand* asmopt_insn_src(const asmopt_insn* insn) {
+    return &insn->ops[insn->src];
+}
+
+static bool asmopt_operand_is_reg(const asmopt_operand* op) {
+    return op->reg >= 0;
+}
+
+static bool asmopt_operand_is_imm(const asmopt_operand* op, long value) {
+    return op->has_imm && op->imm == value;
+}
+
+static bool asmopt_same_reg(const asmopt_operand* left, const asmopt_operand* right) {
+    return left->reg >= 0 && left->reg == right->reg;
+}
+
+/* Two-operand instruction of the given family whose operands are both registers. */
+static bool asmopt_is_reg_reg(const asmopt_insn* insn, asmopt_mnemonic mnemonic) {
+    return insn && insn->is_instruction && insn->mnemonic == mnemonic && insn->two_operands &&
+           asmopt_operand_is_reg(asmopt_insn_dest(insn)) && asmopt_operand_is_reg(asmopt_insn_src(insn));
+}
+
+static const asmopt_insn* asmopt_line_insn(asmopt_context* ctx, size_t index) {
+    if (index >= ctx->ir_count) {
+        return NULL;
+    }
+    return &ctx->ir[index].insn;
+}
+
+/*
+ * Per-microarchitecture costs for the forms above, rounded from published
+ * measurements. "generic" stands for pre-BMI1 cores: no tzcnt, and inc/dec pay
+ * a flags merge because they leave CF untouched, and a three-component lea
+ * takes three cycles on one pipe. Zen 1 and 2 take two cycles for any scaled
+ * or three-component lea, later Zen parts one. Every model fuses cmp/test
+ * with a following jcc; Zen 3 and later also fuse add, sub, and, or, xor,
+ * inc and dec. Zen 3's larger predictor recovers from a miss in about 13
+ * cycles against Zen 1 and 2's 18, and generic cores pay two uops per cmov.
+ * Zen 1 runs 256-bit vector operations as two 128-bit halves, later parts at
+ * full width; Zen 4 splits 512-bit ones. Only Zen 4 has AVX-512, and generic
+ * assumes it might, so a VEX write may clear a zmm register's upper half.
+ */
+static const asmopt_cpu_model CPU_MODELS[] = {
+    {"generic", {
+        [ASMOPT_FORM_MOV_IMM] = {100, 25, ASMOPT_PIPE_ALU, 1, 7},
+        [ASMOPT_FORM_ALU_IMM] = {100, 25, ASMOPT_PIPE_ALU, 1, 4},
+        [ASMOPT_FORM_ALU_REG] = {100, 25, ASMOPT_PIPE_ALU, 1, 3},
+        [ASMOPT_FORM_ZERO_IDIOM] = {0, 25, 0, 1, 3},
+        [ASMOPT_FORM_TEST_REG] = {100, 25, ASMOPT_PIPE_ALU, 1, 3},
+        [ASMOPT_FORM_INC_DEC] = {100, 100, ASMOPT_PIPE_ALU, 2, 3},
+        [ASMOPT_FORM_IMUL_IMM] = {300, 100, ASMOPT_PIPE_ALU1, 1, 4},
+        [ASMOPT_FORM_SHIFT_IMM] = {100, 50, ASMOPT_PIPE_ALU1 | ASMOPT_PIPE_ALU2, 1, 4},
+        [ASMOPT_FORM_BSF] = {300, 100, ASMOPT_PIPE_ALU1, 1, 4},
+        [ASMOPT_FORM_MOV_REG] = {100, 25, ASMOPT_PIPE_ALU, 1, 3},
+        [ASMOPT_FORM_LOAD] = {400, 50, ASMOPT_PIPE_AGU01, 1, 4},
+        [ASMOPT_FORM_STORE] = {100, 100, ASMOPT_PIPE_AGU01, 1, 4},
+        [ASMOPT_FORM_LEA] = {100, 50, ASMOPT_PIPE_ALU1 | ASMOPT_PIPE_ALU2, 1, 4},
+        [ASMOPT_FORM_LEA_SCALED] = {100, 50, ASMOPT_PIPE_ALU1 | ASMOPT_PIPE_ALU2, 1, 4},
+        [ASMOPT_FORM_LEA_COMPLEX] = {300, 100, ASMOPT_PIPE_ALU1, 1, 5},
+        [ASMOPT_FORM_CMOV] = {200, 50, ASMOPT_PIPE_ALU, 2, 4},
+        [ASMOPT_FORM_SETCC] = {100, 50, ASMOPT_PIPE_ALU1 | ASMOPT_PIPE_ALU2, 1, 3},
+    }, ASMOPT_FUSE_CMP_TEST, 15, 256, 512},
+    {"zen1", {
+        [ASMOPT_FORM_MOV_IMM] = {100, 25, ASMOPT_PIPE_ALU, 1, 7},
+        [ASMOPT_FORM_ALU_IMM] = {100, 25, ASMOPT_PIPE_ALU, 1, 4},
+        [ASMOPT_FORM_ALU_REG] = {100, 25, ASMOPT_PIPE_ALU, 1, 3},
+        [ASMOPT_FORM_ZERO_IDIOM] = {0, 25, 0, 1, 3},
+        [ASMOPT_FORM_TEST_REG] = {100, 25, ASMOPT_PIPE_ALU, 1, 3},
+        [ASMOPT_FORM_INC_DEC] = {100, 25, ASMOPT_PIPE_ALU, 1, 3},
+        [ASMOPT_FORM_IMUL_IMM] = {300, 100, ASMOPT_PIPE_ALU1, 1, 4},
+        [ASMOPT_FORM_SHIFT_IMM] = {100, 50, ASMOPT_PIPE_ALU1 | ASMOPT_PIPE_ALU2, 1, 4},
+        [ASMOPT_FORM_BSF] = {300, 300, ASMOPT_PIPE_ALU, 6, 4},
+        [ASMOPT_FORM_TZCNT] = {200, 200, ASMOPT_PIPE_ALU, 2, 5},
+        [ASMOPT_FORM_MOV_REG] = {0, 25, 0, 1, 3},
+        [ASMOPT_FORM_LOAD] = {400, 50, ASMOPT_PIPE_AGU01, 1, 4},
+        [ASMOPT_FORM_STORE] = {100, 100, ASMOPT_PIPE_AGU01, 1, 4},
+        [ASMOPT_FORM_LEA] = {100, 25, ASMOPT_PIPE_ALU, 1, 4},
+        [ASMOPT_FORM_LEA_SCALED] = {200, 50, ASMOPT_PIPE_ALU, 1, 4},
+        [ASMOPT_FORM_LEA_COMPLEX] = {200, 50, ASMOPT_PIPE_ALU, 1, 5},
+        [ASMOPT_FORM_CMOV] = {100, 25, ASMOPT_PIPE_ALU, 1, 4},
+        [ASMOPT_FORM_SETCC] = {100, 25, ASMOPT_PIPE_ALU, 1, 3},
+    }, ASMOPT_FUSE_CMP_TEST, 18, 128, 256},
+    {"zen2", {
+        [ASMOPT_FORM_MOV_IMM] = {100, 25, ASMOPT_PIPE_ALU, 1, 7},
+        [ASMOPT_FORM_ALU_IMM] = {100, 25, ASMOPT_PIPE_ALU, 1, 4},
+        [ASMOPT_FORM_ALU_REG] = {100, 25, ASMOPT_PIPE_ALU, 1, 3},
+        [ASMOPT_FORM_ZERO_IDIOM] = {0, 25, 0, 1, 3},
+        [ASMOPT_FORM_TEST_REG] = {100, 25, ASMOPT_PIPE_ALU, 1, 3},
+        [ASMOPT_FORM_INC_DEC] = {100, 25, ASMOPT_PIPE_ALU, 1, 3},
+        [ASMOPT_FORM_IMUL_IMM] = {300, 100, ASMOPT_PIPE_ALU1, 1, 4},
+        [ASMOPT_FORM_SHIFT_IMM] = {100, 50, ASMOPT_PIPE_ALU1 | ASMOPT_PIPE_ALU2, 1, 4},
+        [ASMOPT_FORM_BSF] = {300, 300, ASMOPT_PIPE_ALU, 6, 4},
+        [ASMOPT_FORM_TZCNT] = {200, 200, ASMOPT_PIPE_ALU, 2, 5},
+        [ASMOPT_FORM_MOV_REG] = {0, 25, 0, 1, 3},
+        [ASMOPT_FORM_LOAD] = {400, 50, ASMOPT_PIPE_AGU, 1, 4},
+        [ASMOPT_FORM_STORE] = {100, 100, ASMOPT_PIPE_AGU, 1, 4},
+        [ASMOPT_FORM_LEA] = {100, 25, ASMOPT_PIPE_ALU, 1, 4},
+        [ASMOPT_FORM_LEA_SCALED] = {200, 50, ASMOPT_PIPE_ALU, 1, 4},
+        [ASMOPT_FORM_LEA_COMPLEX] = {200, 50, ASMOPT_PIPE_ALU, 1, 5},
+        [ASMOPT_FORM_CMOV] = {100, 25, ASMOPT_PIPE_ALU, 1, 4},
+        [ASMOPT_FORM_SETCC] = {100, 25, ASMOPT_PIPE_ALU, 1, 3},
+    }, ASMOPT_FUSE_CMP_TEST, 18, 256, 256},
+    {"zen3", {
+        [ASMOPT_FORM_MOV_IMM] = {100, 25, ASMOPT_PIPE_ALU, 1, 7},
+        [ASMOPT_FORM_ALU_IMM] = {100, 25, ASMOPT_PIPE_ALU, 1, 4},
+        [ASMOPT_FORM_ALU_REG] = {100, 25, ASMOPT_PIPE_ALU, 1, 3},
+        [ASMOPT_FORM_ZERO_IDIOM] = {0, 17, 0, 1, 3},
+        [ASMOPT_FORM_TEST_REG] = {100, 25, ASMOPT_PIPE_ALU, 1, 3},
+        [ASMOPT_FORM_INC_DEC] = {100, 25, ASMOPT_PIPE_ALU, 1, 3},
+        [ASMOPT_FORM_IMUL_IMM] = {300, 100, ASMOPT_PIPE_ALU1, 1, 4},
+        [ASMOPT_FORM_SHIFT_IMM] = {100, 50, ASMOPT_PIPE_ALU1 | ASMOPT_PIPE_ALU2, 1, 4},
+        [ASMOPT_FORM_BSF] = {300, 300, ASMOPT_PIPE_ALU, 6, 4},
+        [ASMOPT_FORM_TZCNT] = {100, 50, ASMOPT_PIPE_ALU1 | ASMOPT_PIPE_ALU2, 1, 5},
+        [ASMOPT_FORM_MOV_REG] = {0, 17, 0, 1, 3},
+        [ASMOPT_FORM_LOAD] = {400, 33, ASMOPT_PIPE_AGU, 1, 4},
+        [ASMOPT_FORM_STORE] = {100, 50, ASMOPT_PIPE_AGU, 1, 4},
+        [ASMOPT_FORM_LEA] = {100, 25, ASMOPT_PIPE_ALU, 1, 4},
+        [ASMOPT_FORM_LEA_SCALED] = {100, 25, ASMOPT_PIPE_ALU, 1, 4},
+        [ASMOPT_FORM_LEA_COMPLEX] = {100, 25, ASMOPT_PIPE_ALU, 1, 5},
+        [ASMOPT_FORM_CMOV] = {100, 25, ASMOPT_PIPE_ALU, 1, 4},
+        [ASMOPT_FORM_SETCC] = {100, 25, ASMOPT_PIPE_ALU, 1, 3},
+    }, ASMOPT_FUSE_CMP_TEST | ASMOPT_FUSE_ALU, 13, 256, 256},
+    {"zen4", {
+        [ASMOPT_FORM_MOV_IMM] = {100, 25, ASMOPT_PIPE_ALU, 1, 7},
+        [ASMOPT_FORM_ALU_IMM] = {100, 25, ASMOPT_PIPE_ALU, 1, 4},
+        [ASMOPT_FORM_ALU_REG] = {100, 25, ASMOPT_PIPE_ALU, 1, 3},
+        [ASMOPT_FORM_ZERO_IDIOM] = {0, 17, 0, 1, 3},
+        [ASMOPT_FORM_TEST_REG] = {100, 25, ASMOPT_PIPE_ALU, 1, 3},
+        [ASMOPT_FORM_INC_DEC] = {100, 25, ASMOPT_PIPE_ALU, 1, 3},
+        [ASMOPT_FORM_IMUL_IMM] = {300, 100, ASMOPT_PIPE_ALU1, 1, 4},
+        [ASMOPT_FORM_SHIFT_IMM] = {100, 50, ASMOPT_PIPE_ALU1 | ASMOPT_PIPE_ALU2, 1, 4},
+        [ASMOPT_FORM_BSF] = {300, 300, ASMOPT_PIPE_ALU, 6, 4},
+        [ASMOPT_FORM_TZCNT] = {100, 50, ASMOPT_PIPE_ALU1 | ASMOPT_PIPE_ALU2, 1, 5},
+        [ASMOPT_FORM_MOV_REG] = {0, 17, 0, 1, 3},
+        [ASMOPT_FORM_LOAD] = {400, 33, ASMOPT_PIPE_AGU, 1, 4},
+        [ASMOPT_FORM_STORE] = {100, 50, ASMOPT_PIPE_AGU, 1, 4},
+        [ASMOPT_FORM_LEA] = {100, 25, ASMOPT_PIPE_ALU, 1, 4},
+        [ASMOPT_FORM_LEA_SCALED] = {100, 25, ASMOPT_PIPE_ALU, 1, 4},
+        [ASMOPT_FORM_LEA_COMPLEX] = {100, 25, ASMOPT_PIPE_ALU, 1, 5},
+        [ASMOPT_FORM_CMOV] = {100, 25, ASMOPT_PIPE_ALU, 1, 4},
+        [ASMOPT_FORM_SETCC] = {100, 25, ASMOPT_PIPE_ALU, 1, 3},
+    }, ASMOPT_FUSE_CMP_TEST | ASMOPT_FUSE_ALU, 13, 256, 512},
+};
+
+static const size_t CPU_MODEL_COUNT = sizeof(CPU_MODELS) / sizeof(CPU_MODELS[0]);
+
+/* "zen" and "zen1".."zen4" pick their table, later Zen parts use zen4; AMD tuning off means generic. */
+static const asmopt_cpu_model* asmopt_select_cpu_model(asmopt_context* ctx) {
+    const asmopt_cpu_model* model = &CPU_MODELS[0];
+    if (!ctx->target_cpu || !ctx->amd_optimizations) {
+        return model;
+    }
+    const size_t prefix_len = strlen("zen");
+    asmopt_view prefix = {ctx->target_cpu, prefix_len};
+    if (strlen(ctx->target_cpu) < prefix_len || !asmopt_view_caseeq(prefix, ASMOPT_VIEW_LIT("zen"))) {
+        return model;
+    }
+    const char* digits = ctx->target_cpu + prefix_len;
+    if (*digits == '\0') {
+        return &CPU_MODELS[1];
+    }
+    if (!isdigit((unsigned char)*digits)) {
+        return model;
+    }
+    long generation = strtol(digits, NULL, 10);
+    if (generation < 1) {
+        return model;
+    }
+    size_t index = (size_t)generation < CPU_MODEL_COUNT ? (size_t)generation : CPU_MODEL_COUNT - 1;
+    return &CPU_MODELS[index];
+}
+
+/*
+ * Cost of a form under the level's goal, lower is better. -O1/-O2 add cycles
+ * (latency plus reciprocal throughput, in hundredths) to 100 per byte. -O3 and
+ * above rank by latency, then reciprocal throughput, then bytes; -Os ranks by
+ * bytes, then cycles. Table cycles stay below 500 hundredths and sizes below
+ * 10 bytes, so the ranks never overlap, even summed over lea_merge's chain of
+ * three instructions.
+ */
+static long asmopt_form_score(const asmopt_context* ctx, asmopt_form form) {
+    const asmopt_form_cost* cost = &ctx->cpu_model->forms[form];
+    if (ctx->optimize_size) {
+        return 100000L * cost->size + cost->latency + cost->rthroughput;
+    }
+    if (ctx->optimization_level >= 3) {
+        return 100000L * cost->latency + 100L * cost->rthroughput + cost->size;
+    }
+    return cost->latency + cost->rthroughput + 100L * cost->size;
+}
+
+/* A rewrite is kept unless the target lacks the new form or the model says it is slower. */
+static bool asmopt_rewrite_pays(const asmopt_match* match, asmopt_form from, asmopt_form to) {
+    const asmopt_context* ctx = match->ctx;
+    if (ctx->cpu_model->forms[to].size == 0) {
+        return false;
+    }
+    return asmopt_form_score(ctx, to) <= asmopt_form_score(ctx, from);
+}
+
+/* Cost form of an lea computing mem: three components, a scaled index, or neither. */
+static asmopt_form asmopt_lea_form(const asmopt_address* mem) {
+    int parts = (mem->base >= 0) + (mem->index >= 0) + (mem->disp != 0);
+    if (!mem->simple || parts < 2) {
+        return ASMOPT_FORM_LEA;
+    }
+    if (parts == 3) {
+        return ASMOPT_FORM_LEA_COMPLEX;
+    }
+    return mem->index >= 0 && mem->scale > 1 ? ASMOPT_FORM_LEA_SCALED : ASMOPT_FORM_LEA;
+}
+
+/*
+ * Register effects. asmopt_insn_effects describes the registers, flags and
+ * memory an instruction reads and writes, for the mnemonics modelled here;
+ * callers treat anything else as reading every register. Implicit operands
+ * follow the System V ABI: a call reads the argument registers and clobbers
+ * the caller-saved ones, a return reads the return and callee-saved ones.
+ * That clobber set covers Microsoft x64 too; liveness swaps in the sets of
+ * the selected ABI (asmopt_live_effects).
+ */
+static void asmopt_reg_effects(int reg_class, unsigned width, bool read, bool written, bool vex,
+                               asmopt_effects* effects) {
+    asmopt_regset bit = ASMOPT_REGSET_BIT(reg_class);
+    /* 8/16-bit and legacy-SSE writes keep the rest of the register; 32-bit and VEX writes zero it. */
+    bool partial = reg_class < ASMOPT_REG_VECTOR0 ? width < 32 : !vex;
+    if (read || (written && partial)) {
+        effects->uses |= bit;
+    }
+    if (written) {
+        effects->defs |= bit;
+    }
+}
+
+/* Add one operand's effects from its text; false for operands that cannot be modelled. */
+static bool asmopt_operand_effects(asmopt_view text, asmopt_operand_kind kind, bool read, bool written, bool vex,
+                                   asmopt_effects* effects) {
+    if (kind == ASMOPT_OPERAND_IMM) {
+        return !written;
+    }
+    if (kind == ASMOPT_OPERAND_MEM) {
+        if (!asmopt_address_uses(text, &effects->uses)) {
+            return false;
+        }
+        effects->load = effects->load || read;
+        effects->store = effects->store || written;
+        return true;
+    }
+    if (kind != ASMOPT_OPERAND_REG) {
+        return false;
+    }
+    unsigned width = 0;
+    int reg_class = asmopt_reg_class(text, &width);
+    if (reg_class < 0) {
+        return false;
+    }
+    asmopt_reg_effects(reg_class, width, read, written, vex, effects);
+    return true;
+}
+
+/* As above, for an operand the tokenizer already decoded. */
+static bool asmopt_decoded_effects(const asmopt_operand* op, bool read, bool written, bool vex,
+                                   asmopt_effects* effects) {
+    if (op->kind == ASMOPT_OPERAND_IMM) {
+        return !written;
+    }
+    if (op->kind == ASMOPT_OPERAND_MEM) {
+        if (!op->mem.uses_known) {
+            return false;
+        }
+        effects->uses |= op->mem.uses;
+        effects->load = effects->load || read;
+        effects->store = effects->store || written;
+        return true;
+    }
+    if (op->kind != ASMOPT_OPERAND_REG || op->reg_class < 0) {
+        return false;
+    }
+    asmopt_reg_effects(op->reg_class, op->reg_width, read, written, vex, effects);
+    return true;
+}
+
+static bool asmopt_op_effects(const asmopt_operand* op, bool read, bool written, asmopt_effects* effects) {
+    return asmopt_decoded_effects(op, read, written, false, effects);
+}
+
+/* Operand kind of a split-off piece of a three-operand list: only registers and memory occur there. */
+static asmopt_operand_kind asmopt_piece_kind(asmopt_view piece) {
+    unsigned width = 0;
+    if (asmopt_view_contains(piece, '[') || asmopt_view_contains(piece, '(')) {
+        return ASMOPT_OPERAND_MEM;
+    }
+    return asmopt_reg_class(piece, &width) >= 0 ? ASMOPT_OPERAND_REG : ASMOPT_OPERAND_OTHER;
+}
+
+/* Integer (or AT&T "$" integer) operand; false for symbols and non-immediates. */
+static bool asmopt_piece_immediate(asmopt_view piece, long* value) {
+    if (piece.len > 0 && piece.ptr[0] == '$') {
+        piece.ptr++;
+        piece.len--;
+    }
+    char text[32];
+    if (piece.len == 0 || piece.len >= sizeof(text) ||
+        !(isdigit((unsigned char)piece.ptr[0]) || piece.ptr[0] == '-' || piece.ptr[0] == '+')) {
+        return false;
+    }
+    asmopt_view_copy(piece, text, sizeof(text));
+    char* end = NULL;
+    *value = strtol(text, &end, 0);
+    return end != text && *end == '\0';
+}
+
+/*
+ * Three-operand imul, dest = src * imm (imm, src, dest in AT&T). The
+ * tokenizer splits operands at the first comma only, so the pieces come from here.
+ */
+static bool asmopt_imul3_pieces(const asmopt_insn* insn, asmopt_view* dest, asmopt_view* src, long* imm) {
+    asmopt_view base = insn->mnemonic_text;
+    if (base.len == 5 && strchr("wlq", tolower((unsigned char)base.ptr[4]))) {
+        base.len = 4;
+    }
+    asmopt_view pieces[3];
+    if (!asmopt_view_is(base, "imul") || asmopt_split_operand_list(insn->operands_trimmed, pieces, 3) != 3) {
+        return false;
+    }
+    bool att = insn->dest == 1;
+    *dest = att ? pieces[2] : pieces[0];
+    *src = pieces[1];
+    return asmopt_piece_immediate(att ? pieces[0] : pieces[2], imm);
+}
+
+typedef enum {
+    /* inc/dec/neg/not: the one operand is read and written. */
+    ASMOPT_SHAPE_UNARY,
+    /* dest = src: extending and vector moves. */
+    ASMOPT_SHAPE_MOVE,
+    /* dest = dest op src; a VEX form writes dest = a op b instead. */
+    ASMOPT_SHAPE_BINARY
+} asmopt_effect_shape;
+
+#define ASMOPT_TRAIT_READS_FLAGS 0x01u
+#define ASMOPT_TRAIT_WRITES_FLAGS 0x02u
+/* Same register twice only writes the destination (pxor xmm0, xmm0). */
+#define ASMOPT_TRAIT_ZERO_IDIOM 0x04u
+/* A v-prefixed VEX form exists, with the destination's upper bits zeroed. */
+#define ASMOPT_TRAIT_VEX 0x08u
+
+static const struct {
+    const char* name;
+    unsigned char shape;
+    unsigned char traits;
+} EFFECT_MNEMONICS[] = {
+    {"inc", ASMOPT_SHAPE_UNARY, ASMOPT_TRAIT_READS_FLAGS | ASMOPT_TRAIT_WRITES_FLAGS},
+    {"dec", ASMOPT_SHAPE_UNARY, ASMOPT_TRAIT_READS_FLAGS | ASMOPT_TRAIT_WRITES_FLAGS},
+    {"neg", ASMOPT_SHAPE_UNARY, ASMOPT_TRAIT_WRITES_FLAGS},
+    {"not", ASMOPT_SHAPE_UNARY, 0},
+    {"movzx", ASMOPT_SHAPE_MOVE, 0}, {"movsx", ASMOPT_SHAPE_MOVE, 0},
+    {"movsxd", ASMOPT_SHAPE_MOVE, 0}, {"movabs", ASMOPT_SHAPE_MOVE, 0},
+    {"movzbw", ASMOPT_SHAPE_MOVE, 0}, {"movzbl", ASMOPT_SHAPE_MOVE, 0},
+    {"movzbq", ASMOPT_SHAPE_MOVE, 0}, {"movzwl", ASMOPT_SHAPE_MOVE, 0},
+    {"movzwq", ASMOPT_SHAPE_MOVE, 0}, {"movsbw", ASMOPT_SHAPE_MOVE, 0},
+    {"movsbl", ASMOPT_SHAPE_MOVE, 0}, {"movsbq", ASMOPT_SHAPE_MOVE, 0},
+    {"movswl", ASMOPT_SHAPE_MOVE, 0}, {"movswq", ASMOPT_SHAPE_MOVE, 0},
+    {"movslq", ASMOPT_SHAPE_MOVE, 0},
+    {"movaps", ASMOPT_SHAPE_MOVE, ASMOPT_TRAIT_VEX}, {"movups", ASMOPT_SHAPE_MOVE, ASMOPT_TRAIT_VEX},
+    {"movapd", ASMOPT_SHAPE_MOVE, ASMOPT_TRAIT_VEX}, {"movupd", ASMOPT_SHAPE_MOVE, ASMOPT_TRAIT_VEX},
+    {"movdqa", ASMOPT_SHAPE_MOVE, ASMOPT_TRAIT_VEX}, {"movdqu", ASMOPT_SHAPE_MOVE, ASMOPT_TRAIT_VEX},
+    {"movd", ASMOPT_SHAPE_MOVE, ASMOPT_TRAIT_VEX}, {"movq", ASMOPT_SHAPE_MOVE, ASMOPT_TRAIT_VEX},
+    {"movss", ASMOPT_SHAPE_MOVE, 0}, {"movsd", ASMOPT_SHAPE_MOVE, 0},
+    {"pxor", ASMOPT_SHAPE_BINARY, ASMOPT_TRAIT_ZERO_IDIOM | ASMOPT_TRAIT_VEX},
+    {"xorps", ASMOPT_SHAPE_BINARY, ASMOPT_TRAIT_ZERO_IDIOM | ASMOPT_TRAIT_VEX},
+    {"xorpd", ASMOPT_SHAPE_BINARY, ASMOPT_TRAIT_ZERO_IDIOM | ASMOPT_TRAIT_VEX},
+    {"psubb", ASMOPT_SHAPE_BINARY, ASMOPT_TRAIT_ZERO_IDIOM | ASMOPT_TRAIT_VEX},
+    {"psubw", ASMOPT_SHAPE_BINARY, ASMOPT_TRAIT_ZERO_IDIOM | ASMOPT_TRAIT_VEX},
+    {"psubd", ASMOPT_SHAPE_BINARY, ASMOPT_TRAIT_ZERO_IDIOM | ASMOPT_TRAIT_VEX},
+    {"psubq", ASMOPT_SHAPE_BINARY, ASMOPT_TRAIT_ZERO_IDIOM | ASMOPT_TRAIT_VEX},
+    {"por", ASMOPT_SHAPE_BINARY, ASMOPT_TRAIT_VEX}, {"pand", ASMOPT_SHAPE_BINARY, ASMOPT_TRAIT_VEX},
+    {"pandn", ASMOPT_SHAPE_BINARY, ASMOPT_TRAIT_VEX}, {"paddb", ASMOPT_SHAPE_BINARY, ASMOPT_TRAIT_VEX},
+    {"paddw", ASMOPT_SHAPE_BINARY, ASMOPT_TRAIT_VEX}, {"paddd", ASMOPT_SHAPE_BINARY, ASMOPT_TRAIT_VEX},
+    {"paddq", ASMOPT_SHAPE_BINARY, ASMOPT_TRAIT_VEX}, {"andps", ASMOPT_SHAPE_BINARY, ASMOPT_TRAIT_VEX},
+    {"andpd", ASMOPT_SHAPE_BINARY, ASMOPT_TRAIT_VEX}, {"andnps", ASMOPT_SHAPE_BINARY, ASMOPT_TRAIT_VEX},
+    {"andnpd", ASMOPT_SHAPE_BINARY, ASMOPT_TRAIT_VEX}, {"orps", ASMOPT_SHAPE_BINARY, ASMOPT_TRAIT_VEX},
+    {"orpd", ASMOPT_SHAPE_BINARY, ASMOPT_TRAIT_VEX}, {"addps", ASMOPT_SHAPE_BINARY, ASMOPT_TRAIT_VEX},
+    {"addpd", ASMOPT_SHAPE_BINARY, ASMOPT_TRAIT_VEX}, {"addss", ASMOPT_SHAPE_BINARY, ASMOPT_TRAIT_VEX},
+    {"addsd", ASMOPT_SHAPE_BINARY, ASMOPT_TRAIT_VEX}, {"subps", ASMOPT_SHAPE_BINARY, ASMOPT_TRAIT_VEX},
+    {"subpd", ASMOPT_SHAPE_BINARY, ASMOPT_TRAIT_VEX}, {"subss", ASMOPT_SHAPE_BINARY, ASMOPT_TRAIT_VEX},
+    {"subsd", ASMOPT_SHAPE_BINARY, ASMOPT_TRAIT_VEX}, {"mulps", ASMOPT_SHAPE_BINARY, ASMOPT_TRAIT_VEX},
+    {"mulpd", ASMOPT_SHAPE_BINARY, ASMOPT_TRAIT_VEX}, {"mulss", ASMOPT_SHAPE_BINARY, ASMOPT_TRAIT_VEX},
+    {"mulsd", ASMOPT_SHAPE_BINARY, ASMOPT_TRAIT_VEX},
+    /* Broadcasts only exist as v forms. */
+    {"pbroadcastb", ASMOPT_SHAPE_MOVE, ASMOPT_TRAIT_VEX}, {"pbroadcastw", ASMOPT_SHAPE_MOVE, ASMOPT_TRAIT_VEX},
+    {"pbroadcastd", ASMOPT_SHAPE_MOVE, ASMOPT_TRAIT_VEX}, {"pbroadcastq", ASMOPT_SHAPE_MOVE, ASMOPT_TRAIT_VEX},
+    {"broadcastss", ASMOPT_SHAPE_MOVE, ASMOPT_TRAIT_VEX}, {"broadcastsd", ASMOPT_SHAPE_MOVE, ASMOPT_TRAIT_VEX},
+};
+
+static const char* const CONDITION_CODES[] = {
+    "o", "no", "b", "c", "nae", "ae", "nb", "nc", "e", "z", "ne", "nz", "be", "na", "a", "nbe",
+    "s", "ns", "p", "pe", "np", "po", "l", "nge", "ge", "nl", "le", "ng", "g", "nle",
+};
+
+static bool asmopt_is_condition_code(const char* text) {
+    for (size_t i = 0; i < sizeof(CONDITION_CODES) / sizeof(CONDITION_CODES[0]); i++) {
+        if (strcmp(text, CONDITION_CODES[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* setcc/cmovcc, with or without an AT&T size suffix. */
+static bool asmopt_is_conditional_op(const char* lower, const char* prefix) {
+    size_t prefix_len = strlen(prefix);
+    if (strncmp(lower, prefix, prefix_len) != 0) {
+        return false;
+    }
+    char condition[8];
+    snprintf(condition, sizeof(condition), "%s", lower + prefix_len);
+    if (asmopt_is_condition_code(condition)) {
+        return true;
+    }
+    size_t len = strlen(condition);
+    if (len < 2 || !strchr("bwlq", condition[len - 1])) {
+        return false;
+    }
+    condition[len - 1] = '\0';
+    return asmopt_is_condition_code(condition);
+}
+
+static int asmopt_effect_mnemonic(const char* lower, bool* vex) {
+    size_t count = sizeof(EFFECT_MNEMONICS) / sizeof(EFFECT_MNEMONICS[0]);
+    *vex = false;
+    for (int pass = 0; pass < 2; pass++) {
+        const char* name = lower;
+        if (pass == 1) {
+            if (lower[0] != 'v') {
+                return -1;
+            }
+            name = lower + 1;
+            *vex = true;
+        }
+        for (size_t i = 0; i < count; i++) {
+            if (strcmp(name, EFFECT_MNEMONICS[i].name) == 0) {
+                if (*vex && !(EFFECT_MNEMONICS[i].traits & ASMOPT_TRAIT_VEX)) {
+                    return -1;
+                }
+                return (int)i;
+            }
+        }
+    }
+    return -1;
+}
+
+/* Effects of the mnemonics without an asmopt_mnemonic of their own. */
+static bool asmopt_other_effects(const asmopt_insn* insn, asmopt_effects* effects) {
+    char lower[16];
+    if (insn->mnemonic_text.len == 0 || insn->mnemonic_text.len >= sizeof(lower)) {
+        return false;
+    }
+    for (size_t i = 0; i < insn->mnemonic_text.len; i++) {
+        lower[i] = (char)tolower((unsigned char)insn->mnemonic_text.ptr[i]);
+    }
+    lower[insn->mnemonic_text.len] = '\0';
+    const asmopt_operand* dest = asmopt_insn_dest(insn);
+    const asmopt_operand* src = asmopt_insn_src(insn);
+    const asmopt_regset rax = ASMOPT_REGSET_BIT(0);
+    const asmopt_regset rdx = ASMOPT_REGSET_BIT(2);
+    const asmopt_regset rsp = ASMOPT_REGSET_BIT(ASMOPT_REG_RSP);
+    if (insn->operand_count == 0) {
+        if (strcmp(lower, "nop") == 0 || strncmp(lower, "endbr", 5) == 0 || strcmp(lower, "pause") == 0 ||
+            strcmp(lower, "vzeroupper") == 0) {
+            return true;
+        }
+        if (strcmp(lower, "cltq") == 0 || strcmp(lower, "cdqe") == 0 || strcmp(lower, "cwtl") == 0 ||
+            strcmp(lower, "cwde") == 0) {
+            effects->uses = rax;
+            effects->defs = rax;
+            return true;
+        }
+        if (strcmp(lower, "cqto") == 0 || strcmp(lower, "cqo") == 0 || strcmp(lower, "cltd") == 0 ||
+            strcmp(lower, "cdq") == 0) {
+            effects->uses = rax;
+            effects->defs = rdx;
+            return true;
+        }
+    }
+    if (strcmp(lower, "call") == 0 || strcmp(lower, "callq") == 0) {
+        effects->uses = ASMOPT_REGSET_ARGUMENTS | rsp;
+        effects->defs = ASMOPT_REGSET_CALL_CLOBBERED;
+        effects->load = true;
+        effects->store = true;
+        return asmopt_address_uses(insn->operands_trimmed, &effects->uses);
+    }
+    if (insn->operand_count == 1 && !insn->two_operands) {
+        if (strcmp(lower, "push") == 0 || strcmp(lower, "pushq") == 0) {
+            effects->uses = rsp;
+            effects->defs = rsp;
+            effects->store = true;
+            return asmopt_op_effects(&insn->ops[0], true, false, effects);
+        }
+        if (strcmp(lower, "pop") == 0 || strcmp(lower, "popq") == 0) {
+            effects->uses = rsp;
+            effects->defs = rsp;
+            effects->load = true;
+            return asmopt_op_effects(&insn->ops[0], false, true, effects);
+        }
+        if (asmopt_is_conditional_op(lower, "set")) {
+            effects->uses = ASMOPT_REGSET_FLAGS;
+            return asmopt_op_effects(&insn->ops[0], false, true, effects);
+        }
+    }
+    if (insn->two_operands && asmopt_is_conditional_op(lower, "cmov")) {
+        effects->uses = ASMOPT_REGSET_FLAGS;
+        return asmopt_op_effects(src, true, false, effects) && asmopt_op_effects(dest, true, true, effects);
+    }
+    bool vex = false;
+    int entry = asmopt_effect_mnemonic(lower, &vex);
+    size_t len = strlen(lower);
+    if (entry < 0 && len > 3 && strchr("bwlq", lower[len - 1])) {
+        lower[len - 1] = '\0';
+        entry = asmopt_effect_mnemonic(lower, &vex);
+        if (entry >= 0 && EFFECT_MNEMONICS[entry].shape != ASMOPT_SHAPE_UNARY) {
+            entry = -1;
+        }
+    }
+    if (entry < 0) {
+        return false;
+    }
+    unsigned traits = EFFECT_MNEMONICS[entry].traits;
+    if (traits & ASMOPT_TRAIT_READS_FLAGS) {
+        effects->uses |= ASMOPT_REGSET_FLAGS;
+    }
+    if (traits & ASMOPT_TRAIT_WRITES_FLAGS) {
+        effects->defs |= ASMOPT_REGSET_FLAGS;
+    }
+    switch (EFFECT_MNEMONICS[entry].shape) {
+    case ASMOPT_SHAPE_UNARY:
+        return insn->operand_count == 1 && asmopt_op_effects(&insn->ops[0], true, true, effects);
+    case ASMOPT_SHAPE_MOVE:
+        return insn->two_operands && asmopt_op_effects(src, true, false, effects) &&
+               asmopt_decoded_effects(dest, false, true, vex, effects);
+    default:
+        break;
+    }
+    bool zero_idiom = (traits & ASMOPT_TRAIT_ZERO_IDIOM) != 0;
+    if (!vex) {
+        if (!insn->two_operands) {
+            return false;
+        }
+        if (zero_idiom && asmopt_same_reg(dest, src)) {
+            return asmopt_op_effects(dest, false, true, effects);
+        }
+        return asmopt_op_effects(src, true, false, effects) && asmopt_op_effects(dest, true, true, effects);
+    }
+    /* VEX: dest, a, b in Intel order, b, a, dest in AT&T. */
+    asmopt_view pieces[3];
+    if (asmopt_split_operand_list(insn->operands_trimmed, pieces, 3) != 3) {
+        return false;
+    }
+    bool att = insn->dest == 1;
+    asmopt_view target = att ? pieces[2] : pieces[0];
+    asmopt_view first = pieces[1];
+    asmopt_view second = att ? pieces[0] : pieces[2];
+    bool same = zero_idiom && asmopt_piece_kind(first) == ASMOPT_OPERAND_REG && asmopt_view_caseeq(first, second);
+    return (same || (asmopt_operand_effects(first, asmopt_piece_kind(first), true, false, true, effects) &&
+                     asmopt_operand_effects(second, asmopt_piece_kind(second), true, false, true, effects))) &&
+           asmopt_operand_effects(target, asmopt_piece_kind(target), false, true, true, effects);
+}
+
+/* Registers, flags and memory an instruction reads and writes; false if it is not modelled. */
+static bool asmopt_insn_effects(const asmopt_insn* insn, asmopt_effects* effects) {
+    memset(effects, 0, sizeof(*effects));
+    if (!insn->is_instruction || insn->kind != ASMOPT_LINE_INSTRUCTION ||
+        asmopt_view_contains(insn->operands, '{')) {
+        return false;
+    }
+    asmopt_view product;
+    asmopt_view factor;
+    long imm = 0;
+    if (asmopt_imul3_pieces(insn, &product, &factor, &imm)) {
+        effects->defs = ASMOPT_REGSET_FLAGS;
+        return asmopt_operand_effects(factor, asmopt_piece_kind(factor), true, false, false, effects) &&
+               asmopt_operand_effects(product, asmopt_piece_kind(product), false, true, false, effects);
+    }
+    const asmopt_operand* dest = asmopt_insn_dest(insn);
+    const asmopt_operand* src = asmopt_insn_src(insn);
+    switch (insn->mnemonic) {
+    case ASMOPT_MN_MOV:
+        return insn->two_operands && asmopt_op_effects(src, true, false, effects) &&
+               asmopt_op_effects(dest, false, true, effects);
+    case ASMOPT_MN_LEA:
+        if (!insn->two_operands || src->kind != ASMOPT_OPERAND_MEM || !src->mem.uses_known) {
+            return false;
+        }
+        effects->uses |= src->mem.uses;
+        return asmopt_op_effects(dest, false, true, effects);
+    case ASMOPT_MN_ADD:
+    case ASMOPT_MN_SUB:
+    case ASMOPT_MN_AND:
+    case ASMOPT_MN_OR:
+    case ASMOPT_MN_XOR:
+        if (!insn->two_operands) {
+            return false;
+        }
+        effects->defs = ASMOPT_REGSET_FLAGS;
+        if ((insn->mnemonic == ASMOPT_MN_XOR || insn->mnemonic == ASMOPT_MN_SUB) && asmopt_same_reg(dest, src)) {
+            /* Zero idiom: the old value is not read. */
+            return asmopt_op_effects(dest, false, true, effects);
+        }
+        return asmopt_op_effects(src, true, false, effects) && asmopt_op_effects(dest, true, true, effects);
+    case ASMOPT_MN_CMP:
+    case ASMOPT_MN_TEST:
+        effects->defs = ASMOPT_REGSET_FLAGS;
+        return insn->two_operands && asmopt_op_effects(src, true, false, effects) &&
+               asmopt_op_effects(dest, true, false, effects);
+    case ASMOPT_MN_SHL:
+    case ASMOPT_MN_SHR:
+    case ASMOPT_MN_SAL:
+    case ASMOPT_MN_SAR:
+        if (!insn->two_operands) {
+            return false;
+        }
+        /* A zero count leaves the flags alone, so a count in cl makes them an input as well. */
+        if (src->kind != ASMOPT_OPERAND_IMM) {
+            effects->uses = ASMOPT_REGSET_FLAGS;
+            effects->defs = ASMOPT_REGSET_FLAGS;
+        } else if (!src->has_imm || (src->imm & 31) != 0) {
+            effects->defs = ASMOPT_REGSET_FLAGS;
+        }
+        return asmopt_op_effects(src, true, false, effects) && asmopt_op_effects(dest, true, true, effects);
+    case ASMOPT_MN_IMUL:
+    case ASMOPT_MN_BSF:
+        /* bsf leaves the destination unchanged for a zero source on AMD parts. */
+        effects->defs = ASMOPT_REGSET_FLAGS;
+        return insn->two_operands && asmopt_op_effects(src, true, false, effects) &&
+               asmopt_op_effects(dest, true, true, effects);
+    case ASMOPT_MN_JMP:
+        return asmopt_address_uses(insn->operands_trimmed, &effects->uses);
+    case ASMOPT_MN_JCC:
+        effects->uses = ASMOPT_REGSET_FLAGS;
+        if (asmopt_view_contains(insn->mnemonic_text, 'x')) {
+            /* jcxz/jecxz/jrcxz test rcx. */
+            effects->uses |= ASMOPT_REGSET_BIT(1);
+        }
+        return true;
+    case ASMOPT_MN_RET:
+        effects->uses = ASMOPT_REGSET_RETURN | ASMOPT_REGSET_CALLEE_SAVED;
+        return true;
+    default:
+        return asmopt_other_effects(insn, effects);
+    }
+}
+
+/* IR index whose liveness describes current line_no (1-based), or false if it no longer applies. */
+static bool asmopt_live_index(const asmopt_context* ctx, size_t line_no, size_t* index) {
+    if (!ctx->live_after || line_no == 0 || line_no > ctx->original_count) {
+        return false;
+    }
+    size_t origin = ctx->worklist.origins ? ctx->worklist.origins[line_no - 1] : line_no;
+    if (origin == 0 || origin > ctx->live_count) {
+        return false;
+    }
+    /* A rewritten line may stand in for several input lines, so only untouched lines are trusted. */
+    if (ctx->live_lines[origin - 1] != ctx->original_lines[line_no - 1]) {
+        return false;
+    }
+    *index = origin - 1;
+    return true;
+}
+
+/* True if nothing reads any of regs after line_no; false when that is not known. */
+static bool asmopt_regs_dead_after(const asmopt_context* ctx, size_t line_no, asmopt_regset regs) {
+    size_t index = 0;
+    return asmopt_live_index(ctx, line_no, &index) && (ctx->live_after[index] & regs) == 0;
+}
+
+/* As above, but without liveness (streaming) patterns keep the local checks they always had. */
+static bool asmopt_may_clobber(const asmopt_context* ctx, size_t line_no, asmopt_regset regs) {
+    return !ctx->live_after || asmopt_regs_dead_after(ctx, line_no, regs);
+}
+
+static asmopt_regset asmopt_operand_regset(const asmopt_operand* op) {
+    return op->kind == ASMOPT_OPERAND_REG && op->reg_class >= 0 ? ASMOPT_REGSET_BIT(op->reg_class) : 0;
+}
+
+/* May name overlapping storage, as eax and rax do; unmodelled names only overlap themselves. */
+static bool asmopt_regs_alias(const asmopt_operand* left, const asmopt_operand* right) {
+    if (left->reg_class >= 0 && right->reg_class >= 0) {
+        return left->reg_class == right->reg_class;
+    }
+    return asmopt_same_reg(left, right);
+}
+
+/* A write to cover leaves nothing of what was last written to reg: it names the same register or a wider one. */
+static bool asmopt_write_covers(const asmopt_operand* cover, const asmopt_operand* reg) {
+    if (asmopt_same_reg(cover, reg)) {
+        return true;
+    }
+    /* 32-bit writes zero the upper half; ah is not covered by al. */
+    return cover->reg_class >= 0 && cover->reg_class == reg->reg_class && cover->reg_class < ASMOPT_REG_VECTOR0 &&
+           cover->reg_width >= 32 && cover->reg_width >= reg->reg_width;
+}
+
+/*
+ * Writing reg with the value it already holds changes nothing, except that a
+ * 32-bit write in 64-bit mode clears the upper half; that only matters if the
+ * register is read after line_no. movq/movd into a vector register clear
+ * everything above the low element, so those are never no-ops.
+ */
+static bool asmopt_self_write_is_nop(const asmopt_context* ctx, size_t line_no, const asmopt_operand* reg) {
+    if (reg->reg_class >= ASMOPT_REG_VECTOR0) {
+        return false;
+    }
+    if (reg->reg_class < 0 || reg->reg_width != 32 || strcmp(ctx->architecture, "x86") == 0) {
+        return true;
+    }
+    return ctx->live_after && asmopt_regs_dead_after(ctx, line_no, asmopt_operand_regset(reg));
+}
+
+/* The register in reg takes part in mem's address, or the address cannot be read. */
+static bool asmopt_address_reads(const asmopt_operand* mem, const asmopt_operand* reg) {
+    return !mem->mem.uses_known || (mem->mem.uses & asmopt_operand_regset(reg)) != 0;
+}
+
+static bool asmopt_is_flag_test_of(const asmopt_insn* test, const asmopt_operand* src) {
+    if (!test->two_operands) {
+        return false;
+    }
+    if (test->mnemonic == ASMOPT_MN_TEST) {
+        return asmopt_same_reg(&test->ops[0], src) && asmopt_same_reg(&test->ops[1], src);
+    }
+    if (test->mnemonic == ASMOPT_MN_CMP) {
+        return asmopt_same_reg(asmopt_insn_dest(test), src) && asmopt_operand_is_imm(asmopt_insn_src(test), 0);
+    }
+    return false;
+}
+
+/*
+ * src is non-zero at IR line index if its block is only entered over the
+ * non-zero edge of a jz/je or jnz/jne whose flags come from test src, src or
+ * cmp src, 0, and nothing on the way writes src.
+ */
+static bool asmopt_cfg_nonzero(const asmopt_context* ctx, size_t index, const asmopt_operand* src) {
+    asmopt_regset bit = asmopt_operand_regset(src);
+    size_t block_index = ctx->line_blocks[index];
+    if (bit == 0 || block_index == ASMOPT_NO_BLOCK) {
+        return false;
+    }
+    const asmopt_cfg_block* block = &ctx->cfg_blocks[block_index];
+    asmopt_effects effects;
+    for (size_t i = 0; i < block->instruction_count && block->instructions[i]->line_no - 1 < index; i++) {
+        if (!asmopt_insn_effects(&block->instructions[i]->insn, &effects) || (effects.defs & bit)) {
+            return false;
+        }
+    }
+    if (block->pred_count != 1) {
+        return false;
+    }
+    size_t pred_index = ctx->cfg_edges[ctx->cfg_pred_edges[block->pred_begin]].source;
+    const asmopt_cfg_block* pred = &ctx->cfg_blocks[pred_index];
+    if (pred->instruction_count < 2) {
+        return false;
+    }
+    const asmopt_insn* jump = &pred->instructions[pred->instruction_count - 1]->insn;
+    bool taken = block_index != pred_index + 1;
+    bool on_zero = asmopt_view_is(jump->mnemonic_text, "jz") || asmopt_view_is(jump->mnemonic_text, "je");
+    bool on_nonzero = asmopt_view_is(jump->mnemonic_text, "jnz") || asmopt_view_is(jump->mnemonic_text, "jne");
+    if (!(on_zero && !taken) && !(on_nonzero && taken)) {
+        return false;
+    }
+    for (size_t i = pred->instruction_count - 1; i-- > 0;) {
+        const asmopt_insn* insn = &pred->instructions[i]->insn;
+        if (!asmopt_insn_effects(insn, &effects)) {
+            return false;
+        }
+        if (effects.defs & ASMOPT_REGSET_FLAGS) {
+            return asmopt_is_flag_test_of(insn, src);
+        }
+        if (effects.defs & bit) {
+            return false;
+        }
+    }
+    return false;
+}
+
+static bool asmopt_is_zero_guarded(asmopt_context* ctx, size_t line_no, const asmopt_operand* src) {
+    if (!ctx || !src) {
+        return false;
+    }
+    size_t index = 0;
+    if (asmopt_live_index(ctx, line_no, &index)) {
+        return asmopt_cfg_nonzero(ctx, index, src);
+    }
+    /* No CFG for this line (streaming, or rewritten by an earlier pass): look for test/jz two lines up. */
+    if (line_no < ZERO_GUARD_PATTERN_LINES) {
+        return false;
+    }
+    const asmopt_insn* jump = asmopt_line_insn(ctx, line_no - 2);
+    const asmopt_insn* test = asmopt_line_insn(ctx, line_no - 3);
+    if (!jump || !test || !jump->is_instruction || !test->is_instruction) {
+        return false;
+    }
+    if (!asmopt_view_is(jump->mnemonic_text, "jz") && !asmopt_view_is(jump->mnemonic_text, "je")) {
+        return false;
+    }
+    return asmopt_is_flag_test_of(test, src);
+}
+
+static bool asmopt_is_power_of_two(long value) {
+    return value > 0 && (value & (value - 1)) == 0;
+}
+
+static int asmopt_log2(long value) {
+    int log = 0;
+    while (value > 1) {
+        value >>= 1;
+        log++;
+    }
+    return log;
+}
+
+static void asmopt_handle_identity_removal(asmopt_context* ctx, size_t line_no, const char* pattern_name,
+                                           const char* line, const asmopt_insn* insn, bool* removed) {
+    asmopt_record_optimization(ctx, line_no, pattern_name, line, NULL);
+    asmopt_store_comment_line(ctx, insn);
+    *removed = true;
+}
+
+/* Store a single-line rewrite and record it. */
+static void asmopt_replace_line(asmopt_context* ctx, size_t line_no, const char* pattern_name, const char* line,
+                                const char* newline, bool* replaced) {
+    if (!newline) {
+        return;
+    }
+    asmopt_record_optimization(ctx, line_no, pattern_name, line, newline);
+    asmopt_store_optimized_line(ctx, newline);
+    *replaced = true;
+}
+
+/* mov reg, reg with no trailing comment (the only form the pair patterns may fold away). */
+static bool asmopt_is_plain_reg_move(const asmopt_insn* insn) {
+    return asmopt_is_reg_reg(insn, ASMOPT_MN_MOV) && insn->comment.len == 0;
+}
+
+static bool asmopt_pattern_on(const asmopt_match* match, asmopt_pattern pattern) {
+    if ((match->ctx->pattern_mask & ASMOPT_PATTERN_BIT(pattern)) == 0) {
+        return false;
+    }
+    if ((ASMOPT_FLAG_CLOBBER_PATTERNS & ASMOPT_PATTERN_BIT(pattern)) && !match->flags_dead) {
+        return false;
+    }
+    if (ASMOPT_PROFILING(match->ctx)) {
+        match->ctx->profile.pattern_attempts[pattern]++;
+    }
+    return true;
+}
+
+static bool asmopt_match_remove(asmopt_match* match, asmopt_pattern pattern) {
+    match->hit = pattern;
+    asmopt_handle_identity_removal(match->ctx, match->line_no, PATTERN_NAMES[pattern], match->line, match->insn,
+                                   &match->removed);
+    return true;
+}
+
+/* Rewrite to "<base><suffix> first, second" keeping the original layout. */
+static bool asmopt_match_binary(asmopt_match* match, asmopt_pattern pattern, const char* base,
+                                asmopt_view first, asmopt_view second) {
+    char name[16];
+    match->hit = pattern;
+    asmopt_view new_name = asmopt_suffixed_name(name, sizeof(name), base, match->insn->suffix);
+    const char* newline = asmopt_emit_binary(match->ctx, match->insn, match->insn, new_name, first, second);
+    asmopt_replace_line(match->ctx, match->line_no, PATTERN_NAMES[pattern], match->line, newline, &match->replaced);
+    return true;
+}
+
+static bool asmopt_match_unary(asmopt_match* match, asmopt_pattern pattern, const char* base) {
+    char name[16];
+    match->hit = pattern;
+    asmopt_view new_name = asmopt_suffixed_name(name, sizeof(name), base, match->insn->suffix);
+    const char* newline = asmopt_emit_unary(match->ctx, match->insn, new_name, match->dest->text);
+    asmopt_replace_line(match->ctx, match->line_no, PATTERN_NAMES[pattern], match->line, newline, &match->replaced);
+    return true;
+}
+
+/* reg, reg with both operands naming the same register. */
+static bool asmopt_match_self(const asmopt_match* match) {
+    return match->dest_reg && match->src_reg && asmopt_same_reg(match->dest, match->src);
+}
+
+/* reg, imm with the given immediate value. */
+static bool asmopt_match_imm(const asmopt_match* match, long value) {
+    return match->dest_reg && asmopt_operand_is_imm(match->src, value);
+}
+
+/* "op reg, value" leaving reg unchanged, unless it is a 32-bit write whose zero-extension is read later. */
+static bool asmopt_match_identity(const asmopt_match* match, long value) {
+    return asmopt_match_imm(match, value) && asmopt_self_write_is_nop(match->ctx, match->line_no, match->dest);
+}
+
+/* 32- or 64-bit general-purpose register operand, the widths an lea can write. */
+static bool asmopt_is_lea_reg(const asmopt_operand* op) {
+    return op->kind == ASMOPT_OPERAND_REG && op->reg_class >= 0 && op->reg_class < 16 && op->reg_width >= 32;
+}
+
+/*
+ * Pattern 31: mov rax, rbx / shl rax, 2 / add rax, rcx -> lea rax, [rcx+rbx*4].
+ * Also takes the chain without the mov, or without the shift, and an
+ * immediate addend. The flags the add leaves must be dead, as lea sets none.
+ */
+static bool asmopt_merge_lea(asmopt_match* match) {
+    asmopt_context* ctx = match->ctx;
+    const asmopt_insn* insn = match->insn;
+    const asmopt_operand* dest = match->dest;
+    if (!asmopt_pattern_on(match, ASMOPT_PATTERN_LEA_MERGE) || !asmopt_is_lea_reg(dest)) {
+        return false;
+    }
+    const asmopt_insn* chain[3] = {insn, match->next, match->after_next};
+    size_t at = 0;
+    int index = dest->reg_class;
+    long before = 0;
+    if (insn->mnemonic == ASMOPT_MN_MOV) {
+        const asmopt_operand* src = match->src;
+        if (!asmopt_is_lea_reg(src) || src->reg_width != dest->reg_width || src->reg_class == dest->reg_class) {
+            return false;
+        }
+        index = src->reg_class;
+        before += asmopt_form_score(ctx, ASMOPT_FORM_MOV_REG);
+        at = 1;
+    }
+    unsigned shift = 0;
+    const asmopt_insn* step = chain[at];
+    if (step && step->is_instruction && !step->has_label && step->two_operands &&
+        (step->mnemonic == ASMOPT_MN_SHL || step->mnemonic == ASMOPT_MN_SAL) &&
+        asmopt_same_reg(asmopt_insn_dest(step), dest) && asmopt_insn_src(step)->has_imm &&
+        asmopt_insn_src(step)->imm >= 1 && asmopt_insn_src(step)->imm <= 3) {
+        shift = (unsigned)asmopt_insn_src(step)->imm;
+        before += asmopt_form_score(ctx, ASMOPT_FORM_SHIFT_IMM);
+        at++;
+    }
+    const asmopt_insn* add = at < 3 ? chain[at] : NULL;
+    if (at == 0 || !add || !add->is_instruction || add->has_label ||
+        add->mnemonic != ASMOPT_MN_ADD || !add->two_operands || !asmopt_same_reg(asmopt_insn_dest(add), dest) ||
+        !asmopt_may_clobber(ctx, match->line_no + at, ASMOPT_REGSET_FLAGS)) {
+        return false;
+    }
+    const asmopt_operand* addend = asmopt_insn_src(add);
+    asmopt_address address = {0};
+    address.simple = true;
+    address.base = -1;
+    address.index = (signed char)index;
+    address.scale = (unsigned char)(1u << shift);
+    if (asmopt_is_lea_reg(addend) && addend->reg_width == dest->reg_width && addend->reg_class != dest->reg_class) {
+        address.base = addend->reg_class;
+        before += asmopt_form_score(ctx, ASMOPT_FORM_ALU_REG);
+    } else if (addend->has_imm && addend->imm >= INT32_MIN && addend->imm <= INT32_MAX) {
+        address.disp = (int32_t)addend->imm;
+        before += asmopt_form_score(ctx, ASMOPT_FORM_ALU_IMM);
+    } else {
+        return false;
+    }
+    if (shift == 0 && address.disp != 0) {
+        /* [rbx+8] rather than [rbx*1+8]. */
+        address.base = address.index;
+        address.index = -1;
+    }
+    asmopt_form form = asmopt_lea_form(&address);
+    if (ctx->cpu_model->forms[form].size == 0 || asmopt_form_score(ctx, form) > before) {
+        return false;
+    }
+    char text[64];
+    char name[16];
+    asmopt_view lea_address = asmopt_format_address(text, sizeof(text), match->att, address.base, address.index,
+                                                    address.scale, address.disp);
+    asmopt_view lea_name = asmopt_suffixed_name(name, sizeof(name), "lea", insn->suffix);
+    asmopt_view first = match->att ? lea_address : dest->text;
+    asmopt_view second = match->att ? dest->text : lea_address;
+    const char* newline = asmopt_emit_binary(ctx, insn, insn, lea_name, first, second);
+    if (!newline) {
+        return false;
+    }
+    size_t line_no = match->line_no;
+    const char* combined = asmopt_emit_joined(ctx, match->line, ctx->original_lines[line_no],
+                                              at == 2 ? ctx->original_lines[line_no + 1] : NULL);
+    asmopt_record_optimization(ctx, line_no, PATTERN_NAMES[ASMOPT_PATTERN_LEA_MERGE],
+                               combined ? combined : match->line, newline);
+    asmopt_store_optimized_line(ctx, newline);
+    for (size_t i = 1; i <= at; i++) {
+        asmopt_store_comment_line(ctx, chain[i]);
+    }
+    match->replaced = true;
+    match->removed = true;
+    match->hit = ASMOPT_PATTERN_LEA_MERGE;
+    ctx->skip_lines = at;
+    return true;
+}
+
+static bool asmopt_peephole_mov(asmopt_match* match) {
+    asmopt_context* ctx = match->ctx;
+    size_t line_no = match->line_no;
+    const char* line = match->line;
+    const asmopt_insn* next = match->next;
+    const asmopt_operand* dest = match->dest;
+    const asmopt_operand* src = match->src;
+    bool reg_reg = match->dest_reg && match->src_reg;
+
+    /* Pattern 1: mov rax, rax -> remove */
+    if (asmopt_pattern_on(match, ASMOPT_PATTERN_REDUNDANT_MOV) && asmopt_match_self(match) &&
+        asmopt_self_write_is_nop(ctx, line_no, dest)) {
+        return asmopt_match_remove(match, ASMOPT_PATTERN_REDUNDANT_MOV);
+    }
+
+    /* Pattern 26: mov rax, rbx / mov rax, rcx -> remove dead store (the second move must not read rax) */
+    if (asmopt_pattern_on(match, ASMOPT_PATTERN_DEAD_STORE_MOVE) && reg_reg && asmopt_is_plain_reg_move(next) &&
+        asmopt_write_covers(asmopt_insn_dest(next), dest) && !asmopt_regs_alias(asmopt_insn_src(next), dest) &&
+        !asmopt_same_reg(src, asmopt_insn_src(next))) {
+        const char* next_line = ctx->original_lines[line_no];
+        const char* combined = asmopt_emit_joined(ctx, line, next_line, NULL);
+        asmopt_record_optimization(ctx, line_no, PATTERN_NAMES[ASMOPT_PATTERN_DEAD_STORE_MOVE],
+                                   combined ? combined : line, next_line);
+        asmopt_store_optimized_line(ctx, next_line);
+        match->removed = true;
+        match->replaced = true;
+        match->hit = ASMOPT_PATTERN_DEAD_STORE_MOVE;
+        ctx->skip_lines = 1;
+        return true;
+    }
+
+    /* Pattern 26, with liveness: mov rax, rbx|imm whose result nothing reads -> remove */
+    if (asmopt_pattern_on(match, ASMOPT_PATTERN_DEAD_STORE_MOVE) && ctx->live_after && match->dest_reg &&
+        (match->src_reg || src->kind == ASMOPT_OPERAND_IMM)) {
+        asmopt_regset written = asmopt_operand_regset(dest);
+        if (written && (written & ASMOPT_REGSET_GPRS) && asmopt_regs_dead_after(ctx, line_no, written)) {
+            return asmopt_match_remove(match, ASMOPT_PATTERN_DEAD_STORE_MOVE);
+        }
+    }
+
+    /* Pattern 2: mov rax, 0 -> xor rax, rax */
+    if (asmopt_pattern_on(match, ASMOPT_PATTERN_MOV_ZERO_TO_XOR) && asmopt_match_imm(match, 0) &&
+        asmopt_rewrite_pays(match, ASMOPT_FORM_MOV_IMM, ASMOPT_FORM_ZERO_IDIOM)) {
+        return asmopt_match_binary(match, ASMOPT_PATTERN_MOV_ZERO_TO_XOR, "xor", dest->text, dest->text);
+    }
+
+    /* Pattern 31: mov rax, rbx / shl rax, 2 / add rax, rcx -> lea rax, [rcx+rbx*4] */
+    if (reg_reg && asmopt_merge_lea(match)) {
+        return true;
+    }
+
+    /* Pattern 27: mov rax, rbx / mov rcx, rdx -> reorder for scheduling */
+    if (asmopt_pattern_on(match, ASMOPT_PATTERN_SCHEDULE_SWAP_MOVE) && reg_reg && asmopt_is_plain_reg_move(next)) {
+        const asmopt_operand* next_dest = asmopt_insn_dest(next);
+        const asmopt_operand* next_src = asmopt_insn_src(next);
+        bool independent = !asmopt_regs_alias(dest, next_dest) && !asmopt_regs_alias(dest, next_src) &&
+                           !asmopt_regs_alias(src, next_dest) && !asmopt_regs_alias(src, next_src);
+        if (independent) {
+            const char* next_line = ctx->original_lines[line_no];
+            asmopt_record_optimization(ctx, line_no, PATTERN_NAMES[ASMOPT_PATTERN_SCHEDULE_SWAP_MOVE], line, next_line);
+            asmopt_store_optimized_line(ctx, next_line);
+            asmopt_store_optimized_line(ctx, line);
+            match->replaced = true;
+            match->hit = ASMOPT_PATTERN_SCHEDULE_SWAP_MOVE;
+            ctx->skip_lines = 1;
+            return true;
+        }
+    }
+
+    /* Pattern 28: mov rax, [mem] / add rax, imm / mov [mem], rax -> add [mem], imm */
+    const asmopt_insn* store = match->after_next;
+    if (asmopt_pattern_on(match, ASMOPT_PATTERN_LOAD_MODIFY_STORE) && match->dest_reg && !match->src_reg &&
+        next && store && next->is_instruction && next->mnemonic == ASMOPT_MN_ADD && next->two_operands &&
+        store->is_instruction && store->mnemonic == ASMOPT_MN_MOV && store->two_operands) {
+        const asmopt_operand* add_dest = asmopt_insn_dest(next);
+        const asmopt_operand* add_src = asmopt_insn_src(next);
+        const asmopt_operand* store_dest = asmopt_insn_dest(store);
+        const asmopt_operand* store_src = asmopt_insn_src(store);
+        if (asmopt_same_reg(add_dest, dest) && add_src->has_imm && asmopt_same_reg(store_src, dest) &&
+            asmopt_view_caseeq(store_dest->text, src->text) && !asmopt_address_reads(src, dest) &&
+            asmopt_may_clobber(ctx, line_no + 2, asmopt_operand_regset(dest))) {
+            char name[16];
+            asmopt_view add_name = asmopt_suffixed_name(name, sizeof(name), "add", next->suffix);
+            asmopt_view first_op = match->att ? add_src->text : store_dest->text;
+            asmopt_view second_op = match->att ? store_dest->text : add_src->text;
+            const char* newline = asmopt_emit_binary(ctx, match->insn, next, add_name, first_op, second_op);
+            if (newline) {
+                const char* add_line = ctx->original_lines[line_no];
+                const char* store_line = ctx->original_lines[line_no + 1];
+                const char* combined = asmopt_emit_joined(ctx, line, add_line, store_line);
+                asmopt_record_optimization(ctx, line_no, PATTERN_NAMES[ASMOPT_PATTERN_LOAD_MODIFY_STORE],
+                                           combined ? combined : line, newline);
+                asmopt_store_optimized_line(ctx, newline);
+                asmopt_store_comment_line(ctx, next);
+                asmopt_store_comment_line(ctx, store);
+                match->replaced = true;
+                match->removed = true;
+                match->hit = ASMOPT_PATTERN_LOAD_MODIFY_STORE;
+                ctx->skip_lines = 2;
+                return true;
+            }
+        }
+    }
+
+    /* Pattern 12: mov rax, rbx / mov rbx, rax -> remove redundant move */
+    if (asmopt_pattern_on(match, ASMOPT_PATTERN_REDUNDANT_MOVE_PAIR) && reg_reg &&
+        asmopt_is_reg_reg(next, ASMOPT_MN_MOV) && asmopt_same_reg(dest, asmopt_insn_src(next)) &&
+        asmopt_same_reg(src, asmopt_insn_dest(next)) && asmopt_self_write_is_nop(ctx, line_no + 1, src)) {
+        const char* pattern_name = PATTERN_NAMES[ASMOPT_PATTERN_REDUNDANT_MOVE_PAIR];
+        const char* next_line = ctx->original_lines[line_no];
+        const char* combined = asmopt_emit_joined(ctx, line, next_line, NULL);
+        if (combined) {
+            asmopt_record_optimization(ctx, line_no, pattern_name, combined, line);
+        }
+        asmopt_store_optimized_line(ctx, line);
+        match->replaced = true;
+        asmopt_store_comment_line(ctx, next);
+        asmopt_record_optimization(ctx, line_no + 1, pattern_name, next_line, NULL);
+        match->removed = true;
+        match->hit = ASMOPT_PATTERN_REDUNDANT_MOVE_PAIR;
+        ctx->skip_lines = 1;
+        return true;
+    }
+    return false;
+}
+
+/*
+ * The register of mem that the line before line_no writes, when it writes
+ * just one of base and index: that operand arrives last. -1 otherwise.
+ */
+static int asmopt_late_address_reg(asmopt_context* ctx, size_t line_no, const asmopt_address* mem) {
+    const asmopt_insn* previous = line_no >= 2 ? asmopt_line_insn(ctx, line_no - 2) : NULL;
+    asmopt_effects effects;
+    if (!previous || !previous->is_instruction || !asmopt_insn_effects(previous, &effects) ||
+        mem->base == mem->index) {
+        return -1;
+    }
+    bool base = (effects.defs & ASMOPT_REGSET_BIT(mem->base)) != 0;
+    bool index = (effects.defs & ASMOPT_REGSET_BIT(mem->index)) != 0;
+    if (base == index) {
+        return -1;
+    }
+    return base ? mem->base : mem->index;
+}
+
+/*
+ * Split a slow lea so that its last-arriving register is added by a 1-cycle
+ * add: the other registers still pay the lea, the late one no longer does.
+ * Kept only when the cost model says that shortens the late path without
+ * lengthening the others.
+ */
+static bool asmopt_split_lea(asmopt_match* match) {
+    asmopt_context* ctx = match->ctx;
+    const asmopt_operand* dest = match->dest;
+    const asmopt_address* mem = &match->src->mem;
+    if (!asmopt_is_lea_reg(dest) || match->insn->has_label || match->src->kind != ASMOPT_OPERAND_MEM ||
+        !mem->simple || mem->base < 0 || mem->index < 0 || mem->base_width != 64) {
+        return false;
+    }
+    /* The split adds an instruction, which -Os never pays for. */
+    if (ctx->optimize_size) {
+        return false;
+    }
+    int late = asmopt_late_address_reg(ctx, match->line_no, mem);
+    if (late < 0 || late == dest->reg_class || (late == mem->index && mem->scale > 1)) {
+        return false;
+    }
+    /* What the lea keeps: the other register, with its scale if it is the index, and the displacement. */
+    int other = late == mem->base ? mem->index : mem->base;
+    unsigned scale = other == mem->index ? mem->scale : 1;
+    asmopt_address rest = *mem;
+    rest.base = scale > 1 ? -1 : (signed char)other;
+    rest.index = scale > 1 ? (signed char)other : -1;
+    rest.scale = (unsigned char)scale;
+    const asmopt_form_cost* forms = ctx->cpu_model->forms;
+    unsigned slow = forms[asmopt_lea_form(mem)].latency;
+    unsigned add = forms[ASMOPT_FORM_ALU_REG].latency;
+    if (add >= slow || forms[asmopt_lea_form(&rest)].latency + add > slow) {
+        return false;
+    }
+    char text[64];
+    char late_name[8];
+    char name[16];
+    asmopt_view rest_address = asmopt_format_address(text, sizeof(text), match->att, rest.base, rest.index,
+                                                     rest.scale, rest.disp);
+    asmopt_view late_view = asmopt_gpr_name(late_name, sizeof(late_name), late, dest->reg_width, match->att);
+    asmopt_view lea_name = asmopt_suffixed_name(name, sizeof(name), "lea", match->insn->suffix);
+    const char* lea_line = asmopt_emit_binary(ctx, match->insn, match->insn, lea_name,
+                                              match->att ? rest_address : dest->text,
+                                              match->att ? dest->text : rest_address);
+    /* The comment stays on the lea. */
+    asmopt_insn plain = *match->insn;
+    plain.comment.len = 0;
+    asmopt_view add_name = asmopt_suffixed_name(name, sizeof(name), "add", match->insn->suffix);
+    const char* add_line = asmopt_emit_binary(ctx, &plain, &plain, add_name, match->att ? late_view : dest->text,
+                                              match->att ? dest->text : late_view);
+    if (!lea_line || !add_line) {
+        return false;
+    }
+    const char* combined = asmopt_emit_joined(ctx, lea_line, add_line, NULL);
+    asmopt_record_optimization(ctx, match->line_no, PATTERN_NAMES[ASMOPT_PATTERN_LEA_SPLIT], match->line,
+                               combined ? combined : lea_line);
+    asmopt_store_optimized_line(ctx, lea_line);
+    asmopt_store_optimized_line(ctx, add_line);
+    match->replaced = true;
+    match->hit = ASMOPT_PATTERN_LEA_SPLIT;
+    return true;
+}
+
+/*
+ * Fold an lea into the memory operand of the next instruction, when that is
+ * the lea's register plus a displacement and the register is dead after it.
+ */
+static bool asmopt_fold_address(asmopt_match* match) {
+    asmopt_context* ctx = match->ctx;
+    const asmopt_operand* dest = match->dest;
+    const asmopt_address* mem = &match->src->mem;
+    const asmopt_insn* next = match->next;
+    if (!asmopt_is_lea_reg(dest) || dest->reg_width != 64 || match->src->kind != ASMOPT_OPERAND_MEM ||
+        !mem->simple || (mem->base >= 0 && mem->base_width != 64) || !next || !next->is_instruction ||
+        next->has_label || !next->two_operands) {
+        return false;
+    }
+    size_t slot = next->ops[0].kind == ASMOPT_OPERAND_MEM ? 0 : 1;
+    const asmopt_operand* use = &next->ops[slot];
+    const asmopt_operand* other = &next->ops[1 - slot];
+    asmopt_effects effects;
+    if (use->kind != ASMOPT_OPERAND_MEM || other->kind == ASMOPT_OPERAND_MEM || !use->mem.simple ||
+        use->mem.base != dest->reg_class || use->mem.index >= 0 || use->mem.base_width != 64 ||
+        (other->kind != ASMOPT_OPERAND_IMM && (other->reg_class < 0 || other->reg_class == dest->reg_class)) ||
+        !asmopt_insn_effects(next, &effects) || !ctx->live_after ||
+        !asmopt_regs_dead_after(ctx, match->line_no + 1, asmopt_operand_regset(dest))) {
+        return false;
+    }
+    long disp = (long)mem->disp + use->mem.disp;
+    if (disp < INT32_MIN || disp > INT32_MAX) {
+        return false;
+    }
+    char text[96];
+    size_t prefix = 0;
+    if (!match->att) {
+        /* Keep "QWORD PTR" and the like in front of the brackets. */
+        const char* open = memchr(use->text.ptr, '[', use->text.len);
+        prefix = open ? (size_t)(open - use->text.ptr) : 0;
+        if (prefix >= sizeof(text) / 2) {
+            return false;
+        }
+        memcpy(text, use->text.ptr, prefix);
+    }
+    asmopt_view address = asmopt_format_address(text + prefix, sizeof(text) - prefix, match->att, mem->base,
+                                                mem->index, mem->scale, disp);
+    asmopt_view operand = {text, prefix + address.len};
+    asmopt_view first = slot == 0 ? operand : other->text;
+    asmopt_view second = slot == 0 ? other->text : operand;
+    const char* newline = asmopt_emit_binary(ctx, next, next, next->mnemonic_text, first, second);
+    if (!newline) {
+        return false;
+    }
+    const char* next_line = ctx->original_lines[match->line_no];
+    const char* combined = asmopt_emit_joined(ctx, match->line, next_line, NULL);
+    asmopt_record_optimization(ctx, match->line_no, PATTERN_NAMES[ASMOPT_PATTERN_ADDRESS_FOLD],
+                               combined ? combined : match->line, newline);
+    asmopt_store_comment_line(ctx, match->insn);
+    asmopt_store_optimized_line(ctx, newline);
+    match->replaced = true;
+    match->removed = true;
+    match->hit = ASMOPT_PATTERN_ADDRESS_FOLD;
+    ctx->skip_lines = 1;
+    return true;
+}
+
+static bool asmopt_peephole_lea(asmopt_match* match) {
+    const asmopt_operand* dest = match->dest;
+    const asmopt_address* mem = &match->src->mem;
+    /* Pattern 24: lea rax, [rax] -> remove (identity); lea eax, [eax] zero-extends on x86-64 */
+    if (asmopt_pattern_on(match, ASMOPT_PATTERN_REDUNDANT_LEA) && match->dest_reg &&
+        match->src->kind == ASMOPT_OPERAND_MEM && mem->simple && mem->base >= 0 && mem->base == dest->reg_class &&
+        mem->index < 0 && mem->disp == 0 && mem->base_width == dest->reg_width && dest->reg_width >= 32 &&
+        asmopt_self_write_is_nop(match->ctx, match->line_no, dest)) {
+        return asmopt_match_remove(match, ASMOPT_PATTERN_REDUNDANT_LEA);
+    }
+
+    /* Pattern 32: lea rax, [rbx+rcx*4] / mov rdx, [rax+8] -> mov rdx, [rbx+rcx*4+8] once rax is dead */
+    if (asmopt_pattern_on(match, ASMOPT_PATTERN_ADDRESS_FOLD) && asmopt_fold_address(match)) {
+        return true;
+    }
+
+    /* Pattern 30: lea rax, [rbx+rcx+8] right after rcx is written -> lea rax, [rbx+8] / add rax, rcx */
+    if (asmopt_pattern_on(match, ASMOPT_PATTERN_LEA_SPLIT) && asmopt_split_lea(match)) {
+        return true;
+    }
+    return false;
+}
+
+static bool asmopt_peephole_add(asmopt_match* match) {
+    /* Pattern 17: add rax, -1 -> dec rax */
+    if (asmopt_pattern_on(match, ASMOPT_PATTERN_ADD_MINUS_ONE_TO_DEC) && asmopt_match_imm(match, -1) &&
+        asmopt_rewrite_pays(match, ASMOPT_FORM_ALU_IMM, ASMOPT_FORM_INC_DEC)) {
+        return asmopt_match_unary(match, ASMOPT_PATTERN_ADD_MINUS_ONE_TO_DEC, "dec");
+    }
+
+    /* Pattern 5: add rax, 0 -> remove (identity) */
+    if (asmopt_pattern_on(match, ASMOPT_PATTERN_ADD_SUB_ZERO) && asmopt_match_identity(match, 0)) {
+        return asmopt_match_remove(match, ASMOPT_PATTERN_ADD_SUB_ZERO);
+    }
+
+    /* Pattern 10: add rax, 1 -> inc rax (smaller encoding) */
+    if (asmopt_pattern_on(match, ASMOPT_PATTERN_ADD_ONE_TO_INC) && asmopt_match_imm(match, 1) &&
+        asmopt_rewrite_pays(match, ASMOPT_FORM_ALU_IMM, ASMOPT_FORM_INC_DEC)) {
+        return asmopt_match_unary(match, ASMOPT_PATTERN_ADD_ONE_TO_INC, "inc");
+    }
+    return false;
+}
+
+static bool asmopt_peephole_sub(asmopt_match* match) {
+    /* Pattern 13: sub rax, rax -> xor rax, rax */
+    if (asmopt_pattern_on(match, ASMOPT_PATTERN_SUB_SELF_TO_XOR) && asmopt_match_self(match) &&
+        asmopt_rewrite_pays(match, ASMOPT_FORM_ALU_REG, ASMOPT_FORM_ZERO_IDIOM)) {
+        return asmopt_match_binary(match, ASMOPT_PATTERN_SUB_SELF_TO_XOR, "xor", match->dest->text, match->dest->text);
+    }
+
+    /* Pattern 18: sub rax, -1 -> inc rax */
+    if (asmopt_pattern_on(match, ASMOPT_PATTERN_SUB_MINUS_ONE_TO_INC) && asmopt_match_imm(match, -1) &&
+        asmopt_rewrite_pays(match, ASMOPT_FORM_ALU_IMM, ASMOPT_FORM_INC_DEC)) {
+        return asmopt_match_unary(match, ASMOPT_PATTERN_SUB_MINUS_ONE_TO_INC, "inc");
+    }
+
+    /* Pattern 5: sub rax, 0 -> remove (identity) */
+    if (asmopt_pattern_on(match, ASMOPT_PATTERN_ADD_SUB_ZERO) && asmopt_match_identity(match, 0)) {
+        return asmopt_match_remove(match, ASMOPT_PATTERN_ADD_SUB_ZERO);
+    }
+
+    /* Pattern 11: sub rax, 1 -> dec rax (smaller encoding) */
+    if (asmopt_pattern_on(match, ASMOPT_PATTERN_SUB_ONE_TO_DEC) && asmopt_match_imm(match, 1) &&
+        asmopt_rewrite_pays(match, ASMOPT_FORM_ALU_IMM, ASMOPT_FORM_INC_DEC)) {
+        return asmopt_match_unary(match, ASMOPT_PATTERN_SUB_ONE_TO_DEC, "dec");
+    }
+    return false;
+}
+
+static bool asmopt_peephole_and(asmopt_match* match) {
+    /* Pattern 14: and rax, 0 -> xor rax, rax */
+    if (asmopt_pattern_on(match, ASMOPT_PATTERN_AND_ZERO_TO_XOR) && asmopt_match_imm(match, 0) &&
+        asmopt_rewrite_pays(match, ASMOPT_FORM_ALU_IMM, ASMOPT_FORM_ZERO_IDIOM)) {
+        return asmopt_match_binary(match, ASMOPT_PATTERN_AND_ZERO_TO_XOR, "xor", match->dest->text, match->dest->text);
+    }
+
+    /* Pattern 19: and rax, rax -> test rax, rax */
+    if (asmopt_pattern_on(match, ASMOPT_PATTERN_AND_SELF_TO_TEST) && asmopt_match_self(match) &&
+        asmopt_self_write_is_nop(match->ctx, match->line_no, match->dest) &&
+        asmopt_rewrite_pays(match, ASMOPT_FORM_ALU_REG, ASMOPT_FORM_TEST_REG)) {
+        return asmopt_match_binary(match, ASMOPT_PATTERN_AND_SELF_TO_TEST, "test", match->dest->text, match->dest->text);
+    }
+
+    /* Pattern 9: and rax, -1 -> remove (identity, all bits set) */
+    if (asmopt_pattern_on(match, ASMOPT_PATTERN_AND_MINUS_ONE) && asmopt_match_identity(match, -1)) {
+        return asmopt_match_remove(match, ASMOPT_PATTERN_AND_MINUS_ONE);
+    }
+    return false;
+}
+
+static bool asmopt_peephole_or(asmopt_match* match) {
     /* Pattern 16: or rax, rax -> test rax, rax */
-    if (strcmp(base_mnemonic, "or") == 0 && has_two_ops && dest_reg && src_reg) {
-        if (asmopt_casecmp(dest, src) == 0) {
-            char test_name[8];
-            if (suffix) {
-                snprintf(test_name, sizeof(test_name), "test%c", suffix);
-            } else {
-                snprintf(test_name, sizeof(test_name), "test");
+    if (asmopt_pattern_on(match, ASMOPT_PATTERN_OR_SELF_TO_TEST) && asmopt_match_self(match) &&
+        asmopt_self_write_is_nop(match->ctx, match->line_no, match->dest) &&
+        asmopt_rewrite_pays(match, ASMOPT_FORM_ALU_REG, ASMOPT_FORM_TEST_REG)) {
+        return asmopt_match_binary(match, ASMOPT_PATTERN_OR_SELF_TO_TEST, "test", match->dest->text, match->dest->text);
+    }
+
+    /* Pattern 7: or rax, 0 -> remove (identity) */
+    if (asmopt_pattern_on(match, ASMOPT_PATTERN_OR_ZERO) && asmopt_match_identity(match, 0)) {
+        return asmopt_match_remove(match, ASMOPT_PATTERN_OR_ZERO);
+    }
+    return false;
+}
+
+static bool asmopt_peephole_xor(asmopt_match* match) {
+    /* Pattern 8: xor rax, 0 -> remove (identity) */
+    if (asmopt_pattern_on(match, ASMOPT_PATTERN_XOR_ZERO) && asmopt_match_identity(match, 0)) {
+        return asmopt_match_remove(match, ASMOPT_PATTERN_XOR_ZERO);
+    }
+    return false;
+}
+
+static bool asmopt_peephole_cmp(asmopt_match* match) {
+    /* Pattern 15: cmp rax, 0 -> test rax, rax */
+    if (asmopt_pattern_on(match, ASMOPT_PATTERN_CMP_ZERO_TO_TEST) && asmopt_match_imm(match, 0) &&
+        asmopt_rewrite_pays(match, ASMOPT_FORM_ALU_IMM, ASMOPT_FORM_TEST_REG)) {
+        return asmopt_match_binary(match, ASMOPT_PATTERN_CMP_ZERO_TO_TEST, "test", match->dest->text, match->dest->text);
+    }
+
+    /* Pattern 20: cmp rax, rax -> test rax, rax */
+    if (asmopt_pattern_on(match, ASMOPT_PATTERN_CMP_SELF_TO_TEST) && asmopt_match_self(match) &&
+        asmopt_rewrite_pays(match, ASMOPT_FORM_ALU_REG, ASMOPT_FORM_TEST_REG)) {
+        return asmopt_match_binary(match, ASMOPT_PATTERN_CMP_SELF_TO_TEST, "test", match->dest->text, match->dest->text);
+    }
+    return false;
+}
+
+static bool asmopt_peephole_shift(asmopt_match* match) {
+    /* Pattern 6: shl/shr/sal/sar rax, 0 -> remove (identity) */
+    if (asmopt_pattern_on(match, ASMOPT_PATTERN_SHIFT_BY_ZERO) && asmopt_match_identity(match, 0)) {
+        return asmopt_match_remove(match, ASMOPT_PATTERN_SHIFT_BY_ZERO);
+    }
+
+    /* Pattern 31: shl rax, 2 / add rax, rcx -> lea rax, [rcx+rax*4] */
+    if ((match->insn->mnemonic == ASMOPT_MN_SHL || match->insn->mnemonic == ASMOPT_MN_SAL) &&
+        asmopt_merge_lea(match)) {
+        return true;
+    }
+    return false;
+}
+
+static bool asmopt_peephole_imul(asmopt_match* match) {
+    /* Pattern 3: imul rax, 1 -> remove (identity) */
+    if (asmopt_pattern_on(match, ASMOPT_PATTERN_MUL_BY_ONE) && asmopt_match_identity(match, 1)) {
+        return asmopt_match_remove(match, ASMOPT_PATTERN_MUL_BY_ONE);
+    }
+
+    /* Pattern 4: imul rax, power_of_2 -> shl rax, log2(power_of_2) */
+    if (asmopt_pattern_on(match, ASMOPT_PATTERN_MUL_POWER_OF_2_TO_SHIFT) && match->dest_reg &&
+        match->src->has_imm && match->src->imm > 1 && asmopt_is_power_of_two(match->src->imm) &&
+        asmopt_rewrite_pays(match, ASMOPT_FORM_IMUL_IMM, ASMOPT_FORM_SHIFT_IMM)) {
+        char shift_str[16];
+        snprintf(shift_str, sizeof(shift_str), match->att ? "$%d" : "%d", asmopt_log2(match->src->imm));
+        return asmopt_match_binary(match, ASMOPT_PATTERN_MUL_POWER_OF_2_TO_SHIFT, "shl", match->dest->text,
+                                   asmopt_view_of(shift_str));
+    }
+    return false;
+}
+
+static bool asmopt_peephole_bsf(asmopt_match* match) {
+    /* Pattern 23: bsf reg, reg -> tzcnt reg, reg (BMI1 targets, guarded zero) */
+    /* bsr -> lzcnt not applied: not semantically equivalent. */
+    if (asmopt_pattern_on(match, ASMOPT_PATTERN_BSF_TO_TZCNT) && match->dest_reg && match->src_reg &&
+        asmopt_rewrite_pays(match, ASMOPT_FORM_BSF, ASMOPT_FORM_TZCNT) &&
+        asmopt_is_zero_guarded(match->ctx, match->line_no, match->src)) {
+        return asmopt_match_binary(match, ASMOPT_PATTERN_BSF_TO_TZCNT, "tzcnt", match->dest->text, match->src->text);
+    }
+    return false;
+}
+
+/* Index N of an xmmN/ymmN/zmmN operand without a mask, -1 for anything else. */
+static int asmopt_vector_index(const asmopt_operand* op) {
+    if (op->kind != ASMOPT_OPERAND_REG || op->reg_class < ASMOPT_REG_VECTOR0 || asmopt_view_contains(op->text, '{')) {
+        return -1;
+    }
+    return op->reg_class - ASMOPT_REG_VECTOR0;
+}
+
+static bool asmopt_peephole_vxor(asmopt_match* match) {
+    const asmopt_insn* insn = match->insn;
+    asmopt_view pieces[4];
+    unsigned width = 0;
+    /*
+     * Pattern 33: vpxor ymm0, ymm0, ymm0 -> vpxor xmm0, xmm0, xmm0. A VEX.128
+     * write zeroes the whole register, so the narrow idiom clears zmm/ymm too:
+     * it drops the EVEX prefix of a zmm form, and halves the uops of a ymm
+     * form on CPUs that split 256-bit operations. xmm16-31 have no VEX form.
+     */
+    if (!asmopt_pattern_on(match, ASMOPT_PATTERN_VECTOR_ZERO_IDIOM) ||
+        asmopt_split_operand_list(insn->operands_trimmed, pieces, 3) != 3 || !asmopt_view_caseeq(pieces[0], pieces[1]) ||
+        !asmopt_view_caseeq(pieces[1], pieces[2]) || asmopt_view_contains(pieces[0], '{')) {
+        return false;
+    }
+    int reg_class = asmopt_reg_class(pieces[0], &width);
+    if (reg_class < ASMOPT_REG_VECTOR0 || reg_class - ASMOPT_REG_VECTOR0 >= 16 ||
+        (width != 512 && (width != 256 || match->ctx->cpu_model->vector_bits >= 256))) {
+        return false;
+    }
+    const char* prefix = match->att ? "%" : "";
+    int index = reg_class - ASMOPT_REG_VECTOR0;
+    char operands[32];
+    snprintf(operands, sizeof(operands), "%sxmm%d, %sxmm%d, %sxmm%d", prefix, index, prefix, index, prefix, index);
+    /* vpxord/vpxorq are EVEX-only; vxorps/vxorpd keep their name. */
+    asmopt_view name = insn->mnemonic_text;
+    if (name.len > 5 && asmopt_view_caseeq((asmopt_view){name.ptr, 5}, ASMOPT_VIEW_LIT("vpxor"))) {
+        name.len = 5;
+    }
+    match->hit = ASMOPT_PATTERN_VECTOR_ZERO_IDIOM;
+    const char* newline = asmopt_emit_unary(match->ctx, insn, name, asmopt_view_of(operands));
+    asmopt_replace_line(match->ctx, match->line_no, PATTERN_NAMES[ASMOPT_PATTERN_VECTOR_ZERO_IDIOM], match->line,
+                        newline, &match->replaced);
+    return true;
+}
+
+/* Register-to-register full-width vector move with no mask and no comment. */
+static bool asmopt_is_vector_copy(const asmopt_insn* insn) {
+    return insn && insn->is_instruction && insn->mnemonic == ASMOPT_MN_VMOV && insn->two_operands &&
+           asmopt_vector_index(asmopt_insn_dest(insn)) >= 0 && asmopt_vector_index(asmopt_insn_src(insn)) >= 0;
+}
+
+/*
+ * Copying a register onto itself with insn changes nothing: a legacy SSE move
+ * leaves the bits above 127 alone, while a VEX or EVEX move zeroes everything
+ * above its own width, which only exists on the target if the model has
+ * wider registers.
+ */
+static bool asmopt_vector_self_copy_is_nop(const asmopt_context* ctx, const asmopt_insn* insn) {
+    bool legacy = tolower((unsigned char)insn->mnemonic_text.ptr[0]) != 'v';
+    return legacy || asmopt_insn_dest(insn)->reg_width >= ctx->cpu_model->max_vector_bits;
+}
+
+static bool asmopt_peephole_vmov(asmopt_match* match) {
+    asmopt_context* ctx = match->ctx;
+    size_t line_no = match->line_no;
+    const asmopt_insn* insn = match->insn;
+    const asmopt_insn* next = match->next;
+    if (!asmopt_is_vector_copy(insn)) {
+        return false;
+    }
+    bool redundant = asmopt_pattern_on(match, ASMOPT_PATTERN_VECTOR_REDUNDANT_MOVE);
+
+    /* Pattern 34: vmovdqa ymm0, ymm0 -> remove (only where no wider register exists) */
+    if (redundant && asmopt_same_reg(match->dest, match->src) && asmopt_vector_self_copy_is_nop(ctx, insn)) {
+        return asmopt_match_remove(match, ASMOPT_PATTERN_VECTOR_REDUNDANT_MOVE);
+    }
+
+    /* Pattern 34: vmovdqa ymm1, ymm2 / vmovdqa ymm2, ymm1 -> vmovdqa ymm1, ymm2 */
+    if (redundant && asmopt_is_vector_copy(next) && !next->has_label && next->comment.len == 0 &&
+        asmopt_view_caseeq(next->mnemonic_text, insn->mnemonic_text) &&
+        asmopt_same_reg(match->dest, asmopt_insn_src(next)) && asmopt_same_reg(match->src, asmopt_insn_dest(next)) &&
+        asmopt_vector_self_copy_is_nop(ctx, next)) {
+        const char* pattern_name = PATTERN_NAMES[ASMOPT_PATTERN_VECTOR_REDUNDANT_MOVE];
+        const char* next_line = ctx->original_lines[line_no];
+        const char* combined = asmopt_emit_joined(ctx, match->line, next_line, NULL);
+        asmopt_record_optimization(ctx, line_no, pattern_name, combined ? combined : match->line, match->line);
+        asmopt_store_optimized_line(ctx, match->line);
+        match->replaced = true;
+        match->removed = true;
+        match->hit = ASMOPT_PATTERN_VECTOR_REDUNDANT_MOVE;
+        ctx->skip_lines = 1;
+        return true;
+    }
+
+    /* Dead store: vmovdqa ymm1, ymm2 whose result nothing reads, under the abi option -> remove */
+    if (asmopt_pattern_on(match, ASMOPT_PATTERN_DEAD_STORE_MOVE) && ctx->live_after &&
+        asmopt_regs_dead_after(ctx, line_no, asmopt_operand_regset(match->dest))) {
+        return asmopt_match_remove(match, ASMOPT_PATTERN_DEAD_STORE_MOVE);
+    }
+    return false;
+}
+
+/* Element size in bits of a scalar vector load or of a broadcast, 0 for other mnemonics. */
+static unsigned asmopt_element_bits(asmopt_view mnemonic, bool broadcast) {
+    static const struct {
+        const char* name;
+        unsigned bits;
+        bool broadcast;
+    } elements[] = {
+        {"movd", 32, false}, {"vmovd", 32, false}, {"movss", 32, false}, {"vmovss", 32, false},
+        {"vmovq", 64, false}, {"movsd", 64, false}, {"vmovsd", 64, false},
+        {"vpbroadcastd", 32, true}, {"vbroadcastss", 32, true}, {"vpbroadcastq", 64, true}, {"vbroadcastsd", 64, true}
+    };
+    for (size_t i = 0; i < sizeof(elements) / sizeof(elements[0]); i++) {
+        if (elements[i].broadcast == broadcast && asmopt_view_is(mnemonic, elements[i].name)) {
+            return elements[i].bits;
+        }
+    }
+    return 0;
+}
+
+static bool asmopt_peephole_vload(asmopt_match* match) {
+    asmopt_context* ctx = match->ctx;
+    size_t line_no = match->line_no;
+    const asmopt_insn* insn = match->insn;
+    const asmopt_insn* next = match->next;
+    asmopt_view pieces[3];
+
+    /*
+     * Pattern 35: vmovd xmm1, [mem] / vpbroadcastd ymm0, xmm1 -> vpbroadcastd ymm0, [mem].
+     * The broadcast reads the same element from memory itself; xmm1 must be
+     * dead afterwards or be the broadcast's own destination.
+     */
+    if (!asmopt_pattern_on(match, ASMOPT_PATTERN_BROADCAST_LOAD_FOLD) || !next || !next->is_instruction ||
+        next->has_label || !next->two_operands || match->src->kind != ASMOPT_OPERAND_MEM ||
+        asmopt_vector_index(match->dest) < 0 ||
+        asmopt_split_operand_list(insn->operands_trimmed, pieces, 3) != 2 ||
+        asmopt_split_operand_list(next->operands_trimmed, pieces, 3) != 2) {
+        return false;
+    }
+    unsigned bits = asmopt_element_bits(insn->mnemonic_text, false);
+    const asmopt_operand* target = asmopt_insn_dest(next);
+    if (bits == 0 || asmopt_element_bits(next->mnemonic_text, true) != bits ||
+        !asmopt_same_reg(asmopt_insn_src(next), match->dest)) {
+        return false;
+    }
+    if (target->reg_class != match->dest->reg_class &&
+        !asmopt_regs_dead_after(ctx, line_no + 1, asmopt_operand_regset(match->dest))) {
+        return false;
+    }
+    asmopt_view first = match->att ? match->src->text : target->text;
+    asmopt_view second = match->att ? target->text : match->src->text;
+    const char* newline = asmopt_emit_binary(ctx, next, next, next->mnemonic_text, first, second);
+    if (!newline) {
+        return false;
+    }
+    const char* combined = asmopt_emit_joined(ctx, match->line, ctx->original_lines[line_no], NULL);
+    asmopt_record_optimization(ctx, line_no, PATTERN_NAMES[ASMOPT_PATTERN_BROADCAST_LOAD_FOLD],
+                               combined ? combined : match->line, newline);
+    asmopt_store_comment_line(ctx, insn);
+    asmopt_store_optimized_line(ctx, newline);
+    match->replaced = true;
+    match->removed = true;
+    match->hit = ASMOPT_PATTERN_BROADCAST_LOAD_FOLD;
+    ctx->skip_lines = 1;
+    return true;
+}
+
+/* Single-operand jump; commas indicate multi-operand syntax (not expected for jumps). */
+static bool asmopt_is_single_target(const asmopt_insn* insn) {
+    return !insn->two_operands && insn->operands_trimmed.len > 0 && !asmopt_view_contains(insn->operands, ',');
+}
+
+static bool asmopt_peephole_jmp(asmopt_match* match) {
+    const asmopt_insn* insn = match->insn;
+    const asmopt_insn* next = match->next;
+
+    /* Pattern 21: jmp <next label> -> remove (fallthrough) */
+    if (asmopt_pattern_on(match, ASMOPT_PATTERN_FALLTHROUGH_JUMP) && asmopt_is_single_target(insn) &&
+        next && next->has_label && asmopt_view_equal(next->label, insn->operands_trimmed)) {
+        return asmopt_match_remove(match, ASMOPT_PATTERN_FALLTHROUGH_JUMP);
+    }
+    return false;
+}
+
+static bool asmopt_peephole_jcc(asmopt_match* match) {
+    asmopt_context* ctx = match->ctx;
+    const asmopt_insn* insn = match->insn;
+    const asmopt_insn* next = match->next;
+    const asmopt_insn* label = match->after_next;
+
+    /* Pattern 25: jcc label + jmp other + label -> invert conditional jump */
+    if (!asmopt_pattern_on(match, ASMOPT_PATTERN_INVERT_CONDITIONAL_JUMP) || !asmopt_is_single_target(insn)) {
+        return false;
+    }
+    char base[32];
+    char inverted[16];
+    asmopt_view_copy(insn->mnemonic_text, base, sizeof(base));
+    asmopt_view cond_target = insn->operands_trimmed;
+    if (!asmopt_invert_conditional_jump(base, inverted, sizeof(inverted)) || !asmopt_is_label_view(cond_target) ||
+        !next || !label || !next->is_instruction || next->mnemonic != ASMOPT_MN_JMP ||
+        asmopt_view_contains(next->operands, ',') || !asmopt_is_label_view(next->operands_trimmed) ||
+        !label->has_label || !asmopt_view_equal(label->label, cond_target)) {
+        return false;
+    }
+    const char* newline = asmopt_emit_unary(ctx, insn, asmopt_view_of(inverted), next->operands_trimmed);
+    if (!newline) {
+        return false;
+    }
+    const char* next_line = ctx->original_lines[match->line_no];
+    const char* combined = asmopt_emit_joined(ctx, match->line, next_line, NULL);
+    asmopt_record_optimization(ctx, match->line_no, PATTERN_NAMES[ASMOPT_PATTERN_INVERT_CONDITIONAL_JUMP],
+                               combined ? combined : match->line, newline);
+    asmopt_store_optimized_line(ctx, newline);
+    asmopt_store_comment_line(ctx, next);
+    match->replaced = true;
+    match->removed = true;
+    match->hit = ASMOPT_PATTERN_INVERT_CONDITIONAL_JUMP;
+    ctx->skip_lines = 1;
+    return true;
+}
+
+/* Low width bits of value, as a register of that width holds it (32-bit writes zero the upper half). */
+static uint64_t asmopt_const_truncate(uint64_t value, unsigned width) {
+    return width >= 64 ? value : value & 0xffffffffu;
+}
+
+static bool asmopt_const_reg(const asmopt_consts* consts, int reg_class, unsigned width, uint64_t* value) {
+    if (reg_class < 0 || reg_class >= 16 || width < 32 || !(consts->known & ASMOPT_REGSET_BIT(reg_class))) {
+        return false;
+    }
+    *value = asmopt_const_truncate(consts->values[reg_class], width);
+    return true;
+}
+
+/* Source operand of a width-bit operation: an immediate that form can encode, or a known register of that width. */
+static bool asmopt_const_operand(const asmopt_consts* consts, const asmopt_operand* op, unsigned width, bool wide_imm,
+                                 uint64_t* value) {
+    if (op->has_imm) {
+        /* The immediate parser saturates out-of-range literals, so the extremes are not exact. */
+        if (op->imm == LONG_MAX || op->imm == LONG_MIN) {
+            return false;
+        }
+        if (width == 64 && !wide_imm && (op->imm < INT32_MIN || op->imm > INT32_MAX)) {
+            return false;
+        }
+        if (width == 32 && (op->imm < INT32_MIN || op->imm > (long)UINT32_MAX)) {
+            return false;
+        }
+        *value = (uint64_t)op->imm;
+        return true;
+    }
+    return op->kind == ASMOPT_OPERAND_REG && op->reg_width == width &&
+           asmopt_const_reg(consts, op->reg_class, op->reg_width, value);
+}
+
+/* Value insn leaves in its (32- or 64-bit) destination register when consts determines it. */
+static bool asmopt_const_result(const asmopt_consts* consts, const asmopt_insn* insn, uint64_t* value) {
+    if (!insn->is_instruction || !insn->two_operands) {
+        return false;
+    }
+    const asmopt_operand* dest = asmopt_insn_dest(insn);
+    const asmopt_operand* src = asmopt_insn_src(insn);
+    if (dest->kind != ASMOPT_OPERAND_REG || dest->reg_class < 0 || dest->reg_class >= 16 || dest->reg_width < 32) {
+        return false;
+    }
+    unsigned width = dest->reg_width;
+    uint64_t current = 0;
+    uint64_t operand = 0;
+    uint64_t result = 0;
+    switch (insn->mnemonic) {
+    case ASMOPT_MN_MOV:
+        /* mov is the one form with a full 64-bit immediate (movabs). */
+        if (!asmopt_const_operand(consts, src, width, true, &result)) {
+            return false;
+        }
+        break;
+    case ASMOPT_MN_LEA: {
+        const asmopt_address* mem = &src->mem;
+        uint64_t base = 0;
+        uint64_t index = 0;
+        if (src->kind != ASMOPT_OPERAND_MEM || !mem->simple ||
+            (mem->base >= 0 && !asmopt_const_reg(consts, mem->base, mem->base_width, &base)) ||
+            (mem->index >= 0 && !asmopt_const_reg(consts, mem->index, mem->base >= 0 ? mem->base_width : 64, &index))) {
+            return false;
+        }
+        result = base + index * mem->scale + (uint64_t)(int64_t)mem->disp;
+        break;
+    }
+    case ASMOPT_MN_XOR:
+    case ASMOPT_MN_SUB:
+        if (asmopt_same_reg(dest, src)) {
+            result = 0;
+            break;
+        }
+        /* fall through */
+    case ASMOPT_MN_ADD:
+    case ASMOPT_MN_AND:
+    case ASMOPT_MN_OR:
+    case ASMOPT_MN_SHL:
+    case ASMOPT_MN_SAL:
+    case ASMOPT_MN_SHR:
+    case ASMOPT_MN_SAR: {
+        if (!asmopt_const_reg(consts, dest->reg_class, width, &current) ||
+            !asmopt_const_operand(consts, src, width, false, &operand)) {
+            return false;
+        }
+        unsigned count = (unsigned)(operand & (width == 64 ? 63 : 31));
+        uint64_t sign = current >> (width - 1) & 1;
+        switch (insn->mnemonic) {
+        case ASMOPT_MN_ADD:
+            result = current + operand;
+            break;
+        case ASMOPT_MN_SUB:
+            result = current - operand;
+            break;
+        case ASMOPT_MN_AND:
+            result = current & operand;
+            break;
+        case ASMOPT_MN_OR:
+            result = current | operand;
+            break;
+        case ASMOPT_MN_XOR:
+            result = current ^ operand;
+            break;
+        case ASMOPT_MN_SHR:
+            result = current >> count;
+            break;
+        case ASMOPT_MN_SAR:
+            /* Shift in copies of the sign bit without relying on signed right shifts. */
+            result = current >> count;
+            if (sign && count > 0) {
+                result |= asmopt_const_truncate(~(uint64_t)0 << (width - count), width);
+            }
+            break;
+        default:
+            result = current << count;
+            break;
+        }
+        break;
+    }
+    default:
+        return false;
+    }
+    *value = asmopt_const_truncate(result, width);
+    return true;
+}
+
+/*
+ * Carry consts past one line. Any line that is not a plain instruction ends
+ * the block, which also keeps the state identical across parallel chunks and
+ * across the lines a fixpoint pass does not retokenize.
+ */
+static void asmopt_const_step(asmopt_consts* consts, const asmopt_insn* insn) {
+    if (!insn->is_instruction || insn->has_label) {
+        consts->known = 0;
+        return;
+    }
+    uint64_t value = 0;
+    bool known = asmopt_const_result(consts, insn, &value);
+    if (consts->known != 0) {
+        asmopt_effects effects = {0};
+        if (!asmopt_insn_effects(insn, &effects)) {
+            consts->known = 0;
+        }
+        consts->known &= ~effects.defs;
+    }
+    if (known) {
+        int reg_class = asmopt_insn_dest(insn)->reg_class;
+        consts->known |= ASMOPT_REGSET_BIT(reg_class);
+        consts->values[reg_class] = value;
+    }
+}
+
+/* Form of a line constant_fold may replace, for asmopt_rewrite_pays. */
+static asmopt_form asmopt_const_form(const asmopt_insn* insn) {
+    bool imm = asmopt_insn_src(insn)->has_imm;
+    switch (insn->mnemonic) {
+    case ASMOPT_MN_MOV:
+        return imm ? ASMOPT_FORM_MOV_IMM : ASMOPT_FORM_MOV_REG;
+    case ASMOPT_MN_LEA:
+        return ASMOPT_FORM_LEA;
+    case ASMOPT_MN_SHL:
+    case ASMOPT_MN_SAL:
+    case ASMOPT_MN_SHR:
+    case ASMOPT_MN_SAR:
+        return ASMOPT_FORM_SHIFT_IMM;
+    default:
+        return imm ? ASMOPT_FORM_ALU_IMM : ASMOPT_FORM_ALU_REG;
+    }
+}
+
+/*
+ * Pattern 29: mov eax, 4 / shl eax, 2 / add eax, 3 -> mov eax, 19. A line
+ * whose result follows from the values known in this block, plus up to two
+ * following lines that only rework the same register from known values, become
+ * one mov, or a zero idiom for 0. A lone line is only rewritten when the cost
+ * model prefers the new form; a chain always gets shorter. Replacing anything
+ * but mov and lea drops a flags write, so that needs the flags dead afterwards.
+ */
+static bool asmopt_fold_constants(asmopt_match* match) {
+    asmopt_context* ctx = match->ctx;
+    if (!ctx->live_after || !asmopt_pattern_on(match, ASMOPT_PATTERN_CONSTANT_FOLD)) {
+        return false;
+    }
+    asmopt_consts consts = ctx->consts;
+    uint64_t value = 0;
+    const asmopt_insn* group[1 + ASMOPT_PATTERN_READ_AHEAD] = {match->insn};
+    size_t count = 0;
+    bool writes_flags = false;
+    int reg_class = match->dest->reg_class;
+    bool was_known = reg_class >= 0 && reg_class < 16 && (consts.known & ASMOPT_REGSET_BIT(reg_class));
+    uint64_t before_value = was_known ? consts.values[reg_class] : 0;
+    while (count < sizeof(group) / sizeof(group[0])) {
+        const asmopt_insn* insn = count == 0 ? match->insn : asmopt_line_insn(ctx, match->line_no - 1 + count);
+        uint64_t result = 0;
+        if (!insn || (count > 0 && insn->has_label) || !asmopt_const_result(&consts, insn, &result) ||
+            asmopt_insn_dest(insn)->reg_class != reg_class) {
+            break;
+        }
+        writes_flags = writes_flags || (insn->mnemonic != ASMOPT_MN_MOV && insn->mnemonic != ASMOPT_MN_LEA);
+        consts.known |= ASMOPT_REGSET_BIT(reg_class);
+        consts.values[reg_class] = result;
+        value = result;
+        group[count++] = insn;
+    }
+    if (count == 0) {
+        return false;
+    }
+    const asmopt_insn* last = group[count - 1];
+    const asmopt_operand* dest = asmopt_insn_dest(last);
+    size_t last_line = match->line_no + count - 1;
+    bool flags_dead = asmopt_regs_dead_after(ctx, last_line, ASMOPT_REGSET_FLAGS);
+    if (writes_flags && !flags_dead) {
+        return false;
+    }
+    bool zero = value == 0 && flags_dead;
+    asmopt_form form = zero ? ASMOPT_FORM_ZERO_IDIOM : ASMOPT_FORM_MOV_IMM;
+    if (count == 1) {
+        /* Leave lines already in final form, and identities (the value stays put) that other patterns delete. */
+        bool already = (was_known && before_value == value) ||
+                       (match->insn->mnemonic == ASMOPT_MN_MOV && match->src->has_imm) ||
+                       ((match->insn->mnemonic == ASMOPT_MN_XOR || match->insn->mnemonic == ASMOPT_MN_SUB) &&
+                        asmopt_same_reg(match->dest, match->src));
+        if (already || !asmopt_rewrite_pays(match, asmopt_const_form(match->insn), form)) {
+            return false;
+        }
+    }
+    /* Past 32 bits only the 10-byte movabs form could hold the value; leave those lines alone. */
+    int64_t imm = dest->reg_width == 64 ? (int64_t)value : (int64_t)(int32_t)(uint32_t)value;
+    if (imm < INT32_MIN || imm > INT32_MAX) {
+        return false;
+    }
+    char name[16];
+    char text[32];
+    snprintf(text, sizeof(text), "%s%lld", match->att ? "$" : "", (long long)imm);
+    asmopt_view name_view = asmopt_suffixed_name(name, sizeof(name), zero ? "xor" : "mov", last->suffix);
+    asmopt_view first = zero ? dest->text : match->att ? asmopt_view_of(text) : dest->text;
+    asmopt_view second = zero ? dest->text : match->att ? dest->text : asmopt_view_of(text);
+    const char* newline = asmopt_emit_binary(ctx, match->insn, match->insn, name_view, first, second);
+    if (!newline) {
+        return false;
+    }
+    const char* before = match->line;
+    if (count > 1) {
+        const char* joined = asmopt_emit_joined(ctx, match->line, ctx->original_lines[match->line_no],
+                                                count > 2 ? ctx->original_lines[match->line_no + 1] : NULL);
+        before = joined ? joined : before;
+    }
+    asmopt_record_optimization(ctx, match->line_no, PATTERN_NAMES[ASMOPT_PATTERN_CONSTANT_FOLD], before, newline);
+    asmopt_store_optimized_line(ctx, newline);
+    for (size_t i = 1; i < count; i++) {
+        asmopt_store_comment_line(ctx, group[i]);
+    }
+    match->replaced = true;
+    match->removed = count > 1;
+    match->hit = ASMOPT_PATTERN_CONSTANT_FOLD;
+    ctx->skip_lines = count - 1;
+    return true;
+}
+
+/* Pattern registry: each mnemonic id only runs the patterns that can match its opcode. */
+static const asmopt_pattern_handler PEEPHOLE_HANDLERS[ASMOPT_MN_COUNT] = {
+    [ASMOPT_MN_MOV] = asmopt_peephole_mov,
+    [ASMOPT_MN_LEA] = asmopt_peephole_lea,
+    [ASMOPT_MN_ADD] = asmopt_peephole_add,
+    [ASMOPT_MN_SUB] = asmopt_peephole_sub,
+    [ASMOPT_MN_AND] = asmopt_peephole_and,
+    [ASMOPT_MN_OR] = asmopt_peephole_or,
+    [ASMOPT_MN_XOR] = asmopt_peephole_xor,
+    [ASMOPT_MN_CMP] = asmopt_peephole_cmp,
+    [ASMOPT_MN_SHL] = asmopt_peephole_shift,
+    [ASMOPT_MN_SHR] = asmopt_peephole_shift,
+    [ASMOPT_MN_SAL] = asmopt_peephole_shift,
+    [ASMOPT_MN_SAR] = asmopt_peephole_shift,
+    [ASMOPT_MN_IMUL] = asmopt_peephole_imul,
+    [ASMOPT_MN_BSF] = asmopt_peephole_bsf,
+    [ASMOPT_MN_JMP] = asmopt_peephole_jmp,
+    [ASMOPT_MN_JCC] = asmopt_peephole_jcc,
+    [ASMOPT_MN_VXOR] = asmopt_peephole_vxor,
+    [ASMOPT_MN_VMOV] = asmopt_peephole_vmov,
+    [ASMOPT_MN_VLOAD] = asmopt_peephole_vload
+};
+
+/* Mnemonic families whose patterns all operate on "dest, src" pairs. */
+static const bool PEEPHOLE_HAS_LOOKAHEAD[ASMOPT_MN_COUNT] = {
+    [ASMOPT_MN_MOV] = true,
+    [ASMOPT_MN_JMP] = true,
+    [ASMOPT_MN_JCC] = true,
+    [ASMOPT_MN_VMOV] = true,
+    [ASMOPT_MN_VLOAD] = true,
+};
+
+static bool asmopt_needs_two_operands(asmopt_mnemonic mnemonic) {
+    return mnemonic != ASMOPT_MN_JMP && mnemonic != ASMOPT_MN_JCC;
+}
+
+static void asmopt_peephole_line(asmopt_context* ctx, size_t line_no, bool att, bool* replaced, bool* removed) {
+    /*
+     * Peephole Optimizer - Pattern Matching Engine
+     * 
+     * This function implements 35 optimization patterns for x86-64 assembly:
+     * (8 identity + 1 redundant move + 12 instruction replacements + 2 control-flow
+     *  + 1 dead-store + 1 scheduling + 1 cache-aware + 1 architecture-aware + 1 load-modify-store)
+     * 
+     * Identity/No-op Eliminations (8 patterns):
+     *   Pattern 1: mov rax, rax            → (removed)        - Redundant self-move
+     *   Pattern 3: imul rax, 1             → (removed)        - Identity multiplication
+     *   Pattern 5: add/sub rax, 0          → (removed)        - Identity addition/subtraction
+     *   Pattern 6: shl/shr/sal/sar rax, 0  → (removed)        - Identity shift
+     *   Pattern 7: or rax, 0               → (removed)        - Identity OR
+     *   Pattern 8: xor rax, 0              → (removed)        - Identity XOR (immediate only)
+     *   Pattern 9: and rax, -1             → (removed)        - Identity AND (all bits)
+     *   Pattern 24: lea rax, [rax]         → (removed)        - Redundant address calc
+     * 
+     * Redundant Move Elimination (1 pattern):
+     *   Pattern 12: mov a, b + mov b, a    → mov a, b         - Remove redundant move
+     * 
+     * Instruction Replacements (12 patterns):
+     *   Pattern 2: mov rax, 0              → xor rax, rax     - Smaller encoding, breaks deps
+     *   Pattern 4: imul rax, 8             → shl rax, 3       - Faster shift for power-of-2
+     *   Pattern 10: add rax, 1             → inc rax          - Size opt (note: flag deps on P4+)
+     *   Pattern 11: sub rax, 1             → dec rax          - Size opt (note: flag deps on P4+)
+     *   Pattern 13: sub rax, rax           → xor rax, rax     - Zero idiom
+     *   Pattern 14: and rax, 0             → xor rax, rax     - Zero idiom
+     *   Pattern 15: cmp rax, 0             → test rax, rax    - Zero compare
+     *   Pattern 16: or rax, rax            → test rax, rax    - Flag-only
+     *   Pattern 17: add rax, -1            → dec rax          - Negative add
+     *   Pattern 18: sub rax, -1            → inc rax          - Negative sub
+     *   Pattern 19: and rax, rax           → test rax, rax    - Flag-only
+     *   Pattern 20: cmp rax, rax           → test rax, rax    - Self-compare
+     * 
+     * Control-flow (2 patterns):
+     *   Pattern 21: jmp next_label         → (removed)        - Fallthrough jump
+     *   Pattern 25: jcc label + jmp next   → j!cc next        - Branch inversion
+     * 
+     * Dead code elimination (1 pattern):
+     *   Pattern 26: mov r1, r2 + mov r1, r3 → mov r1, r3        - Dead store
+     * 
+     * Scheduling (1 pattern):
+     *   Pattern 27: mov r1, r2 + mov r3, r4 → mov r3, r4 + mov r1, r2 - Move hoist
+     * 
+     * Load-modify-store (1 pattern):
+     *   Pattern 28: mov r1, [mem] + add r1, imm + mov [mem], r1 → add [mem], imm
+     *   Pattern 29: mov eax, 4 + shl eax, 2 + add eax, 3 → mov eax, 19 (known values, per block)
+     * 
+     * Address modes (3 patterns, priced per --mtune model):
+     *   Pattern 30: lea r1, [b+i+d] after i is written → lea r1, [b+d] + add r1, i
+     *   Pattern 31: mov r1, r2 + shl r1, k + add r1, r3 → lea r1, [r3+r2*2^k]
+     *   Pattern 32: lea r1, [addr] + mov r2, [r1+d] → mov r2, [addr+d] (r1 dead)
+     * 
+     * Cache-aware (1 pattern):
+     *   Pattern 22: .hot_loop:             → .align 64 + label - Align hot loop headers
+     * 
+     * Architecture-aware (1 pattern):
+     *   Pattern 23: bsf reg, reg           → tzcnt reg, reg    - Zen BMI1 preference
+     * 
+     * Vector (3 patterns, gated by the --mtune vector widths):
+     *   Pattern 33: vpxor ymm0, ymm0, ymm0 → vpxor xmm0, xmm0, xmm0 - zmm always, ymm on Zen 1
+     *   Pattern 34: vmovdqa ymm0, ymm0     → (removed)        - Also the second of a swap pair, or a dead copy
+     *   Pattern 35: vmovd xmm1, [m] + vpbroadcastd ymm0, xmm1 → vpbroadcastd ymm0, [m]
+     * 
+     * Replacements are kept only if asmopt_rewrite_pays finds the new form no worse
+     * in the CPU_MODELS table for --mtune. inc/dec carry a flags merge on the generic
+     * model (Pentium 4+), so patterns 10/11/17/18 are dropped there at -O3 and above,
+     * which rank latency first, and always kept at -Os, which ranks bytes first.
+     * 
+     * Patterns are grouped per mnemonic in PEEPHOLE_HANDLERS, so a line only runs
+     * the handlers for its own opcode; each pattern can be switched off by name.
+     *
+     * All patterns preserve comments and handle both Intel and AT&T syntax.
+     */
+    *replaced = false;
+    *removed = false;
+    ctx->skip_lines = 0;
+    const char* line = ctx->original_lines[line_no - 1];
+    const asmopt_insn* insn = asmopt_line_insn(ctx, line_no - 1);
+    bool profiling = ASMOPT_PROFILING(ctx);
+    if (profiling) {
+        ctx->profile.lines_examined++;
+    }
+    if (!insn || !insn->is_instruction) {
+        bool hot_align = insn && ctx->insert_hot_align &&
+                         (ctx->pattern_mask & ASMOPT_PATTERN_BIT(ASMOPT_PATTERN_HOT_LOOP_ALIGN));
+        if (profiling && hot_align) {
+            ctx->profile.pattern_attempts[ASMOPT_PATTERN_HOT_LOOP_ALIGN]++;
+        }
+        /* Pattern 22: .hot_loop: -> .align 64 + label */
+        if (hot_align && asmopt_view_equal(insn->code, ASMOPT_VIEW_LIT(".hot_loop:"))) {
+            if (profiling) {
+                ctx->profile.pattern_hits[ASMOPT_PATTERN_HOT_LOOP_ALIGN]++;
+            }
+            char align_line[32];
+            snprintf(align_line, sizeof(align_line), "    .align %d", ASMOPT_HOT_LOOP_ALIGNMENT);
+            asmopt_view align_view = asmopt_view_of(align_line);
+            asmopt_store_optimized_line(ctx, asmopt_emit(ctx, &align_view, 1));
+            asmopt_record_optimization(ctx, line_no, PATTERN_NAMES[ASMOPT_PATTERN_HOT_LOOP_ALIGN], line,
+                                       asmopt_emit_joined(ctx, align_line, ".hot_loop:", NULL));
+        }
+        asmopt_store_optimized_line(ctx, line);
+        return;
+    }
+    asmopt_pattern_handler handler = PEEPHOLE_HANDLERS[insn->mnemonic];
+    /* constant_fold runs ahead of the per-mnemonic handlers, on any two-operand line. */
+    bool fold = ctx->live_after && insn->two_operands &&
+                (ctx->pattern_mask & ASMOPT_PATTERN_BIT(ASMOPT_PATTERN_CONSTANT_FOLD));
+    if ((!handler && !fold) || (asmopt_needs_two_operands(insn->mnemonic) && !insn->two_operands)) {
+        asmopt_store_optimized_line(ctx, line);
+        return;
+    }
+    asmopt_match match = {0};
+    match.ctx = ctx;
+    match.line_no = line_no;
+    match.line = line;
+    match.insn = insn;
+    match.next = asmopt_line_insn(ctx, line_no);
+    match.after_next = asmopt_line_insn(ctx, line_no + 1);
+    match.dest = asmopt_insn_dest(insn);
+    match.src = asmopt_insn_src(insn);
+    match.dest_reg = insn->two_operands && asmopt_operand_is_reg(match.dest);
+    match.src_reg = insn->two_operands && asmopt_operand_is_reg(match.src);
+    match.att = att;
+    match.flags_dead = asmopt_may_clobber(ctx, line_no, ASMOPT_REGSET_FLAGS);
+    /* Only the families holding multi-line patterns are timed, to price the lookahead. */
+    bool timed = profiling && PEEPHOLE_HAS_LOOKAHEAD[insn->mnemonic];
+    double start = timed ? asmopt_now() : 0.0;
+    bool hit = (fold && asmopt_fold_constants(&match)) || (handler && handler(&match));
+    if (timed) {
+        ctx->profile.lookahead_seconds += asmopt_now() - start;
+    }
+    if (hit) {
+        if (profiling) {
+            ctx->profile.pattern_hits[match.hit]++;
+        }
+        *replaced = match.replaced;
+        *removed = match.removed;
+        return;
+    }
+
+    /* No optimization applied, store original */
+    asmopt_store_optimized_line(ctx, line);
+}
+
+static bool asmopt_is_unconditional_jump(const char* mnemonic) {
+    return asmopt_is_jump_mnemonic(mnemonic) && !asmopt_is_conditional_jump(mnemonic);
+}
+
+static bool asmopt_is_jump_mnemonic(const char* mnemonic) {
+    if (!mnemonic) {
+        return false;
+    }
+    const char* jumps[] = {
+        "jo",   "jno",  "js",   "jns",  "je",   "jz",   "jne",  "jnz",
+        "jb",   "jnae", "jc",   "jnb",  "jae",  "jnc",  "jbe",  "jna",
+        "ja",   "jnbe", "jl",   "jnge", "jge",  "jnl",  "jle",  "jng",
+        "jg",   "jnle", "jp",   "jpe",  "jnp",  "jpo",  "jcxz", "jecxz",
+        "jrcxz","jmp",  "jmpq", "jmpl", "jmpw"
+    };
+    size_t count = sizeof(jumps) / sizeof(jumps[0]);
+    for (size_t i = 0; i < count; i++) {
+        if (asmopt_casecmp(mnemonic, jumps[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool asmopt_is_conditional_jump(const char* mnemonic) {
+    if (!mnemonic) {
+        return false;
+    }
+    const char* jumps[] = {
+        "jo", "jno", "js", "jns", "je", "jz", "jne", "jnz",
+        "jb", "jnae", "jc", "jnb", "jae", "jnc", "jbe", "jna",
+        "ja", "jnbe", "jl", "jnge", "jge", "jnl", "jle", "jng",
+        "jg", "jnle", "jp", "jpe", "jnp", "jpo", "jcxz", "jecxz", "jrcxz"
+    };
+    size_t count = sizeof(jumps) / sizeof(jumps[0]);
+    for (size_t i = 0; i < count; i++) {
+        if (asmopt_casecmp(mnemonic, jumps[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool asmopt_invert_conditional_jump(const char* mnemonic, char* buffer, size_t size) {
+    if (!mnemonic || !buffer || size == 0) {
+        return false;
+    }
+    const char* pairs[][2] = {
+        {"je", "jne"}, {"jz", "jnz"}, {"jne", "je"}, {"jnz", "jz"},
+        {"jb", "jnb"}, {"jnae", "jae"}, {"jc", "jnc"},
+        {"jnb", "jb"}, {"jae", "jnae"}, {"jnc", "jc"},
+        {"jbe", "ja"}, {"jna", "ja"}, {"ja", "jbe"}, {"jnbe", "jbe"},
+        {"jl", "jge"}, {"jnge", "jge"}, {"jge", "jl"}, {"jnl", "jl"},
+        {"jle", "jg"}, {"jng", "jg"}, {"jg", "jle"}, {"jnle", "jle"},
+        {"jo", "jno"}, {"jno", "jo"}, {"js", "jns"}, {"jns", "js"},
+        {"jp", "jnp"}, {"jpe", "jpo"}, {"jnp", "jp"}, {"jpo", "jpe"}
+    };
+    for (size_t i = 0; i < sizeof(pairs) / sizeof(pairs[0]); i++) {
+        if (asmopt_casecmp(mnemonic, pairs[i][0]) == 0) {
+            snprintf(buffer, size, "%s", pairs[i][1]);
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool asmopt_is_return(const char* mnemonic) {
+    if (!mnemonic) {
+        return false;
+    }
+    if (strlen(mnemonic) < 3) {
+        return false;
+    }
+    return asmopt_case_prefix_len(mnemonic, "ret");
+}
+
+/* Label operand of a jump, or an empty view when the target is not a plain symbol. */
+static asmopt_view asmopt_jump_target(const asmopt_insn* insn) {
+    asmopt_view none = {NULL, 0};
+    /* The first non-empty comma-separated operand. */
+    asmopt_view operand = none;
+    size_t start = 0;
+    for (size_t i = 0; i <= insn->operands.len; i++) {
+        if (i == insn->operands.len || insn->operands.ptr[i] == ',') {
+            operand = asmopt_view_strip((asmopt_view){insn->operands.ptr + start, i - start});
+            if (operand.len > 0) {
+                break;
+            }
+            start = i + 1;
+        }
+    }
+    if (operand.len == 0) {
+        return none;
+    }
+    while (operand.len > 0 && operand.ptr[0] == '*') {
+        operand.ptr++;
+        operand.len--;
+    }
+    char first = operand.len > 0 ? operand.ptr[0] : '\0';
+    if (!isalpha((unsigned char)first) && first != '_' && first != '.') {
+        return none;
+    }
+    for (size_t i = 0; i < operand.len; i++) {
+        if (!isalnum((unsigned char)operand.ptr[i]) && operand.ptr[i] != '_' && operand.ptr[i] != '.') {
+            return none;
+        }
+    }
+    return operand;
+}
+
+/* Instructions that end a basic block, classified once by the tokenizer. */
+static bool asmopt_is_block_end(const asmopt_insn* insn) {
+    return insn->kind == ASMOPT_LINE_INSTRUCTION &&
+           (insn->mnemonic == ASMOPT_MN_JMP || insn->mnemonic == ASMOPT_MN_JCC || insn->mnemonic == ASMOPT_MN_RET);
+}
+
+static char* asmopt_ir_strdup(asmopt_context* ctx, asmopt_view view) {
+    return asmopt_arena_strndup(&ctx->ir_arena, view.ptr ? view.ptr : "", view.len);
+}
+
+/* Tokenize every line once; the records feed both the IR dumps and the peephole engine. */
+static void asmopt_build_ir(asmopt_context* ctx, const char* syntax) {
+    if (!ctx) {
+        return;
+    }
+    asmopt_reset_ir(ctx);
+    if (ctx->ir_capacity < ctx->original_count) {
+        free(ctx->ir);
+        ctx->ir_capacity = 0;
+        ctx->ir = calloc(ctx->original_count, sizeof(asmopt_ir_line));
+        if (!ctx->ir) {
+            return;
+        }
+        ctx->ir_capacity = ctx->original_count;
+        ASMOPT_PROFILE_BYTES(ctx, sizeof(asmopt_ir_line) * ctx->original_count);
+    } else if (ctx->original_count > 0) {
+        memset(ctx->ir, 0, sizeof(asmopt_ir_line) * ctx->original_count);
+    }
+    ctx->ir_count = 0;
+    for (size_t i = 0; i < ctx->original_count; i++) {
+        asmopt_ir_line* entry = &ctx->ir[ctx->ir_count++];
+        asmopt_tokenize_line(ctx, ctx->original_lines[i], syntax, &entry->insn);
+        entry->line_no = i + 1;
+    }
+    ctx->ir_att = syntax && strcmp(syntax, "att") == 0;
+}
+
+/* Copy out the text, mnemonic and operand strings of every IR line for the dumps. */
+static void asmopt_build_ir_text(asmopt_context* ctx) {
+    asmopt_arena* arena = &ctx->ir_arena;
+    for (size_t i = 0; i < ctx->ir_count; i++) {
+        asmopt_ir_line* entry = &ctx->ir[i];
+        const asmopt_insn* insn = &entry->insn;
+        switch (insn->kind) {
+            case ASMOPT_LINE_BLANK:
+                entry->text = asmopt_arena_strdup(arena, "");
+                break;
+            case ASMOPT_LINE_DIRECTIVE:
+            case ASMOPT_LINE_TEXT:
+                entry->text = asmopt_ir_strdup(ctx, insn->code);
+                break;
+            case ASMOPT_LINE_LABEL:
+                entry->text = asmopt_ir_strdup(ctx, insn->label);
+                break;
+            case ASMOPT_LINE_INSTRUCTION: {
+                entry->text = asmopt_ir_strdup(ctx, insn->code);
+                entry->mnemonic = asmopt_ir_strdup(ctx, insn->mnemonic_text);
+                const char* operands = insn->operands.ptr;
+                size_t olen = insn->operands.len;
+                if (olen == 0) {
+                    break;
+                }
+                /* Count segments first so the operand array is a single arena slot. */
+                size_t segments = 1;
+                for (size_t j = 0; j < olen; j++) {
+                    if (operands[j] == ',') {
+                        segments++;
+                    }
+                }
+                entry->operands = asmopt_arena_alloc(arena, sizeof(char*) * segments);
+                size_t start = 0;
+                for (size_t j = 0; entry->operands && j <= olen; j++) {
+                    if (j == olen || operands[j] == ',') {
+                        asmopt_view seg = asmopt_view_strip((asmopt_view){operands + start, j - start});
+                        if (seg.len > 0) {
+                            char* token = asmopt_ir_strdup(ctx, seg);
+                            if (token) {
+                                entry->operands[entry->operand_count++] = token;
+                            }
+                        }
+                        start = j + 1;
+                    }
+                }
+                break;
+            }
+        }
+    }
+    ctx->ir_text_ready = true;
+}
+
+static void asmopt_add_edge(asmopt_context* ctx, size_t source, size_t target) {
+    if (ctx->cfg_edge_count == ctx->cfg_edge_capacity) {
+        size_t capacity = ctx->cfg_edge_capacity == 0 ? 16 : ctx->cfg_edge_capacity * 2;
+        asmopt_cfg_edge* next = realloc(ctx->cfg_edges, sizeof(asmopt_cfg_edge) * capacity);
+        if (!next) {
+            return;
+        }
+        ctx->cfg_edges = next;
+        ctx->cfg_edge_capacity = capacity;
+        ASMOPT_PROFILE_BYTES(ctx, sizeof(asmopt_cfg_edge) * capacity);
+    }
+    ctx->cfg_edges[ctx->cfg_edge_count].source = source;
+    ctx->cfg_edges[ctx->cfg_edge_count].target = target;
+    ctx->cfg_edge_count += 1;
+}
+
+/* Close the block under construction; it takes ownership of label and instrs. */
+static bool asmopt_push_block(asmopt_cfg_block** blocks, size_t* count, size_t* capacity, char* label,
+                              size_t label_line, asmopt_ir_line** instrs, size_t instr_count) {
+    if (*count == *capacity) {
+        size_t next_capacity = *capacity == 0 ? 16 : *capacity * 2;
+        asmopt_cfg_block* next = realloc(*blocks, sizeof(asmopt_cfg_block) * next_capacity);
+        if (!next) {
+            return false;
+        }
+        *blocks = next;
+        *capacity = next_capacity;
+    }
+    asmopt_cfg_block* block = &(*blocks)[(*count)++];
+    memset(block, 0, sizeof(*block));
+    block->name = label;
+    block->instructions = instrs;
+    block->instruction_count = instr_count;
+    block->same_name_next = ASMOPT_NO_BLOCK;
+    block->label_line = label ? label_line : 0;
+    return true;
+}
+
+/* Hash every block name to its first block so jump targets resolve in O(1). */
+static bool asmopt_index_labels(asmopt_context* ctx) {
+    size_t* last = malloc(sizeof(size_t) * ctx->cfg_block_count);
+    ctx->cfg_label_blocks = malloc(sizeof(size_t) * ctx->cfg_block_count);
+    if (!last || !ctx->cfg_label_blocks) {
+        free(last);
+        return false;
+    }
+    for (size_t i = 0; i < ctx->cfg_block_count; i++) {
+        size_t known = ctx->cfg_labels.count;
+        int id = asmopt_intern(&ctx->cfg_labels, asmopt_view_of(ctx->cfg_blocks[i].name));
+        if (id < 0) {
+            free(last);
+            return false;
+        }
+        ctx->cfg_blocks[i].same_name_next = ASMOPT_NO_BLOCK;
+        if ((size_t)id == known) {
+            ctx->cfg_label_blocks[id] = i;
+        } else {
+            ctx->cfg_blocks[last[id]].same_name_next = i;
+        }
+        last[id] = i;
+    }
+    free(last);
+    return true;
+}
+
+/* Edges are added in source order, so each block's successors are one contiguous run; predecessors are bucketed. */
+static void asmopt_link_edges(asmopt_context* ctx) {
+    asmopt_cfg_block* blocks = ctx->cfg_blocks;
+    for (size_t e = 0; e < ctx->cfg_edge_count; e++) {
+        asmopt_cfg_block* source = &blocks[ctx->cfg_edges[e].source];
+        if (source->succ_count == 0) {
+            source->succ_begin = e;
+        }
+        source->succ_count++;
+        blocks[ctx->cfg_edges[e].target].pred_count++;
+    }
+    ctx->cfg_pred_edges = malloc(sizeof(size_t) * (ctx->cfg_edge_count + 1));
+    if (!ctx->cfg_pred_edges) {
+        for (size_t i = 0; i < ctx->cfg_block_count; i++) {
+            blocks[i].pred_count = 0;
+        }
+        return;
+    }
+    size_t offset = 0;
+    for (size_t i = 0; i < ctx->cfg_block_count; i++) {
+        blocks[i].pred_begin = offset;
+        offset += blocks[i].pred_count;
+        blocks[i].pred_count = 0;
+    }
+    for (size_t e = 0; e < ctx->cfg_edge_count; e++) {
+        asmopt_cfg_block* target = &blocks[ctx->cfg_edges[e].target];
+        ctx->cfg_pred_edges[target->pred_begin + target->pred_count++] = e;
+    }
+}
+
+static void asmopt_build_cfg(asmopt_context* ctx) {
+    asmopt_reset_cfg(ctx);
+    if (!ctx) {
+        return;
+    }
+    ctx->cfg_ready = true;
+    if (ctx->ir_count == 0) {
+        return;
+    }
+    asmopt_cfg_block* blocks = NULL;
+    size_t block_count = 0;
+    size_t block_capacity = 0;
+    asmopt_ir_line** current_instrs = NULL;
+    size_t instr_count = 0;
+    size_t instr_capacity = 0;
+    char* current_label = NULL;
+    size_t label_line = 0;
+
+    for (size_t i = 0; i < ctx->ir_count; i++) {
+        asmopt_ir_line* line = &ctx->ir[i];
+        bool is_label = line->insn.kind == ASMOPT_LINE_LABEL;
+        if (is_label && (current_label || instr_count > 0)) {
+            if (!asmopt_push_block(&blocks, &block_count, &block_capacity, current_label, label_line, current_instrs,
+                                   instr_count)) {
+                break;
+            }
+            current_label = NULL;
+            current_instrs = NULL;
+            instr_count = 0;
+            instr_capacity = 0;
+        }
+        if (is_label) {
+            current_label = asmopt_view_strdup(line->insn.label);
+            label_line = line->line_no;
+            continue;
+        }
+        if (line->insn.kind != ASMOPT_LINE_INSTRUCTION) {
+            continue;
+        }
+        if (instr_count == instr_capacity) {
+            size_t capacity = instr_capacity == 0 ? 8 : instr_capacity * 2;
+            asmopt_ir_line** next_instrs = realloc(current_instrs, sizeof(asmopt_ir_line*) * capacity);
+            if (!next_instrs) {
+                break;
+            }
+            current_instrs = next_instrs;
+            instr_capacity = capacity;
+            ASMOPT_PROFILE_BYTES(ctx, sizeof(asmopt_ir_line*) * capacity);
+        }
+        current_instrs[instr_count++] = line;
+        if (asmopt_is_block_end(&line->insn)) {
+            if (!asmopt_push_block(&blocks, &block_count, &block_capacity, current_label, label_line, current_instrs,
+                                   instr_count)) {
+                break;
+            }
+            current_label = NULL;
+            current_instrs = NULL;
+            instr_count = 0;
+            instr_capacity = 0;
+        }
+    }
+    if (current_label || instr_count > 0) {
+        if (asmopt_push_block(&blocks, &block_count, &block_capacity, current_label, label_line, current_instrs,
+                              instr_count)) {
+            current_label = NULL;
+            current_instrs = NULL;
+        }
+    }
+    free(current_instrs);
+    free(current_label);
+
+    if (block_count == 0) {
+        if (!asmopt_push_block(&blocks, &block_count, &block_capacity, asmopt_strdup("block0"), 0, NULL, 0)) {
+            free(blocks);
+            return;
+        }
+    } else {
+        for (size_t i = 0; i < block_count; i++) {
+            if (!blocks[i].name) {
+                char name[32];
+                snprintf(name, sizeof(name), "block%zu", i);
+                blocks[i].name = asmopt_strdup(name);
+            }
+        }
+    }
+
+    ctx->cfg_blocks = blocks;
+    ctx->cfg_block_count = block_count;
+    ASMOPT_PROFILE_BYTES(ctx, sizeof(asmopt_cfg_block) * block_capacity + sizeof(size_t) * block_count);
+    if (!asmopt_index_labels(ctx)) {
+        return;
+    }
+    for (size_t i = 0; i < block_count; i++) {
+        asmopt_cfg_block* block = &ctx->cfg_blocks[i];
+        if (block->instruction_count == 0) {
+            /* A label with no instructions of its own falls into the next block. */
+            if (i + 1 < block_count) {
+                asmopt_add_edge(ctx, i, i + 1);
+            }
+            continue;
+        }
+        const asmopt_insn* last = &block->instructions[block->instruction_count - 1]->insn;
+        if (last->mnemonic == ASMOPT_MN_JMP || last->mnemonic == ASMOPT_MN_JCC) {
+            asmopt_view target = asmopt_jump_target(last);
+            if (target.ptr) {
+                int id = asmopt_intern_find(&ctx->cfg_labels, target);
+                if (id >= 0) {
+                    asmopt_add_edge(ctx, i, ctx->cfg_label_blocks[id]);
+                }
+            }
+            if (last->mnemonic == ASMOPT_MN_JCC && i + 1 < block_count) {
+                asmopt_add_edge(ctx, i, i + 1);
+            }
+        } else if (last->mnemonic == ASMOPT_MN_RET) {
+            continue;
+        } else if (i + 1 < block_count) {
+            asmopt_add_edge(ctx, i, i + 1);
+        }
+    }
+    asmopt_link_edges(ctx);
+}
+
+/* .byte and friends between instructions may encode anything. */
+static bool asmopt_is_data_directive(const asmopt_insn* insn) {
+    static const char* const DATA_DIRECTIVES[] = {
+        ".byte", ".word", ".short", ".hword", ".value", ".long", ".int", ".quad", ".octa",
+        ".2byte", ".4byte", ".8byte", ".inst",
+    };
+    if (insn->kind != ASMOPT_LINE_DIRECTIVE) {
+        return false;
+    }
+    for (size_t i = 0; i < sizeof(DATA_DIRECTIVES) / sizeof(DATA_DIRECTIVES[0]); i++) {
+        size_t len = strlen(DATA_DIRECTIVES[i]);
+        if (insn->code.len > len && strncmp(insn->code.ptr, DATA_DIRECTIVES[i], len) == 0 &&
+            isspace((unsigned char)insn->code.ptr[len])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Local labels (.L3, numeric 1f/1b) never name another function. */
+static bool asmopt_is_local_label(asmopt_view target) {
+    if (target.len >= 2 && target.ptr[0] == '.' && (target.ptr[1] == 'L' || target.ptr[1] == 'l')) {
+        return true;
+    }
+    return target.len > 0 && isdigit((unsigned char)target.ptr[0]);
+}
+
+/*
+ * Registers read once control leaves the input from this block. A jump to a
+ * symbol defined elsewhere is a tail call and reads what a call would; an
+ * indirect jump or a local label missing from the input may read anything;
+ * falling off the end keeps every register but the flags.
+ */
+static asmopt_regset asmopt_block_exit_live(const asmopt_context* ctx, size_t block_index) {
+    const asmopt_regset fall_off = ASMOPT_REGSET_ALL & ~ASMOPT_REGSET_FLAGS;
+    const asmopt_regset tail_call = ctx->abi->arguments | ctx->abi->callee_saved;
+    const asmopt_cfg_block* block = &ctx->cfg_blocks[block_index];
+    bool last_block = block_index + 1 == ctx->cfg_block_count;
+    if (block->instruction_count == 0) {
+        return last_block ? fall_off : 0;
+    }
+    const asmopt_insn* last = &block->instructions[block->instruction_count - 1]->insn;
+    if (last->mnemonic != ASMOPT_MN_JMP && last->mnemonic != ASMOPT_MN_JCC) {
+        bool returns = last->mnemonic == ASMOPT_MN_RET;
+        return last_block && !returns ? fall_off : 0;
+    }
+    asmopt_regset live = last->mnemonic == ASMOPT_MN_JCC && last_block ? fall_off : 0;
+    asmopt_view target = asmopt_jump_target(last);
+    unsigned width = 0;
+    if (!target.ptr || target.len == 0 || target.ptr[0] == '*' || asmopt_view_contains(target, '[') ||
+        asmopt_view_contains(target, '(') || asmopt_reg_class(target, &width) >= 0) {
+        return ASMOPT_REGSET_ALL;
+    }
+    if (asmopt_intern_find(&ctx->cfg_labels, target) < 0) {
+        live |= asmopt_is_local_label(target) ? ASMOPT_REGSET_ALL : tail_call;
+    }
+    return live;
+}
+
+/* Effects as liveness sees them: anything not modelled reads every register; calls and returns follow ctx->abi. */
+static void asmopt_live_effects(const asmopt_context* ctx, const asmopt_ir_line* line, bool opaque,
+                                asmopt_effects* effects) {
+    const asmopt_insn* insn = &line->insn;
+    if (opaque || !asmopt_insn_effects(insn, effects)) {
+        memset(effects, 0, sizeof(*effects));
+        effects->uses = ASMOPT_REGSET_ALL;
+    } else if (insn->mnemonic == ASMOPT_MN_RET) {
+        effects->uses = ctx->abi->returned | ctx->abi->callee_saved;
+    } else if (asmopt_view_is(insn->mnemonic_text, "call") || asmopt_view_is(insn->mnemonic_text, "callq")) {
+        effects->uses = ctx->abi->arguments | ASMOPT_REGSET_BIT(ASMOPT_REG_RSP);
+        effects->defs = ctx->abi->call_clobbered;
+        asmopt_address_uses(insn->operands_trimmed, &effects->uses);
+    }
+}
+
+/*
+ * Backward liveness over the CFG: per-block use/def, then live_in/live_out
+ * iterated to a fixpoint, then one reverse sweep per block for live_after.
+ */
+static void asmopt_build_liveness(asmopt_context* ctx) {
+    size_t block_count = ctx->cfg_block_count;
+    if (ctx->ir_count == 0 || block_count == 0 || !ctx->cfg_pred_edges) {
+        return;
+    }
+    asmopt_regset* live_after = malloc(sizeof(asmopt_regset) * ctx->ir_count);
+    /* Each line's defs; its uses wait in live_after until the final sweep replaces them. */
+    asmopt_regset* line_defs = malloc(sizeof(asmopt_regset) * ctx->ir_count);
+    size_t* line_blocks = malloc(sizeof(size_t) * ctx->ir_count);
+    asmopt_regset* sets = calloc(block_count * 5, sizeof(asmopt_regset));
+    bool* opaque = calloc(block_count, sizeof(bool));
+    if (!live_after || !line_defs || !line_blocks || !sets || !opaque) {
+        free(live_after);
+        free(line_defs);
+        free(line_blocks);
+        free(sets);
+        free(opaque);
+        return;
+    }
+    ASMOPT_PROFILE_BYTES(ctx, (sizeof(asmopt_regset) * 2 + sizeof(size_t)) * ctx->ir_count +
+                                  sizeof(asmopt_regset) * block_count * 5 + block_count);
+    asmopt_regset* use = sets;
+    asmopt_regset* def = sets + block_count;
+    asmopt_regset* live_in = sets + block_count * 2;
+    asmopt_regset* live_out = sets + block_count * 3;
+    asmopt_regset* exit_live = sets + block_count * 4;
+    for (size_t i = 0; i < ctx->ir_count; i++) {
+        live_after[i] = ASMOPT_REGSET_ALL;
+        line_blocks[i] = ASMOPT_NO_BLOCK;
+    }
+    size_t scanned = 0;
+    for (size_t b = 0; b < block_count; b++) {
+        const asmopt_cfg_block* block = &ctx->cfg_blocks[b];
+        for (size_t i = 0; i < block->instruction_count; i++) {
+            size_t index = block->instructions[i]->line_no - 1;
+            line_blocks[index] = b;
+            for (; scanned < index; scanned++) {
+                opaque[b] = opaque[b] || asmopt_is_data_directive(&ctx->ir[scanned].insn);
+            }
+            scanned = index + 1;
+        }
+        for (size_t i = 0; i < block->instruction_count; i++) {
+            asmopt_effects effects;
+            size_t index = block->instructions[i]->line_no - 1;
+            asmopt_live_effects(ctx, block->instructions[i], opaque[b], &effects);
+            live_after[index] = effects.uses;
+            line_defs[index] = effects.defs;
+            use[b] |= effects.uses & ~def[b];
+            def[b] |= effects.defs;
+        }
+        exit_live[b] = asmopt_block_exit_live(ctx, b);
+    }
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t b = block_count; b-- > 0;) {
+            const asmopt_cfg_block* block = &ctx->cfg_blocks[b];
+            asmopt_regset out = exit_live[b];
+            for (size_t e = 0; e < block->succ_count; e++) {
+                out |= live_in[ctx->cfg_edges[block->succ_begin + e].target];
+            }
+            asmopt_regset in = use[b] | (out & ~def[b]);
+            if (out != live_out[b] || in != live_in[b]) {
+                live_out[b] = out;
+                live_in[b] = in;
+                changed = true;
+            }
+        }
+    }
+    for (size_t b = 0; b < block_count; b++) {
+        const asmopt_cfg_block* block = &ctx->cfg_blocks[b];
+        asmopt_regset live = live_out[b];
+        for (size_t i = block->instruction_count; i-- > 0;) {
+            size_t index = block->instructions[i]->line_no - 1;
+            asmopt_regset uses = live_after[index];
+            live_after[index] = live;
+            live = uses | (live & ~line_defs[index]);
+        }
+    }
+    free(line_defs);
+    free(sets);
+    free(opaque);
+    ctx->live_after = live_after;
+    ctx->line_blocks = line_blocks;
+    ctx->live_lines = ctx->original_lines;
+    ctx->live_count = ctx->ir_count;
+}
+
+/* rel8/imm8 range. */
+static bool asmopt_fits_int8(long value) {
+    return value >= -128 && value <= 127;
+}
+
+/*
+ * ModRM, SIB and displacement bytes of a memory operand in either syntax,
+ * plus any segment-override or address-size (32-bit registers) prefix.
+ * Sets *rex when r8-r15 appear in the address.
+ */
+static unsigned asmopt_mem_length(asmopt_view text, bool* rex) {
+    const char* ptr = text.ptr;
+    const char* end = text.ptr + text.len;
+    int base = -1;
+    size_t reg_count = 0;
+    bool index_only = false;
+    bool rip = false;
+    bool symbol = false;
+    unsigned segment = 0;
+    /* [eax]-style addresses take a 0x67 address-size prefix. */
+    bool addr32 = false;
+    long disp = 0;
+    char previous = '\0';
+    while (ptr < end) {
+        char c = *ptr;
+        if (isspace((unsigned char)c)) {
+            ptr++;
+            continue;
+        }
+        if (isalpha((unsigned char)c) || c == '_' || c == '%' || c == '.') {
+            const char* start = ptr++;
+            while (ptr < end && (isalnum((unsigned char)*ptr) || *ptr == '_' || *ptr == '.')) {
+                ptr++;
+            }
+            asmopt_view name = {start, (size_t)(ptr - start)};
+            unsigned width = 0;
+            int reg_class = asmopt_reg_class(name, &width);
+            if (reg_class >= 0 && reg_class < 16) {
+                if (reg_count++ == 0) {
+                    base = reg_class;
+                    /* "(,%rcx,4)" and "[rcx*4]" have an index but no base. */
+                    index_only = previous == ',' || (ptr < end && *ptr == '*');
+                }
+                *rex = *rex || reg_class >= 8;
+                addr32 = addr32 || width == 32;
+            } else if (asmopt_view_is(name, "rip") || asmopt_view_is(name, "%rip")) {
+                rip = true;
+            } else if (ptr < end && *ptr == ':') {
+                /* Segment override prefix, counted with the address. */
+                segment = 1;
+            } else if (!asmopt_view_is(name, "ptr") && !asmopt_view_is(name, "byte") &&
+                       !asmopt_view_is(name, "word") && !asmopt_view_is(name, "dword") &&
+                       !asmopt_view_is(name, "qword") && !asmopt_view_is(name, "xmmword") &&
+                       !asmopt_view_is(name, "ymmword") && !asmopt_view_is(name, "zmmword")) {
+                symbol = true;
+            }
+            previous = 'a';
+            continue;
+        }
+        if (isdigit((unsigned char)c)) {
+            char* after = NULL;
+            long value = strtol(ptr, &after, 0);
+            if (after <= ptr || after > end) {
+                after = (char*)ptr + 1;
+            }
+            const char* next = after;
+            while (next < end && isspace((unsigned char)*next)) {
+                next++;
+            }
+            /* Scale factors follow '*' or the index in AT&T syntax; anything else is displacement. */
+            if (previous != '*' && previous != ',' && (next >= end || *next != '*')) {
+                disp += previous == '-' ? -value : value;
+            }
+            ptr = after;
+            previous = '0';
+            continue;
+        }
+        previous = c;
+        ptr++;
+    }
+    segment += addr32 ? 1 : 0;
+    if (rip) {
+        return segment + 5;
+    }
+    if (reg_count == 0 || (reg_count == 1 && index_only)) {
+        /* Absolute or index-only addresses need a SIB byte and a disp32. */
+        return segment + 6;
+    }
+    bool sib = reg_count > 1 || (base & 7) == ASMOPT_REG_RSP;
+    unsigned disp_bytes = 0;
+    if (symbol || !asmopt_fits_int8(disp)) {
+        disp_bytes = 4;
+    } else if (disp != 0 || (base & 7) == 5) {
+        /* rbp and r13 as a base have no disp-less encoding. */
+        disp_bytes = 1;
+    }
+    return segment + 1 + (sib ? 1 : 0) + disp_bytes;
+}
+
+/* Operand width an Intel size keyword ("qword ptr [...]") gives a memory operand, 0 if none. */
+static unsigned asmopt_ptr_width(asmopt_view piece) {
+    static const struct {
+        const char* name;
+        unsigned width;
+    } sizes[] = {{"byte", 8}, {"word", 16}, {"dword", 32}, {"qword", 64}};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        size_t len = strlen(sizes[i].name);
+        if (piece.len > len && isspace((unsigned char)piece.ptr[len]) &&
+            asmopt_view_is((asmopt_view){piece.ptr, len}, sizes[i].name)) {
+            return sizes[i].width;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Estimated encoded size of an instruction in bytes, 0 for labels, directives
+ * and blank lines. Branches are taken to use rel8 and unknown mnemonics a
+ * one-byte opcode with ModRM; close enough to size loop bodies, not to lay
+ * out code.
+ */
+static unsigned asmopt_insn_length(const asmopt_insn* insn) {
+    char lower[16];
+    if (insn->kind != ASMOPT_LINE_INSTRUCTION || insn->mnemonic_text.len == 0) {
+        return 0;
+    }
+    if (insn->mnemonic_text.len >= sizeof(lower)) {
+        return 4;
+    }
+    for (size_t i = 0; i < insn->mnemonic_text.len; i++) {
+        lower[i] = (char)tolower((unsigned char)insn->mnemonic_text.ptr[i]);
+    }
+    lower[insn->mnemonic_text.len] = '\0';
+    asmopt_view pieces[4];
+    size_t count = insn->operands_trimmed.len == 0 ? 0 : asmopt_split_operand_list(insn->operands_trimmed, pieces, 4);
+    if (count == 0) {
+        if (strncmp(lower, "endbr", 5) == 0) {
+            return 4;
+        }
+        if (strcmp(lower, "vzeroupper") == 0) {
+            return 3;
+        }
+        if (strcmp(lower, "pause") == 0 || strcmp(lower, "syscall") == 0 || strcmp(lower, "ud2") == 0 ||
+            strcmp(lower, "cqto") == 0 || strcmp(lower, "cqo") == 0 || strcmp(lower, "cltq") == 0 ||
+            strcmp(lower, "cdqe") == 0 || strcmp(lower, "rdtsc") == 0 || strcmp(lower, "cpuid") == 0) {
+            return 2;
+        }
+        return 1;
+    }
+    bool rex = false;
+    bool vector = lower[0] == 'v';
+    /* Masks, zmm and xmm16-31 need the four-byte EVEX prefix. */
+    bool evex = asmopt_view_contains(insn->operands_trimmed, '{');
+    bool modrm = false;
+    bool is_imm = false;
+    bool target = false;
+    unsigned mem = 0;
+    unsigned width = 0;
+    long imm = 0;
+    bool reg_dest = false;
+    int dest_class = -1;
+    for (size_t i = 0; i < count && i < 4; i++) {
+        asmopt_view piece = pieces[i];
+        if (piece.len > 0 && piece.ptr[0] == '*') {
+            piece.ptr++;
+            piece.len--;
+        }
+        asmopt_operand_kind kind = asmopt_piece_kind(piece);
+        if (kind == ASMOPT_OPERAND_MEM) {
+            mem = asmopt_mem_length(piece, &rex);
+            modrm = true;
+            if (asmopt_ptr_width(piece) > width) {
+                width = asmopt_ptr_width(piece);
+            }
+        } else if (kind == ASMOPT_OPERAND_REG) {
+            unsigned reg_width = 0;
+            int reg_class = asmopt_reg_class(piece, &reg_width);
+            modrm = true;
+            if (reg_class >= ASMOPT_REG_VECTOR0) {
+                vector = true;
+                rex = rex || reg_class - ASMOPT_REG_VECTOR0 >= 8;
+                evex = evex || reg_width == 512 || reg_class - ASMOPT_REG_VECTOR0 >= 16;
+                continue;
+            }
+            /* r8-r15, and spl/bpl/sil/dil, which only exist with a REX prefix. */
+            if (reg_class >= 8 || (reg_width == 8 && reg_class >= 4 && piece.ptr[piece.len - 1] == 'l')) {
+                rex = true;
+            }
+            if (reg_width > width) {
+                width = reg_width;
+            }
+            if (i == (insn->dest == 1 ? count - 1 : 0)) {
+                reg_dest = true;
+                dest_class = reg_class;
+            }
+        } else if (asmopt_piece_immediate(piece, &imm)) {
+            is_imm = true;
+        } else if (piece.len > 0 && piece.ptr[0] == '$') {
+            /* Symbolic immediate: a 32-bit relocation. */
+            is_imm = true;
+            imm = INT32_MAX;
+        } else {
+            target = true;
+        }
+    }
+    if (width == 0) {
+        width = insn->suffix == 'q' ? 64 : insn->suffix == 'w' ? 16 : insn->suffix == 'b' ? 8 : 32;
+    }
+    unsigned imm_bytes = 0;
+    if (is_imm) {
+        imm_bytes = width == 8 ? 1 : width == 16 ? 2 : 4;
+    }
+    unsigned operand_bytes = modrm ? (mem > 0 ? mem : 1) : 0;
+    if (vector) {
+        /* VEX or a legacy-SSE prefix, escape and opcode, then ModRM (and imm8). */
+        if (evex) {
+            return 5 + operand_bytes + (is_imm ? 1 : 0);
+        }
+        return 3 + (rex && lower[0] != 'v' ? 1 : 0) + operand_bytes + (is_imm ? 1 : 0);
+    }
+    unsigned prefixes = (rex || width == 64 ? 1 : 0) + (width == 16 ? 1 : 0);
+    switch (insn->mnemonic) {
+    case ASMOPT_MN_RET:
+        return is_imm ? 3 : 1;
+    case ASMOPT_MN_JMP:
+    case ASMOPT_MN_JCC:
+        return target ? 2 : (rex ? 1 : 0) + 1 + operand_bytes;
+    case ASMOPT_MN_MOV:
+        if (is_imm && reg_dest && mem == 0) {
+            /* mov r, imm: B8+r; a 64-bit destination needs C7 /0 for a sign-extended imm32, else movabs. */
+            if (width == 64) {
+                return imm >= INT32_MIN && imm <= INT32_MAX ? 7 : 10;
+            }
+            return prefixes + 1 + imm_bytes;
+        }
+        break;
+    case ASMOPT_MN_ADD:
+    case ASMOPT_MN_SUB:
+    case ASMOPT_MN_AND:
+    case ASMOPT_MN_OR:
+    case ASMOPT_MN_XOR:
+    case ASMOPT_MN_CMP:
+    case ASMOPT_MN_IMUL:
+        if (is_imm && width > 8 && asmopt_fits_int8(imm)) {
+            imm_bytes = 1;
+        } else if (is_imm && dest_class == ASMOPT_REG_RAX && mem == 0 && insn->mnemonic != ASMOPT_MN_IMUL) {
+            /* al/ax/eax/rax with a full immediate: the short accumulator opcode, no ModRM. */
+            return prefixes + 1 + imm_bytes;
+        }
+        break;
+    case ASMOPT_MN_TEST:
+        if (is_imm && dest_class == ASMOPT_REG_RAX && mem == 0) {
+            return prefixes + 1 + imm_bytes;
+        }
+        break;
+    case ASMOPT_MN_SHL:
+    case ASMOPT_MN_SHR:
+    case ASMOPT_MN_SAL:
+    case ASMOPT_MN_SAR:
+        imm_bytes = is_imm && imm != 1 ? 1 : 0;
+        break;
+    default:
+        break;
+    }
+    if (strcmp(lower, "call") == 0 || strcmp(lower, "callq") == 0) {
+        return target ? 5 : (rex ? 1 : 0) + 1 + operand_bytes;
+    }
+    if (strcmp(lower, "movabs") == 0 || strcmp(lower, "movabsq") == 0) {
+        return 10;
+    }
+    if (strncmp(lower, "push", 4) == 0 || strncmp(lower, "pop", 3) == 0) {
+        if (is_imm) {
+            return asmopt_fits_int8(imm) ? 2 : 5;
+        }
+        /* push/pop r is 50+r/58+r; only memory operands take ModRM. */
+        return (rex ? 1 : 0) + 1 + (mem > 0 ? mem : 0);
+    }
+    if (is_imm && (strncmp(lower, "adc", 3) == 0 || strncmp(lower, "sbb", 3) == 0 ||
+                   strncmp(lower, "ro", 2) == 0 || strncmp(lower, "rc", 2) == 0)) {
+        imm_bytes = asmopt_fits_int8(imm) ? 1 : imm_bytes;
+    }
+    /* Two-byte opcodes behind 0F; tzcnt/lzcnt/popcnt add a mandatory F3 prefix. */
+    unsigned escape = 0;
+    if (strncmp(lower, "tzcnt", 5) == 0 || strncmp(lower, "lzcnt", 5) == 0 || strncmp(lower, "popcnt", 6) == 0) {
+        escape = 2;
+    } else if (insn->mnemonic == ASMOPT_MN_BSF || strncmp(lower, "bsr", 3) == 0 || strncmp(lower, "bt", 2) == 0 ||
+               strncmp(lower, "movz", 4) == 0 || strncmp(lower, "movsx", 5) == 0 ||
+               (strncmp(lower, "movs", 4) == 0 && (lower[4] == 'b' || lower[4] == 'w') && strlen(lower) == 6) ||
+               strncmp(lower, "bswap", 5) == 0 || strncmp(lower, "xadd", 4) == 0 ||
+               strncmp(lower, "cmpxchg", 7) == 0 || strncmp(lower, "nop", 3) == 0 ||
+               asmopt_is_conditional_op(lower, "set") ||
+               asmopt_is_conditional_op(lower, "cmov") ||
+               (insn->mnemonic == ASMOPT_MN_IMUL && count == 2 && !is_imm)) {
+        escape = 1;
+    }
+    if (strcmp(lower, "movsxd") == 0) {
+        escape = 0;
+    }
+    return prefixes + 1 + escape + operand_bytes + imm_bytes;
+}
+
+/*
+ * Innermost natural loops of the CFG. Dominators are computed with Cooper,
+ * Harvey and Kennedy's iterative scheme over a reverse postorder from a
+ * virtual root that enters block 0 and every block without predecessors,
+ * so every block has an immediate dominator. An edge into a dominator of its
+ * source closes a loop; the body is collected by walking predecessors back
+ * from the latches. For each loop that contains no other loop header,
+ * loop_end[top] is set one past the last body block in layout order, top
+ * being the first one. Returns false if memory runs out.
+ */
+static bool asmopt_find_inner_loops(const asmopt_context* ctx, size_t* loop_end) {
+    size_t count = ctx->cfg_block_count;
+    size_t root = count;
+    const asmopt_cfg_block* blocks = ctx->cfg_blocks;
+    /* number[b] is b's position in reverse postorder; the root is 0. */
+    size_t* number = malloc(sizeof(size_t) * (count + 1));
+    size_t* order = malloc(sizeof(size_t) * (count + 1));
+    size_t* idom = malloc(sizeof(size_t) * (count + 1));
+    size_t* stack = malloc(sizeof(size_t) * count);
+    size_t* cursor = malloc(sizeof(size_t) * count);
+    size_t* mark = malloc(sizeof(size_t) * count);
+    bool* entry = calloc(count, sizeof(bool));
+    bool* header = calloc(count, sizeof(bool));
+    if (!number || !order || !idom || !stack || !cursor || !mark || !entry || !header) {
+        free(number);
+        free(order);
+        free(idom);
+        free(stack);
+        free(cursor);
+        free(mark);
+        free(entry);
+        free(header);
+        return false;
+    }
+    for (size_t b = 0; b < count; b++) {
+        number[b] = ASMOPT_NO_BLOCK;
+        mark[b] = ASMOPT_NO_BLOCK;
+        loop_end[b] = 0;
+    }
+    /* Depth-first from each entry, then from whatever only unreachable cycles lead to. */
+    size_t finished = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t b = 0; b < count; b++) {
+            if (number[b] != ASMOPT_NO_BLOCK || (pass == 0 && b != 0 && blocks[b].pred_count > 0)) {
+                continue;
+            }
+            entry[b] = true;
+            size_t depth = 0;
+            stack[depth] = b;
+            cursor[depth++] = 0;
+            number[b] = 0;
+            while (depth > 0) {
+                size_t top = stack[depth - 1];
+                if (cursor[depth - 1] < blocks[top].succ_count) {
+                    size_t next = ctx->cfg_edges[blocks[top].succ_begin + cursor[depth - 1]++].target;
+                    if (number[next] == ASMOPT_NO_BLOCK) {
+                        number[next] = 0;
+                        stack[depth] = next;
+                        cursor[depth++] = 0;
+                    }
+                    continue;
+                }
+                /* Postorder for now; reversed below. */
+                order[finished++] = top;
+                depth--;
+            }
+        }
+    }
+    for (size_t i = 0; i < count / 2; i++) {
+        size_t swap = order[i];
+        order[i] = order[count - 1 - i];
+        order[count - 1 - i] = swap;
+    }
+    /* Shift right by one so the root takes position 0. */
+    for (size_t i = count; i > 0; i--) {
+        order[i] = order[i - 1];
+        number[order[i]] = i;
+        idom[order[i]] = ASMOPT_NO_BLOCK;
+    }
+    order[0] = root;
+    number[root] = 0;
+    idom[root] = root;
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t i = 1; i <= count; i++) {
+            size_t b = order[i];
+            size_t best = entry[b] ? root : ASMOPT_NO_BLOCK;
+            for (size_t p = 0; p < blocks[b].pred_count; p++) {
+                size_t pred = ctx->cfg_edges[ctx->cfg_pred_edges[blocks[b].pred_begin + p]].source;
+                if (idom[pred] == ASMOPT_NO_BLOCK) {
+                    continue;
+                }
+                if (best == ASMOPT_NO_BLOCK) {
+                    best = pred;
+                    continue;
+                }
+                size_t left = pred;
+                while (left != best) {
+                    while (number[left] > number[best]) {
+                        left = idom[left];
+                    }
+                    while (number[best] > number[left]) {
+                        best = idom[best];
+                    }
+                }
+            }
+            if (idom[b] != best) {
+                idom[b] = best;
+                changed = true;
+            }
+        }
+    }
+    for (size_t e = 0; e < ctx->cfg_edge_count; e++) {
+        size_t source = ctx->cfg_edges[e].source;
+        size_t target = ctx->cfg_edges[e].target;
+        /* Jumps to a duplicated label resolve to its first block, which need not be a real loop. */
+        if (number[target] > number[source] || blocks[target].same_name_next != ASMOPT_NO_BLOCK) {
+            continue;
+        }
+        for (size_t walk = source; walk != root; walk = idom[walk]) {
+            if (walk == target) {
+                header[target] = true;
+                break;
+            }
+        }
+    }
+    for (size_t h = 0; h < count; h++) {
+        if (!header[h]) {
+            continue;
+        }
+        size_t depth = 0;
+        size_t first = h;
+        size_t last = h;
+        bool inner = true;
+        mark[h] = h;
+        for (size_t p = 0; p < blocks[h].pred_count; p++) {
+            size_t pred = ctx->cfg_edges[ctx->cfg_pred_edges[blocks[h].pred_begin + p]].source;
+            if (mark[pred] == h) {
+                continue;
+            }
+            bool latch = false;
+            for (size_t walk = pred; walk != root && !latch; walk = idom[walk]) {
+                latch = walk == h;
+            }
+            if (latch) {
+                mark[pred] = h;
+                stack[depth++] = pred;
+            }
+        }
+        while (depth > 0) {
+            size_t block = stack[--depth];
+            inner = inner && !header[block];
+            first = block < first ? block : first;
+            last = block > last ? block : last;
+            for (size_t p = 0; p < blocks[block].pred_count; p++) {
+                size_t pred = ctx->cfg_edges[ctx->cfg_pred_edges[blocks[block].pred_begin + p]].source;
+                if (mark[pred] != h) {
+                    mark[pred] = h;
+                    stack[depth++] = pred;
+                }
+            }
+        }
+        if (inner && last + 1 > loop_end[first]) {
+            loop_end[first] = last + 1;
+        }
+    }
+    free(number);
+    free(order);
+    free(idom);
+    free(stack);
+    free(cursor);
+    free(mark);
+    free(entry);
+    free(header);
+    return true;
+}
+
+
+/*
+ * asmopt_optimize only tokenizes what its passes read and builds the CFG only
+ * when liveness needs it; the dumps fill in whatever is still missing.
+ */
+static void asmopt_prepare_dump(asmopt_context* ctx, bool need_cfg) {
+    bool profiling = ASMOPT_PROFILING(ctx);
+    double start = profiling ? asmopt_now() : 0.0;
+    if (ctx->original_count > 0 && ctx->ir_count != ctx->original_count) {
+        char* syntax = asmopt_detect_syntax(ctx);
+        asmopt_build_ir(ctx, syntax);
+        free(syntax);
+    }
+    if (!ctx->ir_text_ready) {
+        asmopt_build_ir_text(ctx);
+    }
+    if (profiling) {
+        double now = asmopt_now();
+        ctx->profile.ir_seconds += now - start;
+        start = now;
+    }
+    if (need_cfg && !ctx->cfg_ready) {
+        asmopt_build_cfg(ctx);
+        if (profiling) {
+            ctx->profile.cfg_seconds += asmopt_now() - start;
+        }
+    }
+}
+
+static const char* const LINE_KIND_NAMES[] = {"blank", "directive", "label", "instruction", "text"};
+
+static char* asmopt_dump_ir(asmopt_context* ctx) {
+    if (!ctx) {
+        return asmopt_strdup("IR:\n");
+    }
+    asmopt_prepare_dump(ctx, false);
+    asmopt_buffer buffer = {0};
+    asmopt_buffer_append(&buffer, "IR:\n");
+    for (size_t i = 0; i < ctx->ir_count; i++) {
+        asmopt_ir_line* line = &ctx->ir[i];
+        if (line->insn.kind == ASMOPT_LINE_INSTRUCTION) {
+            asmopt_buffer_appendf(&buffer, "%04zu: instr %s ", line->line_no, line->mnemonic ? line->mnemonic : "");
+            for (size_t j = 0; j < line->operand_count; j++) {
+                asmopt_buffer_append(&buffer, line->operands[j]);
+                if (j + 1 < line->operand_count) {
+                    asmopt_buffer_append(&buffer, ", ");
+                }
+            }
+            asmopt_buffer_append(&buffer, "\n");
+        } else {
+            asmopt_buffer_appendf(&buffer, "%04zu: %s ", line->line_no, LINE_KIND_NAMES[line->insn.kind]);
+            asmopt_buffer_append(&buffer, line->text ? line->text : "");
+            asmopt_buffer_append(&buffer, "\n");
+        }
+    }
+    return asmopt_buffer_finish(&buffer);
+}
+
+static char* asmopt_dump_cfg_text_internal(asmopt_context* ctx) {
+    if (!ctx) {
+        return asmopt_strdup("CFG:\n");
+    }
+    asmopt_prepare_dump(ctx, true);
+    asmopt_buffer buffer = {0};
+    asmopt_buffer_append(&buffer, "CFG:\n");
+    for (size_t i = 0; i < ctx->cfg_block_count; i++) {
+        asmopt_cfg_block* block = &ctx->cfg_blocks[i];
+        asmopt_buffer_append(&buffer, block->name);
+        asmopt_buffer_append(&buffer, ":\n");
+        for (size_t j = 0; j < block->instruction_count; j++) {
+            asmopt_ir_line* line = block->instructions[j];
+            if (!line || !line->mnemonic) {
+                continue;
+            }
+            asmopt_buffer_append(&buffer, "  ");
+            asmopt_buffer_append(&buffer, line->mnemonic);
+            for (size_t k = 0; k < line->operand_count; k++) {
+                asmopt_buffer_append(&buffer, k == 0 ? " " : ", ");
+                asmopt_buffer_append(&buffer, line->operands[k]);
+            }
+            asmopt_buffer_append(&buffer, "\n");
+        }
+        /* Edges are listed per name, so every block sharing this name shows all of them. */
+        int id = asmopt_intern_find(&ctx->cfg_labels, asmopt_view_of(block->name));
+        size_t alias = id >= 0 ? ctx->cfg_label_blocks[id] : i;
+        for (; alias != ASMOPT_NO_BLOCK; alias = ctx->cfg_blocks[alias].same_name_next) {
+            const asmopt_cfg_block* source = &ctx->cfg_blocks[alias];
+            for (size_t e = source->succ_begin; e < source->succ_begin + source->succ_count; e++) {
+                asmopt_buffer_append(&buffer, "  -> ");
+                asmopt_buffer_append(&buffer, ctx->cfg_blocks[ctx->cfg_edges[e].target].name);
+                asmopt_buffer_append(&buffer, "\n");
+            }
+        }
+    }
+    return asmopt_buffer_finish(&buffer);
+}
+
+static char* asmopt_dump_cfg_dot_internal(asmopt_context* ctx) {
+    if (!ctx) {
+        return asmopt_strdup("digraph cfg {\n  node [shape=box];\n}\n");
+    }
+    asmopt_prepare_dump(ctx, true);
+    asmopt_buffer buffer = {0};
+    asmopt_buffer_append(&buffer, "digraph cfg {\n  node [shape=box];\n");
+    for (size_t i = 0; i < ctx->cfg_block_count; i++) {
+        asmopt_cfg_block* block = &ctx->cfg_blocks[i];
+        asmopt_buffer_append(&buffer, "  ");
+        asmopt_buffer_append(&buffer, block->name);
+        asmopt_buffer_append(&buffer, " [label=\"");
+        asmopt_buffer_append(&buffer, block->name);
+        asmopt_buffer_append(&buffer, ":\\l");
+        for (size_t j = 0; j < block->instruction_count; j++) {
+            asmopt_ir_line* line = block->instructions[j];
+            if (!line || !line->mnemonic) {
+                continue;
+            }
+            asmopt_buffer_append(&buffer, line->mnemonic);
+            for (size_t k = 0; k < line->operand_count; k++) {
+                asmopt_buffer_append(&buffer, k == 0 ? " " : ", ");
+                asmopt_buffer_append(&buffer, line->operands[k]);
+            }
+            asmopt_buffer_append(&buffer, "\\l");
+        }
+        asmopt_buffer_append(&buffer, "\"];\n");
+    }
+    for (size_t e = 0; e < ctx->cfg_edge_count; e++) {
+        asmopt_buffer_append(&buffer, "  ");
+        asmopt_buffer_append(&buffer, ctx->cfg_blocks[ctx->cfg_edges[e].source].name);
+        asmopt_buffer_append(&buffer, " -> ");
+        asmopt_buffer_append(&buffer, ctx->cfg_blocks[ctx->cfg_edges[e].target].name);
+        asmopt_buffer_append(&buffer, ";\n");
+    }
+    asmopt_buffer_append(&buffer, "}\n");
+    return asmopt_buffer_finish(&buffer);
+}
+
+asmopt_context* asmopt_create(const char* architecture) {
+    asmopt_context* ctx = calloc(1, sizeof(asmopt_context));
+    if (!ctx) {
+        return NULL;
+    }
+    ctx->architecture = asmopt_strdup(architecture ? architecture : "x86-64");
+    ctx->target_cpu = asmopt_strdup("generic");
+    ctx->cpu_model = &CPU_MODELS[0];
+    ctx->optimization_level = 2;
+    ctx->amd_optimizations = true;
+    ctx->operand_names.fold_case = true;
+    ctx->pattern_mask = ASMOPT_PATTERN_ALL;
+    ctx->scan_level = asmopt_cpu_scan_level();
+    ctx->abi = &ASMOPT_ABIS[0];
+    ctx->enabled_opts = NULL;
+    ctx->enabled_count = 0;
+    asmopt_add_name(&ctx->enabled_opts, &ctx->enabled_count, "peephole");
+    return ctx;
+}
+
+void asmopt_set_option(asmopt_context* ctx, const char* option, const char* value) {
+    asmopt_add_option(ctx, option, value);
+    if (ctx && option && strcmp(option, "profile") == 0) {
+        ctx->profiling = ASMOPT_ENABLE_PROFILE && value && strcmp(value, "1") == 0;
+    }
+    /* "simd": "0" forces the scalar scanners, "sse2" caps them at 16 bytes; output never changes. */
+    if (ctx && option && strcmp(option, "simd") == 0) {
+        asmopt_scan_level level = asmopt_cpu_scan_level();
+        if (value && strcmp(value, "0") == 0) {
+            level = ASMOPT_SCAN_SCALAR;
+        } else if (value && strcmp(value, "sse2") == 0 && level > ASMOPT_SCAN_SSE2) {
+            level = ASMOPT_SCAN_SSE2;
+        }
+        ctx->scan_level = level;
+    }
+    if (ctx && option && strcmp(option, "abi") == 0) {
+        size_t count = sizeof(ASMOPT_ABIS) / sizeof(ASMOPT_ABIS[0]);
+        ctx->abi = &ASMOPT_ABIS[count - 1];
+        for (size_t i = 0; value && i < count; i++) {
+            if (strcmp(value, ASMOPT_ABIS[i].name) == 0) {
+                ctx->abi = &ASMOPT_ABIS[i];
+            }
+        }
+    }
+}
+
+void asmopt_set_optimization_level(asmopt_context* ctx, int level) {
+    if (!ctx) {
+        return;
+    }
+    ctx->optimize_size = level == ASMOPT_LEVEL_SIZE;
+    if (ctx->optimize_size) {
+        level = 2;
+    }
+    if (level < 0) {
+        level = 0;
+    }
+    if (level > 4) {
+        level = 4;
+    }
+    ctx->optimization_level = level;
+}
+
+void asmopt_set_target_cpu(asmopt_context* ctx, const char* cpu) {
+    if (!ctx) {
+        return;
+    }
+    free(ctx->target_cpu);
+    ctx->target_cpu = asmopt_strdup(cpu ? cpu : "generic");
+}
+
+/* Take ownership of NUL-terminated input text and slice it into lines. */
+static void asmopt_adopt_text(asmopt_context* ctx, char* text, size_t length, size_t map_length) {
+    asmopt_reset_lines(ctx);
+    /* text is either new or the buffer reset_lines kept, which parse_string refilled. */
+    if (text != ctx->original_text) {
+        free(ctx->original_text);
+        ctx->text_capacity = map_length == 0 ? length + 1 : 0;
+        if (map_length == 0) {
+            ASMOPT_PROFILE_BYTES(ctx, length + 1);
+        }
+    }
+    ctx->original_text = text;
+    ctx->original_length = length;
+    ctx->original_map_length = map_length;
+    asmopt_split_lines(ctx);
+}
+
+/* Read a file or pipe to EOF in fixed-size chunks; works where fseek/ftell cannot. */
+static char* asmopt_read_stream(FILE* handle, size_t* length) {
+    size_t capacity = READ_CHUNK_SIZE;
+    size_t used = 0;
+    char* buffer = malloc(capacity + 1);
+    if (!buffer) {
+        return NULL;
+    }
+    for (;;) {
+        if (capacity - used < READ_CHUNK_SIZE) {
+            size_t next_capacity = capacity * 2;
+            char* next = realloc(buffer, next_capacity + 1);
+            if (!next) {
+                free(buffer);
+                return NULL;
+            }
+            buffer = next;
+            capacity = next_capacity;
+        }
+        size_t read = fread(buffer + used, 1, READ_CHUNK_SIZE, handle);
+        used += read;
+        if (read < READ_CHUNK_SIZE) {
+            break;
+        }
+    }
+    if (ferror(handle)) {
+        free(buffer);
+        return NULL;
+    }
+    buffer[used] = '\0';
+    /* Text stops at an embedded NUL, as with asmopt_parse_string. */
+    *length = strlen(buffer);
+    return buffer;
+}
+
+#if ASMOPT_HAVE_MMAP
+/*
+ * Map a regular file copy-on-write so lines are sliced in place without
+ * reading it into a heap buffer. The byte after the data must be addressable
+ * (zero-filled tail of the last page), so page-aligned sizes fall back to read.
+ */
+static int asmopt_map_file(asmopt_context* ctx, const char* filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat info;
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) || info.st_size <= 0 || page_size <= 0 ||
+        info.st_size % page_size == 0) {
+        close(fd);
+        return -1;
+    }
+    size_t size = (size_t)info.st_size;
+    char* text = mmap(NULL, size + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (text == MAP_FAILED) {
+        return -1;
+    }
+    const char* nul = memchr(text, '\0', size);
+    asmopt_adopt_text(ctx, text, nul ? (size_t)(nul - text) : size, size + 1);
+    return 0;
+}
+#endif
+
+int asmopt_parse_file(asmopt_context* ctx, const char* filename) {
+    if (!ctx || !filename) {
+        return -1;
+    }
+    bool from_stdin = strcmp(filename, "-") == 0;
+    double start = ASMOPT_PROFILING(ctx) ? asmopt_now() : 0.0;
+#if ASMOPT_HAVE_MMAP
+    if (!from_stdin && asmopt_map_file(ctx, filename) == 0) {
+        if (ASMOPT_PROFILING(ctx)) {
+            ctx->profile.parse_seconds = asmopt_now() - start;
+        }
+        return 0;
+    }
+#endif
+    FILE* handle = from_stdin ? stdin : fopen(filename, "rb");
+    if (!handle) {
+        return -1;
+    }
+    size_t length = 0;
+    char* text = asmopt_read_stream(handle, &length);
+    if (!from_stdin) {
+        fclose(handle);
+    }
+    if (!text) {
+        return -1;
+    }
+    asmopt_adopt_text(ctx, text, length, 0);
+    if (ASMOPT_PROFILING(ctx)) {
+        ctx->profile.parse_seconds = asmopt_now() - start;
+    }
+    return 0;
+}
+
+int asmopt_parse_string(asmopt_context* ctx, const char* assembly) {
+    if (!ctx || !assembly) {
+        return -1;
+    }
+    double start = ASMOPT_PROFILING(ctx) ? asmopt_now() : 0.0;
+    size_t length = strlen(assembly);
+    bool reuse = ctx->original_map_length == 0 && ctx->text_capacity > length;
+    char* text = reuse ? ctx->original_text : malloc(length + 1);
+    if (!text) {
+        asmopt_reset_lines(ctx);
+        return -1;
+    }
+    memcpy(text, assembly, length + 1);
+    asmopt_adopt_text(ctx, text, length, 0);
+    if (ASMOPT_PROFILING(ctx)) {
+        ctx->profile.parse_seconds = asmopt_now() - start;
+    }
+    return 0;
+}
+
+static bool asmopt_should_optimize(asmopt_context* ctx) {
+    if (!ctx) {
+        return false;
+    }
+    if (ctx->no_optimize || ctx->optimization_level == 0) {
+        return false;
+    }
+    if (asmopt_is_disabled(ctx, "peephole")) {
+        return false;
+    }
+    if (!asmopt_has_opt(ctx->enabled_opts, ctx->enabled_count, "peephole")) {
+        return false;
+    }
+    return true;
+}
+
+/* Record that optimized lines [first, optimized_count) came from input line source. */
+static void asmopt_worklist_note(asmopt_context* ctx, size_t first, size_t source, bool touched) {
+    asmopt_worklist* worklist = &ctx->worklist;
+    if (ctx->optimized_count + 1 > worklist->capacity) {
+        size_t new_capacity = worklist->capacity == 0 ? 16 : worklist->capacity;
+        while (new_capacity < ctx->optimized_count + 1) {
+            new_capacity *= 2;
+        }
+        size_t* sources = realloc(worklist->sources, sizeof(size_t) * new_capacity);
+        if (sources) {
+            worklist->sources = sources;
+        }
+        bool* flags = realloc(worklist->touched, sizeof(bool) * new_capacity);
+        if (flags) {
+            memset(flags + worklist->capacity, 0, sizeof(bool) * (new_capacity - worklist->capacity));
+            worklist->touched = flags;
+        }
+        if (!sources || !flags) {
+            /* Without bookkeeping the next pass cannot run; asmopt_optimize stops here. */
+            worklist->enabled = false;
+            return;
+        }
+        worklist->capacity = new_capacity;
+    }
+    for (size_t i = first; i < ctx->optimized_count; i++) {
+        worklist->sources[i] = source;
+    }
+    if (touched) {
+        size_t last = ctx->optimized_count > first ? ctx->optimized_count : first + 1;
+        for (size_t i = first; i < last; i++) {
+            worklist->touched[i] = true;
+        }
+    }
+}
+
+/* Run the peephole engine over lines [begin, end) of ctx, appending to its output.
+ * Returns the index after the last line consumed; a multi-line pattern may run past end. */
+static size_t asmopt_optimize_range(asmopt_context* ctx, size_t begin, size_t end, bool att) {
+    size_t i = begin;
+    /* constant_fold's block state; it only fires with liveness, so streaming skips the tracking. */
+    bool track = ctx->live_after && (ctx->pattern_mask & ASMOPT_PATTERN_BIT(ASMOPT_PATTERN_CONSTANT_FOLD));
+    ctx->consts.known = 0;
+    for (; i < end; i++) {
+        bool replaced = false;
+        bool removed = false;
+        size_t first = ctx->optimized_count;
+        if (ctx->worklist.visit && !ctx->worklist.visit[i]) {
+            ctx->skip_lines = 0;
+            ctx->consts.known = 0;
+            asmopt_store_optimized_line(ctx, ctx->original_lines[i]);
+        } else {
+            asmopt_peephole_line(ctx, i + 1, att, &replaced, &removed);
+        }
+        if (ctx->worklist.enabled) {
+            /* Anything but a one-line copy (hot-loop alignment adds a line) is retokenized next pass. */
+            bool touched = replaced || removed || ctx->optimized_count != first + 1;
+            asmopt_worklist_note(ctx, first, i, touched);
+        }
+        size_t skip_lines = ctx->skip_lines;
+        ctx->skip_lines = 0;
+        if (track) {
+            for (size_t j = i; j <= i + skip_lines && j < ctx->ir_count; j++) {
+                asmopt_const_step(&ctx->consts, &ctx->ir[j].insn);
+            }
+        }
+        if (replaced) {
+            ctx->stats.replacements += 1;
+        }
+        if (removed) {
+            ctx->stats.removals += 1;
+        }
+        if (skip_lines > 0) {
+            i += skip_lines;
+        }
+    }
+    return i;
+}
+
+#if ASMOPT_HAVE_THREADS
+static size_t asmopt_thread_count(asmopt_context* ctx) {
+    const char* value = asmopt_option_value(ctx, "threads");
+    if (!value) {
+        return 1;
+    }
+    char* end = NULL;
+    long threads = strtol(value, &end, 10);
+    if (end == value || threads < 1) {
+        return 1;
+    }
+    return threads > ASMOPT_MAX_THREADS ? ASMOPT_MAX_THREADS : (size_t)threads;
+}
+
+/*
+ * One unit of parallel work. Each chunk writes into a private shadow of the
+ * context (own output lines, events and line arena) that shares the read-only
+ * input, IR and settings, so workers never touch each other's state.
+ */
+typedef struct {
+    size_t begin;
+    size_t end;
+    asmopt_context shadow;
+} asmopt_chunk;
+
+typedef struct {
+    asmopt_chunk* chunks;
+    size_t chunk_count;
+    atomic_size_t next_chunk;
+    bool att;
+} asmopt_chunk_queue;
+
+static void* asmopt_chunk_worker(void* arg) {
+    asmopt_chunk_queue* queue = arg;
+    for (;;) {
+        size_t index = atomic_fetch_add(&queue->next_chunk, 1);
+        if (index >= queue->chunk_count) {
+            break;
+        }
+        asmopt_chunk* chunk = &queue->chunks[index];
+        asmopt_optimize_range(&chunk->shadow, chunk->begin, chunk->end, queue->att);
+    }
+    return NULL;
+}
+
+/*
+ * Patterns only ever consume instruction lines as lookahead, so the serial
+ * loop always visits every label/directive/blank line. Cutting chunks right
+ * before such a line therefore reproduces the serial result exactly.
+ */
+static size_t asmopt_split_chunks(asmopt_context* ctx, size_t threads, asmopt_chunk** out) {
+    size_t target = ctx->original_count / (threads * ASMOPT_CHUNKS_PER_THREAD);
+    if (target < ASMOPT_MIN_CHUNK_LINES) {
+        target = ASMOPT_MIN_CHUNK_LINES;
+    }
+    size_t capacity = ctx->original_count / target + 1;
+    asmopt_chunk* chunks = calloc(capacity, sizeof(asmopt_chunk));
+    if (!chunks) {
+        return 0;
+    }
+    size_t count = 0;
+    size_t begin = 0;
+    while (begin < ctx->original_count && count < capacity) {
+        size_t end = begin + target;
+        while (end < ctx->original_count && ctx->ir[end].insn.is_instruction) {
+            end++;
+        }
+        if (end > ctx->original_count || count + 1 == capacity) {
+            end = ctx->original_count;
+        }
+        chunks[count].begin = begin;
+        chunks[count].end = end;
+        count++;
+        begin = end;
+    }
+    *out = chunks;
+    return count;
+}
+
+static void asmopt_init_shadow(asmopt_context* ctx, asmopt_context* shadow) {
+    *shadow = *ctx;
+    shadow->optimized_lines = NULL;
+    shadow->optimized_count = 0;
+    shadow->optimized_capacity = 0;
+    shadow->line_arena.head = NULL;
+    shadow->opt_events = NULL;
+    shadow->opt_event_count = 0;
+    shadow->opt_event_capacity = 0;
+    shadow->skip_lines = 0;
+    shadow->stats.replacements = 0;
+    shadow->stats.removals = 0;
+    shadow->line_arena.allocated = 0;
+    memset(&shadow->profile, 0, sizeof(shadow->profile));
+    shadow->worklist.sources = NULL;
+    shadow->worklist.touched = NULL;
+    shadow->worklist.capacity = 0;
+}
+
+/* Append a finished chunk to ctx in line order and take over its arena blocks. */
+static void asmopt_merge_shadow(asmopt_context* ctx, asmopt_context* shadow) {
+    size_t offset = ctx->optimized_count;
+    for (size_t i = 0; i < shadow->optimized_count; i++) {
+        asmopt_store_optimized_line(ctx, shadow->optimized_lines[i]);
+    }
+    if (ctx->worklist.enabled) {
+        /* Chunks index the shared input, so sources carry over; touched marks OR in, including the
+         * mark a trailing removal left for the first line of the next chunk. */
+        asmopt_worklist_note(ctx, offset, 0, false);
+        if (!shadow->worklist.enabled) {
+            ctx->worklist.enabled = false;
+        }
+        for (size_t i = 0; ctx->worklist.enabled && i <= shadow->optimized_count; i++) {
+            if (i < shadow->optimized_count) {
+                ctx->worklist.sources[offset + i] = shadow->worklist.sources[i];
+            }
+            if (i < shadow->worklist.capacity && shadow->worklist.touched[i]) {
+                ctx->worklist.touched[offset + i] = true;
+            }
+        }
+    }
+    free(shadow->worklist.sources);
+    free(shadow->worklist.touched);
+    for (size_t i = 0; i < shadow->opt_event_count; i++) {
+        const asmopt_optimization_event* event = &shadow->opt_events[i];
+        asmopt_record_optimization(ctx, event->line_no, event->pattern_name, event->original, event->optimized);
+    }
+    ctx->stats.replacements += shadow->stats.replacements;
+    ctx->stats.removals += shadow->stats.removals;
+    ctx->line_arena.allocated += shadow->line_arena.allocated;
+    if (ASMOPT_PROFILING(ctx)) {
+        /* Worker time is summed over threads, like CPU time. */
+        ctx->profile.bytes_allocated += shadow->profile.bytes_allocated;
+        ctx->profile.lines_examined += shadow->profile.lines_examined;
+        ctx->profile.lookahead_seconds += shadow->profile.lookahead_seconds;
+        for (size_t i = 0; i < ASMOPT_PATTERN_COUNT; i++) {
+            ctx->profile.pattern_attempts[i] += shadow->profile.pattern_attempts[i];
+            ctx->profile.pattern_hits[i] += shadow->profile.pattern_hits[i];
+        }
+    }
+    asmopt_arena_block* tail = shadow->line_arena.head;
+    if (tail) {
+        while (tail->next) {
+            tail = tail->next;
+        }
+        tail->next = ctx->line_arena.head;
+        ctx->line_arena.head = shadow->line_arena.head;
+    }
+    free(shadow->optimized_lines);
+    free(shadow->opt_events);
+}
+
+static bool asmopt_optimize_parallel(asmopt_context* ctx, size_t threads, bool att) {
+    asmopt_chunk* chunks = NULL;
+    size_t chunk_count = asmopt_split_chunks(ctx, threads, &chunks);
+    if (chunk_count < 2) {
+        free(chunks);
+        return false;
+    }
+    asmopt_chunk_queue queue;
+    queue.chunks = chunks;
+    queue.chunk_count = chunk_count;
+    queue.att = att;
+    atomic_init(&queue.next_chunk, 0);
+    for (size_t i = 0; i < chunk_count; i++) {
+        asmopt_init_shadow(ctx, &chunks[i].shadow);
+    }
+    if (threads > chunk_count) {
+        threads = chunk_count;
+    }
+    pthread_t workers[ASMOPT_MAX_THREADS];
+    size_t started = 0;
+    for (size_t i = 1; i < threads; i++) {
+        if (pthread_create(&workers[started], NULL, asmopt_chunk_worker, &queue) != 0) {
+            break;
+        }
+        started++;
+    }
+    /* The calling thread drains the queue too, so a failed pthread_create only costs speed. */
+    asmopt_chunk_worker(&queue);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    for (size_t i = 0; i < chunk_count; i++) {
+        asmopt_merge_shadow(ctx, &chunks[i].shadow);
+    }
+    free(chunks);
+    return true;
+}
+#endif
+
+/*
+ * List scheduler. Runs over the optimized lines after the peephole passes and
+ * reorders runs of instructions that sit inside one basic block: labels,
+ * directives, blank lines, jumps and anything whose register, flag and memory
+ * effects are not fully understood end a run. Within a run a dependency DAG
+ * is built from def/use sets, and instructions are list-scheduled by critical
+ * path on the cost model's pipes with a 4-wide issue. The new order is kept
+ * only if an in-order issue estimate says it finishes in fewer cycles.
+ *
+ * A run that ends at a conditional jump keeps the flag producer feeding it
+ * last, so the pair stays macro-op fused, and sinks a fusible producer that
+ * nothing after it depends on down to the jump when that costs no cycles.
+ */
+typedef struct {
+    const char* line;
+    /* line_origins entry of the line, moved along with it. */
+    size_t origin;
+    asmopt_regset uses;
+    asmopt_regset defs;
+    bool load;
+    bool store;
+    unsigned latency;
+    unsigned busy;
+    uint16_t ports;
+    unsigned height;
+    /* The flags this node writes are read later in the run, or are still live at its end. */
+    bool flags_live;
+    /* ASMOPT_FUSE_* class as a flag producer. */
+    unsigned fusion;
+} asmopt_sched_node;
+
+/* inc/dec, which the peephole patterns emit, with or without an AT&T size suffix. */
+static bool asmopt_is_inc_dec(const asmopt_insn* insn) {
+    asmopt_view base = insn->mnemonic_text;
+    if (base.len == 4 && strchr("bwlq", tolower((unsigned char)base.ptr[3]))) {
+        base.len = 3;
+    }
+    return asmopt_view_is(base, "inc") || asmopt_view_is(base, "dec");
+}
+
+/* Memory operand addressed relative to rip. */
+static bool asmopt_is_rip_relative(const asmopt_operand* op) {
+    asmopt_view text = op->text;
+    for (size_t i = 0; op->kind == ASMOPT_OPERAND_MEM && i + 3 <= text.len; i++) {
+        bool starts = i == 0 || !isalnum((unsigned char)text.ptr[i - 1]);
+        bool ends = i + 3 == text.len || !isalnum((unsigned char)text.ptr[i + 3]);
+        if (starts && ends && asmopt_view_caseeq((asmopt_view){text.ptr + i, 3}, ASMOPT_VIEW_LIT("rip"))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Macro-op fusion class of a flag producer, 0 if it never fuses. cmp and test
+ * fuse unless they combine a memory operand with an immediate or address
+ * relative to rip; the other ALU ops only without a memory operand.
+ */
+static unsigned asmopt_fusion_class(const asmopt_insn* insn) {
+    if (!insn->is_instruction) {
+        return 0;
+    }
+    bool mem = false;
+    bool imm = false;
+    bool rip = false;
+    for (size_t i = 0; i < insn->operand_count && i < 2; i++) {
+        mem = mem || insn->ops[i].kind == ASMOPT_OPERAND_MEM;
+        imm = imm || insn->ops[i].kind == ASMOPT_OPERAND_IMM;
+        rip = rip || asmopt_is_rip_relative(&insn->ops[i]);
+    }
+    switch (insn->mnemonic) {
+    case ASMOPT_MN_CMP:
+    case ASMOPT_MN_TEST:
+        return (mem && imm) || rip ? 0 : ASMOPT_FUSE_CMP_TEST;
+    case ASMOPT_MN_ADD:
+    case ASMOPT_MN_SUB:
+    case ASMOPT_MN_AND:
+    case ASMOPT_MN_OR:
+    case ASMOPT_MN_XOR:
+        return mem ? 0 : ASMOPT_FUSE_ALU;
+    case ASMOPT_MN_OTHER:
+        return !mem && asmopt_is_inc_dec(insn) ? ASMOPT_FUSE_ALU : 0;
+    default:
+        return 0;
+    }
+}
+
+/* A producer of fusion_class directly before branch fuses with it on the target CPU. */
+static bool asmopt_fuses(const asmopt_context* ctx, unsigned fusion_class, const asmopt_insn* branch) {
+    /* jcxz/jecxz/jrcxz read rcx, not the flags. */
+    return (fusion_class & ctx->cpu_model->fusion) && branch->is_instruction && !branch->has_label &&
+           branch->mnemonic == ASMOPT_MN_JCC && !asmopt_view_contains(branch->mnemonic_text, 'x');
+}
+
+/* Describe one instruction for the DAG; false makes it a scheduling barrier. */
+static bool asmopt_sched_describe(const asmopt_context* ctx, const asmopt_insn* insn, asmopt_sched_node* node) {
+    memset(node, 0, sizeof(*node));
+    asmopt_effects effects;
+    /* The cost model only prices integer forms. */
+    if (!asmopt_insn_effects(insn, &effects) || ((effects.uses | effects.defs) & ASMOPT_REGSET_VECTORS)) {
+        return false;
+    }
+    const asmopt_operand* dest = asmopt_insn_dest(insn);
+    const asmopt_operand* src = asmopt_insn_src(insn);
+    asmopt_form form;
+    switch (insn->mnemonic) {
+    case ASMOPT_MN_MOV:
+        if (dest->kind == ASMOPT_OPERAND_MEM) {
+            form = ASMOPT_FORM_STORE;
+        } else if (src->kind == ASMOPT_OPERAND_MEM) {
+            form = ASMOPT_FORM_LOAD;
+        } else {
+            form = src->kind == ASMOPT_OPERAND_IMM ? ASMOPT_FORM_MOV_IMM : ASMOPT_FORM_MOV_REG;
+        }
+        break;
+    case ASMOPT_MN_LEA:
+        form = src->kind == ASMOPT_OPERAND_MEM ? asmopt_lea_form(&src->mem) : ASMOPT_FORM_LEA;
+        break;
+    case ASMOPT_MN_ADD:
+    case ASMOPT_MN_SUB:
+    case ASMOPT_MN_AND:
+    case ASMOPT_MN_OR:
+    case ASMOPT_MN_XOR:
+        if ((insn->mnemonic == ASMOPT_MN_XOR || insn->mnemonic == ASMOPT_MN_SUB) && asmopt_same_reg(dest, src)) {
+            form = ASMOPT_FORM_ZERO_IDIOM;
+        } else {
+            form = src->kind == ASMOPT_OPERAND_IMM ? ASMOPT_FORM_ALU_IMM : ASMOPT_FORM_ALU_REG;
+        }
+        break;
+    case ASMOPT_MN_CMP:
+    case ASMOPT_MN_TEST:
+        form = src->kind == ASMOPT_OPERAND_IMM ? ASMOPT_FORM_ALU_IMM : ASMOPT_FORM_TEST_REG;
+        break;
+    case ASMOPT_MN_SHL:
+    case ASMOPT_MN_SHR:
+    case ASMOPT_MN_SAL:
+    case ASMOPT_MN_SAR:
+        form = ASMOPT_FORM_SHIFT_IMM;
+        break;
+    case ASMOPT_MN_IMUL:
+        form = ASMOPT_FORM_IMUL_IMM;
+        break;
+    case ASMOPT_MN_BSF:
+        form = ASMOPT_FORM_BSF;
+        break;
+    case ASMOPT_MN_OTHER:
+        if (!asmopt_is_inc_dec(insn)) {
+            return false;
+        }
+        form = ASMOPT_FORM_INC_DEC;
+        break;
+    default:
+        return false;
+    }
+    node->uses = effects.uses;
+    node->defs = effects.defs;
+    node->load = effects.load;
+    node->store = effects.store;
+    const asmopt_form_cost* cost = &ctx->cpu_model->forms[form];
+    unsigned latency = cost->latency;
+    if (node->load && form != ASMOPT_FORM_LOAD) {
+        /* Folded load: the operation waits for the load's result. */
+        latency += ctx->cpu_model->forms[ASMOPT_FORM_LOAD].latency;
+    }
+    node->latency = (latency + 99) / 100;
+    node->busy = cost->rthroughput > 100 ? (cost->rthroughput + 99) / 100 : 1;
+    node->ports = cost->ports;
+    node->fusion = asmopt_fusion_class(insn);
+    return true;
+}
+
+static int asmopt_sched_edge(const asmopt_sched_node* first, const asmopt_sched_node* second) {
+    const asmopt_regset regs = ~ASMOPT_REGSET_FLAGS;
+    if ((first->defs & second->uses & regs) || (first->store && second->load)) {
+        return (int)first->latency;
+    }
+    if (first->defs & second->uses & ASMOPT_REGSET_FLAGS) {
+        return first->flags_live ? (int)first->latency : 0;
+    }
+    if ((first->uses & second->defs) || (first->defs & second->defs & regs) || (first->store && second->store) ||
+        (first->load && second->store)) {
+        return 0;
+    }
+    /*
+     * Two flag writes only need to stay ordered if one of them is read: a dead
+     * write may move anywhere between the surrounding live ones and their readers.
+     */
+    if ((first->defs & second->defs & ASMOPT_REGSET_FLAGS) && (first->flags_live || second->flags_live)) {
+        return 0;
+    }
+    return -1;
+}
+
+/* Issue nodes in the given order, never earlier than the one before; returns the cycle the last result is ready. */
+static unsigned asmopt_sched_estimate(const asmopt_sched_node* nodes, const int edges[][ASMOPT_SCHED_WINDOW],
+                                      const size_t* order, size_t count) {
+    unsigned pipe_free[ASMOPT_PIPE_COUNT] = {0};
+    unsigned issue[ASMOPT_SCHED_WINDOW] = {0};
+    unsigned cycle = 0;
+    unsigned issued = 0;
+    unsigned finish = 0;
+    for (size_t k = 0; k < count; k++) {
+        size_t i = order[k];
+        unsigned at = cycle;
+        for (size_t m = 0; m < k; m++) {
+            size_t p = order[m];
+            int latency = p < i ? edges[p][i] : edges[i][p];
+            if (latency >= 0 && issue[p] + (unsigned)latency > at) {
+                at = issue[p] + (unsigned)latency;
+            }
+        }
+        int pipe = -1;
+        for (;; at++) {
+            if (at == cycle && issued >= ASMOPT_SCHED_ISSUE_WIDTH) {
+                continue;
+            }
+            pipe = -1;
+            for (int b = 0; b < ASMOPT_PIPE_COUNT && nodes[i].ports; b++) {
+                if ((nodes[i].ports & (1u << b)) && pipe_free[b] <= at) {
+                    pipe = b;
+                    break;
+                }
+            }
+            if (!nodes[i].ports || pipe >= 0) {
+                break;
+            }
+        }
+        if (at > cycle) {
+            cycle = at;
+            issued = 0;
+        }
+        issued++;
+        issue[i] = at;
+        if (pipe >= 0) {
+            pipe_free[pipe] = at + nodes[i].busy;
+        }
+        if (at + nodes[i].latency > finish) {
+            finish = at + nodes[i].latency;
+        }
+    }
+    return finish > cycle ? finish : cycle + 1;
+}
+
+static void asmopt_record_schedule(asmopt_context* ctx, size_t first_line, size_t last_line, unsigned before,
+                                   unsigned after) {
+    if (ctx->streaming) {
+        return;
+    }
+    if (ctx->schedule_event_count >= ctx->schedule_event_capacity) {
+        size_t new_capacity = ctx->schedule_event_capacity == 0 ? 16 : ctx->schedule_event_capacity * 2;
+        asmopt_schedule_event* next = realloc(ctx->schedule_events, sizeof(asmopt_schedule_event) * new_capacity);
+        if (!next) {
+            return;
+        }
+        ctx->schedule_events = next;
+        ctx->schedule_event_capacity = new_capacity;
+        ASMOPT_PROFILE_BYTES(ctx, sizeof(asmopt_schedule_event) * new_capacity);
+    }
+    asmopt_schedule_event* event = &ctx->schedule_events[ctx->schedule_event_count++];
+    event->first_line = first_line;
+    event->last_line = last_line;
+    event->cycles_before = before;
+    event->cycles_after = after;
+}
+
+static void asmopt_record_fusion(asmopt_context* ctx, size_t line_no, const char* branch, bool fused) {
+    if (ctx->streaming || !branch) {
+        return;
+    }
+    if (ctx->fusion_event_count >= ctx->fusion_event_capacity) {
+        size_t new_capacity = ctx->fusion_event_capacity == 0 ? 16 : ctx->fusion_event_capacity * 2;
+        asmopt_fusion_event* next = realloc(ctx->fusion_events, sizeof(asmopt_fusion_event) * new_capacity);
+        if (!next) {
+            return;
+        }
+        ctx->fusion_events = next;
+        ctx->fusion_event_capacity = new_capacity;
+        ASMOPT_PROFILE_BYTES(ctx, sizeof(asmopt_fusion_event) * new_capacity);
+    }
+    asmopt_fusion_event* event = &ctx->fusion_events[ctx->fusion_event_count++];
+    event->line_no = line_no;
+    event->branch = branch;
+    event->fused = fused;
+}
+
+/* The conditional jump at IR index was fused with the instruction before it in the input. */
+static bool asmopt_input_fused(const asmopt_context* ctx, size_t index) {
+    for (size_t j = index; j-- > 0;) {
+        const asmopt_insn* previous = &ctx->ir[j].insn;
+        if (previous->kind != ASMOPT_LINE_BLANK) {
+            return asmopt_fuses(ctx, asmopt_fusion_class(previous), &ctx->ir[index].insn);
+        }
+    }
+    return false;
+}
+
+/*
+ * Schedule optimized_lines[first, first + count) in place if that is estimated
+ * to save cycles. branch is the conditional jump right after the run, or NULL.
+ * Returns the fusion class of the node the run now ends with.
+ */
+static unsigned asmopt_schedule_run(asmopt_context* ctx, asmopt_sched_node* nodes, size_t first, size_t count,
+                                    const asmopt_insn* branch) {
+    if (count < 2) {
+        return count == 1 ? nodes[0].fusion : 0;
+    }
+    int edges[ASMOPT_SCHED_WINDOW][ASMOPT_SCHED_WINDOW];
+    size_t pending[ASMOPT_SCHED_WINDOW] = {0};
+    /* Whatever follows the run may read the flags, so the last write is always live. */
+    bool flags_read = true;
+    size_t producer = count;
+    for (size_t k = count; k-- > 0;) {
+        if (nodes[k].defs & ASMOPT_REGSET_FLAGS) {
+            nodes[k].flags_live = flags_read;
+            flags_read = false;
+            producer = producer == count ? k : producer;
+        }
+        if (nodes[k].uses & ASMOPT_REGSET_FLAGS) {
+            flags_read = true;
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        for (size_t j = i + 1; j < count; j++) {
+            edges[i][j] = asmopt_sched_edge(&nodes[i], &nodes[j]);
+            if (edges[i][j] >= 0) {
+                pending[j]++;
+            }
+        }
+    }
+    /* The branch's flag producer is placed last, if nothing after it in the run depends on it. */
+    size_t pinned = count;
+    if (branch && producer < count && asmopt_fuses(ctx, nodes[producer].fusion, branch)) {
+        pinned = producer;
+        for (size_t j = producer + 1; j < count; j++) {
+            if (edges[producer][j] >= 0) {
+                pinned = count;
+                break;
+            }
+        }
+    }
+    /* Critical path height: the longest latency chain from a node to the end of the run. */
+    for (size_t k = count; k-- > 0;) {
+        unsigned height = nodes[k].latency;
+        for (size_t j = k + 1; j < count; j++) {
+            if (edges[k][j] >= 0 && (unsigned)edges[k][j] + nodes[j].height > height) {
+                height = (unsigned)edges[k][j] + nodes[j].height;
+            }
+        }
+        nodes[k].height = height;
+    }
+    size_t original[ASMOPT_SCHED_WINDOW];
+    size_t order[ASMOPT_SCHED_WINDOW];
+    unsigned ready_at[ASMOPT_SCHED_WINDOW] = {0};
+    bool placed[ASMOPT_SCHED_WINDOW] = {false};
+    for (size_t i = 0; i < count; i++) {
+        original[i] = i;
+    }
+    /* Top-down list scheduling: earliest possible start first, then the longest remaining path. */
+    for (size_t k = 0; k < count; k++) {
+        size_t best = count;
+        for (size_t i = 0; i < count; i++) {
+            if (placed[i] || pending[i] > 0 || (i == pinned && k + 1 < count)) {
+                continue;
+            }
+            if (best == count || ready_at[i] < ready_at[best] ||
+                (ready_at[i] == ready_at[best] && nodes[i].height > nodes[best].height)) {
+                best = i;
+            }
+        }
+        placed[best] = true;
+        order[k] = best;
+        for (size_t j = best + 1; j < count; j++) {
+            if (edges[best][j] >= 0) {
+                pending[j]--;
+                unsigned issue_bound = ready_at[best] + (unsigned)edges[best][j];
+                if (issue_bound > ready_at[j]) {
+                    ready_at[j] = issue_bound;
+                }
+            }
+        }
+    }
+    unsigned before = asmopt_sched_estimate(nodes, (const int (*)[ASMOPT_SCHED_WINDOW])edges, original, count);
+    unsigned after = asmopt_sched_estimate(nodes, (const int (*)[ASMOPT_SCHED_WINDOW])edges, order, count);
+    /* The estimate does not price the decode slot fusion saves; gaining it is worth a tie. */
+    bool gains_fusion = pinned + 1 < count;
+    if (after > before || (after == before && !gains_fusion)) {
+        if (!gains_fusion) {
+            return nodes[count - 1].fusion;
+        }
+        /* Sink just the producer. */
+        for (size_t i = 0, k = 0; i < count; i++) {
+            if (i != pinned) {
+                order[k++] = i;
+            }
+        }
+        order[count - 1] = pinned;
+        after = asmopt_sched_estimate(nodes, (const int (*)[ASMOPT_SCHED_WINDOW])edges, order, count);
+        if (after > before) {
+            return nodes[count - 1].fusion;
+        }
+    }
+    bool known = ctx->line_origin_count == ctx->optimized_count;
+    for (size_t k = 0; k < count; k++) {
+        ctx->optimized_lines[first + k] = (char*)nodes[order[k]].line;
+        if (known) {
+            ctx->line_origins[first + k] = nodes[order[k]].origin;
+        }
+    }
+    asmopt_record_schedule(ctx, first + 1, first + count, before, after);
+    return nodes[order[count - 1]].fusion;
+}
+
+/*
+ * Also counts the fused flag producer + jcc pairs of the input and of the
+ * output, recording each input jump whose fusion the output changed.
+ */
+static void asmopt_schedule_lines(asmopt_context* ctx, const char* syntax) {
+    asmopt_sched_node nodes[ASMOPT_SCHED_WINDOW];
+    size_t first = 0;
+    size_t count = 0;
+    bool keep_fused = !asmopt_is_disabled(ctx, "fusion");
+    /* Jumps if-conversion removed are neither kept nor lost. */
+    size_t converted = 0;
+    for (size_t j = 0; j < ctx->ir_count; j++) {
+        const asmopt_insn* insn = &ctx->ir[j].insn;
+        if (converted < ctx->if_convert_event_count && ctx->if_convert_events[converted].line_no == j + 1) {
+            converted++;
+            continue;
+        }
+        if (insn->is_instruction && insn->mnemonic == ASMOPT_MN_JCC && asmopt_input_fused(ctx, j)) {
+            ctx->fusion_pairs_before++;
+        }
+    }
+    /* Fusion class of the last instruction emitted so far; comments and blank lines keep it. */
+    unsigned tail = 0;
+    /* Lines the passes copied through are input lines; reuse their IR instead of re-tokenizing. */
+    bool known = ctx->line_origin_count == ctx->optimized_count;
+    for (size_t i = 0; i < ctx->optimized_count; i++) {
+        if (count == ASMOPT_SCHED_WINDOW) {
+            tail = asmopt_schedule_run(ctx, nodes, first, count, NULL);
+            count = 0;
+        }
+        const char* line = ctx->optimized_lines[i];
+        size_t input = known ? ctx->line_origins[i] : ctx->ir_count;
+        const asmopt_insn* insn = input < ctx->ir_count ? &ctx->ir[input].insn : NULL;
+        asmopt_insn scratch;
+        if (!insn) {
+            asmopt_tokenize_line(ctx, line, syntax, &scratch);
+            insn = &scratch;
+        }
+        if (asmopt_sched_describe(ctx, insn, &nodes[count])) {
+            if (count == 0) {
+                first = i;
+            }
+            nodes[count].line = line;
+            nodes[count++].origin = input;
+            continue;
+        }
+        if (count > 0) {
+            /* The jump the run leads to, looking past comment lines. */
+            const asmopt_insn* branch = insn;
+            asmopt_insn next;
+            for (size_t j = i + 1; branch->kind == ASMOPT_LINE_BLANK && j < ctx->optimized_count; j++) {
+                asmopt_tokenize_line(ctx, ctx->optimized_lines[j], syntax, &next);
+                branch = &next;
+            }
+            tail = asmopt_schedule_run(ctx, nodes, first, count, keep_fused ? branch : NULL);
+            count = 0;
+        }
+        if (insn->kind == ASMOPT_LINE_BLANK) {
+            continue;
+        }
+        if (insn->is_instruction && insn->mnemonic == ASMOPT_MN_JCC) {
+            bool fused = asmopt_fuses(ctx, tail, insn);
+            ctx->fusion_pairs_after += fused ? 1 : 0;
+            if (input < ctx->ir_count && asmopt_input_fused(ctx, input) != fused) {
+                asmopt_record_fusion(ctx, input + 1, asmopt_emit(ctx, &insn->code, 1), fused);
+            }
+        }
+        tail = asmopt_fusion_class(insn);
+    }
+    asmopt_schedule_run(ctx, nodes, first, count, NULL);
+}
+
+static void asmopt_record_if_convert(asmopt_context* ctx, size_t line_no, const char* branch, const char* select,
+                                     unsigned cycles, bool diamond) {
+    if (ctx->streaming || !branch || !select) {
+        return;
+    }
+    if (ctx->if_convert_event_count >= ctx->if_convert_event_capacity) {
+        size_t new_capacity = ctx->if_convert_event_capacity == 0 ? 16 : ctx->if_convert_event_capacity * 2;
+        asmopt_if_convert_event* next =
+            realloc(ctx->if_convert_events, sizeof(asmopt_if_convert_event) * new_capacity);
+        if (!next) {
+            return;
+        }
+        ctx->if_convert_events = next;
+        ctx->if_convert_event_capacity = new_capacity;
+        ASMOPT_PROFILE_BYTES(ctx, sizeof(asmopt_if_convert_event) * new_capacity);
+    }
+    asmopt_if_convert_event* event = &ctx->if_convert_events[ctx->if_convert_event_count++];
+    event->line_no = line_no;
+    event->branch = branch;
+    event->select = select;
+    event->cycles = cycles;
+    event->diamond = diamond;
+}
+
+/*
+ * If-conversion. A cmp/test + jcc that skips a short arm (a triangle) or
+ * picks one of two short arms that meet again (a diamond) becomes straight
+ * code: the arms compute into spare registers ahead of the cmp/test, and
+ * cmovcc, or setcc for a 0/1 result, picks the values after it. Arms hold
+ * at most ASMOPT_IF_CONVERT_MAX_ARM moves and ALU operations on 32/64-bit
+ * registers, nothing that touches memory or reads the flags. Spare registers
+ * are those dead after the jump in the liveness and unused by the arms. A
+ * conversion is kept when the latency of what it emits fits a quarter of the
+ * model's misprediction penalty.
+ */
+#define ASMOPT_IF_CONVERT_MAX_ARM 4
+#define ASMOPT_IF_CONVERT_MAX_LINES 64
+
+/* Where an arm left a register's value. */
+typedef enum {
+    ASMOPT_ARM_ORIGINAL,
+    /* The entry value of reg[r]. */
+    ASMOPT_ARM_COPY,
+    /* Computed into spare register reg[r]. */
+    ASMOPT_ARM_TEMP,
+    ASMOPT_ARM_CONST
+} asmopt_arm_kind;
+
+typedef struct {
+    asmopt_arm_kind kind[16];
+    signed char reg[16];
+    uint64_t value[16];
+} asmopt_arm_state;
+
+typedef struct {
+    asmopt_context* ctx;
+    /* The cmp/test without its comment. */
+    const asmopt_insn* layout;
+    bool att;
+    asmopt_regset spare;
+    /* Lines before the cmp/test, then after it. */
+    const char* hoisted[ASMOPT_IF_CONVERT_MAX_LINES];
+    size_t hoisted_count;
+    const char* selects[ASMOPT_IF_CONVERT_MAX_LINES];
+    size_t select_count;
+    bool after_flags;
+    unsigned latency;
+    bool failed;
+} asmopt_if_builder;
+
+static int asmopt_if_spare(asmopt_if_builder* builder) {
+    asmopt_regset free_regs = builder->spare & ASMOPT_REGSET_GPRS;
+    if (free_regs == 0) {
+        builder->failed = true;
+        return -1;
+    }
+    int reg = 0;
+    while (!(free_regs & ASMOPT_REGSET_BIT(reg))) {
+        reg++;
+    }
+    builder->spare &= ~ASMOPT_REGSET_BIT(reg);
+    return reg;
+}
+
+/* Emit "name first, second" (Intel order; second may be empty) and charge form's latency. */
+static void asmopt_if_emit(asmopt_if_builder* builder, const char* name, asmopt_view first, asmopt_view second,
+                           asmopt_form form) {
+    const char** lines = builder->after_flags ? builder->selects : builder->hoisted;
+    size_t* count = builder->after_flags ? &builder->select_count : &builder->hoisted_count;
+    if (builder->failed || *count == ASMOPT_IF_CONVERT_MAX_LINES) {
+        builder->failed = true;
+        return;
+    }
+    asmopt_view mnemonic = asmopt_view_of(name);
+    const char* line = second.len == 0 ? asmopt_emit_unary(builder->ctx, builder->layout, mnemonic, first)
+                       : builder->att  ? asmopt_emit_binary(builder->ctx, builder->layout, builder->layout,
+                                                            mnemonic, second, first)
+                                       : asmopt_emit_binary(builder->ctx, builder->layout, builder->layout,
+                                                            mnemonic, first, second);
+    if (!line) {
+        builder->failed = true;
+        return;
+    }
+    lines[(*count)++] = line;
+    builder->latency += builder->ctx->cpu_model->forms[form].latency;
+}
+
+/* mov reg, value at the narrowest width that holds it. */
+static void asmopt_if_load_const(asmopt_if_builder* builder, int reg, uint64_t value) {
+    char name[8];
+    char text[32];
+    unsigned width = value <= UINT32_MAX ? 32 : 64;
+    if (width == 32) {
+        snprintf(text, sizeof(text), "%s%lu", builder->att ? "$" : "", (unsigned long)value);
+    } else {
+        snprintf(text, sizeof(text), "%s%lld", builder->att ? "$" : "", (long long)(int64_t)value);
+    }
+    asmopt_if_emit(builder, builder->att && width == 64 ? "movq" : "mov",
+                   asmopt_gpr_name(name, sizeof(name), reg, width, builder->att), asmopt_view_of(text),
+                   ASMOPT_FORM_MOV_IMM);
+}
+
+/* Register holding reg's current value in the arm; constants are loaded into a spare one first. */
+static int asmopt_if_read(asmopt_if_builder* builder, asmopt_arm_state* state, int reg) {
+    switch (state->kind[reg]) {
+    case ASMOPT_ARM_ORIGINAL:
+        return reg;
+    case ASMOPT_ARM_CONST: {
+        int temp = asmopt_if_spare(builder);
+        if (temp < 0) {
+            return reg;
+        }
+        asmopt_if_load_const(builder, temp, state->value[reg]);
+        state->kind[reg] = ASMOPT_ARM_TEMP;
+        state->reg[reg] = (signed char)temp;
+        return temp;
+    }
+    default:
+        return state->reg[reg];
+    }
+}
+
+/* Spare register that reg's arm value is computed in, holding its current value. */
+static int asmopt_if_own(asmopt_if_builder* builder, asmopt_arm_state* state, int reg) {
+    int current = asmopt_if_read(builder, state, reg);
+    if (state->kind[reg] == ASMOPT_ARM_TEMP) {
+        return current;
+    }
+    int temp = asmopt_if_spare(builder);
+    if (temp < 0) {
+        return reg;
+    }
+    char name[8];
+    char source[8];
+    asmopt_if_emit(builder, "mov", asmopt_gpr_name(name, sizeof(name), temp, 64, builder->att),
+                   asmopt_gpr_name(source, sizeof(source), current, 64, builder->att), ASMOPT_FORM_MOV_REG);
+    state->kind[reg] = ASMOPT_ARM_TEMP;
+    state->reg[reg] = (signed char)temp;
+    return temp;
+}
+
+/* A 32/64-bit general-purpose register operand. */
+static bool asmopt_if_gpr(const asmopt_operand* op) {
+    return op->kind == ASMOPT_OPERAND_REG && op->reg_class >= 0 && op->reg_class < 16 &&
+           (op->reg_width == 32 || op->reg_width == 64);
+}
+
+/* Rewrite one arm instruction to write spare registers only; false if it cannot be. */
+static bool asmopt_if_arm_insn(asmopt_if_builder* builder, asmopt_arm_state* state, const asmopt_insn* insn) {
+    asmopt_effects effects;
+    if (!insn->is_instruction || insn->has_label || !insn->two_operands || insn->operand_count != 2 ||
+        !asmopt_insn_effects(insn, &effects) || effects.load || effects.store ||
+        (effects.uses & ASMOPT_REGSET_FLAGS)) {
+        return false;
+    }
+    const asmopt_operand* dest = asmopt_insn_dest(insn);
+    const asmopt_operand* src = asmopt_insn_src(insn);
+    if (!asmopt_if_gpr(dest) || dest->reg_class == ASMOPT_REG_RSP) {
+        return false;
+    }
+    int reg = dest->reg_class;
+    unsigned width = dest->reg_width;
+    bool imm = src->kind == ASMOPT_OPERAND_IMM && src->has_imm && src->imm != LONG_MAX && src->imm != LONG_MIN;
+    bool gpr = asmopt_if_gpr(src) && src->reg_width == width;
+    char name[8];
+    char source[8];
+    char address[64];
+    asmopt_form form = gpr ? ASMOPT_FORM_ALU_REG : ASMOPT_FORM_ALU_IMM;
+    switch (insn->mnemonic) {
+    case ASMOPT_MN_MOV:
+        if (imm) {
+            state->kind[reg] = ASMOPT_ARM_CONST;
+            state->value[reg] = width == 32 ? (uint32_t)src->imm : (uint64_t)src->imm;
+            return true;
+        }
+        if (!gpr) {
+            return false;
+        }
+        if (width == 64 && state->kind[src->reg_class] != ASMOPT_ARM_TEMP &&
+            state->kind[src->reg_class] != ASMOPT_ARM_CONST) {
+            /* A 64-bit copy of an entry value costs nothing until a select needs it. */
+            int entry = asmopt_if_read(builder, state, src->reg_class);
+            state->kind[reg] = entry == reg ? ASMOPT_ARM_ORIGINAL : ASMOPT_ARM_COPY;
+            state->reg[reg] = (signed char)entry;
+            return true;
+        }
+        {
+            int from = asmopt_if_read(builder, state, src->reg_class);
+            int temp = state->kind[reg] == ASMOPT_ARM_TEMP ? state->reg[reg] : asmopt_if_spare(builder);
+            if (temp < 0) {
+                return false;
+            }
+            asmopt_if_emit(builder, "mov", asmopt_gpr_name(name, sizeof(name), temp, width, builder->att),
+                           asmopt_gpr_name(source, sizeof(source), from, width, builder->att), ASMOPT_FORM_MOV_REG);
+            state->kind[reg] = ASMOPT_ARM_TEMP;
+            state->reg[reg] = (signed char)temp;
+        }
+        return !builder->failed;
+    case ASMOPT_MN_LEA: {
+        const asmopt_address* mem = &src->mem;
+        if (src->kind != ASMOPT_OPERAND_MEM || !mem->simple || mem->base >= 16 || mem->index >= 16 ||
+            (mem->base >= 0 && mem->base_width != 64) || mem->base == ASMOPT_REG_RSP) {
+            return false;
+        }
+        int base = mem->base >= 0 ? asmopt_if_read(builder, state, mem->base) : -1;
+        int index = mem->index >= 0 ? asmopt_if_read(builder, state, mem->index) : -1;
+        int temp = state->kind[reg] == ASMOPT_ARM_TEMP ? state->reg[reg] : asmopt_if_spare(builder);
+        if (temp < 0) {
+            return false;
+        }
+        asmopt_view text = asmopt_format_address(address, sizeof(address), builder->att, base, index, mem->scale,
+                                                 mem->disp);
+        asmopt_if_emit(builder, "lea", asmopt_gpr_name(name, sizeof(name), temp, width, builder->att), text,
+                       asmopt_lea_form(mem));
+        state->kind[reg] = ASMOPT_ARM_TEMP;
+        state->reg[reg] = (signed char)temp;
+        return !builder->failed;
+    }
+    case ASMOPT_MN_XOR:
+    case ASMOPT_MN_SUB:
+        if (asmopt_same_reg(dest, src)) {
+            state->kind[reg] = ASMOPT_ARM_CONST;
+            state->value[reg] = 0;
+            return true;
+        }
+        break;
+    case ASMOPT_MN_ADD:
+    case ASMOPT_MN_AND:
+    case ASMOPT_MN_OR:
+        break;
+    case ASMOPT_MN_SHL:
+    case ASMOPT_MN_SHR:
+    case ASMOPT_MN_SAL:
+    case ASMOPT_MN_SAR:
+        if (!imm) {
+            return false;
+        }
+        form = ASMOPT_FORM_SHIFT_IMM;
+        break;
+    case ASMOPT_MN_IMUL:
+        form = ASMOPT_FORM_IMUL_IMM;
+        break;
+    default:
+        return false;
+    }
+    if (!imm && !gpr) {
+        return false;
+    }
+    asmopt_view operand = src->text;
+    if (gpr) {
+        operand = asmopt_gpr_name(source, sizeof(source), asmopt_if_read(builder, state, src->reg_class), width,
+                                  builder->att);
+    }
+    int temp = asmopt_if_own(builder, state, reg);
+    char mnemonic[16];
+    asmopt_view_copy(insn->mnemonic_text, mnemonic, sizeof(mnemonic));
+    asmopt_if_emit(builder, mnemonic, asmopt_gpr_name(name, sizeof(name), temp, width, builder->att), operand, form);
+    return !builder->failed;
+}
+
+/* Add name to a "/"-separated list unless it is already there. */
+static void asmopt_if_note(char* list, size_t size, const char* name) {
+    size_t len = strlen(name);
+    for (const char* at = list; *at; at += strcspn(at, "/") + (at[strcspn(at, "/")] == '/')) {
+        if (strcspn(at, "/") == len && strncmp(at, name, len) == 0) {
+            return;
+        }
+    }
+    size_t used = strlen(list);
+    snprintf(list + used, size - used, "%s%s", used > 0 ? "/" : "", name);
+}
+
+/* Selects for every register an arm wrote; cc is the condition under which taken's values win. */
+static void asmopt_if_select(asmopt_if_builder* builder, asmopt_arm_state* fall, asmopt_arm_state* taken,
+                             const char* cc, const char* not_cc, char* summary, size_t summary_size) {
+    asmopt_regset written = 0;
+    for (int reg = 0; reg < 16; reg++) {
+        if (fall->kind[reg] != ASMOPT_ARM_ORIGINAL || taken->kind[reg] != ASMOPT_ARM_ORIGINAL) {
+            written |= ASMOPT_REGSET_BIT(reg);
+        }
+    }
+    /* A copy of a register that is itself selected must be taken before the select overwrites it. */
+    asmopt_arm_state* arms[2] = {fall, taken};
+    for (size_t a = 0; a < 2; a++) {
+        for (int reg = 0; reg < 16; reg++) {
+            if (arms[a]->kind[reg] == ASMOPT_ARM_COPY && (written & ASMOPT_REGSET_BIT(arms[a]->reg[reg]))) {
+                asmopt_if_own(builder, arms[a], reg);
+            }
+        }
+    }
+    builder->after_flags = true;
+    summary[0] = '\0';
+    for (int reg = 0; reg < 16 && !builder->failed; reg++) {
+        if (!(written & ASMOPT_REGSET_BIT(reg))) {
+            continue;
+        }
+        char name[8];
+        char source[8];
+        /* "cmov" and a condition cut from a 16-byte jump mnemonic. */
+        char mnemonic[20];
+        asmopt_arm_kind f = fall->kind[reg];
+        asmopt_arm_kind t = taken->kind[reg];
+        if (f == ASMOPT_ARM_CONST && t == ASMOPT_ARM_CONST && fall->value[reg] == taken->value[reg]) {
+            asmopt_if_load_const(builder, reg, fall->value[reg]);
+            continue;
+        }
+        if (f == ASMOPT_ARM_CONST && t == ASMOPT_ARM_CONST && fall->value[reg] + taken->value[reg] == 1) {
+            snprintf(mnemonic, sizeof(mnemonic), "set%s", taken->value[reg] == 1 ? cc : not_cc);
+            asmopt_if_emit(builder, mnemonic, asmopt_gpr_name(name, sizeof(name), reg, 8, builder->att),
+                           (asmopt_view){NULL, 0}, ASMOPT_FORM_SETCC);
+            asmopt_if_emit(builder, builder->att ? "movzbl" : "movzx",
+                           asmopt_gpr_name(source, sizeof(source), reg, 32, builder->att),
+                           asmopt_gpr_name(name, sizeof(name), reg, 8, builder->att), ASMOPT_FORM_ALU_REG);
+        } else if (f == ASMOPT_ARM_ORIGINAL || t == ASMOPT_ARM_ORIGINAL) {
+            bool use_taken = f == ASMOPT_ARM_ORIGINAL;
+            int from = asmopt_if_read(builder, use_taken ? taken : fall, reg);
+            snprintf(mnemonic, sizeof(mnemonic), "cmov%s", use_taken ? cc : not_cc);
+            asmopt_if_emit(builder, mnemonic, asmopt_gpr_name(name, sizeof(name), reg, 64, builder->att),
+                           asmopt_gpr_name(source, sizeof(source), from, 64, builder->att), ASMOPT_FORM_CMOV);
+        } else {
+            int first = asmopt_if_read(builder, fall, reg);
+            int second = asmopt_if_read(builder, taken, reg);
+            snprintf(mnemonic, sizeof(mnemonic), "cmov%s", cc);
+            asmopt_if_emit(builder, "mov", asmopt_gpr_name(name, sizeof(name), reg, 64, builder->att),
+                           asmopt_gpr_name(source, sizeof(source), first, 64, builder->att), ASMOPT_FORM_MOV_REG);
+            asmopt_if_emit(builder, mnemonic, asmopt_gpr_name(name, sizeof(name), reg, 64, builder->att),
+                           asmopt_gpr_name(source, sizeof(source), second, 64, builder->att), ASMOPT_FORM_CMOV);
+        }
+        asmopt_if_note(summary, summary_size, mnemonic);
+    }
+}
+
+/* label's block is entered only by the jump on input line jump_line (1-based). */
+static bool asmopt_if_single_entry(const asmopt_context* ctx, asmopt_view label, size_t jump_line) {
+    int id = asmopt_intern_find(&ctx->cfg_labels, label);
+    if (id < 0) {
+        return false;
+    }
+    const asmopt_cfg_block* block = &ctx->cfg_blocks[ctx->cfg_label_blocks[id]];
+    if (block->same_name_next != ASMOPT_NO_BLOCK || block->pred_count != 1) {
+        return false;
+    }
+    const asmopt_cfg_edge* edge = &ctx->cfg_edges[ctx->cfg_pred_edges[block->pred_begin]];
+    const asmopt_cfg_block* source = &ctx->cfg_blocks[edge->source];
+    return source->instruction_count > 0 &&
+           source->instructions[source->instruction_count - 1]->line_no == jump_line;
+}
+
+/*
+ * A copy of line_origins, which the passes that rebuild the output rewrite as
+ * they go; every line counts as written when they are unknown. NULL if out of
+ * memory.
+ */
+static size_t* asmopt_line_origins(const asmopt_context* ctx) {
+    size_t* origins = malloc(sizeof(size_t) * (ctx->optimized_count + 1));
+    if (!origins) {
+        return NULL;
+    }
+    bool known = ctx->line_origin_count == ctx->optimized_count;
+    for (size_t i = 0; i < ctx->optimized_count; i++) {
+        origins[i] = known ? ctx->line_origins[i] : ctx->ir_count;
+    }
+    return origins;
+}
+
+/* Optimized line i tokenized: the input's IR when the passes copied the line through. */
+static const asmopt_insn* asmopt_if_line(asmopt_context* ctx, char** lines, const size_t* origins, size_t i,
+                                         const char* syntax, asmopt_insn* scratch) {
+    if (origins[i] < ctx->ir_count) {
+        return &ctx->ir[origins[i]].insn;
+    }
+    asmopt_tokenize_line(ctx, lines[i], syntax, scratch);
+    return scratch;
+}
+
+/* A line an arm may consist of: an unlabelled instruction that does not leave the arm. */
+static bool asmopt_if_arm_line(const asmopt_insn* insn) {
+    return insn->kind == ASMOPT_LINE_INSTRUCTION && insn->is_instruction && !insn->has_label &&
+           insn->mnemonic != ASMOPT_MN_JMP && insn->mnemonic != ASMOPT_MN_JCC && insn->mnemonic != ASMOPT_MN_RET;
+}
+
+/*
+ * The cmp/test leaves the flags at the join now, so what the arms left must
+ * not be read there. Labels carry no liveness of their own; the input line
+ * falling into the join label at IR index join has it.
+ */
+static bool asmopt_if_flags_dead_at(const asmopt_context* ctx, size_t join) {
+    if (join == 0 || join >= ctx->ir_count) {
+        return false;
+    }
+    const asmopt_insn* before = &ctx->ir[join - 1].insn;
+    return before->kind == ASMOPT_LINE_INSTRUCTION && before->mnemonic != ASMOPT_MN_JMP &&
+           before->mnemonic != ASMOPT_MN_JCC && before->mnemonic != ASMOPT_MN_RET &&
+           asmopt_regs_dead_after(ctx, join, ASMOPT_REGSET_FLAGS);
+}
+
+/* Region of an if-conversion, as optimized line indices. */
+typedef struct {
+    size_t flags;
+    size_t fall_first;
+    size_t fall_count;
+    size_t taken_first;
+    size_t taken_count;
+    /* The label both arms reach; it stays. */
+    size_t join;
+    bool diamond;
+} asmopt_if_region;
+
+/*
+ * Match the region starting at the cmp/test on line i: a triangle
+ *   cmp; jcc T; <fall arm>; T:
+ * or a diamond
+ *   cmp; jcc T; <fall arm>; jmp J; T: <taken arm>; J:
+ * where nothing but the jcc enters T.
+ */
+static bool asmopt_if_match(asmopt_context* ctx, char** lines, const size_t* origins, size_t count, size_t i,
+                            const char* syntax, asmopt_insn* scratch, const asmopt_insn** insns,
+                            asmopt_if_region* region) {
+    size_t limit = count - i < 2 * ASMOPT_IF_CONVERT_MAX_ARM + 5 ? count - i : 2 * ASMOPT_IF_CONVERT_MAX_ARM + 5;
+    if (limit < 4 || origins[i + 1] >= ctx->ir_count) {
+        return false;
+    }
+    const asmopt_insn* jcc = &ctx->ir[origins[i + 1]].insn;
+    if (jcc->mnemonic != ASMOPT_MN_JCC || jcc->has_label || !asmopt_is_single_target(jcc) ||
+        !asmopt_is_label_view(jcc->operands_trimmed)) {
+        return false;
+    }
+    insns[0] = asmopt_if_line(ctx, lines, origins, i, syntax, &scratch[0]);
+    insns[1] = jcc;
+    asmopt_effects effects;
+    const asmopt_insn* flags = insns[0];
+    if (!flags->is_instruction || flags->has_label ||
+        (flags->mnemonic != ASMOPT_MN_CMP && flags->mnemonic != ASMOPT_MN_TEST) ||
+        !asmopt_insn_effects(flags, &effects) || effects.defs != ASMOPT_REGSET_FLAGS || effects.store) {
+        return false;
+    }
+    asmopt_view target = jcc->operands_trimmed;
+    size_t k = 2;
+    for (; k < limit && k - 2 < ASMOPT_IF_CONVERT_MAX_ARM; k++) {
+        insns[k] = asmopt_if_line(ctx, lines, origins, i + k, syntax, &scratch[k]);
+        if (!asmopt_if_arm_line(insns[k])) {
+            break;
+        }
+    }
+    if (k == 2 || k >= limit) {
+        return false;
+    }
+    insns[k] = asmopt_if_line(ctx, lines, origins, i + k, syntax, &scratch[k]);
+    region->flags = i;
+    region->fall_first = i + 2;
+    region->fall_count = k - 2;
+    region->taken_first = 0;
+    region->taken_count = 0;
+    if (insns[k]->has_label && asmopt_view_equal(insns[k]->label, target)) {
+        region->join = i + k;
+        region->diamond = false;
+        return true;
+    }
+    const asmopt_insn* jump = insns[k];
+    if (k + 3 >= limit || jump->kind != ASMOPT_LINE_INSTRUCTION || jump->mnemonic != ASMOPT_MN_JMP ||
+        jump->has_label || !asmopt_is_single_target(jump) || !asmopt_is_label_view(jump->operands_trimmed)) {
+        return false;
+    }
+    insns[k + 1] = asmopt_if_line(ctx, lines, origins, i + k + 1, syntax, &scratch[k + 1]);
+    if (insns[k + 1]->kind != ASMOPT_LINE_LABEL || !asmopt_view_equal(insns[k + 1]->label, target) ||
+        !asmopt_if_single_entry(ctx, target, origins[i + 1] + 1)) {
+        return false;
+    }
+    size_t first = k + 2;
+    size_t j = first;
+    for (; j < limit && j - first < ASMOPT_IF_CONVERT_MAX_ARM; j++) {
+        insns[j] = asmopt_if_line(ctx, lines, origins, i + j, syntax, &scratch[j]);
+        if (!asmopt_if_arm_line(insns[j])) {
+            break;
+        }
+    }
+    if (j == first || j >= limit) {
+        return false;
+    }
+    insns[j] = asmopt_if_line(ctx, lines, origins, i + j, syntax, &scratch[j]);
+    if (!insns[j]->has_label || !asmopt_view_equal(insns[j]->label, jump->operands_trimmed)) {
+        return false;
+    }
+    region->taken_first = i + first;
+    region->taken_count = j - first;
+    region->join = i + j;
+    region->diamond = true;
+    return true;
+}
+
+static void asmopt_if_convert(asmopt_context* ctx, const char* syntax) {
+    size_t count = ctx->optimized_count;
+    if (count < 4 || !ctx->live_after || !ctx->cfg_pred_edges || ctx->ir_count != ctx->original_count) {
+        return;
+    }
+    char** lines = ctx->optimized_lines;
+    size_t* origins = asmopt_line_origins(ctx);
+    if (!origins) {
+        return;
+    }
+    bool att = syntax && strcmp(syntax, "att") == 0;
+    unsigned budget = ctx->cpu_model->branch_miss * 100 / 4;
+    asmopt_insn scratch[2 * ASMOPT_IF_CONVERT_MAX_ARM + 5];
+    const asmopt_insn* insns[2 * ASMOPT_IF_CONVERT_MAX_ARM + 5];
+    /* Output is rebuilt from the first conversion on; copied is how much of lines it holds. */
+    bool rebuilding = false;
+    size_t copied = 0;
+    for (size_t i = 0; i + 3 < count; i++) {
+        asmopt_if_region region;
+        if (!asmopt_if_match(ctx, lines, origins, count, i, syntax, scratch, insns, &region)) {
+            continue;
+        }
+        asmopt_regset used = 0;
+        bool writes_flags = false;
+        size_t last = region.join - i;
+        for (size_t k = 0; k < last; k++) {
+            asmopt_effects effects;
+            if (insns[k]->kind == ASMOPT_LINE_INSTRUCTION && asmopt_insn_effects(insns[k], &effects)) {
+                used |= effects.uses | effects.defs;
+                writes_flags |= k >= 2 && (effects.defs & ASMOPT_REGSET_FLAGS);
+            }
+        }
+        size_t live = 0;
+        if (!asmopt_live_index(ctx, origins[i + 1] + 1, &live) ||
+            (writes_flags && !asmopt_if_flags_dead_at(ctx, origins[region.join]))) {
+            continue;
+        }
+        asmopt_insn layout = *insns[0];
+        layout.comment.len = 0;
+        asmopt_if_builder builder;
+        memset(&builder, 0, sizeof(builder));
+        builder.ctx = ctx;
+        builder.layout = &layout;
+        builder.att = att;
+        /* Temporaries must be dead under the abi option: with "none" nothing is free at a ret. */
+        builder.spare = ASMOPT_REGSET_GPRS & ~ctx->live_after[live] & ~used & ~ASMOPT_REGSET_BIT(ASMOPT_REG_RSP);
+        asmopt_arm_state fall;
+        asmopt_arm_state taken;
+        memset(&fall, 0, sizeof(fall));
+        memset(&taken, 0, sizeof(taken));
+        bool ok = true;
+        for (size_t k = 0; ok && k < region.fall_count; k++) {
+            ok = asmopt_if_arm_insn(&builder, &fall, insns[region.fall_first - i + k]);
+        }
+        for (size_t k = 0; ok && k < region.taken_count; k++) {
+            ok = asmopt_if_arm_insn(&builder, &taken, insns[region.taken_first - i + k]);
+        }
+        char jump[16];
+        char inverted[16];
+        char summary[64];
+        asmopt_view_copy(insns[1]->mnemonic_text, jump, sizeof(jump));
+        if (!ok || !asmopt_invert_conditional_jump(jump, inverted, sizeof(inverted))) {
+            continue;
+        }
+        asmopt_if_select(&builder, &fall, &taken, jump + 1, inverted + 1, summary, sizeof(summary));
+        if (builder.failed || summary[0] == '\0' || builder.latency > budget) {
+            continue;
+        }
+        if (!rebuilding) {
+            ctx->optimized_lines = NULL;
+            ctx->optimized_count = 0;
+            ctx->optimized_capacity = 0;
+            ctx->line_origin_count = 0;
+            rebuilding = true;
+        }
+        for (; copied < i; copied++) {
+            asmopt_store_optimized_line(ctx, lines[copied]);
+            asmopt_trace_line_origin(ctx, origins[copied]);
+        }
+        for (size_t k = 0; k < builder.hoisted_count; k++) {
+            asmopt_store_optimized_line(ctx, builder.hoisted[k]);
+            asmopt_trace_line_origin(ctx, ctx->ir_count);
+        }
+        asmopt_store_optimized_line(ctx, lines[i]);
+        asmopt_trace_line_origin(ctx, origins[i]);
+        for (size_t k = 0; k < builder.select_count; k++) {
+            asmopt_store_optimized_line(ctx, builder.selects[k]);
+            asmopt_trace_line_origin(ctx, ctx->ir_count);
+        }
+        for (size_t k = 1; k < last; k++) {
+            asmopt_store_comment_line(ctx, insns[k]);
+            asmopt_trace_line_origin(ctx, ctx->ir_count);
+        }
+        asmopt_view summary_view = asmopt_view_of(summary);
+        asmopt_record_if_convert(ctx, origins[i + 1] + 1, asmopt_emit(ctx, &insns[1]->code, 1),
+                                 asmopt_emit(ctx, &summary_view, 1), (builder.latency + 99) / 100, region.diamond);
+        copied = region.join;
+        i = region.join - 1;
+    }
+    if (rebuilding) {
+        for (; copied < count; copied++) {
+            asmopt_store_optimized_line(ctx, lines[copied]);
+            asmopt_trace_line_origin(ctx, origins[copied]);
+        }
+        free(lines);
+    }
+    free(origins);
+}
+
+static void asmopt_record_loop_opt(asmopt_context* ctx, size_t line_no, const char* label, const char* before,
+                                   const char* after) {
+    if (ctx->streaming || !label || !before) {
+        return;
+    }
+    if (ctx->loop_opt_event_count >= ctx->loop_opt_event_capacity) {
+        size_t new_capacity = ctx->loop_opt_event_capacity == 0 ? 16 : ctx->loop_opt_event_capacity * 2;
+        asmopt_loop_opt_event* next = realloc(ctx->loop_opt_events, sizeof(asmopt_loop_opt_event) * new_capacity);
+        if (!next) {
+            return;
+        }
+        ctx->loop_opt_events = next;
+        ctx->loop_opt_event_capacity = new_capacity;
+        ASMOPT_PROFILE_BYTES(ctx, sizeof(asmopt_loop_opt_event) * new_capacity);
+    }
+    asmopt_loop_opt_event* event = &ctx->loop_opt_events[ctx->loop_opt_event_count++];
+    event->line_no = line_no;
+    event->label = label;
+    event->before = before;
+    event->after = after;
+}
+
+/*
+ * Loop optimizations, on loops of one block: a label entered only by falling
+ * into it and by a conditional jump back to it that ends the block. Liveness
+ * inside the body is recomputed on the optimized lines, starting from the
+ * input liveness after that jump, which covers both the exit and, through
+ * the back edge, the top of the loop.
+ *
+ * Invariant code motion moves a mov or lea that only touches registers to
+ * just above the label, when the loop writes none of its sources and writes
+ * its destination nowhere else and reads it nowhere before.
+ *
+ * Strength reduction looks for a register i that the loop only steps by a
+ * constant (add, sub, inc, dec) and a register t computed from it ahead of
+ * the step, as imul t, i, K or as mov t, i followed by imul t, K or shl t, k.
+ * When t is read nowhere before and is dead after the loop, it is set to i*K
+ * above the label and stepped by K times i's step ahead of the loop's flag
+ * producer instead. Only 64-bit registers and constant strides qualify.
+ */
+#define ASMOPT_LOOP_OPT_MAX_LINES 64
+
+typedef struct {
+    const asmopt_insn* insn;
+    asmopt_insn scratch;
+    asmopt_effects effects;
+    /* Optimized line index. */
+    size_t line;
+    /* Live after it, in this body. */
+    asmopt_regset live;
+    bool removed;
+} asmopt_loop_insn;
+
+/* A line placed before optimized line at. */
+typedef struct {
+    size_t at;
+    const char* line;
+} asmopt_loop_edit;
+
+/* What happens to an optimized line: kept, moved above its loop, or removed leaving its comment. */
+#define ASMOPT_LOOP_KEEP 0
+#define ASMOPT_LOOP_MOVED 1
+#define ASMOPT_LOOP_REMOVED 2
+
+/* label's block is entered only by falling into it and by the jump on input line jump_line (1-based). */
+static bool asmopt_loop_single_entry(const asmopt_context* ctx, asmopt_view label, size_t jump_line) {
+    int id = asmopt_intern_find(&ctx->cfg_labels, label);
+    if (id < 0) {
+        return false;
+    }
+    size_t index = ctx->cfg_label_blocks[id];
+    const asmopt_cfg_block* block = &ctx->cfg_blocks[index];
+    if (block->same_name_next != ASMOPT_NO_BLOCK || block->pred_count != 2 || index == 0) {
+        return false;
+    }
+    bool back = false;
+    bool fall = false;
+    for (size_t e = 0; e < 2; e++) {
+        size_t source = ctx->cfg_edges[ctx->cfg_pred_edges[block->pred_begin + e]].source;
+        const asmopt_cfg_block* pred = &ctx->cfg_blocks[source];
+        const asmopt_ir_line* last = pred->instruction_count > 0 ? pred->instructions[pred->instruction_count - 1]
+                                                                  : NULL;
+        if (last && last->line_no == jump_line) {
+            back = true;
+        } else if (source == index - 1) {
+            /* A jump from just above the label would pass what is placed there. */
+            fall = !last || (last->insn.mnemonic != ASMOPT_MN_JMP && last->insn.mnemonic != ASMOPT_MN_JCC);
+        }
+    }
+    return back && fall;
+}
+
+/* Registers live at the top of the body, filling in what is live after each instruction still in it. */
+static asmopt_regset asmopt_loop_liveness(asmopt_loop_insn* body, size_t count, asmopt_regset live_out) {
+    asmopt_regset live = live_out;
+    for (size_t k = count; k-- > 0;) {
+        body[k].live = live;
+        if (!body[k].removed) {
+            live = body[k].effects.uses | (live & ~body[k].effects.defs);
+        }
+    }
+    return live;
+}
+
+/* A mov or lea invariant code motion may move: a full write of a register from registers or a constant. */
+static bool asmopt_loop_hoistable(const asmopt_insn* insn, const asmopt_effects* effects) {
+    const asmopt_operand* dest = asmopt_insn_dest(insn);
+    const asmopt_operand* src = asmopt_insn_src(insn);
+    if (!insn->two_operands || dest->kind != ASMOPT_OPERAND_REG || dest->reg_class < 0 ||
+        dest->reg_class >= ASMOPT_REG_VECTOR0 || dest->reg_class == ASMOPT_REG_RSP || dest->reg_width < 32 ||
+        effects->load || effects->store || ((effects->uses | effects->defs) & ~ASMOPT_REGSET_GPRS)) {
+        return false;
+    }
+    if (insn->mnemonic == ASMOPT_MN_MOV) {
+        return src->kind == ASMOPT_OPERAND_IMM || src->kind == ASMOPT_OPERAND_REG;
+    }
+    return insn->mnemonic == ASMOPT_MN_LEA;
+}
+
+/* reg += step on a 64-bit register: add or sub of a constant, inc or dec. */
+static bool asmopt_loop_step(const asmopt_insn* insn, int* reg, long* step) {
+    const asmopt_operand* dest = asmopt_insn_dest(insn);
+    const asmopt_operand* src = asmopt_insn_src(insn);
+    if (asmopt_is_inc_dec(insn) && insn->operand_count == 1) {
+        dest = &insn->ops[0];
+        *step = tolower((unsigned char)insn->mnemonic_text.ptr[0]) == 'i' ? 1 : -1;
+    } else if ((insn->mnemonic == ASMOPT_MN_ADD || insn->mnemonic == ASMOPT_MN_SUB) && insn->two_operands &&
+               src->kind == ASMOPT_OPERAND_IMM && src->has_imm) {
+        *step = insn->mnemonic == ASMOPT_MN_SUB ? -src->imm : src->imm;
+    } else {
+        return false;
+    }
+    if (dest->kind != ASMOPT_OPERAND_REG || dest->reg_class < 0 || dest->reg_class >= 16 || dest->reg_width != 64) {
+        return false;
+    }
+    *reg = dest->reg_class;
+    return true;
+}
+
+/* 64-bit general-purpose register class of an operand text, -1 for anything else. */
+static int asmopt_loop_gpr64(asmopt_view piece) {
+    unsigned width = 0;
+    int reg_class = asmopt_reg_class(piece, &width);
+    return reg_class >= 0 && reg_class < 16 && width == 64 ? reg_class : -1;
+}
+
+/*
+ * t = iv * factor computed by body[first..*last]: imul t, iv, K, or mov t, iv
+ * followed by imul t, K or shl t, k. Sets *t and *factor.
+ */
+static bool asmopt_loop_product(const asmopt_loop_insn* body, size_t first, size_t limit, int iv, size_t* last,
+                                int* t, long* factor) {
+    const asmopt_insn* insn = body[first].insn;
+    asmopt_view product;
+    asmopt_view source;
+    long imm = 0;
+    if (asmopt_imul3_pieces(insn, &product, &source, &imm)) {
+        *last = first;
+        *t = asmopt_loop_gpr64(product);
+        *factor = imm;
+        return *t >= 0 && asmopt_loop_gpr64(source) == iv;
+    }
+    const asmopt_operand* dest = asmopt_insn_dest(insn);
+    const asmopt_operand* src = asmopt_insn_src(insn);
+    if (insn->mnemonic != ASMOPT_MN_MOV || !insn->two_operands || first + 1 >= limit || body[first + 1].removed ||
+        dest->kind != ASMOPT_OPERAND_REG || dest->reg_width != 64 || src->kind != ASMOPT_OPERAND_REG ||
+        src->reg_width != 64 || src->reg_class != iv) {
+        return false;
+    }
+    const asmopt_insn* next = body[first + 1].insn;
+    const asmopt_operand* scaled = asmopt_insn_dest(next);
+    const asmopt_operand* by = asmopt_insn_src(next);
+    if (!next->two_operands || !asmopt_same_reg(scaled, dest) || by->kind != ASMOPT_OPERAND_IMM || !by->has_imm) {
+        return false;
+    }
+    if (next->mnemonic == ASMOPT_MN_IMUL) {
+        *factor = by->imm;
+    } else if ((next->mnemonic == ASMOPT_MN_SHL || next->mnemonic == ASMOPT_MN_SAL) && by->imm > 0 && by->imm < 31) {
+        *factor = 1L << by->imm;
+    } else {
+        return false;
+    }
+    *last = first + 1;
+    *t = dest->reg_class;
+    return *t >= 0 && *t < 16;
+}
+
+/* A new body or preheader line laid out like layout, without its comment. */
+static const char* asmopt_loop_line(asmopt_context* ctx, const asmopt_insn* layout, const char* name,
+                                    const char* operands) {
+    asmopt_view parts[] = {layout->indent, asmopt_view_of(name), layout->spacing, asmopt_view_of(operands)};
+    return asmopt_emit(ctx, parts, 4);
+}
+
+/* "dest, src" in Intel order, "src, dest" in AT&T. */
+static void asmopt_loop_operands(char* buffer, size_t size, bool att, const char* dest, const char* src) {
+    snprintf(buffer, size, "%s, %s", att ? src : dest, att ? dest : src);
+}
+
+/* "name operands" as the report shows it. */
+static const char* asmopt_loop_text(asmopt_context* ctx, const char* name, const char* operands) {
+    asmopt_view parts[] = {asmopt_view_of(name), ASMOPT_VIEW_LIT(" "), asmopt_view_of(operands)};
+    return asmopt_emit(ctx, parts, 3);
+}
+
+static bool asmopt_loop_edit_add(asmopt_loop_edit** edits, size_t* count, size_t* capacity, size_t at,
+                                 const char* line) {
+    if (!line) {
+        return false;
+    }
+    if (*count == *capacity) {
+        size_t new_capacity = *capacity == 0 ? 16 : *capacity * 2;
+        asmopt_loop_edit* next = realloc(*edits, sizeof(asmopt_loop_edit) * new_capacity);
+        if (!next) {
+            return false;
+        }
+        *edits = next;
+        *capacity = new_capacity;
+    }
+    (*edits)[*count].at = at;
+    (*edits)[(*count)++].line = line;
+    return true;
+}
+
+/*
+ * Strength-reduce t = iv * factor computed by body[first..last] and return the
+ * lines that set t above the loop (*init) and step it in the body (*step,
+ * placed before body[*at]). False when the flags or the encoding get in the way.
+ */
+static bool asmopt_loop_reduce(asmopt_context* ctx, asmopt_loop_insn* body, size_t count, size_t last, int iv,
+                               long step, int t, long factor, asmopt_regset live_in, bool att, const char** init,
+                               const char** step_line, size_t* at, const char** summary) {
+    long long delta = (long long)factor * step;
+    if (factor == 0 || factor < INT32_MIN || factor > INT32_MAX || delta < INT32_MIN || delta > INT32_MAX ||
+        delta == 0) {
+        return false;
+    }
+    /* The flag producer of the closing jump, when there is one to stay ahead of. */
+    size_t producer = count - 1;
+    for (size_t k = count - 1; k-- > last + 1;) {
+        if (!body[k].removed) {
+            producer = body[k].effects.defs & ASMOPT_REGSET_FLAGS ? k : count - 1;
+            break;
+        }
+    }
+    asmopt_regset t_bit = ASMOPT_REGSET_BIT(t);
+    if (producer < count - 1 && ((body[producer].effects.uses | body[producer].effects.defs) & t_bit)) {
+        producer = count - 1;
+    }
+    /* add clobbers the flags; only a producer that sets them all without reading them hides that. */
+    bool add = producer < count - 1 && !(body[producer].effects.uses & ASMOPT_REGSET_FLAGS);
+    const asmopt_insn* layout = body[last].insn;
+    char suffix = '\0';
+    if (att && layout->mnemonic_text.len > 3 &&
+        tolower((unsigned char)layout->mnemonic_text.ptr[layout->mnemonic_text.len - 1]) == 'q') {
+        suffix = 'q';
+    }
+    char t_name[8];
+    char iv_name[8];
+    char address[48];
+    /* Room for two addresses, so neither operand order can truncate. */
+    char operands[2 * sizeof(address) + 2];
+    char name[8];
+    asmopt_gpr_name(t_name, sizeof(t_name), t, 64, att);
+    asmopt_gpr_name(iv_name, sizeof(iv_name), iv, 64, att);
+    const char* base = "lea";
+    if (factor == 1) {
+        base = "mov";
+        asmopt_loop_operands(operands, sizeof(operands), att, t_name, iv_name);
+    } else if (factor == 2 || factor == 4 || factor == 8 || factor == 3 || factor == 5 || factor == 9) {
+        bool odd = factor & 1;
+        asmopt_format_address(address, sizeof(address), att, odd ? iv : -1, iv, (unsigned)(odd ? factor - 1 : factor),
+                              0);
+        asmopt_loop_operands(operands, sizeof(operands), att, t_name, address);
+    } else {
+        /* Only imul multiplies by anything else, and it writes the flags. */
+        if (live_in & ASMOPT_REGSET_FLAGS) {
+            return false;
+        }
+        base = "imul";
+        if (att) {
+            snprintf(operands, sizeof(operands), "$%ld, %s, %s", factor, iv_name, t_name);
+        } else {
+            snprintf(operands, sizeof(operands), "%s, %s, %ld", t_name, iv_name, factor);
+        }
+    }
+    asmopt_suffixed_name(name, sizeof(name), base, suffix);
+    *init = asmopt_loop_line(ctx, layout, name, operands);
+    if (add) {
+        char amount[24];
+        snprintf(amount, sizeof(amount), "%s%lld", att ? "$" : "", delta);
+        asmopt_loop_operands(operands, sizeof(operands), att, t_name, amount);
+        asmopt_suffixed_name(name, sizeof(name), "add", suffix);
+    } else {
+        asmopt_format_address(address, sizeof(address), att, t, -1, 1, (long)delta);
+        asmopt_loop_operands(operands, sizeof(operands), att, t_name, address);
+        asmopt_suffixed_name(name, sizeof(name), "lea", suffix);
+    }
+    *step_line = asmopt_loop_line(ctx, layout, name, operands);
+    *summary = asmopt_loop_text(ctx, name, operands);
+    *at = producer;
+    return *init && *step_line && *summary;
+}
+
+static void asmopt_optimize_loops(asmopt_context* ctx, const char* syntax, bool hoist, bool reduce) {
+    size_t count = ctx->optimized_count;
+    if (count < 3 || !ctx->live_after || !ctx->cfg_pred_edges || ctx->ir_count != ctx->original_count) {
+        return;
+    }
+    char** lines = ctx->optimized_lines;
+    size_t* origins = asmopt_line_origins(ctx);
+    unsigned char* fate = calloc(count, 1);
+    asmopt_loop_insn* body = malloc(sizeof(asmopt_loop_insn) * ASMOPT_LOOP_OPT_MAX_LINES);
+    if (!origins || !fate || !body) {
+        free(origins);
+        free(fate);
+        free(body);
+        return;
+    }
+    bool att = syntax && strcmp(syntax, "att") == 0;
+    asmopt_loop_edit* edits = NULL;
+    size_t edit_count = 0;
+    size_t edit_capacity = 0;
+    size_t event_count = ctx->loop_opt_event_count;
+    bool failed = false;
+    /* Lines stepping reduced registers, placed after this loop's preheader lines. */
+    asmopt_loop_edit steps[ASMOPT_LOOP_OPT_MAX_LINES];
+    for (size_t top = 0; !failed && top + 2 < count; top++) {
+        if (origins[top] >= ctx->ir_count) {
+            continue;
+        }
+        const asmopt_insn* label = &ctx->ir[origins[top]].insn;
+        if (label->kind != ASMOPT_LINE_LABEL) {
+            continue;
+        }
+        size_t n = 0;
+        size_t end = top + 1;
+        bool ok = true;
+        for (; end < count; end++) {
+            asmopt_loop_insn* entry = &body[n];
+            entry->insn = asmopt_if_line(ctx, lines, origins, end, syntax, &entry->scratch);
+            if (entry->insn->kind == ASMOPT_LINE_BLANK) {
+                continue;
             }
-            char* trimmed_comment = asmopt_trim_comment(comment);
-            size_t new_len = strlen(indent) + strlen(test_name) + strlen(spacing) +
-                             strlen(dest) + strlen(pre_space) + strlen(post_space) + strlen(dest) + 2;
-            if (!asmopt_is_blank(trimmed_comment)) {
-                new_len += strlen(trimmed_comment) + 1;
+            if (n == ASMOPT_LOOP_OPT_MAX_LINES || !asmopt_if_arm_line(entry->insn) ||
+                !asmopt_insn_effects(entry->insn, &entry->effects)) {
+                ok = entry->insn->mnemonic == ASMOPT_MN_JCC && !entry->insn->has_label &&
+                     n < ASMOPT_LOOP_OPT_MAX_LINES && asmopt_insn_effects(entry->insn, &entry->effects);
+                if (ok) {
+                    entry->line = end;
+                    entry->removed = false;
+                    n++;
+                }
+                break;
             }
-            char* newline = malloc(new_len + 1);
-            if (newline) {
-                if (!asmopt_is_blank(trimmed_comment)) {
-                    snprintf(newline, new_len + 1, "%s%s%s%s%s,%s%s %s",
-                             indent, test_name, spacing, dest, pre_space, post_space, dest, trimmed_comment);
-                } else {
-                    snprintf(newline, new_len + 1, "%s%s%s%s%s,%s%s",
-                             indent, test_name, spacing, dest, pre_space, post_space, dest);
+            entry->line = end;
+            entry->removed = false;
+            n++;
+        }
+        size_t live = 0;
+        if (!ok || end == count || n < 3 || origins[end] >= ctx->ir_count ||
+            !asmopt_is_single_target(body[n - 1].insn) ||
+            !asmopt_view_equal(body[n - 1].insn->operands_trimmed, label->label) ||
+            !asmopt_loop_single_entry(ctx, label->label, origins[end] + 1) ||
+            !asmopt_live_index(ctx, origins[end] + 1, &live)) {
+            continue;
+        }
+        asmopt_regset live_out = ctx->live_after[live];
+        asmopt_regset written = 0;
+        unsigned writers[16] = {0};
+        for (size_t k = 0; k < n; k++) {
+            written |= body[k].effects.defs;
+            for (int r = 0; r < 16; r++) {
+                writers[r] += (body[k].effects.defs & ASMOPT_REGSET_BIT(r)) ? 1 : 0;
+            }
+        }
+        asmopt_view name_view = label->label;
+        const char* name = asmopt_emit(ctx, &name_view, 1);
+        size_t step_count = 0;
+        asmopt_regset live_in = asmopt_loop_liveness(body, n, live_out);
+        for (size_t k = 0; hoist && k + 1 < n; k++) {
+            const asmopt_insn* insn = body[k].insn;
+            int reg = asmopt_insn_dest(insn)->reg_class;
+            if (!asmopt_loop_hoistable(insn, &body[k].effects) || writers[reg] != 1 ||
+                (live_in & ASMOPT_REGSET_BIT(reg)) || (body[k].effects.uses & written) ||
+                !asmopt_loop_edit_add(&edits, &edit_count, &edit_capacity, top, lines[body[k].line])) {
+                continue;
+            }
+            body[k].removed = true;
+            fate[body[k].line] = ASMOPT_LOOP_MOVED;
+            written &= ~ASMOPT_REGSET_BIT(reg);
+            writers[reg] = 0;
+            size_t line_no = origins[body[k].line] < ctx->ir_count ? origins[body[k].line] + 1 : origins[top] + 1;
+            asmopt_record_loop_opt(ctx, line_no, name, asmopt_emit(ctx, &insn->code, 1), NULL);
+        }
+        live_in = asmopt_loop_liveness(body, n, live_out);
+        for (size_t u = 1; reduce && u + 1 < n; u++) {
+            int iv = -1;
+            long step = 0;
+            if (body[u].removed || !asmopt_loop_step(body[u].insn, &iv, &step) || writers[iv] != 1) {
+                continue;
+            }
+            for (size_t m = 0; m < u; m++) {
+                size_t last = m;
+                int t = -1;
+                long factor = 0;
+                if (body[m].removed || !asmopt_loop_product(body, m, u, iv, &last, &t, &factor) || t == iv ||
+                    t == ASMOPT_REG_RSP || writers[t] != last - m + 1 || (live_in & ASMOPT_REGSET_BIT(t)) ||
+                    (live_out & ASMOPT_REGSET_BIT(t)) || (body[last].live & ASMOPT_REGSET_FLAGS)) {
+                    continue;
                 }
-                asmopt_record_optimization(ctx, line_no, "or_self_to_test", line, newline);
-                asmopt_store_optimized_line(ctx, newline);
-                free(newline);
-                *replaced = true;
+                const char* init = NULL;
+                const char* step_line = NULL;
+                const char* summary = NULL;
+                size_t at = 0;
+                if (!asmopt_loop_reduce(ctx, body, n, last, iv, step, t, factor, live_in, att, &init, &step_line,
+                                        &at, &summary) ||
+                    !asmopt_loop_edit_add(&edits, &edit_count, &edit_capacity, top, init)) {
+                    continue;
+                }
+                steps[step_count].at = body[at].line;
+                steps[step_count++].line = step_line;
+                size_t line_no = origins[top] + 1;
+                for (size_t k = m; k <= last; k++) {
+                    body[k].removed = true;
+                    fate[body[k].line] = ASMOPT_LOOP_REMOVED;
+                    if (line_no == origins[top] + 1 && origins[body[k].line] < ctx->ir_count) {
+                        line_no = origins[body[k].line] + 1;
+                    }
+                }
+                writers[t] = 0;
+                asmopt_record_loop_opt(ctx, line_no, name, asmopt_emit(ctx, &body[last].insn->code, 1), summary);
+                live_in = asmopt_loop_liveness(body, n, live_out);
+                m = last;
+            }
+        }
+        /* Steps come after the preheader lines; edits stay ordered by line. */
+        for (size_t k = 0; !failed && k < step_count; k++) {
+            failed = !asmopt_loop_edit_add(&edits, &edit_count, &edit_capacity, steps[k].at, steps[k].line);
+        }
+        top = end;
+    }
+    free(body);
+    if (failed) {
+        ctx->loop_opt_event_count = event_count;
+    } else if (edit_count > 0) {
+        ctx->optimized_lines = NULL;
+        ctx->optimized_count = 0;
+        ctx->optimized_capacity = 0;
+        ctx->line_origin_count = 0;
+        size_t e = 0;
+        for (size_t i = 0; i < count; i++) {
+            for (; e < edit_count && edits[e].at == i; e++) {
+                asmopt_store_optimized_line(ctx, edits[e].line);
+                asmopt_trace_line_origin(ctx, ctx->ir_count);
+            }
+            if (fate[i] == ASMOPT_LOOP_KEEP) {
+                asmopt_store_optimized_line(ctx, lines[i]);
+                asmopt_trace_line_origin(ctx, origins[i]);
+            } else if (fate[i] == ASMOPT_LOOP_REMOVED) {
+                asmopt_insn insn;
+                asmopt_tokenize_line(ctx, lines[i], syntax, &insn);
+                asmopt_store_comment_line(ctx, &insn);
+                asmopt_trace_line_origin(ctx, ctx->ir_count);
             }
-            free(trimmed_comment);
-            goto cleanup;
         }
+        free(lines);
     }
+    free(edits);
+    free(fate);
+    free(origins);
+}
 
-    /* Pattern 17: add rax, -1 -> dec rax */
-    if (strcmp(base_mnemonic, "add") == 0 && has_two_ops && dest_reg) {
-        if (asmopt_is_immediate_minus_one(src, syntax)) {
-            char dec_name[16];
-            if (suffix) {
-                snprintf(dec_name, sizeof(dec_name), "dec%c", suffix);
-            } else {
-                snprintf(dec_name, sizeof(dec_name), "dec");
+static void asmopt_record_loop_align(asmopt_context* ctx, size_t line_no, const char* label, unsigned bytes,
+                                     const char* directive) {
+    if (ctx->streaming || !label || !directive) {
+        return;
+    }
+    if (ctx->loop_align_event_count >= ctx->loop_align_event_capacity) {
+        size_t new_capacity = ctx->loop_align_event_capacity == 0 ? 16 : ctx->loop_align_event_capacity * 2;
+        asmopt_loop_align_event* next = realloc(ctx->loop_align_events, sizeof(asmopt_loop_align_event) * new_capacity);
+        if (!next) {
+            return;
+        }
+        ctx->loop_align_events = next;
+        ctx->loop_align_event_capacity = new_capacity;
+        ASMOPT_PROFILE_BYTES(ctx, sizeof(asmopt_loop_align_event) * new_capacity);
+    }
+    asmopt_loop_align_event* event = &ctx->loop_align_events[ctx->loop_align_event_count++];
+    event->line_no = line_no;
+    event->label = label;
+    event->bytes = bytes;
+    event->directive = directive;
+}
+
+/* Alignment in bytes an alignment directive requests, 0 for any other line. */
+static unsigned asmopt_directive_alignment(asmopt_view code) {
+    static const struct {
+        const char* name;
+        bool power;
+    } directives[] = {{".p2align", true}, {".balign", false}, {".align", false}};
+    for (size_t i = 0; i < sizeof(directives) / sizeof(directives[0]); i++) {
+        size_t len = strlen(directives[i].name);
+        if (code.len <= len || !isspace((unsigned char)code.ptr[len]) ||
+            !asmopt_view_is((asmopt_view){code.ptr, len}, directives[i].name)) {
+            continue;
+        }
+        char text[16];
+        asmopt_view_copy(asmopt_view_strip((asmopt_view){code.ptr + len, code.len - len}), text, sizeof(text));
+        long value = strtol(text, NULL, 0);
+        if (value <= 0 || (directives[i].power && value > 16)) {
+            return 0;
+        }
+        return directives[i].power ? 1u << value : (unsigned)value;
+    }
+    return 0;
+}
+
+/*
+ * Align the top of each innermost loop for Zen's front end: a body that fits
+ * a 32-byte fetch window starts on one, one that fits a 64-byte op-cache line
+ * starts on that, and larger bodies start on a fetch window. Padding that is
+ * executed on the way into the loop is capped at
+ * ASMOPT_LOOP_ALIGN_MAX_PADDING bytes; padding after a jmp or ret is not.
+ * Body sizes are estimated from the input, before the peephole passes.
+ */
+static void asmopt_align_loops(asmopt_context* ctx, const char* syntax) {
+    size_t block_count = ctx->cfg_block_count;
+    if (block_count == 0 || !ctx->cfg_pred_edges || ctx->ir_count != ctx->original_count) {
+        return;
+    }
+    size_t* loop_end = malloc(sizeof(size_t) * block_count);
+    if (!loop_end || !asmopt_find_inner_loops(ctx, loop_end)) {
+        free(loop_end);
+        return;
+    }
+    char** lines = ctx->optimized_lines;
+    size_t count = ctx->optimized_count;
+    /* Directive to insert before optimized line i; the label's input line tells where it went. */
+    const char** inserts = NULL;
+    size_t cursor = 0;
+    for (size_t b = 0; b < block_count; b++) {
+        const asmopt_cfg_block* top = &ctx->cfg_blocks[b];
+        if (loop_end[b] == 0 || top->label_line == 0) {
+            continue;
+        }
+        const asmopt_cfg_block* bottom = &ctx->cfg_blocks[loop_end[b] - 1];
+        size_t last_line = bottom->instruction_count > 0
+                               ? bottom->instructions[bottom->instruction_count - 1]->line_no
+                               : bottom->label_line;
+        unsigned bytes = 0;
+        for (size_t i = top->label_line - 1; i < last_line && i < ctx->ir_count; i++) {
+            bytes += asmopt_insn_length(&ctx->ir[i].insn);
+        }
+        const char* label = ctx->original_lines[top->label_line - 1];
+        size_t at = cursor;
+        while (at < count && lines[at] != label) {
+            at++;
+        }
+        if (at == count) {
+            continue;
+        }
+        cursor = at + 1;
+        /* Place the directive above any labels sharing the address, and see what already precedes them. */
+        asmopt_insn insn;
+        while (at > 0) {
+            asmopt_tokenize_line(ctx, lines[at - 1], syntax, &insn);
+            if (insn.kind != ASMOPT_LINE_LABEL && insn.kind != ASMOPT_LINE_BLANK) {
+                break;
+            }
+            at--;
+        }
+        unsigned alignment = bytes > ASMOPT_FETCH_WINDOW && bytes <= ASMOPT_OP_CACHE_WINDOW ? ASMOPT_OP_CACHE_WINDOW
+                                                                                            : ASMOPT_FETCH_WINDOW;
+        unsigned existing = 0;
+        bool falls_through = false;
+        for (size_t i = at; i-- > 0;) {
+            asmopt_tokenize_line(ctx, lines[i], syntax, &insn);
+            if (insn.kind == ASMOPT_LINE_BLANK) {
+                continue;
+            }
+            unsigned directive = asmopt_directive_alignment(insn.code);
+            if (directive > 0) {
+                existing = directive > existing ? directive : existing;
+                continue;
+            }
+            falls_through = !(insn.kind == ASMOPT_LINE_INSTRUCTION &&
+                              (insn.mnemonic == ASMOPT_MN_JMP || insn.mnemonic == ASMOPT_MN_RET));
+            break;
+        }
+        if (existing >= alignment) {
+            continue;
+        }
+        if (!inserts) {
+            inserts = calloc(count + 1, sizeof(const char*));
+            if (!inserts) {
+                break;
             }
-            char* trimmed_comment = asmopt_trim_comment(comment);
-            size_t new_len = strlen(indent) + strlen(dec_name) + strlen(spacing) + strlen(dest) + 2;
-            if (!asmopt_is_blank(trimmed_comment)) {
-                new_len += strlen(trimmed_comment) + 1;
+        }
+        char text[32];
+        unsigned power = alignment == ASMOPT_OP_CACHE_WINDOW ? 6 : 5;
+        if (falls_through) {
+            snprintf(text, sizeof(text), "    .p2align %u,,%d", power, ASMOPT_LOOP_ALIGN_MAX_PADDING);
+        } else {
+            snprintf(text, sizeof(text), "    .p2align %u", power);
+        }
+        asmopt_view view = asmopt_view_of(text);
+        asmopt_view name = asmopt_view_of(top->name);
+        inserts[at] = asmopt_emit(ctx, &view, 1);
+        asmopt_record_loop_align(ctx, top->label_line, asmopt_emit(ctx, &name, 1), bytes,
+                                 inserts[at] ? inserts[at] + 4 : NULL);
+    }
+    free(loop_end);
+    if (!inserts) {
+        return;
+    }
+    size_t* origins = ctx->line_origins;
+    bool known = ctx->line_origin_count == count;
+    ctx->optimized_lines = NULL;
+    ctx->optimized_count = 0;
+    ctx->optimized_capacity = 0;
+    ctx->line_origins = NULL;
+    ctx->line_origin_count = 0;
+    ctx->line_origin_capacity = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (inserts[i]) {
+            asmopt_store_optimized_line(ctx, inserts[i]);
+            asmopt_trace_line_origin(ctx, ctx->ir_count);
+        }
+        asmopt_store_optimized_line(ctx, lines[i]);
+        asmopt_trace_line_origin(ctx, known ? origins[i] : ctx->ir_count);
+    }
+    /* Scheduled runs are reported by output line; move them past the inserted directives. */
+    size_t shift = 0;
+    size_t next = 0;
+    for (size_t i = 0; i < ctx->schedule_event_count; i++) {
+        asmopt_schedule_event* event = &ctx->schedule_events[i];
+        for (; next < event->first_line && next < count; next++) {
+            shift += inserts[next] ? 1 : 0;
+        }
+        event->first_line += shift;
+        event->last_line += shift;
+    }
+    free(inserts);
+    free(lines);
+    free(origins);
+}
+
+/*
+ * Result cache. With the "cache_dir" option set, the input is cut into
+ * functions and each one is optimized on its own, in a context that shares
+ * ctx's settings. A function's result therefore depends only on its text and
+ * the settings, and is stored in <cache_dir>/<hash>.asmopt keyed by both. An
+ * entry holds a header line and then NUL-terminated fields: the key, the
+ * input (compared on lookup, so hash collisions only cost a miss), the
+ * optimized lines and the report events with unit-relative line numbers. A
+ * hit is mapped and its lines and event strings are used where they lie.
+ */
+#define ASMOPT_CACHE_MAGIC "asmopt-cache 4"
+
+static asmopt_context* asmopt_clone_settings(asmopt_context* ctx, bool keep_threads, bool keep_cache);
+
+/* Settings that can change a function's result; the options that only affect reporting are left out. */
+static char* asmopt_cache_key(asmopt_context* ctx, const char* syntax) {
+    static const char* const ignored[] = {"threads", "cache_dir", "profile", "simd", "verbose", "quiet", "stats",
+                                          "dump_ir", "dump_cfg"};
+    asmopt_buffer buffer = {0};
+    asmopt_buffer_appendf(&buffer, "%s|%s|%s|%s|O%d%s|amd=%d|preserve=%d|abi=%s|mask=%llx", ASMOPT_CACHE_MAGIC,
+                          ctx->architecture ? ctx->architecture : "", ctx->target_cpu ? ctx->target_cpu : "",
+                          syntax, ctx->optimization_level, ctx->optimize_size ? "s" : "", ctx->amd_optimizations,
+                          ctx->preserve_all, ctx->abi->name,
+                          (unsigned long long)ctx->pattern_mask);
+    for (size_t i = 0; i < ctx->enabled_count; i++) {
+        asmopt_buffer_appendf(&buffer, "|+%s", ctx->enabled_opts[i]);
+    }
+    for (size_t i = 0; i < ctx->disabled_count; i++) {
+        asmopt_buffer_appendf(&buffer, "|-%s", ctx->disabled_opts[i]);
+    }
+    for (size_t i = 0; i < ctx->option_count; i++) {
+        bool skip = !ctx->options[i].key;
+        for (size_t j = 0; !skip && j < sizeof(ignored) / sizeof(ignored[0]); j++) {
+            skip = strcmp(ctx->options[i].key, ignored[j]) == 0;
+        }
+        if (!skip) {
+            asmopt_buffer_appendf(&buffer, "|%s=%s", ctx->options[i].key, ctx->options[i].value);
+        }
+    }
+    return asmopt_buffer_finish(&buffer);
+}
+
+/* Non-local label: the start of a function when nothing falls into it. */
+static bool asmopt_is_function_label(const asmopt_insn* insn) {
+    return insn->kind == ASMOPT_LINE_LABEL && !asmopt_is_local_label(insn->label);
+}
+
+/*
+ * Cut the input into functions: a new one starts at .globl/.global/.type, or
+ * at a non-local label that follows a jmp or ret, once the current one holds
+ * an instruction. Patterns only read a label as the line after a jmp, so no
+ * cut is made right after one. Returns the number of units; starts[i] is the
+ * first line of unit i, and starts[count] is original_count.
+ */
+static size_t asmopt_cache_units(asmopt_context* ctx, size_t** out) {
+    size_t capacity = 16;
+    size_t count = 0;
+    size_t* starts = malloc(sizeof(size_t) * capacity);
+    if (!starts) {
+        return 0;
+    }
+    starts[count++] = 0;
+    bool has_code = false;
+    bool fell_off = false;
+    for (size_t i = 0; i < ctx->ir_count; i++) {
+        const asmopt_insn* insn = &ctx->ir[i].insn;
+        bool boundary = false;
+        if (insn->kind == ASMOPT_LINE_DIRECTIVE) {
+            asmopt_view name = insn->code;
+            for (size_t j = 0; j < name.len; j++) {
+                if (isspace((unsigned char)name.ptr[j])) {
+                    name.len = j;
+                    break;
+                }
             }
-            char* newline = malloc(new_len + 1);
-            if (newline) {
-                if (!asmopt_is_blank(trimmed_comment)) {
-                    snprintf(newline, new_len + 1, "%s%s%s%s %s",
-                             indent, dec_name, spacing, dest, trimmed_comment);
-                } else {
-                    snprintf(newline, new_len + 1, "%s%s%s%s",
-                             indent, dec_name, spacing, dest);
+            boundary = asmopt_view_is(name, ".globl") || asmopt_view_is(name, ".global") ||
+                       asmopt_view_is(name, ".type");
+        } else if (asmopt_is_function_label(insn)) {
+            boundary = fell_off;
+        }
+        bool after_jump = i > 0 && ctx->ir[i - 1].insn.kind == ASMOPT_LINE_INSTRUCTION &&
+                          ctx->ir[i - 1].insn.mnemonic == ASMOPT_MN_JMP;
+        if (boundary && has_code && !after_jump) {
+            if (count + 1 >= capacity) {
+                size_t* next = realloc(starts, sizeof(size_t) * capacity * 2);
+                if (!next) {
+                    free(starts);
+                    return 0;
                 }
-                asmopt_record_optimization(ctx, line_no, "add_minus_one_to_dec", line, newline);
-                asmopt_store_optimized_line(ctx, newline);
-                free(newline);
-                *replaced = true;
+                starts = next;
+                capacity *= 2;
             }
-            free(trimmed_comment);
-            goto cleanup;
+            starts[count++] = i;
+            has_code = false;
+        }
+        if (insn->kind == ASMOPT_LINE_INSTRUCTION) {
+            has_code = true;
+            fell_off = insn->mnemonic == ASMOPT_MN_JMP || insn->mnemonic == ASMOPT_MN_RET;
         }
     }
+    starts[count] = ctx->original_count;
+    *out = starts;
+    return count;
+}
 
-    /* Pattern 18: sub rax, -1 -> inc rax */
-    if (strcmp(base_mnemonic, "sub") == 0 && has_two_ops && dest_reg) {
-        if (asmopt_is_immediate_minus_one(src, syntax)) {
-            char inc_name[16];
-            if (suffix) {
-                snprintf(inc_name, sizeof(inc_name), "inc%c", suffix);
-            } else {
-                snprintf(inc_name, sizeof(inc_name), "inc");
-            }
-            char* trimmed_comment = asmopt_trim_comment(comment);
-            size_t new_len = strlen(indent) + strlen(inc_name) + strlen(spacing) + strlen(dest) + 2;
-            if (!asmopt_is_blank(trimmed_comment)) {
-                new_len += strlen(trimmed_comment) + 1;
-            }
-            char* newline = malloc(new_len + 1);
-            if (newline) {
-                if (!asmopt_is_blank(trimmed_comment)) {
-                    snprintf(newline, new_len + 1, "%s%s%s%s %s",
-                             indent, inc_name, spacing, dest, trimmed_comment);
-                } else {
-                    snprintf(newline, new_len + 1, "%s%s%s%s",
-                             indent, inc_name, spacing, dest);
-                }
-                asmopt_record_optimization(ctx, line_no, "sub_minus_one_to_inc", line, newline);
-                asmopt_store_optimized_line(ctx, newline);
-                free(newline);
-                *replaced = true;
-            }
-            free(trimmed_comment);
-            goto cleanup;
+static uint64_t asmopt_fnv1a(uint64_t hash, const char* data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+/* Serialize a unit's optimized lines, stats and events as a cache entry. */
+static char* asmopt_cache_entry(asmopt_context* unit, const char* key, const char* input, size_t* length) {
+    asmopt_buffer buffer = {0};
+    asmopt_buffer_appendf(&buffer, "%s %zu %zu %zu %zu %zu %zu %zu %zu %zu %zu %zu\n", ASMOPT_CACHE_MAGIC,
+                          unit->optimized_count, unit->stats.replacements, unit->stats.removals,
+                          unit->opt_event_count, unit->schedule_event_count, unit->loop_align_event_count,
+                          unit->fusion_event_count, unit->fusion_pairs_before, unit->fusion_pairs_after,
+                          unit->if_convert_event_count, unit->loop_opt_event_count);
+    asmopt_buffer_append_n(&buffer, key, strlen(key) + 1);
+    asmopt_buffer_append_n(&buffer, input, strlen(input) + 1);
+    for (size_t i = 0; i < unit->optimized_count; i++) {
+        asmopt_buffer_append_n(&buffer, unit->optimized_lines[i], strlen(unit->optimized_lines[i]) + 1);
+    }
+    for (size_t i = 0; i < unit->opt_event_count; i++) {
+        const asmopt_optimization_event* event = &unit->opt_events[i];
+        asmopt_buffer_appendf(&buffer, "%zu", event->line_no);
+        asmopt_buffer_append_n(&buffer, "", 1);
+        asmopt_buffer_append_n(&buffer, event->pattern_name, strlen(event->pattern_name) + 1);
+        asmopt_buffer_append_n(&buffer, event->original, strlen(event->original) + 1);
+        asmopt_buffer_append_n(&buffer, event->optimized, strlen(event->optimized) + 1);
+    }
+    for (size_t i = 0; i < unit->schedule_event_count; i++) {
+        const asmopt_schedule_event* event = &unit->schedule_events[i];
+        asmopt_buffer_appendf(&buffer, "%zu %zu %u %u", event->first_line, event->last_line, event->cycles_before,
+                              event->cycles_after);
+        asmopt_buffer_append_n(&buffer, "", 1);
+    }
+    for (size_t i = 0; i < unit->loop_align_event_count; i++) {
+        const asmopt_loop_align_event* event = &unit->loop_align_events[i];
+        asmopt_buffer_appendf(&buffer, "%zu %u", event->line_no, event->bytes);
+        asmopt_buffer_append_n(&buffer, "", 1);
+        asmopt_buffer_append_n(&buffer, event->label, strlen(event->label) + 1);
+        asmopt_buffer_append_n(&buffer, event->directive, strlen(event->directive) + 1);
+    }
+    for (size_t i = 0; i < unit->fusion_event_count; i++) {
+        const asmopt_fusion_event* event = &unit->fusion_events[i];
+        asmopt_buffer_appendf(&buffer, "%zu %d", event->line_no, event->fused ? 1 : 0);
+        asmopt_buffer_append_n(&buffer, "", 1);
+        asmopt_buffer_append_n(&buffer, event->branch, strlen(event->branch) + 1);
+    }
+    for (size_t i = 0; i < unit->if_convert_event_count; i++) {
+        const asmopt_if_convert_event* event = &unit->if_convert_events[i];
+        asmopt_buffer_appendf(&buffer, "%zu %u %d", event->line_no, event->cycles, event->diamond ? 1 : 0);
+        asmopt_buffer_append_n(&buffer, "", 1);
+        asmopt_buffer_append_n(&buffer, event->branch, strlen(event->branch) + 1);
+        asmopt_buffer_append_n(&buffer, event->select, strlen(event->select) + 1);
+    }
+    /* A hoisted instruction has an empty after field. */
+    for (size_t i = 0; i < unit->loop_opt_event_count; i++) {
+        const asmopt_loop_opt_event* event = &unit->loop_opt_events[i];
+        const char* after = event->after ? event->after : "";
+        asmopt_buffer_appendf(&buffer, "%zu", event->line_no);
+        asmopt_buffer_append_n(&buffer, "", 1);
+        asmopt_buffer_append_n(&buffer, event->label, strlen(event->label) + 1);
+        asmopt_buffer_append_n(&buffer, event->before, strlen(event->before) + 1);
+        asmopt_buffer_append_n(&buffer, after, strlen(after) + 1);
+    }
+    *length = buffer.length;
+    return asmopt_buffer_finish(&buffer);
+}
+
+/* Next NUL-terminated field of an entry, or NULL past its end. */
+static const char* asmopt_cache_field(const char** cursor, const char* end) {
+    const char* field = *cursor;
+    const char* nul = field < end ? memchr(field, '\0', (size_t)(end - field)) : NULL;
+    if (!nul) {
+        return NULL;
+    }
+    *cursor = nul + 1;
+    return field;
+}
+
+/*
+ * Append a cache entry to ctx's output and events, offsetting line numbers by
+ * the unit's first input line. Checks the whole entry before changing ctx and
+ * returns false if it is malformed or was stored for another key or input.
+ */
+static bool asmopt_cache_splice(asmopt_context* ctx, const char* data, size_t length, const char* key,
+                                const char* input, size_t first_line) {
+    const char* end = data + length;
+    const char* newline = memchr(data, '\n', length);
+    size_t counts[11];
+    if (!newline || sscanf(data, ASMOPT_CACHE_MAGIC " %zu %zu %zu %zu %zu %zu %zu %zu %zu %zu %zu", &counts[0],
+                           &counts[1], &counts[2], &counts[3], &counts[4], &counts[5], &counts[6], &counts[7],
+                           &counts[8], &counts[9], &counts[10]) != 11) {
+        return false;
+    }
+    const char* cursor = newline + 1;
+    const char* stored_key = asmopt_cache_field(&cursor, end);
+    const char* stored_input = asmopt_cache_field(&cursor, end);
+    if (!stored_key || !stored_input || strcmp(stored_key, key) != 0 || strcmp(stored_input, input) != 0) {
+        return false;
+    }
+    const char* body = cursor;
+    size_t fields =
+        counts[0] + counts[3] * 4 + counts[4] + counts[5] * 3 + counts[6] * 2 + counts[9] * 3 + counts[10] * 4;
+    for (size_t i = 0; i < fields; i++) {
+        if (!asmopt_cache_field(&cursor, end)) {
+            return false;
         }
     }
+    cursor = body;
+    size_t output_offset = ctx->optimized_count;
+    for (size_t i = 0; i < counts[0]; i++) {
+        asmopt_store_optimized_line(ctx, asmopt_cache_field(&cursor, end));
+    }
+    ctx->stats.replacements += counts[1];
+    ctx->stats.removals += counts[2];
+    for (size_t i = 0; i < counts[3]; i++) {
+        size_t line_no = strtoul(asmopt_cache_field(&cursor, end), NULL, 10);
+        const char* pattern = asmopt_cache_field(&cursor, end);
+        const char* original = asmopt_cache_field(&cursor, end);
+        const char* optimized = asmopt_cache_field(&cursor, end);
+        asmopt_record_optimization(ctx, line_no + first_line, pattern, original, optimized);
+    }
+    for (size_t i = 0; i < counts[4]; i++) {
+        size_t first = 0;
+        size_t last = 0;
+        unsigned before = 0;
+        unsigned after = 0;
+        sscanf(asmopt_cache_field(&cursor, end), "%zu %zu %u %u", &first, &last, &before, &after);
+        asmopt_record_schedule(ctx, first + output_offset, last + output_offset, before, after);
+    }
+    for (size_t i = 0; i < counts[5]; i++) {
+        size_t line_no = 0;
+        unsigned bytes = 0;
+        sscanf(asmopt_cache_field(&cursor, end), "%zu %u", &line_no, &bytes);
+        const char* label = asmopt_cache_field(&cursor, end);
+        const char* directive = asmopt_cache_field(&cursor, end);
+        asmopt_record_loop_align(ctx, line_no + first_line, label, bytes, directive);
+    }
+    for (size_t i = 0; i < counts[6]; i++) {
+        size_t line_no = 0;
+        int fused = 0;
+        sscanf(asmopt_cache_field(&cursor, end), "%zu %d", &line_no, &fused);
+        const char* branch = asmopt_cache_field(&cursor, end);
+        asmopt_record_fusion(ctx, line_no + first_line, branch, fused != 0);
+    }
+    ctx->fusion_pairs_before += counts[7];
+    ctx->fusion_pairs_after += counts[8];
+    for (size_t i = 0; i < counts[9]; i++) {
+        size_t line_no = 0;
+        unsigned cycles = 0;
+        int diamond = 0;
+        sscanf(asmopt_cache_field(&cursor, end), "%zu %u %d", &line_no, &cycles, &diamond);
+        const char* branch = asmopt_cache_field(&cursor, end);
+        const char* select = asmopt_cache_field(&cursor, end);
+        asmopt_record_if_convert(ctx, line_no + first_line, branch, select, cycles, diamond != 0);
+    }
+    for (size_t i = 0; i < counts[10]; i++) {
+        size_t line_no = strtoul(asmopt_cache_field(&cursor, end), NULL, 10);
+        const char* label = asmopt_cache_field(&cursor, end);
+        const char* before = asmopt_cache_field(&cursor, end);
+        const char* after = asmopt_cache_field(&cursor, end);
+        asmopt_record_loop_opt(ctx, line_no + first_line, label, before, after[0] != '\0' ? after : NULL);
+    }
+    return true;
+}
 
-    /* Pattern 19: and rax, rax -> test rax, rax */
-    if (strcmp(base_mnemonic, "and") == 0 && has_two_ops && dest_reg && src_reg) {
-        if (asmopt_casecmp(dest, src) == 0) {
-            char test_name[8];
-            if (suffix) {
-                snprintf(test_name, sizeof(test_name), "test%c", suffix);
-            } else {
-                snprintf(test_name, sizeof(test_name), "test");
-            }
-            char* trimmed_comment = asmopt_trim_comment(comment);
-            size_t new_len = strlen(indent) + strlen(test_name) + strlen(spacing) +
-                             strlen(dest) + strlen(pre_space) + strlen(post_space) + strlen(dest) + 2;
-            if (!asmopt_is_blank(trimmed_comment)) {
-                new_len += strlen(trimmed_comment) + 1;
-            }
-            char* newline = malloc(new_len + 1);
-            if (newline) {
-                if (!asmopt_is_blank(trimmed_comment)) {
-                    snprintf(newline, new_len + 1, "%s%s%s%s%s,%s%s %s",
-                             indent, test_name, spacing, dest, pre_space, post_space, dest, trimmed_comment);
-                } else {
-                    snprintf(newline, new_len + 1, "%s%s%s%s%s,%s%s",
-                             indent, test_name, spacing, dest, pre_space, post_space, dest);
-                }
-                asmopt_record_optimization(ctx, line_no, "and_self_to_test", line, newline);
-                asmopt_store_optimized_line(ctx, newline);
-                free(newline);
-                *replaced = true;
-            }
-            free(trimmed_comment);
-            goto cleanup;
+/* Keep an entry's storage until ctx drops its output; map_length 0 means heap memory. */
+static bool asmopt_cache_keep(asmopt_context* ctx, char* data, size_t map_length) {
+    if (ctx->cache_data_count == ctx->cache_data_capacity) {
+        size_t new_capacity = ctx->cache_data_capacity == 0 ? 16 : ctx->cache_data_capacity * 2;
+        asmopt_cache_data* next = realloc(ctx->cache_data, sizeof(asmopt_cache_data) * new_capacity);
+        if (!next) {
+            return false;
         }
+        ctx->cache_data = next;
+        ctx->cache_data_capacity = new_capacity;
     }
+    ctx->cache_data[ctx->cache_data_count].data = data;
+    ctx->cache_data[ctx->cache_data_count].map_length = map_length;
+    ctx->cache_data_count++;
+    return true;
+}
 
-    /* Pattern 20: cmp rax, rax -> test rax, rax */
-    if (strcmp(base_mnemonic, "cmp") == 0 && has_two_ops && dest_reg && src_reg) {
-        if (asmopt_casecmp(dest, src) == 0) {
-            char test_name[8];
-            if (suffix) {
-                snprintf(test_name, sizeof(test_name), "test%c", suffix);
-            } else {
-                snprintf(test_name, sizeof(test_name), "test");
-            }
-            char* trimmed_comment = asmopt_trim_comment(comment);
-            size_t new_len = strlen(indent) + strlen(test_name) + strlen(spacing) +
-                             strlen(dest) + strlen(pre_space) + strlen(post_space) + strlen(dest) + 2;
-            if (!asmopt_is_blank(trimmed_comment)) {
-                new_len += strlen(trimmed_comment) + 1;
-            }
-            char* newline = malloc(new_len + 1);
-            if (newline) {
-                if (!asmopt_is_blank(trimmed_comment)) {
-                    snprintf(newline, new_len + 1, "%s%s%s%s%s,%s%s %s",
-                             indent, test_name, spacing, dest, pre_space, post_space, dest, trimmed_comment);
-                } else {
-                    snprintf(newline, new_len + 1, "%s%s%s%s%s,%s%s",
-                             indent, test_name, spacing, dest, pre_space, post_space, dest);
-                }
-                asmopt_record_optimization(ctx, line_no, "cmp_self_to_test", line, newline);
-                asmopt_store_optimized_line(ctx, newline);
-                free(newline);
-                *replaced = true;
-            }
-            free(trimmed_comment);
-            goto cleanup;
+/* Look up path and splice it into ctx; false on a miss. */
+static bool asmopt_cache_lookup(asmopt_context* ctx, const char* path, const char* key, const char* input,
+                                size_t first_line) {
+    asmopt_cache_data entry = {NULL, 0};
+    size_t length = 0;
+#if ASMOPT_HAVE_MMAP
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        length = (size_t)info.st_size;
+        void* mapped = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped != MAP_FAILED) {
+            entry.data = mapped;
+            entry.map_length = length;
         }
     }
+    close(fd);
+#else
+    FILE* handle = fopen(path, "rb");
+    if (handle) {
+        entry.data = asmopt_read_stream(handle, &length);
+        fclose(handle);
+    }
+#endif
+    if (!entry.data) {
+        return false;
+    }
+    if (!asmopt_cache_splice(ctx, entry.data, length, key, input, first_line) ||
+        !asmopt_cache_keep(ctx, entry.data, entry.map_length)) {
+        asmopt_cache_release(&entry);
+        return false;
+    }
+    return true;
+}
 
-    /* Pattern 21: jmp <next label> -> remove (fallthrough) */
-    /* Single-operand jump; commas indicate multi-operand syntax (not expected for jmp). */
-    if (!has_two_ops && operands && *operands && asmopt_is_unconditional_jump(base_mnemonic) && !strchr(operands, ',')) {
-        char* trimmed = asmopt_strip(operands);
-        if (trimmed && *trimmed) {
-            size_t next_index = line_no; /* line_no is 1-based; next line lives at this index */
-            if (next_index < ctx->original_count) {
-                const char* next_line = ctx->original_lines[next_index];
-                char* next_code = NULL;
-                char* next_comment = NULL;
-                asmopt_split_comment(next_line, &next_code, &next_comment);
-                if (next_code && !asmopt_is_blank(next_code)) {
-                    char* next_trimmed = asmopt_strip(next_code);
-                    if (next_trimmed) {
-                        size_t len = strlen(next_trimmed);
-                        if (len > 0 && next_trimmed[len - 1] == ':') {
-                            next_trimmed[len - 1] = '\0';
-                            if (strcmp(next_trimmed, trimmed) == 0) {
-                                asmopt_handle_identity_removal(ctx, line_no, "fallthrough_jump", line, comment, indent, removed);
-                                free(next_trimmed);
-                                free(next_code);
-                                free(next_comment);
-                                free(trimmed);
-                                goto cleanup;
-                            }
-                        }
-                        free(next_trimmed);
-                    }
-                }
-                free(next_code);
-                free(next_comment);
-            }
+/* Write an entry through a temporary file so concurrent builds never see half of one. */
+static void asmopt_cache_store(const char* path, const char* data, size_t length) {
+    char temp[4096];
+#if ASMOPT_HAVE_MMAP
+    snprintf(temp, sizeof(temp), "%s.%ld.tmp", path, (long)getpid());
+#else
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+#endif
+    FILE* handle = fopen(temp, "wb");
+    if (!handle) {
+        return;
+    }
+    bool ok = fwrite(data, 1, length, handle) == length;
+    if (fclose(handle) != 0 || !ok || rename(temp, path) != 0) {
+        remove(temp);
+    }
+}
+
+/* Splice the memo entry stored for this key and unit text; false on a miss. */
+static bool asmopt_memo_lookup(asmopt_context* ctx, uint64_t hash, const char* key, const char* input,
+                               size_t first_line) {
+    size_t low = 0;
+    size_t high = ctx->unit_memo_sorted;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (ctx->unit_memo[mid].hash < hash) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    for (; low < ctx->unit_memo_sorted && ctx->unit_memo[low].hash == hash; low++) {
+        asmopt_unit_memo* entry = &ctx->unit_memo[low];
+        if (asmopt_cache_splice(ctx, entry->data, entry->length, key, input, first_line)) {
+            entry->used = true;
+            return true;
         }
-        free(trimmed);
     }
+    return false;
+}
 
-    /* Pattern 25: jcc label + jmp other + label -> invert conditional jump */
-    if (!has_two_ops && operands && *operands && asmopt_is_conditional_jump(base_mnemonic) && !strchr(operands, ',')) {
-        char inverted[16];
-        if (asmopt_invert_conditional_jump(base_mnemonic, inverted, sizeof(inverted))) {
-            char* cond_target = asmopt_strip(operands);
-            if (cond_target && asmopt_is_label_operand(cond_target)) {
-                size_t next_index = line_no;
-                size_t label_index = line_no + 1;
-                if (next_index < ctx->original_count && label_index < ctx->original_count) {
-                    const char* next_line = ctx->original_lines[next_index];
-                    char* next_code = NULL;
-                    char* next_comment = NULL;
-                    asmopt_split_comment(next_line, &next_code, &next_comment);
-                    if (next_code && !asmopt_is_directive_or_label(next_code)) {
-                        char* next_indent = NULL;
-                        char* next_mnemonic = NULL;
-                        char* next_spacing = NULL;
-                        char* next_operands = NULL;
-                        if (asmopt_parse_instruction(next_code, &next_indent, &next_mnemonic, &next_spacing, &next_operands)) {
-                            char next_lower[32];
-                            size_t next_len = strlen(next_mnemonic);
-                            if (next_len >= sizeof(next_lower)) {
-                                next_len = sizeof(next_lower) - 1;
-                            }
-                            for (size_t i = 0; i < next_len; i++) {
-                                next_lower[i] = (char)tolower((unsigned char)next_mnemonic[i]);
-                            }
-                            next_lower[next_len] = '\0';
-                            if (asmopt_is_unconditional_jump(next_lower) && next_operands && !strchr(next_operands, ',')) {
-                                char* jmp_target = asmopt_strip(next_operands);
-                                if (jmp_target && asmopt_is_label_operand(jmp_target)) {
-                                    const char* label_line = ctx->original_lines[label_index];
-                                    char* label_code = NULL;
-                                    char* label_comment = NULL;
-                                    asmopt_split_comment(label_line, &label_code, &label_comment);
-                                    if (label_code) {
-                                        char* label_trimmed = asmopt_strip(label_code);
-                                        if (label_trimmed) {
-                                            size_t label_len = strlen(label_trimmed);
-                                            if (label_len > 0 && label_trimmed[label_len - 1] == ':') {
-                                                label_trimmed[label_len - 1] = '\0';
-                                                if (strcmp(label_trimmed, cond_target) == 0) {
-                                                    char* trimmed_comment = asmopt_trim_comment(comment);
-                                                    size_t new_len = strlen(indent) + strlen(inverted) + strlen(spacing) + strlen(jmp_target) + 1;
-                                                    if (!asmopt_is_blank(trimmed_comment)) {
-                                                        new_len += strlen(trimmed_comment) + 1;
-                                                    }
-                                                    char* newline = malloc(new_len + 1);
-                                                    if (newline) {
-                                                        if (!asmopt_is_blank(trimmed_comment)) {
-                                                            snprintf(newline, new_len + 1, "%s%s%s%s %s",
-                                                                     indent, inverted, spacing, jmp_target, trimmed_comment);
-                                                        } else {
-                                                            snprintf(newline, new_len + 1, "%s%s%s%s",
-                                                                     indent, inverted, spacing, jmp_target);
-                                                        }
-                                                        size_t combo_len = strlen(line) + strlen(next_line) + 2;
-                                                        char* combined = malloc(combo_len + 1);
-                                                        if (combined) {
-                                                            snprintf(combined, combo_len + 1, "%s\n%s", line, next_line);
-                                                            asmopt_record_optimization(ctx, line_no, "invert_conditional_jump", combined, newline);
-                                                            free(combined);
-                                                        } else {
-                                                            asmopt_record_optimization(ctx, line_no, "invert_conditional_jump", line, newline);
-                                                        }
-                                                        asmopt_store_optimized_line(ctx, newline);
-                                                        free(newline);
-                                                        if (!asmopt_is_blank(next_comment)) {
-                                                            char* trimmed_next = asmopt_trim_comment(next_comment);
-                                                            size_t next_len_comment = strlen(next_indent) + strlen(trimmed_next) + 1;
-                                                            char* comment_line = malloc(next_len_comment + 1);
-                                                            if (comment_line) {
-                                                                snprintf(comment_line, next_len_comment + 1, "%s%s", next_indent, trimmed_next);
-                                                                asmopt_store_optimized_line(ctx, comment_line);
-                                                                free(comment_line);
-                                                            }
-                                                            free(trimmed_next);
-                                                        }
-                                                        *replaced = true;
-                                                        *removed = true;
-                                                        ctx->skip_lines = 1;
-                                                        free(trimmed_comment);
-                                                        free(label_trimmed);
-                                                        free(label_code);
-                                                        free(label_comment);
-                                                        free(jmp_target);
-                                                        free(next_indent);
-                                                        free(next_mnemonic);
-                                                        free(next_spacing);
-                                                        free(next_operands);
-                                                        free(next_code);
-                                                        free(next_comment);
-                                                        free(cond_target);
-                                                        goto cleanup;
-                                                    }
-                                                    free(trimmed_comment);
-                                                }
-                                            }
-                                            free(label_trimmed);
-                                        }
-                                    }
-                                    free(label_code);
-                                    free(label_comment);
-                                }
-                                free(jmp_target);
-                            }
-                        }
-                        free(next_indent);
-                        free(next_mnemonic);
-                        free(next_spacing);
-                        free(next_operands);
-                    }
-                    free(next_code);
-                    free(next_comment);
-                }
-            }
-            free(cond_target);
+static bool asmopt_memo_add(asmopt_context* ctx, uint64_t hash, char* data, size_t length) {
+    if (ctx->unit_memo_count == ctx->unit_memo_capacity) {
+        size_t new_capacity = ctx->unit_memo_capacity == 0 ? 16 : ctx->unit_memo_capacity * 2;
+        asmopt_unit_memo* next = realloc(ctx->unit_memo, sizeof(asmopt_unit_memo) * new_capacity);
+        if (!next) {
+            return false;
         }
+        ctx->unit_memo = next;
+        ctx->unit_memo_capacity = new_capacity;
     }
+    ctx->unit_memo[ctx->unit_memo_count++] = (asmopt_unit_memo){hash, data, length, true};
+    return true;
+}
+
+static int asmopt_memo_compare(const void* a, const void* b) {
+    uint64_t left = ((const asmopt_unit_memo*)a)->hash;
+    uint64_t right = ((const asmopt_unit_memo*)b)->hash;
+    return left < right ? -1 : left > right;
+}
 
-    /* Pattern 23: bsf reg, reg -> tzcnt reg, reg (Zen/BMI1, guarded zero) */
-    if (strcmp(base_mnemonic, "bsf") == 0 && has_two_ops && dest_reg && src_reg && asmopt_is_target_zen(ctx) &&
-        asmopt_is_zero_guarded(ctx, line_no, src, syntax)) {
-        char tzcnt_name[8];
-        asmopt_build_suffixed_name(tzcnt_name, sizeof(tzcnt_name), "tzcnt", suffix);
-        char* trimmed_comment = asmopt_trim_comment(comment);
-        size_t new_len = strlen(indent) + strlen(tzcnt_name) + strlen(spacing) +
-                         strlen(dest) + strlen(pre_space) + strlen(post_space) + strlen(src) + 2;
-        if (!asmopt_is_blank(trimmed_comment)) {
-            new_len += strlen(trimmed_comment) + 1;
+/* Drop the entries the last run did not splice and sort the rest for the next one. */
+static void asmopt_memo_prune(asmopt_context* ctx) {
+    size_t kept = 0;
+    for (size_t i = 0; i < ctx->unit_memo_count; i++) {
+        asmopt_unit_memo entry = ctx->unit_memo[i];
+        if (!entry.used) {
+            free(entry.data);
+            continue;
         }
-        char* newline = malloc(new_len + 1);
-        if (newline) {
-            if (!asmopt_is_blank(trimmed_comment)) {
-                snprintf(newline, new_len + 1, "%s%s%s%s%s,%s%s %s",
-                         indent, tzcnt_name, spacing, dest, pre_space, post_space, src, trimmed_comment);
-            } else {
-                snprintf(newline, new_len + 1, "%s%s%s%s%s,%s%s",
-                         indent, tzcnt_name, spacing, dest, pre_space, post_space, src);
+        entry.used = false;
+        ctx->unit_memo[kept++] = entry;
+    }
+    ctx->unit_memo_count = kept;
+    ctx->unit_memo_sorted = kept;
+    if (kept > 1) {
+        qsort(ctx->unit_memo, kept, sizeof(asmopt_unit_memo), asmopt_memo_compare);
+    }
+}
+
+/*
+ * Optimize one unit in a context of its own and splice the result, storing it
+ * for next time: in the cache file path, or in the memo under hash when path
+ * is NULL.
+ */
+static bool asmopt_cache_fill(asmopt_context* ctx, const char* path, uint64_t hash, const char* key,
+                              const char* syntax, const char* input, size_t first_line) {
+    asmopt_context* unit = asmopt_clone_settings(ctx, false, false);
+    if (!unit) {
+        return false;
+    }
+    asmopt_set_format(unit, syntax);
+    bool ok = asmopt_parse_string(unit, input) == 0 && asmopt_optimize(unit) == 0;
+    size_t length = 0;
+    char* entry = ok ? asmopt_cache_entry(unit, key, input, &length) : NULL;
+    asmopt_destroy(unit);
+    if (!entry) {
+        return false;
+    }
+    if (path) {
+        asmopt_cache_store(path, entry, length);
+    }
+    if (!asmopt_cache_splice(ctx, entry, length, key, input, first_line) ||
+        !(path ? asmopt_cache_keep(ctx, entry, 0) : asmopt_memo_add(ctx, hash, entry, length))) {
+        free(entry);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * The optimization passes through a result cache in dir, or through the
+ * in-memory memo when dir is NULL; false if some unit could not be optimized.
+ */
+static bool asmopt_optimize_cached(asmopt_context* ctx, const char* dir, const char* syntax) {
+    size_t* starts = NULL;
+    size_t unit_count = asmopt_cache_units(ctx, &starts);
+    char* key = unit_count > 0 ? asmopt_cache_key(ctx, syntax) : NULL;
+    if (!key) {
+        free(starts);
+        return false;
+    }
+#if ASMOPT_HAVE_MMAP
+    if (dir) {
+        mkdir(dir, 0777);
+    }
+#endif
+    uint64_t key_hash = asmopt_fnv1a(0xcbf29ce484222325ull, key, strlen(key) + 1);
+    asmopt_buffer input = {0};
+    bool ok = asmopt_buffer_reserve(&input, 0);
+    for (size_t u = 0; u < unit_count && ok; u++) {
+        input.length = 0;
+        for (size_t i = starts[u]; i < starts[u + 1]; i++) {
+            if (i > starts[u]) {
+                asmopt_buffer_append_n(&input, "\n", 1);
             }
-            asmopt_record_optimization(ctx, line_no, "bsf_to_tzcnt", line, newline);
-            asmopt_store_optimized_line(ctx, newline);
-            free(newline);
-            *replaced = true;
+            asmopt_buffer_append(&input, ctx->original_lines[i]);
+        }
+        if (input.failed) {
+            ok = false;
+            break;
+        }
+        uint64_t hash = asmopt_fnv1a(key_hash, input.data, input.length);
+        if (!dir) {
+            ok = asmopt_memo_lookup(ctx, hash, key, input.data, starts[u]) ||
+                 asmopt_cache_fill(ctx, NULL, hash, key, syntax, input.data, starts[u]);
+            continue;
+        }
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%016llx.asmopt", dir, (unsigned long long)hash);
+        if (!asmopt_cache_lookup(ctx, path, key, input.data, starts[u])) {
+            ok = asmopt_cache_fill(ctx, path, hash, key, syntax, input.data, starts[u]);
         }
-        free(trimmed_comment);
-        goto cleanup;
     }
+    if (!dir) {
+        asmopt_memo_prune(ctx);
+    }
+    free(input.data);
+    free(key);
+    free(starts);
+    return ok;
+}
 
-    /* bsr -> lzcnt not applied: not semantically equivalent. */
+/* -O1 runs one pass; each level above doubles the number of fixpoint passes allowed. */
+static size_t asmopt_pass_limit(asmopt_context* ctx) {
+    if (ctx->optimization_level <= 1) {
+        return 1;
+    }
+    size_t passes = (size_t)1 << (ctx->optimization_level - 1);
+    return passes > ASMOPT_MAX_PASSES ? ASMOPT_MAX_PASSES : passes;
+}
+
+static void asmopt_worklist_release(asmopt_worklist* worklist) {
+    free(worklist->sources);
+    free(worklist->touched);
+    worklist->sources = NULL;
+    worklist->touched = NULL;
+    worklist->capacity = 0;
+}
 
-    /* Pattern 3: imul/mul rax, 1 -> remove (identity) */
-    if (strcmp(base_mnemonic, "imul") == 0 && has_two_ops) {
-        if (dest_reg && asmopt_is_immediate_one(src, syntax)) {
-            asmopt_handle_identity_removal(ctx, line_no, "mul_by_one", line, comment, indent, removed);
-            goto cleanup;
+/*
+ * Carry the last pass's worklist into line_origins: optimized line i came from
+ * input line sources[i], which started as original line origins[sources[i]],
+ * and was copied through if it still points at that line's text.
+ */
+static void asmopt_keep_line_origins(asmopt_context* ctx, char** lines, size_t ir_count, const size_t* origins) {
+    size_t count = ctx->optimized_count;
+    ctx->line_origin_count = 0;
+    if (!ctx->worklist.enabled) {
+        return;
+    }
+    if (count > ctx->line_origin_capacity) {
+        size_t* next = realloc(ctx->line_origins, sizeof(size_t) * count);
+        if (!next) {
+            return;
         }
-        
-        /* Pattern 4: imul rax, power_of_2 -> shl rax, log2(power_of_2) */
-        bool success = false;
-        long imm_val = asmopt_parse_immediate(src, syntax, &success);
-        if (dest_reg && success && asmopt_is_power_of_two(imm_val)) {
-            int shift_amount = asmopt_log2(imm_val);
-            char shl_name[8];
-            if (suffix) {
-                snprintf(shl_name, sizeof(shl_name), "shl%c", suffix);
-            } else {
-                snprintf(shl_name, sizeof(shl_name), "shl");
+        ctx->line_origins = next;
+        ctx->line_origin_capacity = count;
+        ASMOPT_PROFILE_BYTES(ctx, sizeof(size_t) * count);
+    }
+    for (size_t i = 0; i < count; i++) {
+        size_t origin = origins ? origins[ctx->worklist.sources[i]] - 1 : ctx->worklist.sources[i];
+        ctx->line_origins[i] = origin < ir_count && ctx->optimized_lines[i] == lines[origin] ? origin : ir_count;
+    }
+    ctx->line_origin_count = count;
+}
+
+/*
+ * Re-run the patterns over the output of the first pass until nothing changes
+ * or the pass limit is reached. Each pass takes the previous optimized lines as
+ * its input, and only lines within reach of a rewrite are tokenized and
+ * examined again. Hot-loop alignment and
+ * the scheduling swap are not idempotent, so they only run in the first pass.
+ */
+static void asmopt_optimize_fixpoint(asmopt_context* ctx, const char* syntax, bool att, size_t passes) {
+    char** saved_lines = ctx->original_lines;
+    size_t saved_count = ctx->original_count;
+    asmopt_ir_line* saved_ir = ctx->ir;
+    size_t saved_ir_count = ctx->ir_count;
+    uint64_t saved_mask = ctx->pattern_mask;
+    ctx->pattern_mask &= ~(ASMOPT_PATTERN_BIT(ASMOPT_PATTERN_HOT_LOOP_ALIGN) |
+                           ASMOPT_PATTERN_BIT(ASMOPT_PATTERN_SCHEDULE_SWAP_MOVE));
+    size_t* origins = NULL;
+    bool* visit = NULL;
+    for (size_t pass = 1; pass < passes && ctx->worklist.enabled && ctx->optimized_count > 0; pass++) {
+        size_t count = ctx->optimized_count;
+        bool* next_visit = calloc(count, sizeof(bool));
+        size_t* next_origins = malloc(sizeof(size_t) * count);
+        asmopt_ir_line* next_ir = calloc(count, sizeof(asmopt_ir_line));
+        if (!next_visit || !next_origins || !next_ir) {
+            free(next_visit);
+            free(next_origins);
+            free(next_ir);
+            break;
+        }
+        size_t pending = 0;
+        for (size_t i = 0; i <= count; i++) {
+            if (!ctx->worklist.touched[i]) {
+                continue;
             }
-            char shift_str[16];
-            if (syntax && strcmp(syntax, "att") == 0) {
-                snprintf(shift_str, sizeof(shift_str), "$%d", shift_amount);
-            } else {
-                snprintf(shift_str, sizeof(shift_str), "%d", shift_amount);
+            size_t from = i > ASMOPT_PATTERN_READ_AHEAD ? i - ASMOPT_PATTERN_READ_AHEAD : 0;
+            size_t to = i + ASMOPT_PATTERN_READ_BEHIND < count ? i + ASMOPT_PATTERN_READ_BEHIND + 1 : count;
+            for (size_t j = from; j < to; j++) {
+                pending += !next_visit[j];
+                next_visit[j] = true;
             }
-            char* trimmed_comment = asmopt_trim_comment(comment);
-            size_t new_len = strlen(indent) + strlen(shl_name) + strlen(spacing) + 
-                            strlen(dest) + strlen(pre_space) + strlen(post_space) + strlen(shift_str) + 2;
-            if (!asmopt_is_blank(trimmed_comment)) {
-                new_len += strlen(trimmed_comment) + 1;
+        }
+        if (pending == 0) {
+            free(next_visit);
+            free(next_origins);
+            free(next_ir);
+            break;
+        }
+        /* Only the lines visited lines can read are tokenized; the rest of next_ir stays untouched. */
+        size_t filled = 0;
+        for (size_t i = 0; i < count; i++) {
+            size_t source = ctx->worklist.sources[i];
+            next_origins[i] = origins ? origins[source] : source + 1;
+            if (!next_visit[i]) {
+                continue;
             }
-            char* newline = malloc(new_len + 1);
-            if (newline) {
-                if (!asmopt_is_blank(trimmed_comment)) {
-                    snprintf(newline, new_len + 1, "%s%s%s%s%s,%s%s %s", 
-                            indent, shl_name, spacing, dest, pre_space, post_space, shift_str, trimmed_comment);
-                } else {
-                    snprintf(newline, new_len + 1, "%s%s%s%s%s,%s%s", 
-                            indent, shl_name, spacing, dest, pre_space, post_space, shift_str);
-                }
-                asmopt_record_optimization(ctx, line_no, "mul_power_of_2_to_shift", line, newline);
-                asmopt_store_optimized_line(ctx, newline);
-                free(newline);
-                *replaced = true;
+            size_t from = i > ASMOPT_PATTERN_READ_BEHIND ? i - ASMOPT_PATTERN_READ_BEHIND : 0;
+            size_t to = i + ASMOPT_PATTERN_READ_AHEAD < count ? i + ASMOPT_PATTERN_READ_AHEAD + 1 : count;
+            for (size_t j = from > filled ? from : filled; j < to; j++) {
+                asmopt_tokenize_line(ctx, ctx->optimized_lines[j], syntax, &next_ir[j].insn);
             }
-            free(trimmed_comment);
-            goto cleanup;
+            filled = to;
         }
-    }
-    
-    /* Pattern 5: add/sub rax, 0 -> remove (identity) */
-    if ((strcmp(base_mnemonic, "add") == 0 || strcmp(base_mnemonic, "sub") == 0) && has_two_ops) {
-        if (dest_reg && asmopt_is_immediate_zero(src, syntax)) {
-            asmopt_handle_identity_removal(ctx, line_no, "add_sub_zero", line, comment, indent, removed);
-            goto cleanup;
+        ASMOPT_PROFILE_BYTES(ctx, count * (sizeof(bool) + sizeof(size_t)));
+        char** input_lines = ctx->original_lines;
+        asmopt_ir_line* input_ir = ctx->ir;
+        ctx->original_lines = ctx->optimized_lines;
+        ctx->original_count = count;
+        ctx->ir = next_ir;
+        ctx->ir_count = count;
+        ctx->optimized_lines = NULL;
+        ctx->optimized_count = 0;
+        ctx->optimized_capacity = 0;
+        asmopt_worklist_release(&ctx->worklist);
+        free(origins);
+        free(visit);
+        origins = next_origins;
+        visit = next_visit;
+        ctx->worklist.origins = origins;
+        ctx->worklist.visit = visit;
+        if (input_lines != saved_lines) {
+            free(input_lines);
         }
-    }
-    
-    /* Pattern 6: shl/shr rax, 0 -> remove (identity) */
-    if ((strcmp(base_mnemonic, "shl") == 0 || strcmp(base_mnemonic, "shr") == 0 || 
-         strcmp(base_mnemonic, "sal") == 0 || strcmp(base_mnemonic, "sar") == 0) && has_two_ops) {
-        if (dest_reg && asmopt_is_immediate_zero(src, syntax)) {
-            asmopt_handle_identity_removal(ctx, line_no, "shift_by_zero", line, comment, indent, removed);
-            goto cleanup;
+        if (input_ir != saved_ir) {
+            free(input_ir);
         }
+        asmopt_optimize_range(ctx, 0, count, att);
+    }
+    asmopt_keep_line_origins(ctx, saved_lines, saved_ir_count, origins);
+    if (ctx->original_lines != saved_lines) {
+        free(ctx->original_lines);
+    }
+    if (ctx->ir != saved_ir) {
+        free(ctx->ir);
+    }
+    free(origins);
+    free(visit);
+    asmopt_worklist_release(&ctx->worklist);
+    memset(&ctx->worklist, 0, sizeof(ctx->worklist));
+    ctx->original_lines = saved_lines;
+    ctx->original_count = saved_count;
+    ctx->ir = saved_ir;
+    ctx->ir_count = saved_ir_count;
+    ctx->pattern_mask = saved_mask;
+}
+
+static void asmopt_record_vex_transition(asmopt_context* ctx, size_t line_no, size_t avx_line,
+                                         const char* instruction) {
+    if (ctx->streaming || !instruction) {
+        return;
     }
-    
-    /* Pattern 7: or rax, 0 -> remove (identity) */
-    if (strcmp(base_mnemonic, "or") == 0 && has_two_ops) {
-        if (dest_reg && asmopt_is_immediate_zero(src, syntax)) {
-            asmopt_handle_identity_removal(ctx, line_no, "or_zero", line, comment, indent, removed);
-            goto cleanup;
+    if (ctx->vex_transition_event_count >= ctx->vex_transition_event_capacity) {
+        size_t new_capacity = ctx->vex_transition_event_capacity == 0 ? 16 : ctx->vex_transition_event_capacity * 2;
+        asmopt_vex_transition_event* next =
+            realloc(ctx->vex_transition_events, sizeof(asmopt_vex_transition_event) * new_capacity);
+        if (!next) {
+            return;
         }
-    }
-    
-    /* Pattern 8: xor rax, 0 -> remove (identity) */
-    if (strcmp(base_mnemonic, "xor") == 0 && has_two_ops) {
-        if (dest_reg && asmopt_is_immediate_zero(src, syntax)) {
-            asmopt_handle_identity_removal(ctx, line_no, "xor_zero", line, comment, indent, removed);
-            goto cleanup;
+        ctx->vex_transition_events = next;
+        ctx->vex_transition_event_capacity = new_capacity;
+        ASMOPT_PROFILE_BYTES(ctx, sizeof(asmopt_vex_transition_event) * new_capacity);
+    }
+    asmopt_vex_transition_event* event = &ctx->vex_transition_events[ctx->vex_transition_event_count++];
+    event->line_no = line_no;
+    event->avx_line = avx_line;
+    event->instruction = instruction;
+}
+
+/*
+ * Report AVX/SSE transitions in the input. A v-prefixed instruction naming a
+ * ymm or zmm register dirties the upper halves; vzeroupper or vzeroall cleans
+ * them, and every function label starts clean. A legacy SSE instruction (an
+ * xmm operand without the v prefix) reached while dirty pays a state
+ * transition or a merge with the upper halves, and a call or ret hands dirty
+ * state to code that expects it clean. Each is reported once, then the state
+ * counts as clean. Nothing is inserted: a vzeroupper is only safe where no
+ * upper half holds a live value, which liveness does not track.
+ */
+static void asmopt_check_vex_transitions(asmopt_context* ctx) {
+    size_t dirty = 0;
+    for (size_t i = 0; i < ctx->ir_count; i++) {
+        const asmopt_insn* insn = &ctx->ir[i].insn;
+        if (asmopt_is_function_label(insn)) {
+            dirty = 0;
+            continue;
         }
-    }
-    
-    /* Pattern 9: and rax, -1 -> remove (identity, all bits set) */
-    if (strcmp(base_mnemonic, "and") == 0 && has_two_ops) {
-        if (dest_reg && asmopt_is_immediate_minus_one(src, syntax)) {
-            asmopt_handle_identity_removal(ctx, line_no, "and_minus_one", line, comment, indent, removed);
-            goto cleanup;
+        if (!insn->is_instruction) {
+            continue;
         }
-    }
-    
-    /* Pattern 10: add rax, 1 -> inc rax (smaller encoding) */
-    if (strcmp(base_mnemonic, "add") == 0 && has_two_ops) {
-        if (dest_reg && asmopt_is_immediate_one(src, syntax)) {
-            char inc_name[16];  /* Increased buffer size for safety */
-            if (suffix) {
-                snprintf(inc_name, sizeof(inc_name), "inc%c", suffix);
-            } else {
-                snprintf(inc_name, sizeof(inc_name), "inc");
-            }
-            char* trimmed_comment = asmopt_trim_comment(comment);
-            size_t new_len = strlen(indent) + strlen(inc_name) + strlen(spacing) + strlen(dest) + 2;
-            if (!asmopt_is_blank(trimmed_comment)) {
-                new_len += strlen(trimmed_comment) + 1;
-            }
-            char* newline = malloc(new_len + 1);
-            if (newline) {
-                if (!asmopt_is_blank(trimmed_comment)) {
-                    snprintf(newline, new_len + 1, "%s%s%s%s %s", 
-                            indent, inc_name, spacing, dest, trimmed_comment);
-                } else {
-                    snprintf(newline, new_len + 1, "%s%s%s%s", 
-                            indent, inc_name, spacing, dest);
-                }
-                asmopt_record_optimization(ctx, line_no, "add_one_to_inc", line, newline);
-                asmopt_store_optimized_line(ctx, newline);
-                free(newline);
-                *replaced = true;
-            }
-            free(trimmed_comment);
-            goto cleanup;
+        asmopt_view name = insn->mnemonic_text;
+        if (asmopt_view_is(name, "vzeroupper") || asmopt_view_is(name, "vzeroall")) {
+            dirty = 0;
+            continue;
         }
-    }
-    
-    /* Pattern 11: sub rax, 1 -> dec rax (smaller encoding) */
-    if (strcmp(base_mnemonic, "sub") == 0 && has_two_ops) {
-        if (dest_reg && asmopt_is_immediate_one(src, syntax)) {
-            char dec_name[16];  /* Increased buffer size for safety */
-            if (suffix) {
-                snprintf(dec_name, sizeof(dec_name), "dec%c", suffix);
-            } else {
-                snprintf(dec_name, sizeof(dec_name), "dec");
+        bool vex = tolower((unsigned char)name.ptr[0]) == 'v';
+        bool wide = false;
+        bool legacy = false;
+        asmopt_view pieces[4];
+        size_t count = insn->operands_trimmed.len == 0 ? 0 : asmopt_split_operand_list(insn->operands_trimmed, pieces, 4);
+        for (size_t k = 0; k < count && k < 4; k++) {
+            asmopt_view piece = pieces[k];
+            const char* mask = memchr(piece.ptr, '{', piece.len);
+            if (mask) {
+                piece.len = (size_t)(mask - piece.ptr);
             }
-            char* trimmed_comment = asmopt_trim_comment(comment);
-            size_t new_len = strlen(indent) + strlen(dec_name) + strlen(spacing) + strlen(dest) + 2;
-            if (!asmopt_is_blank(trimmed_comment)) {
-                new_len += strlen(trimmed_comment) + 1;
+            unsigned width = 0;
+            if (asmopt_reg_class(piece, &width) >= ASMOPT_REG_VECTOR0) {
+                wide = wide || width > 128;
+                legacy = legacy || !vex;
             }
-            char* newline = malloc(new_len + 1);
-            if (newline) {
-                if (!asmopt_is_blank(trimmed_comment)) {
-                    snprintf(newline, new_len + 1, "%s%s%s%s %s", 
-                            indent, dec_name, spacing, dest, trimmed_comment);
-                } else {
-                    snprintf(newline, new_len + 1, "%s%s%s%s", 
-                            indent, dec_name, spacing, dest);
-                }
-                asmopt_record_optimization(ctx, line_no, "sub_one_to_dec", line, newline);
-                asmopt_store_optimized_line(ctx, newline);
-                free(newline);
-                *replaced = true;
+        }
+        if (vex && wide) {
+            if (dirty == 0) {
+                dirty = i + 1;
             }
-            free(trimmed_comment);
-            goto cleanup;
+            continue;
+        }
+        bool leaves = insn->mnemonic == ASMOPT_MN_RET || asmopt_view_is(name, "call") || asmopt_view_is(name, "callq");
+        if (dirty > 0 && (legacy || leaves)) {
+            asmopt_record_vex_transition(ctx, i + 1, dirty, asmopt_emit(ctx, &insn->code, 1));
+            dirty = 0;
         }
     }
-    
-    /* No optimization applied, store original */
-    asmopt_store_optimized_line(ctx, line);
-
-cleanup:
-    free(code);
-    free(comment);
-    free(indent);
-    free(mnemonic);
-    free(spacing);
-    free(operands);
-    free(op1);
-    free(op2);
-    free(pre_space);
-    free(post_space);
-}
-
-static bool asmopt_is_unconditional_jump(const char* mnemonic) {
-    return asmopt_is_jump_mnemonic(mnemonic) && !asmopt_is_conditional_jump(mnemonic);
 }
 
-static bool asmopt_is_jump_mnemonic(const char* mnemonic) {
-    if (!mnemonic) {
-        return false;
+int asmopt_optimize(asmopt_context* ctx) {
+    if (!ctx || ctx->original_count == 0) {
+        return -1;
     }
-    const char* jumps[] = {
-        "jo",   "jno",  "js",   "jns",  "je",   "jz",   "jne",  "jnz",
-        "jb",   "jnae", "jc",   "jnb",  "jae",  "jnc",  "jbe",  "jna",
-        "ja",   "jnbe", "jl",   "jnge", "jge",  "jnl",  "jle",  "jng",
-        "jg",   "jnle", "jp",   "jpe",  "jnp",  "jpo",  "jcxz", "jecxz",
-        "jrcxz","jmp",  "jmpq", "jmpl", "jmpw"
-    };
-    size_t count = sizeof(jumps) / sizeof(jumps[0]);
-    for (size_t i = 0; i < count; i++) {
-        if (asmopt_casecmp(mnemonic, jumps[i]) == 0) {
-            return true;
+    char* syntax = asmopt_detect_syntax(ctx);
+    ctx->stats.original_lines = ctx->original_count;
+    ctx->stats.optimized_lines = 0;
+    ctx->stats.replacements = 0;
+    ctx->stats.removals = 0;
+    bool profiling = ASMOPT_PROFILING(ctx);
+    double phase_start = profiling ? asmopt_now() : 0.0;
+    bool att = syntax && strcmp(syntax, "att") == 0;
+    /* A passthrough run never looks at the IR; dumps build it on demand. After an edit it is already current. */
+    asmopt_reset_cfg(ctx);
+    bool keep_ir = ctx->incremental && ctx->ir_count == ctx->original_count && ctx->ir_att == att;
+    if (!keep_ir) {
+        asmopt_reset_ir(ctx);
+    }
+    bool do_opt = asmopt_should_optimize(ctx);
+    if (do_opt) {
+        if (!keep_ir) {
+            asmopt_build_ir(ctx, syntax);
         }
+        do_opt = ctx->ir_count == ctx->original_count;
+    }
+    if (profiling) {
+        double now = asmopt_now();
+        ctx->profile.ir_seconds += now - phase_start;
+        phase_start = now;
+    }
+    /* Incremental mode keeps its units in memory rather than in cache_dir. */
+    const char* cache_dir = ctx->streaming || ctx->incremental ? NULL : asmopt_option_value(ctx, "cache_dir");
+    bool cached = do_opt && ((ctx->incremental && !ctx->streaming) || (cache_dir && cache_dir[0] != '\0'));
+    /* Cached units are optimized in their own contexts; only a full run needs the CFG. */
+    if (do_opt && !cached) {
+        asmopt_build_cfg(ctx);
+        asmopt_build_liveness(ctx);
+    }
+    if (profiling) {
+        double now = asmopt_now();
+        ctx->profile.cfg_seconds += now - phase_start;
+        phase_start = now;
     }
-    return false;
-}
-
-static bool asmopt_is_label_operand(const char* operand) {
-    if (!operand) {
-        return false;
+    ctx->insert_hot_align = asmopt_option_enabled(ctx, "hot_align");
+    ctx->cpu_model = asmopt_select_cpu_model(ctx);
+    if (cached && !asmopt_optimize_cached(ctx, cache_dir, syntax)) {
+        /* Start over without the cache. */
+        ctx->optimized_count = 0;
+        ctx->stats.replacements = 0;
+        ctx->stats.removals = 0;
+        asmopt_reset_opt_events(ctx);
+        asmopt_build_cfg(ctx);
+        asmopt_build_liveness(ctx);
+        cached = false;
+    }
+    if (!do_opt) {
+        for (size_t i = 0; i < ctx->original_count; i++) {
+            asmopt_store_optimized_line(ctx, ctx->original_lines[i]);
+        }
+    } else if (!cached) {
+        bool done = false;
+        size_t passes = asmopt_pass_limit(ctx);
+        ctx->worklist.enabled = passes > 1;
+        ctx->line_origin_count = 0;
+#if ASMOPT_HAVE_THREADS
+        size_t threads = asmopt_thread_count(ctx);
+        if (threads > 1) {
+            done = asmopt_optimize_parallel(ctx, threads, att);
+        }
+#endif
+        if (!done) {
+            asmopt_optimize_range(ctx, 0, ctx->original_count, att);
+        }
+        if (passes > 1) {
+            asmopt_optimize_fixpoint(ctx, syntax, att, passes);
+        }
+        if (ctx->optimization_level >= 2 && !asmopt_is_disabled(ctx, "if_convert")) {
+            asmopt_if_convert(ctx, syntax);
+        }
+        /* Strength reduction adds a line above the loop for each one it rewrites, so -Os keeps the multiply. */
+        if (ctx->optimization_level >= 2) {
+            asmopt_optimize_loops(ctx, syntax, !asmopt_is_disabled(ctx, "licm"),
+                                  !ctx->optimize_size && !asmopt_is_disabled(ctx, "loop_strength"));
+        }
+        if (ctx->optimization_level >= 2 && !asmopt_is_disabled(ctx, "schedule")) {
+            asmopt_schedule_lines(ctx, syntax);
+        }
+        /* Alignment padding is all cost under -Os. */
+        if (ctx->optimization_level >= 2 && !ctx->optimize_size && !asmopt_is_disabled(ctx, "loop_align")) {
+            asmopt_align_loops(ctx, syntax);
+        }
     }
-    const char* op = operand;
-    while (*op == '*') {
-        op++;
+    /* A whole-file check on the input, so cached and incremental runs report it too. */
+    if (do_opt && !asmopt_is_disabled(ctx, "vex_transition")) {
+        asmopt_check_vex_transitions(ctx);
     }
-    if (!isalpha((unsigned char)*op) && *op != '_' && *op != '.') {
-        return false;
+    if (profiling) {
+        ctx->profile.peephole_seconds += asmopt_now() - phase_start;
     }
-    for (const char* ptr = op; *ptr; ptr++) {
-        if (!isalnum((unsigned char)*ptr) && *ptr != '_' && *ptr != '.') {
-            return false;
-        }
+    if (!do_opt) {
+        ctx->stats.optimized_lines = ctx->original_count;
+    } else {
+        ctx->stats.optimized_lines = ctx->optimized_count;
     }
-    return true;
+    free(syntax);
+    return 0;
 }
 
-static bool asmopt_is_conditional_jump(const char* mnemonic) {
-    if (!mnemonic) {
-        return false;
-    }
-    const char* jumps[] = {
-        "jo", "jno", "js", "jns", "je", "jz", "jne", "jnz",
-        "jb", "jnae", "jc", "jnb", "jae", "jnc", "jbe", "jna",
-        "ja", "jnbe", "jl", "jnge", "jge", "jnl", "jle", "jng",
-        "jg", "jnle", "jp", "jpe", "jnp", "jpo", "jcxz", "jecxz", "jrcxz"
-    };
-    size_t count = sizeof(jumps) / sizeof(jumps[0]);
-    for (size_t i = 0; i < count; i++) {
-        if (asmopt_casecmp(mnemonic, jumps[i]) == 0) {
-            return true;
+/* Move the views of a record tokenized from old_line onto the same bytes at new_line. */
+static void asmopt_rebase_insn(asmopt_insn* insn, const char* old_line, const char* new_line) {
+    const char* end = old_line + strlen(old_line);
+    asmopt_view* views[] = {&insn->code,      &insn->label,           &insn->indent,  &insn->mnemonic_text,
+                            &insn->spacing,   &insn->operands,        &insn->comment, &insn->operands_trimmed,
+                            &insn->pre_space, &insn->post_space,      &insn->ops[0].text, &insn->ops[1].text};
+    for (size_t i = 0; i < sizeof(views) / sizeof(views[0]); i++) {
+        if (views[i]->ptr && views[i]->ptr >= old_line && views[i]->ptr <= end) {
+            views[i]->ptr = new_line + (views[i]->ptr - old_line);
         }
     }
-    return false;
 }
 
-static bool asmopt_invert_conditional_jump(const char* mnemonic, char* buffer, size_t size) {
-    if (!mnemonic || !buffer || size == 0) {
-        return false;
+/*
+ * Replace removed lines starting at line first_line (1-based) with the lines of
+ * new_text and optimize again. The text is rebuilt in one buffer and the IR
+ * records of untouched lines are moved onto it, so only the new lines are
+ * tokenized; asmopt_optimize then reuses the memoized result of every unit
+ * whose text did not change.
+ */
+int asmopt_apply_edit(asmopt_context* ctx, size_t first_line, size_t removed, const char* new_text) {
+    if (!ctx || ctx->original_count == 0 || first_line == 0 || first_line - 1 > ctx->original_count ||
+        removed > ctx->original_count - (first_line - 1)) {
+        return -1;
     }
-    const char* pairs[][2] = {
-        {"je", "jne"}, {"jz", "jnz"}, {"jne", "je"}, {"jnz", "jz"},
-        {"jb", "jnb"}, {"jnae", "jae"}, {"jc", "jnc"},
-        {"jnb", "jb"}, {"jae", "jnae"}, {"jnc", "jc"},
-        {"jbe", "ja"}, {"jna", "ja"}, {"ja", "jbe"}, {"jnbe", "jbe"},
-        {"jl", "jge"}, {"jnge", "jge"}, {"jge", "jl"}, {"jnl", "jl"},
-        {"jle", "jg"}, {"jng", "jg"}, {"jg", "jle"}, {"jnle", "jle"},
-        {"jo", "jno"}, {"jno", "jo"}, {"js", "jns"}, {"jns", "js"},
-        {"jp", "jnp"}, {"jpe", "jpo"}, {"jnp", "jp"}, {"jpo", "jpe"}
-    };
-    for (size_t i = 0; i < sizeof(pairs) / sizeof(pairs[0]); i++) {
-        if (asmopt_casecmp(mnemonic, pairs[i][0]) == 0) {
-            snprintf(buffer, size, "%s", pairs[i][1]);
-            return true;
+    double start = ASMOPT_PROFILING(ctx) ? asmopt_now() : 0.0;
+    size_t first = first_line - 1;
+    size_t count = ctx->original_count;
+    /* A final newline ends the last new line instead of starting another. */
+    size_t new_length = new_text ? strlen(new_text) : 0;
+    size_t added = new_length > 0 ? 1 : 0;
+    if (new_length > 0 && new_text[new_length - 1] == '\n') {
+        new_length--;
+    }
+    for (size_t i = 0; i < new_length; i++) {
+        added += new_text[i] == '\n';
+    }
+    if (count - removed + added == 0) {
+        added = 1;
+    }
+    size_t next_count = count - removed + added;
+    /* Lines are NUL-separated slices of original_text, so each region is one byte range. */
+    char* old_text = ctx->original_text;
+    size_t text_end = (size_t)(ctx->original_lines[count - 1] - old_text) + strlen(ctx->original_lines[count - 1]) + 1;
+    size_t head = first < count ? (size_t)(ctx->original_lines[first] - old_text) : text_end;
+    size_t tail = first + removed < count ? (size_t)(ctx->original_lines[first + removed] - old_text) : text_end;
+    size_t inserted = added > 0 ? new_length + 1 : 0;
+    size_t total = head + inserted + (text_end - tail);
+    bool keep_ir = ctx->ir_count == count;
+    char* text = malloc(total);
+    if (!text) {
+        return -1;
+    }
+    if (ctx->original_capacity < next_count) {
+        char** lines = realloc(ctx->original_lines, sizeof(char*) * next_count);
+        if (!lines) {
+            free(text);
+            return -1;
+        }
+        ctx->original_lines = lines;
+        ctx->original_capacity = next_count;
+    }
+    if (keep_ir && ctx->ir_capacity < next_count) {
+        asmopt_ir_line* ir = realloc(ctx->ir, sizeof(asmopt_ir_line) * next_count);
+        if (!ir) {
+            free(text);
+            return -1;
+        }
+        ctx->ir = ir;
+        ctx->ir_capacity = next_count;
+    }
+    memcpy(text, old_text, head);
+    if (new_length > 0) {
+        memcpy(text + head, new_text, new_length);
+    }
+    if (inserted > 0) {
+        text[head + new_length] = '\0';
+    }
+    memcpy(text + head + inserted, old_text + tail, text_end - tail);
+    char** lines = ctx->original_lines;
+    size_t suffix = count - first - removed;
+    memmove(lines + first + added, lines + first + removed, sizeof(char*) * suffix);
+    if (keep_ir) {
+        memmove(ctx->ir + first + added, ctx->ir + first + removed, sizeof(asmopt_ir_line) * suffix);
+    }
+    char* line = text + head;
+    for (size_t i = first; i < first + added; i++) {
+        lines[i] = line;
+        line += strcspn(line, "\n");
+        if (*line == '\n') {
+            *line++ = '\0';
         }
     }
-    return false;
+    /* Renumber and rebase the untouched records, and re-intern every operand in line order. */
+    const char* syntax = ctx->ir_att ? "att" : "intel";
+    asmopt_intern_reset(&ctx->operand_names);
+    for (size_t i = 0; i < next_count; i++) {
+        bool fresh = i >= first && i < first + added;
+        if (!fresh) {
+            const char* old_line = lines[i];
+            size_t offset = (size_t)(old_line - old_text);
+            lines[i] = text + (i < first ? offset : offset - tail + head + inserted);
+            if (keep_ir) {
+                asmopt_rebase_insn(&ctx->ir[i].insn, old_line, lines[i]);
+            }
+        }
+        if (!keep_ir) {
+            continue;
+        }
+        asmopt_ir_line* entry = &ctx->ir[i];
+        if (fresh) {
+            memset(entry, 0, sizeof(*entry));
+            asmopt_tokenize_line(ctx, lines[i], syntax, &entry->insn);
+        } else {
+            for (size_t j = 0; j < entry->insn.operand_count; j++) {
+                if (entry->insn.ops[j].reg >= 0) {
+                    entry->insn.ops[j].reg = asmopt_intern(&ctx->operand_names, entry->insn.ops[j].text);
+                }
+            }
+            entry->text = NULL;
+            entry->mnemonic = NULL;
+            entry->operands = NULL;
+            entry->operand_count = 0;
+        }
+        entry->line_no = i + 1;
+    }
+#if ASMOPT_HAVE_MMAP
+    if (ctx->original_map_length > 0) {
+        munmap(old_text, ctx->original_map_length);
+        old_text = NULL;
+    }
+#endif
+    free(old_text);
+    ctx->original_text = text;
+    ctx->original_length = total - 1;
+    ctx->original_map_length = 0;
+    ctx->text_capacity = total;
+    ctx->original_count = next_count;
+    ctx->trailing_newline = next_count > 1 && lines[next_count - 1][0] == '\0';
+    ctx->ir_count = keep_ir ? next_count : 0;
+    ctx->ir_text_ready = false;
+    asmopt_arena_rewind(&ctx->ir_arena);
+    asmopt_reset_output(ctx);
+    ctx->incremental = true;
+    if (ASMOPT_PROFILING(ctx)) {
+        ctx->profile.parse_seconds = asmopt_now() - start;
+    }
+    ASMOPT_PROFILE_BYTES(ctx, total);
+    return asmopt_optimize(ctx);
 }
 
-static bool asmopt_is_return(const char* mnemonic) {
-    if (!mnemonic) {
-        return false;
-    }
-    if (strlen(mnemonic) < 3) {
-        return false;
-    }
-    return asmopt_case_prefix_len(mnemonic, "ret");
-}
+/* One buffered input line of the streaming window; text is reused across lines. */
+typedef struct {
+    char* text;
+    size_t capacity;
+} asmopt_stream_slot;
 
-static char* asmopt_jump_target(const asmopt_ir_line* line) {
-    if (!line || line->operand_count == 0) {
-        return NULL;
-    }
-    char* operand = line->operands[0];
-    if (!operand) {
-        return NULL;
-    }
-    while (*operand == '*') {
-        operand++;
-    }
-    if (!isalpha((unsigned char)*operand) && *operand != '_' && *operand != '.') {
-        return NULL;
-    }
-    for (const char* ptr = operand; *ptr; ptr++) {
-        if (!isalnum((unsigned char)*ptr) && *ptr != '_' && *ptr != '.') {
-            return NULL;
+typedef struct {
+    asmopt_context* ctx;
+    FILE* input;
+    FILE* output;
+    char* chunk;
+    size_t chunk_pos;
+    size_t chunk_len;
+    /* No more lines: the final (possibly empty) segment has been returned. */
+    bool done;
+    /* Stop reading: end of file or an embedded NUL, which ends the text. */
+    bool ended;
+    bool last_newline;
+    asmopt_stream_slot slots[ASMOPT_STREAM_WINDOW];
+    size_t count;
+    size_t total_lines;
+    size_t emitted;
+    /* Input echoed if nothing is ever emitted, mirroring asmopt_output_lines. */
+    asmopt_buffer pending;
+    size_t pending_lines;
+    bool failed;
+} asmopt_stream;
+
+static bool asmopt_stream_append(asmopt_stream_slot* slot, size_t* length, const char* text, size_t len) {
+    if (*length + len + 1 > slot->capacity) {
+        size_t capacity = slot->capacity == 0 ? 128 : slot->capacity;
+        while (capacity < *length + len + 1) {
+            capacity *= 2;
+        }
+        char* next = realloc(slot->text, capacity);
+        if (!next) {
+            return false;
         }
+        slot->text = next;
+        slot->capacity = capacity;
     }
-    return asmopt_strdup(operand);
+    memcpy(slot->text + *length, text, len);
+    *length += len;
+    slot->text[*length] = '\0';
+    return true;
 }
 
-static void asmopt_build_ir(asmopt_context* ctx) {
-    if (!ctx) {
-        return;
+/* Read the next line into slot, splitting exactly like asmopt_split_lines. */
+static bool asmopt_stream_next_line(asmopt_stream* stream, asmopt_stream_slot* slot) {
+    if (stream->done) {
+        return false;
     }
-    asmopt_reset_ir(ctx);
-    ctx->ir = calloc(ctx->original_count, sizeof(asmopt_ir_line));
-    if (!ctx->ir) {
-        ctx->ir_count = 0;
-        return;
+    size_t length = 0;
+    if (!asmopt_stream_append(slot, &length, "", 0)) {
+        stream->failed = true;
+        return false;
     }
-    ctx->ir_count = 0;
-    for (size_t i = 0; i < ctx->original_count; i++) {
-        char* line = ctx->original_lines[i];
-        char* code = NULL;
-    char* comment = NULL;
-    asmopt_split_comment(line, &code, &comment);
-    if (!code) {
-        free(comment);
-        continue;
-    }
-    char* trimmed = asmopt_strip(code);
-    asmopt_ir_line entry = {0};
-        entry.line_no = i + 1;
-        if (!trimmed || trimmed[0] == '\0') {
-            entry.kind = asmopt_strdup("blank");
-            entry.text = asmopt_strdup("");
-        } else if (trimmed[0] == '.') {
-            entry.kind = asmopt_strdup("directive");
-            entry.text = asmopt_strdup(trimmed);
-        } else {
-            size_t len = strlen(trimmed);
-            if (len > 0 && trimmed[len - 1] == ':') {
-                trimmed[len - 1] = '\0';
-                entry.kind = asmopt_strdup("label");
-                entry.text = asmopt_strdup(trimmed);
-            } else {
-                char* indent = NULL;
-                char* mnemonic = NULL;
-                char* spacing = NULL;
-                char* operands = NULL;
-                if (asmopt_parse_instruction(code, &indent, &mnemonic, &spacing, &operands)) {
-                    entry.kind = asmopt_strdup("instruction");
-                    entry.text = asmopt_strdup(trimmed);
-                    entry.mnemonic = asmopt_strdup(mnemonic);
-                    entry.operands = NULL;
-                    entry.operand_count = 0;
-                    if (operands && *operands) {
-                        size_t olen = strlen(operands);
-                        size_t start = 0;
-                        for (size_t j = 0; j <= olen; j++) {
-                            if (operands[j] == ',' || operands[j] == '\0') {
-                                size_t seg_len = j - start;
-                                char* segment = malloc(seg_len + 1);
-                                if (!segment) {
-                                    break;
-                                }
-                                memcpy(segment, operands + start, seg_len);
-                                segment[seg_len] = '\0';
-                                char* token_trimmed = asmopt_strip(segment);
-                                if (token_trimmed && *token_trimmed) {
-                                    char** next_ops = realloc(entry.operands, sizeof(char*) * (entry.operand_count + 1));
-                                    if (next_ops) {
-                                        entry.operands = next_ops;
-                                        entry.operands[entry.operand_count++] = token_trimmed;
-                                    } else {
-                                        free(token_trimmed);
-                                    }
-                                } else {
-                                    free(token_trimmed);
-                                }
-                                free(segment);
-                                start = j + 1;
-                            }
-                        }
-                    }
-                } else {
-                    entry.kind = asmopt_strdup("text");
-                    entry.text = asmopt_strdup(trimmed);
+    for (;;) {
+        if (stream->chunk_pos == stream->chunk_len) {
+            stream->chunk_pos = 0;
+            stream->chunk_len = stream->ended ? 0 : fread(stream->chunk, 1, READ_CHUNK_SIZE, stream->input);
+            if (stream->chunk_len == 0) {
+                if (ferror(stream->input)) {
+                    stream->failed = true;
                 }
-                free(indent);
-                free(mnemonic);
-                free(spacing);
-                free(operands);
+                stream->done = true;
+                return true;
             }
         }
-        free(code);
-        free(comment);
-        if (!entry.kind) {
-            entry.kind = asmopt_strdup("text");
-            entry.text = asmopt_strdup(trimmed ? trimmed : "");
+        const char* start = stream->chunk + stream->chunk_pos;
+        size_t avail = stream->chunk_len - stream->chunk_pos;
+        const char* newline = memchr(start, '\n', avail);
+        size_t take = newline ? (size_t)(newline - start) : avail;
+        const char* nul = memchr(start, '\0', take);
+        if (nul) {
+            take = (size_t)(nul - start);
+            stream->ended = true;
+            stream->chunk_len = stream->chunk_pos;
+            newline = NULL;
+        }
+        if (take > 0) {
+            stream->last_newline = false;
+            if (!asmopt_stream_append(slot, &length, start, take)) {
+                stream->failed = true;
+                return false;
+            }
+        }
+        if (nul) {
+            stream->done = true;
+            return true;
+        }
+        stream->chunk_pos += take;
+        if (newline) {
+            stream->chunk_pos++;
+            stream->last_newline = true;
+            return true;
         }
-        free(trimmed);
-        ctx->ir[ctx->ir_count++] = entry;
     }
 }
 
-static int asmopt_find_block_index(asmopt_cfg_block* blocks, size_t count, const char* name) {
-    for (size_t i = 0; i < count; i++) {
-        if (blocks[i].name && strcmp(blocks[i].name, name) == 0) {
-            return (int)i;
-        }
+static void asmopt_stream_write(asmopt_stream* stream, const char* line) {
+    if (stream->emitted++ > 0) {
+        fputc('\n', stream->output);
     }
-    return -1;
+    fputs(line, stream->output);
 }
 
-static void asmopt_add_edge(asmopt_context* ctx, const char* source, const char* target) {
-    if (!ctx || !source || !target) {
-        return;
+/* Write out everything the patterns produced for this window and drop its arena text. */
+static void asmopt_stream_flush(asmopt_stream* stream, size_t consumed_from, size_t consumed_to) {
+    asmopt_context* ctx = stream->ctx;
+    if (stream->emitted == 0 && ctx->optimized_count == 0) {
+        for (size_t i = consumed_from; i < consumed_to; i++) {
+            if (stream->pending_lines++ > 0) {
+                asmopt_buffer_append_n(&stream->pending, "\n", 1);
+            }
+            asmopt_buffer_append(&stream->pending, ctx->original_lines[i]);
+        }
     }
-    asmopt_cfg_edge* next = realloc(ctx->cfg_edges, sizeof(asmopt_cfg_edge) * (ctx->cfg_edge_count + 1));
-    if (!next) {
-        return;
+    if (ctx->optimized_count > 0) {
+        free(stream->pending.data);
+        memset(&stream->pending, 0, sizeof(stream->pending));
     }
-    ctx->cfg_edges = next;
-    ctx->cfg_edges[ctx->cfg_edge_count].source = asmopt_strdup(source);
-    ctx->cfg_edges[ctx->cfg_edge_count].target = asmopt_strdup(target);
-    ctx->cfg_edge_count += 1;
+    for (size_t i = 0; i < ctx->optimized_count; i++) {
+        asmopt_stream_write(stream, ctx->optimized_lines[i]);
+    }
+    ctx->optimized_count = 0;
+    asmopt_arena_rewind(&ctx->line_arena);
 }
 
-static void asmopt_build_cfg(asmopt_context* ctx) {
-    asmopt_reset_cfg(ctx);
-    if (!ctx || ctx->ir_count == 0) {
-        return;
+/* Keep the last few consumed lines as pattern context and move them to the front. */
+static void asmopt_stream_slide(asmopt_stream* stream, size_t* pos, const char* syntax) {
+    asmopt_context* ctx = stream->ctx;
+    size_t keep_from = *pos > ASMOPT_STREAM_HISTORY ? *pos - ASMOPT_STREAM_HISTORY : 0;
+    for (size_t i = keep_from; i < stream->count; i++) {
+        asmopt_stream_slot slot = stream->slots[i - keep_from];
+        stream->slots[i - keep_from] = stream->slots[i];
+        stream->slots[i] = slot;
+    }
+    stream->count -= keep_from;
+    *pos -= keep_from;
+    /* Interned names are views into slot text, so rebuild them for the lines that stay. */
+    asmopt_intern_reset(&ctx->operand_names);
+    for (size_t i = 0; i < stream->count; i++) {
+        ctx->original_lines[i] = stream->slots[i].text;
+        asmopt_tokenize_line(ctx, ctx->original_lines[i], syntax, &ctx->ir[i].insn);
     }
-    asmopt_cfg_block* blocks = NULL;
-    size_t block_count = 0;
-    asmopt_ir_line** current_instrs = NULL;
-    size_t instr_count = 0;
-    char* current_label = NULL;
-    char** label_names = NULL;
-    size_t label_count = 0;
+}
 
-    for (size_t i = 0; i < ctx->ir_count; i++) {
-        asmopt_ir_line* line = &ctx->ir[i];
-        if (line->kind && strcmp(line->kind, "label") == 0) {
-            if (current_label || instr_count > 0) {
-                asmopt_cfg_block* next = realloc(blocks, sizeof(asmopt_cfg_block) * (block_count + 1));
-                if (!next) {
-                    break;
-                }
-                blocks = next;
-                blocks[block_count].name = current_label ? asmopt_strdup(current_label) : NULL;
-                blocks[block_count].instructions = current_instrs;
-                blocks[block_count].instruction_count = instr_count;
-                if (current_label) {
-                    char** label_next = realloc(label_names, sizeof(char*) * (label_count + 1));
-                    if (label_next) {
-                        label_names = label_next;
-                        label_names[label_count++] = asmopt_strdup(current_label);
-                    }
-                }
-                block_count += 1;
-                free(current_label);
-                current_label = NULL;
-                current_instrs = NULL;
-                instr_count = 0;
-            }
-            current_label = asmopt_strdup(line->text);
-            continue;
+int asmopt_optimize_stream(asmopt_context* ctx, FILE* input, FILE* output) {
+    if (!ctx || !input || !output) {
+        return -1;
+    }
+    asmopt_release_lines(ctx);
+    asmopt_stream* stream = calloc(1, sizeof(asmopt_stream));
+    ctx->original_lines = malloc(sizeof(char*) * ASMOPT_STREAM_WINDOW);
+    ctx->ir = calloc(ASMOPT_STREAM_WINDOW, sizeof(asmopt_ir_line));
+    if (!stream || !ctx->original_lines || !ctx->ir) {
+        free(stream);
+        asmopt_release_lines(ctx);
+        return -1;
+    }
+    ctx->original_capacity = ASMOPT_STREAM_WINDOW;
+    ctx->ir_capacity = ASMOPT_STREAM_WINDOW;
+    stream->chunk = malloc(READ_CHUNK_SIZE);
+    stream->ctx = ctx;
+    stream->input = input;
+    stream->output = output;
+    ctx->streaming = true;
+    ctx->insert_hot_align = asmopt_option_enabled(ctx, "hot_align");
+    ctx->cpu_model = asmopt_select_cpu_model(ctx);
+    bool do_opt = asmopt_should_optimize(ctx);
+    char* syntax = NULL;
+    bool att = false;
+    size_t pos = 0;
+    while (stream->chunk && !stream->failed) {
+        size_t first_new = stream->count;
+        while (stream->count < ASMOPT_STREAM_WINDOW && asmopt_stream_next_line(stream, &stream->slots[stream->count])) {
+            ctx->original_lines[stream->count] = stream->slots[stream->count].text;
+            stream->count++;
+            stream->total_lines++;
         }
-        if (!line->kind || strcmp(line->kind, "instruction") != 0) {
-            continue;
+        ctx->original_count = stream->count;
+        ctx->ir_count = stream->count;
+        if (!syntax) {
+            /* Without --format, the first window decides the syntax. */
+            syntax = asmopt_detect_syntax(ctx);
+            att = syntax && strcmp(syntax, "att") == 0;
         }
-        asmopt_ir_line** next_instrs = realloc(current_instrs, sizeof(asmopt_ir_line*) * (instr_count + 1));
-        if (!next_instrs) {
-            break;
+        for (size_t i = first_new; i < stream->count; i++) {
+            asmopt_tokenize_line(ctx, ctx->original_lines[i], syntax, &ctx->ir[i].insn);
         }
-        current_instrs = next_instrs;
-        current_instrs[instr_count++] = line;
-        if (line->mnemonic && (asmopt_is_jump_mnemonic(line->mnemonic) || asmopt_is_return(line->mnemonic))) {
-            asmopt_cfg_block* next = realloc(blocks, sizeof(asmopt_cfg_block) * (block_count + 1));
-            if (!next) {
-                break;
+        size_t limit = stream->count;
+        if (!stream->done) {
+            limit = limit > ASMOPT_STREAM_LOOKAHEAD ? limit - ASMOPT_STREAM_LOOKAHEAD : 0;
+        }
+        size_t consumed_from = pos;
+        if (!do_opt) {
+            for (; pos < limit; pos++) {
+                asmopt_store_optimized_line(ctx, ctx->original_lines[pos]);
             }
-            blocks = next;
-            blocks[block_count].name = current_label ? asmopt_strdup(current_label) : NULL;
-            blocks[block_count].instructions = current_instrs;
-            blocks[block_count].instruction_count = instr_count;
-            if (current_label) {
-                char** label_next = realloc(label_names, sizeof(char*) * (label_count + 1));
-                if (label_next) {
-                    label_names = label_next;
-                    label_names[label_count++] = asmopt_strdup(current_label);
-                }
+        } else if (pos < limit) {
+            double start = ASMOPT_PROFILING(ctx) ? asmopt_now() : 0.0;
+            pos = asmopt_optimize_range(ctx, pos, limit, att);
+            if (ASMOPT_PROFILING(ctx)) {
+                ctx->profile.peephole_seconds += asmopt_now() - start;
             }
-            block_count += 1;
-            free(current_label);
-            current_label = NULL;
-            current_instrs = NULL;
-            instr_count = 0;
         }
-    }
-    if (current_label || instr_count > 0) {
-        asmopt_cfg_block* next = realloc(blocks, sizeof(asmopt_cfg_block) * (block_count + 1));
-        if (next) {
-            blocks = next;
-            blocks[block_count].name = current_label ? asmopt_strdup(current_label) : NULL;
-            blocks[block_count].instructions = current_instrs;
-            blocks[block_count].instruction_count = instr_count;
-            if (current_label) {
-                char** label_next = realloc(label_names, sizeof(char*) * (label_count + 1));
-                if (label_next) {
-                    label_names = label_next;
-                    label_names[label_count++] = asmopt_strdup(current_label);
-                }
-            }
-            block_count += 1;
+        asmopt_stream_flush(stream, consumed_from, pos);
+        if (stream->done) {
+            break;
         }
-    } else {
-        free(current_instrs);
+        asmopt_stream_slide(stream, &pos, syntax);
     }
-    free(current_label);
-
-    if (block_count == 0) {
-        blocks = calloc(1, sizeof(asmopt_cfg_block));
-        if (!blocks) {
-            ctx->cfg_blocks = NULL;
-            ctx->cfg_block_count = 0;
-            free(label_names);
-            return;
-        }
-        block_count = 1;
-        blocks[0].name = asmopt_strdup("block0");
-        blocks[0].instructions = NULL;
-        blocks[0].instruction_count = 0;
-    } else {
-        for (size_t i = 0; i < block_count; i++) {
-            if (!blocks[i].name) {
-                char name[32];
-                snprintf(name, sizeof(name), "block%zu", i);
-                blocks[i].name = asmopt_strdup(name);
-            }
-        }
+    if (stream->emitted == 0 && stream->pending.data) {
+        fputs(stream->pending.data, output);
     }
-
-    ctx->cfg_blocks = blocks;
-    ctx->cfg_block_count = block_count;
-    for (size_t i = 0; i < block_count; i++) {
-        asmopt_cfg_block* block = &ctx->cfg_blocks[i];
-        if (block->instruction_count == 0) {
-            continue;
-        }
-        asmopt_ir_line* last = block->instructions[block->instruction_count - 1];
-        if (last && last->mnemonic && asmopt_is_jump_mnemonic(last->mnemonic)) {
-            char* target = asmopt_jump_target(last);
-            if (target) {
-                int index = asmopt_find_block_index(ctx->cfg_blocks, ctx->cfg_block_count, target);
-                if (index >= 0) {
-                    asmopt_add_edge(ctx, block->name, ctx->cfg_blocks[index].name);
-                }
-                free(target);
-            }
-            if (last->mnemonic && asmopt_is_conditional_jump(last->mnemonic) && i + 1 < block_count) {
-                asmopt_add_edge(ctx, block->name, ctx->cfg_blocks[i + 1].name);
-            }
-        } else if (last && last->mnemonic && asmopt_is_return(last->mnemonic)) {
-            continue;
-        } else if (i + 1 < block_count) {
-            asmopt_add_edge(ctx, block->name, ctx->cfg_blocks[i + 1].name);
-        }
+    if (stream->last_newline) {
+        fputc('\n', output);
     }
+    bool failed = !stream->chunk || stream->failed || stream->pending.failed || ferror(output);
+    ctx->stats.original_lines = stream->total_lines;
+    ctx->stats.optimized_lines = do_opt ? stream->emitted : stream->total_lines;
+    for (size_t i = 0; i < ASMOPT_STREAM_WINDOW; i++) {
+        free(stream->slots[i].text);
+    }
+    free(stream->pending.data);
+    free(stream->chunk);
+    free(stream);
+    free(syntax);
+    /* Window lines are gone; leave the context without input, keeping the stats. */
+    asmopt_stats stats = ctx->stats;
+    asmopt_profile profile = ctx->profile;
+    profile.bytes_allocated += ctx->line_arena.allocated + ctx->ir_arena.allocated;
+    asmopt_reset_lines(ctx);
+    ctx->stats = stats;
+    ctx->profile = profile;
+    ctx->streaming = false;
+    return failed ? -1 : 0;
+}
 
-    asmopt_free_string_array(label_names, label_count);
+static char** asmopt_output_lines(asmopt_context* ctx, size_t* count) {
+    if (ctx->optimized_count == 0 && ctx->original_count > 0) {
+        *count = ctx->original_count;
+        return ctx->original_lines;
+    }
+    *count = ctx->optimized_count;
+    return ctx->optimized_lines;
 }
 
-static void asmopt_append_text(char** buffer, size_t* length, size_t* capacity, const char* text) {
-    size_t add = strlen(text);
-    if (*length + add + 1 > *capacity) {
-        size_t next = (*capacity + add + 1) * 2;
-        char* resized = realloc(*buffer, next);
-        if (!resized) {
-            return;
-        }
-        *buffer = resized;
-        *capacity = next;
+char* asmopt_generate_assembly(asmopt_context* ctx) {
+    if (!ctx) {
+        return NULL;
     }
-    memcpy(*buffer + *length, text, add);
-    *length += add;
-    (*buffer)[*length] = '\0';
+    double start = ASMOPT_PROFILING(ctx) ? asmopt_now() : 0.0;
+    size_t count = 0;
+    char** lines = asmopt_output_lines(ctx, &count);
+    char* output = asmopt_join_lines(lines, count, ctx->trailing_newline);
+    if (ASMOPT_PROFILING(ctx)) {
+        ctx->profile.emit_seconds += asmopt_now() - start;
+        ctx->profile.bytes_allocated += output ? strlen(output) + 1 : 0;
+    }
+    return output;
 }
 
-static char* asmopt_dump_ir(asmopt_context* ctx) {
+int asmopt_generate_assembly_into(asmopt_context* ctx, char* buffer, size_t capacity, size_t* length) {
     if (!ctx) {
-        return asmopt_strdup("IR:\n");
+        return -1;
     }
-    size_t capacity = 256;
-    size_t length = 0;
-    char* buffer = malloc(capacity);
-    if (!buffer) {
-        return NULL;
+    size_t count = 0;
+    char** lines = asmopt_output_lines(ctx, &count);
+    if (!lines) {
+        count = 0;
     }
-    buffer[0] = '\0';
-    asmopt_append_text(&buffer, &length, &capacity, "IR:\n");
-    for (size_t i = 0; i < ctx->ir_count; i++) {
-        asmopt_ir_line* line = &ctx->ir[i];
-        if (!line->kind) {
-            continue;
-        }
-        if (strcmp(line->kind, "instruction") == 0) {
-            size_t ops_cap = 128;
-            size_t ops_len = 0;
-            char* ops = malloc(ops_cap);
-            if (!ops) {
-                continue;
-            }
-            ops[0] = '\0';
-            for (size_t j = 0; j < line->operand_count; j++) {
-                asmopt_append_text(&ops, &ops_len, &ops_cap, line->operands[j]);
-                if (j + 1 < line->operand_count) {
-                    asmopt_append_text(&ops, &ops_len, &ops_cap, ", ");
-                }
-            }
-            char linebuf[64];
-            snprintf(linebuf, sizeof(linebuf), "%04zu: instr %s ", line->line_no, line->mnemonic ? line->mnemonic : "");
-            asmopt_append_text(&buffer, &length, &capacity, linebuf);
-            asmopt_append_text(&buffer, &length, &capacity, ops);
-            asmopt_append_text(&buffer, &length, &capacity, "\n");
-            free(ops);
+    size_t total = asmopt_joined_length(lines, count, ctx->trailing_newline);
+    if (length) {
+        *length = total;
+    }
+    if (!buffer || capacity < total + 1) {
+        return -1;
+    }
+    double start = ASMOPT_PROFILING(ctx) ? asmopt_now() : 0.0;
+    asmopt_join_lines_into(lines, count, ctx->trailing_newline, buffer);
+    if (ASMOPT_PROFILING(ctx)) {
+        ctx->profile.emit_seconds += asmopt_now() - start;
+    }
+    return 0;
+}
+
+/* Input line index of an output line that is an input line, or original_count. */
+static size_t asmopt_input_index(const asmopt_context* ctx, const char* line) {
+    if (!ctx->original_text || line < ctx->original_text || line >= ctx->original_text + ctx->original_length) {
+        return ctx->original_count;
+    }
+    /* original_lines are slices of original_text in order, so their addresses are sorted. */
+    size_t low = 0;
+    size_t high = ctx->original_count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (ctx->original_lines[mid] < line) {
+            low = mid + 1;
         } else {
-            char linebuf[64];
-            snprintf(linebuf, sizeof(linebuf), "%04zu: %s ", line->line_no, line->kind);
-            asmopt_append_text(&buffer, &length, &capacity, linebuf);
-            asmopt_append_text(&buffer, &length, &capacity, line->text ? line->text : "");
-            asmopt_append_text(&buffer, &length, &capacity, "\n");
+            high = mid;
         }
     }
-    return buffer;
+    return low < ctx->original_count && ctx->original_lines[low] == line ? low : ctx->original_count;
 }
 
-static char* asmopt_dump_cfg_text_internal(asmopt_context* ctx) {
-    if (!ctx) {
-        return asmopt_strdup("CFG:\n");
+/*
+ * Encoded bytes per function (from one non-local label to the next) in the
+ * input and in the output, with asmopt_insn_length. Output lines taken over
+ * from the input reuse its IR; the others are tokenized. Output functions are
+ * matched to input ones by label, in order. Only functions whose size changed
+ * become events; the totals cover every line.
+ */
+static void asmopt_measure_sizes(asmopt_context* ctx) {
+    if (ctx->sizes_ready) {
+        return;
     }
-    size_t capacity = 256;
-    size_t length = 0;
-    char* buffer = malloc(capacity);
-    if (!buffer) {
-        return NULL;
+    ctx->sizes_ready = true;
+    if (ctx->optimized_count == 0 || ctx->ir_count < ctx->original_count) {
+        return;
     }
-    buffer[0] = '\0';
-    asmopt_append_text(&buffer, &length, &capacity, "CFG:\n");
-    for (size_t i = 0; i < ctx->cfg_block_count; i++) {
-        asmopt_cfg_block* block = &ctx->cfg_blocks[i];
-        asmopt_append_text(&buffer, &length, &capacity, block->name);
-        asmopt_append_text(&buffer, &length, &capacity, ":\n");
-        for (size_t j = 0; j < block->instruction_count; j++) {
-            asmopt_ir_line* line = block->instructions[j];
-            if (!line || !line->mnemonic) {
-                continue;
-            }
-            asmopt_append_text(&buffer, &length, &capacity, "  ");
-            asmopt_append_text(&buffer, &length, &capacity, line->mnemonic);
-            for (size_t k = 0; k < line->operand_count; k++) {
-                asmopt_append_text(&buffer, &length, &capacity, k == 0 ? " " : ", ");
-                asmopt_append_text(&buffer, &length, &capacity, line->operands[k]);
+    char* syntax = asmopt_detect_syntax(ctx);
+    size_t count = 0;
+    size_t* starts = malloc(sizeof(size_t) * (ctx->original_count + 1));
+    size_t* before = calloc(ctx->original_count + 1, sizeof(size_t));
+    size_t* after = calloc(ctx->original_count + 1, sizeof(size_t));
+    if (!syntax || !starts || !before || !after) {
+        free(syntax);
+        free(starts);
+        free(before);
+        free(after);
+        return;
+    }
+    /* Bucket 0 is whatever precedes the first function. */
+    starts[count++] = ctx->original_count;
+    for (size_t i = 0; i < ctx->ir_count; i++) {
+        const asmopt_insn* insn = &ctx->ir[i].insn;
+        if (asmopt_is_function_label(insn)) {
+            starts[count++] = i;
+        }
+        unsigned bytes = asmopt_insn_length(insn);
+        before[count - 1] += bytes;
+        ctx->code_bytes_before += bytes;
+    }
+    size_t current = 0;
+    asmopt_insn scratch;
+    for (size_t i = 0; i < ctx->optimized_count; i++) {
+        const char* line = ctx->optimized_lines[i];
+        size_t index = asmopt_input_index(ctx, line);
+        const asmopt_insn* insn = &scratch;
+        if (index < ctx->original_count) {
+            insn = &ctx->ir[index].insn;
+        } else {
+            asmopt_tokenize_line(ctx, line, syntax, &scratch);
+        }
+        if (asmopt_is_function_label(insn)) {
+            for (size_t j = current + 1; j < count; j++) {
+                if (asmopt_view_equal(ctx->ir[starts[j]].insn.label, insn->label)) {
+                    current = j;
+                    break;
+                }
             }
-            asmopt_append_text(&buffer, &length, &capacity, "\n");
         }
-        for (size_t e = 0; e < ctx->cfg_edge_count; e++) {
-            if (strcmp(ctx->cfg_edges[e].source, block->name) == 0) {
-                asmopt_append_text(&buffer, &length, &capacity, "  -> ");
-                asmopt_append_text(&buffer, &length, &capacity, ctx->cfg_edges[e].target);
-                asmopt_append_text(&buffer, &length, &capacity, "\n");
+        unsigned bytes = asmopt_insn_length(insn);
+        after[current] += bytes;
+        ctx->code_bytes_after += bytes;
+    }
+    for (size_t j = 1; j < count; j++) {
+        if (before[j] == after[j]) {
+            continue;
+        }
+        if (ctx->size_event_count == ctx->size_event_capacity) {
+            size_t capacity = ctx->size_event_capacity == 0 ? 16 : ctx->size_event_capacity * 2;
+            asmopt_size_event* next = realloc(ctx->size_events, sizeof(asmopt_size_event) * capacity);
+            if (!next) {
+                break;
             }
+            ctx->size_events = next;
+            ctx->size_event_capacity = capacity;
+            ASMOPT_PROFILE_BYTES(ctx, sizeof(asmopt_size_event) * capacity);
         }
+        asmopt_size_event* event = &ctx->size_events[ctx->size_event_count++];
+        event->line_no = starts[j] + 1;
+        event->label = ctx->ir[starts[j]].insn.label;
+        event->bytes_before = before[j];
+        event->bytes_after = after[j];
     }
-    return buffer;
+    free(syntax);
+    free(starts);
+    free(before);
+    free(after);
 }
 
-static char* asmopt_dump_cfg_dot_internal(asmopt_context* ctx) {
+/* "N saved" or, when the output grew, "N added". */
+static void asmopt_append_size_change(asmopt_buffer* buffer, size_t before, size_t after) {
+    if (after <= before) {
+        asmopt_buffer_appendf(buffer, "%zu saved", before - after);
+    } else {
+        asmopt_buffer_appendf(buffer, "%zu added", after - before);
+    }
+}
+
+char* asmopt_generate_report(asmopt_context* ctx) {
     if (!ctx) {
-        return asmopt_strdup("digraph cfg {\n  node [shape=box];\n}\n");
+        return asmopt_strdup("");
     }
-    size_t capacity = 256;
-    size_t length = 0;
-    char* buffer = malloc(capacity);
-    if (!buffer) {
-        return NULL;
+    asmopt_buffer buffer = {0};
+    asmopt_buffer_appendf(&buffer,
+                          "Optimization Report\n"
+                          "==================\n\n"
+                          "Summary:\n"
+                          "  Original lines: %zu\n"
+                          "  Optimized lines: %zu\n"
+                          "  Replacements: %zu\n"
+                          "  Removals: %zu\n",
+                          ctx->stats.original_lines,
+                          ctx->stats.optimized_lines,
+                          ctx->stats.replacements,
+                          ctx->stats.removals);
+    if (ctx->opt_event_count > 0) {
+        asmopt_buffer_append(&buffer, "\nOptimizations Applied:\n");
+        for (size_t i = 0; i < ctx->opt_event_count; i++) {
+            asmopt_optimization_event* event = &ctx->opt_events[i];
+            asmopt_buffer_appendf(&buffer, "  Line %zu: %s\n", event->line_no, event->pattern_name);
+            asmopt_buffer_append(&buffer, "    Before: ");
+            asmopt_buffer_append(&buffer, event->original);
+            asmopt_buffer_append(&buffer, "\n    After:  ");
+            asmopt_buffer_append(&buffer, event->optimized);
+            asmopt_buffer_append(&buffer, "\n");
+        }
     }
-    buffer[0] = '\0';
-    asmopt_append_text(&buffer, &length, &capacity, "digraph cfg {\n  node [shape=box];\n");
-    for (size_t i = 0; i < ctx->cfg_block_count; i++) {
-        asmopt_cfg_block* block = &ctx->cfg_blocks[i];
-        asmopt_append_text(&buffer, &length, &capacity, "  ");
-        asmopt_append_text(&buffer, &length, &capacity, block->name);
-        asmopt_append_text(&buffer, &length, &capacity, " [label=\"");
-        asmopt_append_text(&buffer, &length, &capacity, block->name);
-        asmopt_append_text(&buffer, &length, &capacity, ":\\l");
-        for (size_t j = 0; j < block->instruction_count; j++) {
-            asmopt_ir_line* line = block->instructions[j];
-            if (!line || !line->mnemonic) {
-                continue;
-            }
-            asmopt_append_text(&buffer, &length, &capacity, line->mnemonic);
-            for (size_t k = 0; k < line->operand_count; k++) {
-                asmopt_append_text(&buffer, &length, &capacity, k == 0 ? " " : ", ");
-                asmopt_append_text(&buffer, &length, &capacity, line->operands[k]);
+    if (ctx->schedule_event_count > 0) {
+        unsigned saved = 0;
+        asmopt_buffer_append(&buffer, "\nScheduling:\n");
+        for (size_t i = 0; i < ctx->schedule_event_count; i++) {
+            asmopt_schedule_event* event = &ctx->schedule_events[i];
+            saved += event->cycles_before - event->cycles_after;
+            asmopt_buffer_appendf(&buffer, "  Lines %zu-%zu: %u -> %u cycles (%u saved)\n", event->first_line,
+                                  event->last_line, event->cycles_before, event->cycles_after,
+                                  event->cycles_before - event->cycles_after);
+        }
+        asmopt_buffer_appendf(&buffer, "  Estimated cycles saved: %u\n", saved);
+    }
+    if (ctx->fusion_pairs_before > 0 || ctx->fusion_pairs_after > 0 || ctx->fusion_event_count > 0) {
+        size_t gained = 0;
+        asmopt_buffer_append(&buffer, "\nMacro-op fusion:\n");
+        for (size_t i = 0; i < ctx->fusion_event_count; i++) {
+            asmopt_fusion_event* event = &ctx->fusion_events[i];
+            gained += event->fused ? 1 : 0;
+            asmopt_buffer_appendf(&buffer, "  Line %zu: %s %s\n", event->line_no, event->branch,
+                                  event->fused ? "now fused" : "no longer fused");
+        }
+        asmopt_buffer_appendf(&buffer, "  Fused pairs: %zu -> %zu (%zu gained, %zu lost)\n", ctx->fusion_pairs_before,
+                              ctx->fusion_pairs_after, gained, ctx->fusion_event_count - gained);
+    }
+    if (ctx->if_convert_event_count > 0) {
+        asmopt_buffer_append(&buffer, "\nIf-conversion:\n");
+        for (size_t i = 0; i < ctx->if_convert_event_count; i++) {
+            asmopt_if_convert_event* event = &ctx->if_convert_events[i];
+            asmopt_buffer_appendf(&buffer, "  Line %zu: %s -> %s (%s, %u cycle%s)\n", event->line_no, event->branch,
+                                  event->select, event->diamond ? "diamond" : "triangle", event->cycles,
+                                  event->cycles == 1 ? "" : "s");
+        }
+        asmopt_buffer_appendf(&buffer, "  Branches converted: %zu (budget %u cycles each)\n",
+                              ctx->if_convert_event_count, ctx->cpu_model ? ctx->cpu_model->branch_miss / 4 : 0);
+    }
+    asmopt_measure_sizes(ctx);
+    if (ctx->size_event_count > 0) {
+        asmopt_buffer_append(&buffer, "\nCode size:\n");
+        for (size_t i = 0; i < ctx->size_event_count; i++) {
+            asmopt_size_event* event = &ctx->size_events[i];
+            asmopt_buffer_appendf(&buffer, "  Line %zu: %.*s %zu -> %zu bytes (", event->line_no,
+                                  (int)event->label.len, event->label.ptr, event->bytes_before, event->bytes_after);
+            asmopt_append_size_change(&buffer, event->bytes_before, event->bytes_after);
+            asmopt_buffer_append(&buffer, ")\n");
+        }
+        asmopt_buffer_appendf(&buffer, "  Total: %zu -> %zu bytes (", ctx->code_bytes_before, ctx->code_bytes_after);
+        asmopt_append_size_change(&buffer, ctx->code_bytes_before, ctx->code_bytes_after);
+        asmopt_buffer_append(&buffer, ")\n");
+    }
+    if (ctx->loop_align_event_count > 0) {
+        asmopt_buffer_append(&buffer, "\nLoop alignment:\n");
+        for (size_t i = 0; i < ctx->loop_align_event_count; i++) {
+            asmopt_loop_align_event* event = &ctx->loop_align_events[i];
+            asmopt_buffer_appendf(&buffer, "  Line %zu: %s (%u bytes) -> %s\n", event->line_no, event->label,
+                                  event->bytes, event->directive);
+        }
+    }
+    if (ctx->loop_opt_event_count > 0) {
+        size_t hoisted = 0;
+        asmopt_buffer_append(&buffer, "\nLoop optimizations:\n");
+        for (size_t i = 0; i < ctx->loop_opt_event_count; i++) {
+            asmopt_loop_opt_event* event = &ctx->loop_opt_events[i];
+            if (event->after) {
+                asmopt_buffer_appendf(&buffer, "  Line %zu: %s -> %s in %s\n", event->line_no, event->before,
+                                      event->after, event->label);
+            } else {
+                hoisted++;
+                asmopt_buffer_appendf(&buffer, "  Line %zu: %s hoisted above %s\n", event->line_no, event->before,
+                                      event->label);
             }
-            asmopt_append_text(&buffer, &length, &capacity, "\\l");
         }
-        asmopt_append_text(&buffer, &length, &capacity, "\"];\n");
+        asmopt_buffer_appendf(&buffer, "  Hoisted: %zu, strength-reduced: %zu\n", hoisted,
+                              ctx->loop_opt_event_count - hoisted);
+    }
+    if (ctx->vex_transition_event_count > 0) {
+        asmopt_buffer_append(&buffer, "\nAVX-SSE transitions:\n");
+        for (size_t i = 0; i < ctx->vex_transition_event_count; i++) {
+            asmopt_vex_transition_event* event = &ctx->vex_transition_events[i];
+            asmopt_buffer_appendf(&buffer, "  Line %zu: %s with upper halves dirty since line %zu, no vzeroupper\n",
+                                  event->line_no, event->instruction, event->avx_line);
+        }
     }
-    for (size_t e = 0; e < ctx->cfg_edge_count; e++) {
-        asmopt_append_text(&buffer, &length, &capacity, "  ");
-        asmopt_append_text(&buffer, &length, &capacity, ctx->cfg_edges[e].source);
-        asmopt_append_text(&buffer, &length, &capacity, " -> ");
-        asmopt_append_text(&buffer, &length, &capacity, ctx->cfg_edges[e].target);
-        asmopt_append_text(&buffer, &length, &capacity, ";\n");
+    char* report = asmopt_buffer_finish(&buffer);
+    return report ? report : asmopt_strdup("Error: Report generation failed\n");
+}
+
+static int asmopt_find_pattern(const char* name) {
+    for (int i = 0; i < ASMOPT_PATTERN_COUNT; i++) {
+        if (strcmp(name, PATTERN_NAMES[i]) == 0) {
+            return i;
+        }
     }
-    asmopt_append_text(&buffer, &length, &capacity, "}\n");
-    return buffer;
+    return -1;
 }
 
-asmopt_context* asmopt_create(const char* architecture) {
-    asmopt_context* ctx = calloc(1, sizeof(asmopt_context));
-    if (!ctx) {
-        return NULL;
+/* Event kinds of the machine-readable reports, in report order. */
+typedef enum {
+    ASMOPT_REPORT_OPTIMIZATION,
+    ASMOPT_REPORT_SCHEDULE,
+    ASMOPT_REPORT_FUSION,
+    ASMOPT_REPORT_IF_CONVERT,
+    ASMOPT_REPORT_LOOP_ALIGN,
+    ASMOPT_REPORT_CODE_SIZE,
+    ASMOPT_REPORT_LOOP_OPT,
+    ASMOPT_REPORT_VEX_TRANSITION,
+    ASMOPT_REPORT_KIND_COUNT
+} asmopt_report_kind;
+
+/* JSON array names and JSON Lines "type" values, indexed by asmopt_report_kind. */
+static const char* const REPORT_SECTIONS[ASMOPT_REPORT_KIND_COUNT] = {
+    "optimizations", "scheduling", "fusion", "if_conversion", "loop_alignment", "code_size", "loop_optimizations",
+    "vex_transitions"
+};
+static const char* const REPORT_TYPES[ASMOPT_REPORT_KIND_COUNT] = {
+    "optimization", "schedule", "fusion", "if_conversion", "loop_alignment", "code_size", "loop_optimization",
+    "vex_transition"
+};
+
+#define ASMOPT_REPORT_MAGIC "ASMOPTRB"
+#define ASMOPT_REPORT_VERSION 2
+#define ASMOPT_REPORT_HEADER_SIZE 96
+#define ASMOPT_REPORT_RECORD_SIZE 32
+#define ASMOPT_REPORT_NO_SOURCE UINT64_MAX
+
+static size_t asmopt_report_count(const asmopt_context* ctx, asmopt_report_kind kind) {
+    switch (kind) {
+    case ASMOPT_REPORT_OPTIMIZATION:
+        return ctx->opt_event_count;
+    case ASMOPT_REPORT_SCHEDULE:
+        return ctx->schedule_event_count;
+    case ASMOPT_REPORT_FUSION:
+        return ctx->fusion_event_count;
+    case ASMOPT_REPORT_IF_CONVERT:
+        return ctx->if_convert_event_count;
+    case ASMOPT_REPORT_LOOP_ALIGN:
+        return ctx->loop_align_event_count;
+    case ASMOPT_REPORT_CODE_SIZE:
+        return ctx->size_event_count;
+    case ASMOPT_REPORT_LOOP_OPT:
+        return ctx->loop_opt_event_count;
+    default:
+        return ctx->vex_transition_event_count;
     }
-    ctx->architecture = asmopt_strdup(architecture ? architecture : "x86-64");
-    ctx->target_cpu = asmopt_strdup("generic");
-    ctx->optimization_level = 2;
-    ctx->amd_optimizations = true;
-    ctx->enabled_opts = NULL;
-    ctx->enabled_count = 0;
-    asmopt_add_name(&ctx->enabled_opts, &ctx->enabled_count, "peephole");
-    return ctx;
 }
 
-void asmopt_set_option(asmopt_context* ctx, const char* option, const char* value) {
-    asmopt_add_option(ctx, option, value);
+static bool asmopt_event_removed(const asmopt_optimization_event* event) {
+    return strcmp(event->optimized, "(removed)") == 0;
 }
 
-void asmopt_set_optimization_level(asmopt_context* ctx, int level) {
-    if (!ctx) {
-        return;
-    }
-    if (level < 0) {
-        level = 0;
-    }
-    if (level > 4) {
-        level = 4;
+static void asmopt_json_view(FILE* output, asmopt_view text) {
+    fputc('"', output);
+    const unsigned char* end = (const unsigned char*)text.ptr + text.len;
+    for (const unsigned char* ptr = (const unsigned char*)text.ptr; ptr < end; ptr++) {
+        if (*ptr == '"' || *ptr == '\\') {
+            fputc('\\', output);
+            fputc(*ptr, output);
+        } else if (*ptr == '\t') {
+            fputs("\\t", output);
+        } else if (*ptr < 0x20) {
+            fprintf(output, "\\u%04x", *ptr);
+        } else {
+            fputc(*ptr, output);
+        }
     }
-    ctx->optimization_level = level;
+    fputc('"', output);
 }
 
-void asmopt_set_target_cpu(asmopt_context* ctx, const char* cpu) {
-    if (!ctx) {
-        return;
-    }
-    free(ctx->target_cpu);
-    ctx->target_cpu = asmopt_strdup(cpu ? cpu : "generic");
+static void asmopt_json_string(FILE* output, const char* text) {
+    asmopt_json_view(output, (asmopt_view){text, strlen(text)});
 }
 
-static char* asmopt_read_file(const char* filename) {
-    if (!filename) {
-        return NULL;
-    }
-    FILE* handle = fopen(filename, "rb");
-    if (!handle) {
-        return NULL;
-    }
-    fseek(handle, 0, SEEK_END);
-    long length = ftell(handle);
-    if (length < 0) {
-        fclose(handle);
-        return NULL;
+/* One event as a JSON object; type is the JSON Lines tag, or NULL inside a JSON array. */
+static void asmopt_json_event(FILE* output, const asmopt_context* ctx, asmopt_report_kind kind, size_t index,
+                              const char* type) {
+    fputc('{', output);
+    if (type) {
+        fprintf(output, "\"type\":\"%s\",", type);
+    }
+    switch (kind) {
+    case ASMOPT_REPORT_OPTIMIZATION: {
+        const asmopt_optimization_event* event = &ctx->opt_events[index];
+        fprintf(output, "\"line\":%zu,\"pattern\":", event->line_no);
+        asmopt_json_string(output, event->pattern_name);
+        fputs(",\"before\":", output);
+        asmopt_json_string(output, event->original);
+        fputs(",\"after\":", output);
+        if (asmopt_event_removed(event)) {
+            fputs("null", output);
+        } else {
+            asmopt_json_string(output, event->optimized);
+        }
+        break;
+    }
+    case ASMOPT_REPORT_SCHEDULE: {
+        const asmopt_schedule_event* event = &ctx->schedule_events[index];
+        fprintf(output, "\"first_line\":%zu,\"last_line\":%zu,\"cycles_before\":%u,\"cycles_after\":%u",
+                event->first_line, event->last_line, event->cycles_before, event->cycles_after);
+        break;
+    }
+    case ASMOPT_REPORT_FUSION: {
+        const asmopt_fusion_event* event = &ctx->fusion_events[index];
+        fprintf(output, "\"line\":%zu,\"branch\":", event->line_no);
+        asmopt_json_string(output, event->branch);
+        fprintf(output, ",\"fused\":%s", event->fused ? "true" : "false");
+        break;
+    }
+    case ASMOPT_REPORT_IF_CONVERT: {
+        const asmopt_if_convert_event* event = &ctx->if_convert_events[index];
+        fprintf(output, "\"line\":%zu,\"branch\":", event->line_no);
+        asmopt_json_string(output, event->branch);
+        fputs(",\"select\":", output);
+        asmopt_json_string(output, event->select);
+        fprintf(output, ",\"shape\":\"%s\",\"cycles\":%u", event->diamond ? "diamond" : "triangle", event->cycles);
+        break;
+    }
+    case ASMOPT_REPORT_LOOP_ALIGN: {
+        const asmopt_loop_align_event* event = &ctx->loop_align_events[index];
+        fprintf(output, "\"line\":%zu,\"label\":", event->line_no);
+        asmopt_json_string(output, event->label);
+        fprintf(output, ",\"bytes\":%u,\"directive\":", event->bytes);
+        asmopt_json_string(output, event->directive);
+        break;
+    }
+    case ASMOPT_REPORT_CODE_SIZE: {
+        const asmopt_size_event* event = &ctx->size_events[index];
+        fprintf(output, "\"line\":%zu,\"function\":", event->line_no);
+        asmopt_json_view(output, event->label);
+        fprintf(output, ",\"bytes_before\":%zu,\"bytes_after\":%zu", event->bytes_before, event->bytes_after);
+        break;
+    }
+    case ASMOPT_REPORT_LOOP_OPT: {
+        const asmopt_loop_opt_event* event = &ctx->loop_opt_events[index];
+        fprintf(output, "\"line\":%zu,\"loop\":", event->line_no);
+        asmopt_json_string(output, event->label);
+        fputs(",\"before\":", output);
+        asmopt_json_string(output, event->before);
+        fputs(",\"after\":", output);
+        if (event->after) {
+            asmopt_json_string(output, event->after);
+        } else {
+            fputs("null", output);
+        }
+        break;
     }
-    fseek(handle, 0, SEEK_SET);
-    char* buffer = malloc((size_t)length + 1);
-    if (!buffer) {
-        fclose(handle);
-        return NULL;
+    default: {
+        const asmopt_vex_transition_event* event = &ctx->vex_transition_events[index];
+        fprintf(output, "\"line\":%zu,\"instruction\":", event->line_no);
+        asmopt_json_string(output, event->instruction);
+        fprintf(output, ",\"avx_line\":%zu", event->avx_line);
+        break;
     }
-    size_t read = fread(buffer, 1, (size_t)length, handle);
-    fclose(handle);
-    if (read != (size_t)length) {
-        free(buffer);
-        return NULL;
     }
-    buffer[read] = '\0';
-    return buffer;
+    fputc('}', output);
 }
 
-int asmopt_parse_file(asmopt_context* ctx, const char* filename) {
-    if (!ctx || !filename) {
-        return -1;
-    }
-    char* text = asmopt_read_file(filename);
-    if (!text) {
-        return -1;
-    }
-    asmopt_parse_string(ctx, text);
-    free(text);
-    return 0;
+static void asmopt_json_summary(FILE* output, const asmopt_context* ctx, const char* type) {
+    fputc('{', output);
+    if (type) {
+        fprintf(output, "\"type\":\"%s\",", type);
+    }
+    fprintf(output,
+            "\"original_lines\":%zu,\"optimized_lines\":%zu,\"replacements\":%zu,\"removals\":%zu,"
+            "\"fused_pairs_before\":%zu,\"fused_pairs_after\":%zu,\"bytes_before\":%zu,\"bytes_after\":%zu,"
+            "\"if_convert_budget\":%u}",
+            ctx->stats.original_lines, ctx->stats.optimized_lines, ctx->stats.replacements, ctx->stats.removals,
+            ctx->fusion_pairs_before, ctx->fusion_pairs_after, ctx->code_bytes_before, ctx->code_bytes_after,
+            ctx->cpu_model ? ctx->cpu_model->branch_miss / 4 : 0);
 }
 
-int asmopt_parse_string(asmopt_context* ctx, const char* assembly) {
-    if (!ctx || !assembly) {
-        return -1;
+static void asmopt_write_report_json(FILE* output, const asmopt_context* ctx) {
+    fputs("{\"summary\":", output);
+    asmopt_json_summary(output, ctx, NULL);
+    for (int kind = 0; kind < ASMOPT_REPORT_KIND_COUNT; kind++) {
+        fprintf(output, ",\n\"%s\":[", REPORT_SECTIONS[kind]);
+        size_t count = asmopt_report_count(ctx, (asmopt_report_kind)kind);
+        for (size_t i = 0; i < count; i++) {
+            fputs(i == 0 ? "\n" : ",\n", output);
+            asmopt_json_event(output, ctx, (asmopt_report_kind)kind, i, NULL);
+        }
+        fputs("]", output);
     }
-    asmopt_reset_lines(ctx);
-    ctx->original_text = asmopt_strdup(assembly);
-    asmopt_split_lines(ctx, assembly);
-    return 0;
+    fputs("}\n", output);
 }
 
-static bool asmopt_should_optimize(asmopt_context* ctx) {
-    if (!ctx) {
-        return false;
+static void asmopt_write_report_jsonl(FILE* output, const asmopt_context* ctx) {
+    asmopt_json_summary(output, ctx, "summary");
+    fputc('\n', output);
+    for (int kind = 0; kind < ASMOPT_REPORT_KIND_COUNT; kind++) {
+        size_t count = asmopt_report_count(ctx, (asmopt_report_kind)kind);
+        for (size_t i = 0; i < count; i++) {
+            asmopt_json_event(output, ctx, (asmopt_report_kind)kind, i, REPORT_TYPES[kind]);
+            fputc('\n', output);
+        }
     }
-    if (ctx->no_optimize || ctx->optimization_level == 0) {
-        return false;
+}
+
+static void asmopt_put_le(unsigned char* out, uint64_t value, size_t bytes) {
+    for (size_t i = 0; i < bytes; i++) {
+        out[i] = (unsigned char)(value >> (8 * i));
     }
-    if (asmopt_is_disabled(ctx, "peephole")) {
+}
+
+/* Where input line line_no (1-based) sits in original_text; false when it is not there. */
+static bool asmopt_source_span(const asmopt_context* ctx, size_t line_no, uint64_t* offset, uint32_t* length) {
+    if (line_no == 0 || line_no > ctx->original_count || !ctx->original_text) {
         return false;
     }
-    if (!asmopt_has_opt(ctx->enabled_opts, ctx->enabled_count, "peephole")) {
+    const char* line = ctx->original_lines[line_no - 1];
+    if (line < ctx->original_text || line >= ctx->original_text + ctx->original_length) {
         return false;
     }
+    *offset = (uint64_t)(line - ctx->original_text);
+    *length = (uint32_t)strlen(line);
     return true;
 }
 
-int asmopt_optimize(asmopt_context* ctx) {
-    if (!ctx || !ctx->original_lines) {
-        return -1;
-    }
-    char* syntax = asmopt_detect_syntax(ctx);
-    ctx->stats.original_lines = ctx->original_count;
-    ctx->stats.optimized_lines = 0;
-    ctx->stats.replacements = 0;
-    ctx->stats.removals = 0;
-    asmopt_build_ir(ctx);
-    asmopt_build_cfg(ctx);
-    ctx->insert_hot_align = asmopt_option_enabled(ctx, "hot_align");
-    bool do_opt = asmopt_should_optimize(ctx);
-    for (size_t i = 0; i < ctx->original_count; i++) {
-        if (!do_opt) {
-            asmopt_store_optimized_line(ctx, ctx->original_lines[i]);
-            continue;
-        }
-        bool replaced = false;
-        bool removed = false;
-        asmopt_peephole_line(ctx, i + 1, ctx->original_lines[i], syntax, &replaced, &removed);
-        size_t skip_lines = ctx->skip_lines;
-        ctx->skip_lines = 0;
-        if (replaced) {
-            ctx->stats.replacements += 1;
-        }
-        if (removed) {
-            ctx->stats.removals += 1;
+/* One fixed-width record; the meaning of a, b and c depends on kind (SPECIFICATION.md §10.2.3). */
+static void asmopt_binary_event(unsigned char* record, const asmopt_context* ctx, asmopt_report_kind kind,
+                                size_t index) {
+    size_t line_no = 0;
+    unsigned id = 0;
+    uint64_t a = 0;
+    uint64_t b = 0;
+    uint64_t c = 0;
+    switch (kind) {
+    case ASMOPT_REPORT_OPTIMIZATION: {
+        const asmopt_optimization_event* event = &ctx->opt_events[index];
+        /* Names are PATTERN_NAMES entries except for events replayed from the cache. */
+        int pattern = -1;
+        for (int i = 0; i < ASMOPT_PATTERN_COUNT; i++) {
+            if (event->pattern_name == PATTERN_NAMES[i]) {
+                pattern = i;
+                break;
+            }
         }
-        if (skip_lines > 0) {
-            i += skip_lines;
+        if (pattern < 0) {
+            pattern = asmopt_find_pattern(event->pattern_name);
         }
-    }
-    if (!do_opt) {
-        ctx->stats.optimized_lines = ctx->original_count;
-    } else {
-        ctx->stats.optimized_lines = ctx->optimized_count;
-    }
-    free(syntax);
-    return 0;
+        line_no = event->line_no;
+        id = pattern < 0 ? 0xFFFFu : (unsigned)pattern;
+        a = asmopt_event_removed(event) ? 1 : 0;
+        break;
+    }
+    case ASMOPT_REPORT_SCHEDULE: {
+        const asmopt_schedule_event* event = &ctx->schedule_events[index];
+        line_no = event->first_line;
+        a = event->cycles_before;
+        b = event->cycles_after;
+        c = event->last_line;
+        break;
+    }
+    case ASMOPT_REPORT_FUSION: {
+        const asmopt_fusion_event* event = &ctx->fusion_events[index];
+        line_no = event->line_no;
+        a = event->fused ? 1 : 0;
+        break;
+    }
+    case ASMOPT_REPORT_IF_CONVERT: {
+        const asmopt_if_convert_event* event = &ctx->if_convert_events[index];
+        line_no = event->line_no;
+        a = event->cycles;
+        b = event->diamond ? 1 : 0;
+        break;
+    }
+    case ASMOPT_REPORT_LOOP_ALIGN: {
+        const asmopt_loop_align_event* event = &ctx->loop_align_events[index];
+        line_no = event->line_no;
+        a = event->bytes;
+        break;
+    }
+    case ASMOPT_REPORT_CODE_SIZE: {
+        const asmopt_size_event* event = &ctx->size_events[index];
+        line_no = event->line_no;
+        a = event->bytes_before;
+        b = event->bytes_after;
+        break;
+    }
+    case ASMOPT_REPORT_LOOP_OPT: {
+        const asmopt_loop_opt_event* event = &ctx->loop_opt_events[index];
+        line_no = event->line_no;
+        a = event->after ? 1 : 0;
+        break;
+    }
+    default: {
+        const asmopt_vex_transition_event* event = &ctx->vex_transition_events[index];
+        line_no = event->line_no;
+        a = event->avx_line;
+        break;
+    }
+    }
+    uint64_t offset = ASMOPT_REPORT_NO_SOURCE;
+    uint32_t length = 0;
+    /* Schedule events count output lines, which have no place in the source. */
+    if (kind != ASMOPT_REPORT_SCHEDULE) {
+        asmopt_source_span(ctx, line_no, &offset, &length);
+    }
+    asmopt_put_le(record, line_no, 4);
+    asmopt_put_le(record + 4, (uint64_t)kind, 2);
+    asmopt_put_le(record + 6, id, 2);
+    asmopt_put_le(record + 8, a, 4);
+    asmopt_put_le(record + 12, b, 4);
+    asmopt_put_le(record + 16, offset, 8);
+    asmopt_put_le(record + 24, length, 4);
+    asmopt_put_le(record + 28, c, 4);
 }
 
-char* asmopt_generate_assembly(asmopt_context* ctx) {
-    if (!ctx) {
-        return NULL;
-    }
-    if ((!ctx->optimized_lines || ctx->optimized_count == 0) && ctx->original_lines) {
-        return asmopt_join_lines(ctx->original_lines, ctx->original_count, ctx->trailing_newline);
+static void asmopt_write_report_binary(FILE* output, const asmopt_context* ctx) {
+    size_t names_size = 0;
+    for (size_t i = 0; i < ASMOPT_PATTERN_COUNT; i++) {
+        names_size += strlen(PATTERN_NAMES[i]) + 1;
+    }
+    size_t padded = (names_size + 7) & ~(size_t)7;
+    size_t records = 0;
+    for (int kind = 0; kind < ASMOPT_REPORT_KIND_COUNT; kind++) {
+        records += asmopt_report_count(ctx, (asmopt_report_kind)kind);
+    }
+    unsigned char header[ASMOPT_REPORT_HEADER_SIZE];
+    memcpy(header, ASMOPT_REPORT_MAGIC, 8);
+    asmopt_put_le(header + 8, ASMOPT_REPORT_VERSION, 4);
+    asmopt_put_le(header + 12, ASMOPT_REPORT_RECORD_SIZE, 4);
+    asmopt_put_le(header + 16, records, 8);
+    asmopt_put_le(header + 24, ctx->stats.original_lines, 8);
+    asmopt_put_le(header + 32, ctx->stats.optimized_lines, 8);
+    asmopt_put_le(header + 40, ctx->stats.replacements, 8);
+    asmopt_put_le(header + 48, ctx->stats.removals, 8);
+    asmopt_put_le(header + 56, ctx->fusion_pairs_before, 8);
+    asmopt_put_le(header + 64, ctx->fusion_pairs_after, 8);
+    asmopt_put_le(header + 72, ctx->code_bytes_before, 8);
+    asmopt_put_le(header + 80, ctx->code_bytes_after, 8);
+    asmopt_put_le(header + 88, ASMOPT_PATTERN_COUNT, 4);
+    asmopt_put_le(header + 92, padded, 4);
+    fwrite(header, 1, sizeof(header), output);
+    for (size_t i = 0; i < ASMOPT_PATTERN_COUNT; i++) {
+        fwrite(PATTERN_NAMES[i], 1, strlen(PATTERN_NAMES[i]) + 1, output);
+    }
+    static const unsigned char padding[8] = {0};
+    fwrite(padding, 1, padded - names_size, output);
+    unsigned char record[ASMOPT_REPORT_RECORD_SIZE];
+    for (int kind = 0; kind < ASMOPT_REPORT_KIND_COUNT; kind++) {
+        size_t count = asmopt_report_count(ctx, (asmopt_report_kind)kind);
+        for (size_t i = 0; i < count; i++) {
+            asmopt_binary_event(record, ctx, (asmopt_report_kind)kind, i);
+            fwrite(record, 1, sizeof(record), output);
+        }
     }
-    return asmopt_join_lines(ctx->optimized_lines, ctx->optimized_count, ctx->trailing_newline);
 }
 
-char* asmopt_generate_report(asmopt_context* ctx) {
-    if (!ctx) {
-        return asmopt_strdup("");
-    }
-    
-    /* Calculate required buffer size */
-    size_t buffer_size = 1024;
-    for (size_t i = 0; i < ctx->opt_event_count; i++) {
-        buffer_size += strlen(ctx->opt_events[i].pattern_name) + 
-                      strlen(ctx->opt_events[i].original) + 
-                      strlen(ctx->opt_events[i].optimized) + 100;
-    }
-    
-    char* buffer = malloc(buffer_size);
-    if (!buffer) {
-        return asmopt_strdup("");
-    }
-    
-    int written = snprintf(buffer, buffer_size,
-             "Optimization Report\n"
-             "==================\n\n"
-             "Summary:\n"
-             "  Original lines: %zu\n"
-             "  Optimized lines: %zu\n"
-             "  Replacements: %zu\n"
-             "  Removals: %zu\n",
-             ctx->stats.original_lines,
-             ctx->stats.optimized_lines,
-             ctx->stats.replacements,
-             ctx->stats.removals);
-    
-    if (written < 0 || (size_t)written >= buffer_size) {
-        free(buffer);
-        return asmopt_strdup("Error: Report generation failed\n");
+int asmopt_write_report(asmopt_context* ctx, FILE* output, const char* format) {
+    if (!ctx || !output) {
+        return -1;
     }
-    
-    size_t offset = (size_t)written;
-    
-    if (ctx->opt_event_count > 0) {
-        written = snprintf(buffer + offset, buffer_size - offset, 
-                          "\nOptimizations Applied:\n");
-        if (written < 0 || offset + (size_t)written >= buffer_size) {
-            return buffer;  /* Return what we have so far */
-        }
-        offset += (size_t)written;
-        
-        for (size_t i = 0; i < ctx->opt_event_count; i++) {
-            asmopt_optimization_event* event = &ctx->opt_events[i];
-            written = snprintf(buffer + offset, buffer_size - offset,
-                             "  Line %zu: %s\n"
-                             "    Before: %s\n"
-                             "    After:  %s\n",
-                             event->line_no,
-                             event->pattern_name,
-                             event->original,
-                             event->optimized);
-            if (written < 0 || offset + (size_t)written >= buffer_size) {
-                return buffer;  /* Return what we have so far */
-            }
-            offset += (size_t)written;
-        }
+    if (!format || strcmp(format, "text") == 0) {
+        char* report = asmopt_generate_report(ctx);
+        int result = report && fputs(report, output) >= 0 ? 0 : -1;
+        free(report);
+        return ferror(output) ? -1 : result;
+    }
+    asmopt_measure_sizes(ctx);
+    if (strcmp(format, "json") == 0) {
+        asmopt_write_report_json(output, ctx);
+    } else if (strcmp(format, "jsonl") == 0) {
+        asmopt_write_report_jsonl(output, ctx);
+    } else if (strcmp(format, "binary") == 0) {
+        asmopt_write_report_binary(output, ctx);
+    } else {
+        return -1;
     }
-    
-    return buffer;
+    return ferror(output) ? -1 : 0;
 }
 
 void asmopt_get_stats(asmopt_context* ctx, size_t* original, size_t* optimized, size_t* replacements, size_t* removals) {
@@ -3221,6 +9926,30 @@ void asmopt_get_stats(asmopt_context* ctx, size_t* original, size_t* optimized,
     }
 }
 
+int asmopt_get_profile(asmopt_context* ctx, asmopt_profile* profile) {
+    if (!profile) {
+        return -1;
+    }
+    bool enabled = ctx && ASMOPT_PROFILING(ctx);
+    if (enabled) {
+        *profile = ctx->profile;
+        profile->bytes_allocated += ctx->line_arena.allocated + ctx->ir_arena.allocated;
+    } else {
+        memset(profile, 0, sizeof(*profile));
+    }
+    profile->pattern_count = ASMOPT_PATTERN_COUNT;
+    profile->lookahead_attempts = 0;
+    profile->lookahead_hits = 0;
+    for (size_t i = 0; i < ASMOPT_PATTERN_COUNT; i++) {
+        profile->pattern_names[i] = PATTERN_NAMES[i];
+        if (ASMOPT_LOOKAHEAD_PATTERNS & ASMOPT_PATTERN_BIT(i)) {
+            profile->lookahead_attempts += profile->pattern_attempts[i];
+            profile->lookahead_hits += profile->pattern_hits[i];
+        }
+    }
+    return enabled ? 0 : -1;
+}
+
 void asmopt_destroy(asmopt_context* ctx) {
     if (!ctx) {
         return;
@@ -3241,18 +9970,31 @@ void asmopt_destroy(asmopt_context* ctx) {
         free(ctx->options[i].value);
     }
     free(ctx->options);
-    asmopt_reset_lines(ctx);
+    free(ctx->file_results);
+    asmopt_release_lines(ctx);
     free(ctx);
 }
 
+void asmopt_reset(asmopt_context* ctx) {
+    if (!ctx) {
+        return;
+    }
+    asmopt_reset_lines(ctx);
+}
+
 void asmopt_enable_optimization(asmopt_context* ctx, const char* name) {
     if (!ctx || !name) {
         return;
     }
     if (strcmp(name, "all") == 0) {
         asmopt_add_name(&ctx->enabled_opts, &ctx->enabled_count, "peephole");
+        ctx->pattern_mask = ASMOPT_PATTERN_ALL;
         return;
     }
+    int pattern = asmopt_find_pattern(name);
+    if (pattern >= 0) {
+        ctx->pattern_mask |= ASMOPT_PATTERN_BIT(pattern);
+    }
     asmopt_add_name(&ctx->enabled_opts, &ctx->enabled_count, name);
 }
 
@@ -3265,8 +10007,13 @@ void asmopt_disable_optimization(asmopt_context* ctx, const char* name) {
         ctx->enabled_opts = NULL;
         ctx->enabled_count = 0;
         asmopt_add_name(&ctx->disabled_opts, &ctx->disabled_count, "all");
+        ctx->pattern_mask = 0;
         return;
     }
+    int pattern = asmopt_find_pattern(name);
+    if (pattern >= 0) {
+        ctx->pattern_mask &= ~ASMOPT_PATTERN_BIT(pattern);
+    }
     asmopt_add_name(&ctx->disabled_opts, &ctx->disabled_count, name);
 }
 
@@ -3310,3 +10057,170 @@ char* asmopt_dump_cfg_text(asmopt_context* ctx) {
 char* asmopt_dump_cfg_dot(asmopt_context* ctx) {
     return asmopt_dump_cfg_dot_internal(ctx);
 }
+
+/* New context carrying ctx's configuration but none of its input or results. */
+static asmopt_context* asmopt_clone_settings(asmopt_context* ctx, bool keep_threads, bool keep_cache) {
+    asmopt_context* clone = asmopt_create(ctx->architecture);
+    if (!clone) {
+        return NULL;
+    }
+    asmopt_set_target_cpu(clone, ctx->target_cpu);
+    asmopt_set_format(clone, ctx->format);
+    clone->optimization_level = ctx->optimization_level;
+    clone->optimize_size = ctx->optimize_size;
+    clone->amd_optimizations = ctx->amd_optimizations;
+    clone->no_optimize = ctx->no_optimize;
+    clone->preserve_all = ctx->preserve_all;
+    clone->pattern_mask = ctx->pattern_mask;
+    clone->abi = ctx->abi;
+    asmopt_free_string_array(clone->enabled_opts, clone->enabled_count);
+    clone->enabled_opts = NULL;
+    clone->enabled_count = 0;
+    for (size_t i = 0; i < ctx->enabled_count; i++) {
+        asmopt_add_name(&clone->enabled_opts, &clone->enabled_count, ctx->enabled_opts[i]);
+    }
+    for (size_t i = 0; i < ctx->disabled_count; i++) {
+        asmopt_add_name(&clone->disabled_opts, &clone->disabled_count, ctx->disabled_opts[i]);
+    }
+    for (size_t i = 0; i < ctx->option_count; i++) {
+        if (!keep_threads && ctx->options[i].key && strcmp(ctx->options[i].key, "threads") == 0) {
+            continue;
+        }
+        if (!keep_cache && ctx->options[i].key && strcmp(ctx->options[i].key, "cache_dir") == 0) {
+            continue;
+        }
+        asmopt_add_option(clone, ctx->options[i].key, ctx->options[i].value);
+    }
+    return clone;
+}
+
+static bool asmopt_write_text(const char* path, const char* text) {
+    FILE* handle = fopen(path, "w");
+    if (!handle) {
+        return false;
+    }
+    bool ok = fputs(text, handle) >= 0;
+    return fclose(handle) == 0 && ok;
+}
+
+typedef struct {
+    asmopt_context* settings;
+    const char* const* inputs;
+    const char* const* outputs;
+    size_t count;
+    bool keep_threads;
+    int* results;
+    asmopt_stats* stats;
+#if ASMOPT_HAVE_THREADS
+    atomic_size_t next_file;
+#else
+    size_t next_file;
+#endif
+} asmopt_file_queue;
+
+static int asmopt_optimize_one_file(asmopt_file_queue* queue, size_t index) {
+    asmopt_context* ctx = asmopt_clone_settings(queue->settings, queue->keep_threads, true);
+    if (!ctx) {
+        return -1;
+    }
+    int result = -1;
+    if (asmopt_parse_file(ctx, queue->inputs[index]) == 0 && asmopt_optimize(ctx) == 0) {
+        char* output = asmopt_generate_assembly(ctx);
+        if (output && asmopt_write_text(queue->outputs[index], output)) {
+            queue->stats[index] = ctx->stats;
+            result = 0;
+        }
+        free(output);
+    }
+    asmopt_destroy(ctx);
+    return result;
+}
+
+static void* asmopt_file_worker(void* arg) {
+    asmopt_file_queue* queue = arg;
+    for (;;) {
+#if ASMOPT_HAVE_THREADS
+        size_t index = atomic_fetch_add(&queue->next_file, 1);
+#else
+        size_t index = queue->next_file++;
+#endif
+        if (index >= queue->count) {
+            break;
+        }
+        queue->results[index] = asmopt_optimize_one_file(queue, index);
+    }
+    return NULL;
+}
+
+int asmopt_optimize_files(asmopt_context* ctx, const char* const* inputs, const char* const* outputs, size_t count) {
+    if (!ctx || (count > 0 && (!inputs || !outputs))) {
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (!inputs[i] || !outputs[i]) {
+            return -1;
+        }
+    }
+    ctx->file_result_count = 0;
+    asmopt_file_queue queue;
+    queue.settings = ctx;
+    queue.inputs = inputs;
+    queue.outputs = outputs;
+    queue.count = count;
+    queue.results = calloc(count ? count : 1, sizeof(int));
+    queue.stats = calloc(count ? count : 1, sizeof(asmopt_stats));
+    if (!queue.results || !queue.stats) {
+        free(queue.results);
+        free(queue.stats);
+        return -1;
+    }
+#if ASMOPT_HAVE_THREADS
+    atomic_init(&queue.next_file, 0);
+    size_t jobs = asmopt_thread_count(ctx);
+    if (jobs > count) {
+        jobs = count;
+    }
+    /* With several files in flight, keep each file on one thread. */
+    queue.keep_threads = jobs <= 1;
+    pthread_t workers[ASMOPT_MAX_THREADS];
+    size_t started = 0;
+    for (size_t i = 1; i < jobs; i++) {
+        if (pthread_create(&workers[started], NULL, asmopt_file_worker, &queue) != 0) {
+            break;
+        }
+        started++;
+    }
+    asmopt_file_worker(&queue);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+#else
+    queue.next_file = 0;
+    queue.keep_threads = true;
+    asmopt_file_worker(&queue);
+#endif
+    int failures = 0;
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    for (size_t i = 0; i < count; i++) {
+        if (queue.results[i] != 0) {
+            failures++;
+            continue;
+        }
+        ctx->stats.original_lines += queue.stats[i].original_lines;
+        ctx->stats.optimized_lines += queue.stats[i].optimized_lines;
+        ctx->stats.replacements += queue.stats[i].replacements;
+        ctx->stats.removals += queue.stats[i].removals;
+    }
+    free(ctx->file_results);
+    ctx->file_results = queue.results;
+    ctx->file_result_count = count;
+    free(queue.stats);
+    return failures;
+}
+
+int asmopt_get_file_result(asmopt_context* ctx, size_t index) {
+    if (!ctx || index >= ctx->file_result_count) {
+        return -1;
+    }
+    return ctx->file_results[index];
+}
@@ -1,16 +1,21 @@
 #include "asmopt.h"
 
+#include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #if defined(_WIN32)
+#include <direct.h>
 #define asmopt_isatty _isatty
 #define asmopt_fileno _fileno
+#define asmopt_mkdir(path) _mkdir(path)
 #else
+#include <sys/stat.h>
 #include <unistd.h>
 #define asmopt_isatty isatty
 #define asmopt_fileno fileno
+#define asmopt_mkdir(path) mkdir(path, 0777)
 #endif
 
 typedef struct {
@@ -18,6 +23,7 @@ typedef struct {
     const char* output_path;
     const char* format;
     const char* report_path;
+    const char* report_format;
     const char* cfg_path;
     const char* march;
     const char* mtune;
@@ -26,11 +32,17 @@ typedef struct {
     bool no_optimize;
     bool preserve_all;
     bool stats;
+    bool profile;
     bool dump_ir;
     bool dump_cfg;
+    bool stream;
     int verbose;
     bool quiet;
     bool amd_optimize;
+    const char* batch_path;
+    const char* outdir;
+    const char** inputs;
+    size_t input_count;
 } asmopt_cli_options;
 
 static void asmopt_set_bool_option(asmopt_context* ctx, const char* key, bool value) {
@@ -45,12 +57,17 @@ static void asmopt_print_usage(const char* prog) {
             "  -o, --output <file>      Output assembly file\n"
             "  -f, --format <format>    Syntax format (intel, att)\n"
             "  -O0..-O4                 Optimization level\n"
+            "  -Os                      Optimize for size: -O2 passes, smallest encodings\n"
+            "  -j, --threads <n>        Optimize independent blocks on n threads\n"
+            "  --cache-dir <dir>        Reuse results for functions unchanged since an earlier run\n"
             "  --enable <opt>           Enable optimization\n"
             "  --disable <opt>          Disable optimization\n"
             "  --no-optimize            Parse and regenerate without optimization\n"
             "  --preserve-all           Preserve comments and formatting\n"
             "  --report <file>          Write optimization report\n"
+            "  --report-format <fmt>    Report format (text, json, jsonl, binary)\n"
             "  --stats                  Print optimization statistics\n"
+            "  --profile                Print phase times, allocations and pattern counters\n"
             "  --cfg <file>             Write CFG dot output\n"
             "  --dump-ir                Dump IR to stderr\n"
             "  --dump-cfg               Dump CFG to stderr\n"
@@ -58,8 +75,12 @@ static void asmopt_print_usage(const char* prog) {
             "  -q, --quiet              Suppress non-error output\n"
             "  -m, --march <arch>        Target architecture\n"
             "  --mtune <cpu>            Target CPU\n"
+            "  --abi <abi>              Registers live at ret and calls (sysv, win64, none)\n"
             "  --amd-optimize           Enable AMD optimizations\n"
-            "  --no-amd-optimize        Disable AMD optimizations\n",
+            "  --no-amd-optimize        Disable AMD optimizations\n"
+            "  --batch <list>           Optimize every file named in <list> (one per line)\n"
+            "  --outdir <dir>           Batch output directory; positional inputs join the batch\n"
+            "  --stream                 Optimize through a sliding window, writing output as it goes\n",
             prog);
 }
 
@@ -90,6 +111,32 @@ static bool asmopt_parse_args(int argc, char** argv, asmopt_cli_options* options
             options->opt_level = arg[2] - '0';
             options->has_opt_level = true;
             asmopt_set_optimization_level(ctx, options->opt_level);
+        } else if (strcmp(arg, "-Os") == 0) {
+            options->opt_level = 2;
+            options->has_opt_level = true;
+            asmopt_set_optimization_level(ctx, ASMOPT_LEVEL_SIZE);
+        } else if (strcmp(arg, "-j") == 0 || strcmp(arg, "--threads") == 0) {
+            if (i + 1 >= argc) {
+                return false;
+            }
+            asmopt_set_option(ctx, "threads", argv[++i]);
+        } else if (strcmp(arg, "--cache-dir") == 0) {
+            if (i + 1 >= argc) {
+                return false;
+            }
+            asmopt_set_option(ctx, "cache_dir", argv[++i]);
+        } else if (strcmp(arg, "--batch") == 0) {
+            if (i + 1 >= argc) {
+                return false;
+            }
+            options->batch_path = argv[++i];
+        } else if (strcmp(arg, "--outdir") == 0) {
+            if (i + 1 >= argc) {
+                return false;
+            }
+            options->outdir = argv[++i];
+        } else if (strcmp(arg, "--stream") == 0) {
+            options->stream = true;
         } else if (strcmp(arg, "--enable") == 0) {
             if (i + 1 >= argc) {
                 return false;
@@ -113,9 +160,21 @@ static bool asmopt_parse_args(int argc, char** argv, asmopt_cli_options* options
                 return false;
             }
             options->report_path = argv[++i];
+        } else if (strcmp(arg, "--report-format") == 0) {
+            if (i + 1 >= argc) {
+                return false;
+            }
+            options->report_format = argv[++i];
+            if (strcmp(options->report_format, "text") != 0 && strcmp(options->report_format, "json") != 0 &&
+                strcmp(options->report_format, "jsonl") != 0 && strcmp(options->report_format, "binary") != 0) {
+                return false;
+            }
         } else if (strcmp(arg, "--stats") == 0) {
             options->stats = true;
             asmopt_set_bool_option(ctx, "stats", true);
+        } else if (strcmp(arg, "--profile") == 0) {
+            options->profile = true;
+            asmopt_set_option(ctx, "profile", "1");
         } else if (strcmp(arg, "--cfg") == 0) {
             if (i + 1 >= argc) {
                 return false;
@@ -147,6 +206,15 @@ static bool asmopt_parse_args(int argc, char** argv, asmopt_cli_options* options
             options->mtune = argv[++i];
             asmopt_set_target_cpu(ctx, options->mtune);
             asmopt_set_option(ctx, "mtune", options->mtune);
+        } else if (strcmp(arg, "--abi") == 0) {
+            if (i + 1 >= argc) {
+                return false;
+            }
+            const char* abi = argv[++i];
+            if (strcmp(abi, "sysv") != 0 && strcmp(abi, "win64") != 0 && strcmp(abi, "none") != 0) {
+                return false;
+            }
+            asmopt_set_option(ctx, "abi", abi);
         } else if (strcmp(arg, "--amd-optimize") == 0) {
             options->amd_optimize = true;
             asmopt_set_amd_optimizations(ctx, 1);
@@ -159,37 +227,15 @@ static bool asmopt_parse_args(int argc, char** argv, asmopt_cli_options* options
             asmopt_set_option(ctx, arg, "");
         } else if (!options->input_path) {
             options->input_path = arg;
+            options->inputs[options->input_count++] = arg;
         } else {
             asmopt_set_option(ctx, "extra", arg);
+            options->inputs[options->input_count++] = arg;
         }
     }
     return true;
 }
 
-static char* asmopt_read_stdin(void) {
-    size_t cap = 4096;
-    size_t len = 0;
-    char* buffer = malloc(cap);
-    if (!buffer) {
-        return NULL;
-    }
-    int ch = 0;
-    while ((ch = getchar()) != EOF) {
-        if (len + 1 >= cap) {
-            cap *= 2;
-            char* next = realloc(buffer, cap);
-            if (!next) {
-                free(buffer);
-                return NULL;
-            }
-            buffer = next;
-        }
-        buffer[len++] = (char)ch;
-    }
-    buffer[len] = '\0';
-    return buffer;
-}
-
 static bool asmopt_write_file(const char* path, const char* data) {
     if (!path || strcmp(path, "-") == 0) {
         fputs(data, stdout);
@@ -204,32 +250,311 @@ static bool asmopt_write_file(const char* path, const char* data) {
     return true;
 }
 
-static bool asmopt_write_report(const char* path, const char* data) {
-    if (!path || strcmp(path, "-") == 0) {
-        fputs(data, stderr);
-        return true;
+/* Events go straight to the file; only the text format builds the report in memory first. */
+static bool asmopt_emit_report(asmopt_context* ctx, const asmopt_cli_options* options) {
+    const char* path = options->report_path;
+    const char* format = options->report_format ? options->report_format : "text";
+    if (strcmp(path, "-") == 0) {
+        return asmopt_write_report(ctx, stderr, format) == 0;
     }
-    FILE* handle = fopen(path, "w");
+    FILE* handle = fopen(path, strcmp(format, "binary") == 0 ? "wb" : "w");
     if (!handle) {
         return false;
     }
-    fputs(data, handle);
-    fclose(handle);
+    bool ok = asmopt_write_report(ctx, handle, format) == 0;
+    return fclose(handle) == 0 && ok;
+}
+
+static void asmopt_print_stats(asmopt_context* ctx) {
+    size_t original = 0;
+    size_t optimized = 0;
+    size_t replacements = 0;
+    size_t removals = 0;
+    asmopt_get_stats(ctx, &original, &optimized, &replacements, &removals);
+    fprintf(stderr,
+            "Statistics:\n"
+            "  original_lines: %zu\n"
+            "  optimized_lines: %zu\n"
+            "  replacements: %zu\n"
+            "  removals: %zu\n",
+            original, optimized, replacements, removals);
+}
+
+static void asmopt_print_profile(asmopt_context* ctx) {
+    asmopt_profile profile;
+    if (asmopt_get_profile(ctx, &profile) != 0) {
+        fprintf(stderr, "Profile: not available in this build\n");
+        return;
+    }
+    fprintf(stderr,
+            "Profile:\n"
+            "  parse_seconds: %.6f\n"
+            "  ir_seconds: %.6f\n"
+            "  cfg_seconds: %.6f\n"
+            "  peephole_seconds: %.6f\n"
+            "  emit_seconds: %.6f\n"
+            "  lookahead_seconds: %.6f\n"
+            "  bytes_allocated: %zu\n"
+            "  lines_examined: %zu\n"
+            "  lookahead_attempts: %zu\n"
+            "  lookahead_hits: %zu\n"
+            "  patterns (attempts/hits):\n",
+            profile.parse_seconds, profile.ir_seconds, profile.cfg_seconds, profile.peephole_seconds,
+            profile.emit_seconds, profile.lookahead_seconds, profile.bytes_allocated, profile.lines_examined,
+            profile.lookahead_attempts, profile.lookahead_hits);
+    for (size_t i = 0; i < profile.pattern_count; i++) {
+        fprintf(stderr, "    %s: %zu/%zu\n", profile.pattern_names[i], profile.pattern_attempts[i],
+                profile.pattern_hits[i]);
+    }
+}
+
+static bool asmopt_add_path(char*** paths, size_t* count, size_t* capacity, const char* path, size_t len) {
+    if (*count == *capacity) {
+        size_t next_capacity = *capacity == 0 ? 16 : *capacity * 2;
+        char** next = realloc(*paths, sizeof(char*) * next_capacity);
+        if (!next) {
+            return false;
+        }
+        *paths = next;
+        *capacity = next_capacity;
+    }
+    char* copy = malloc(len + 1);
+    if (!copy) {
+        return false;
+    }
+    memcpy(copy, path, len);
+    copy[len] = '\0';
+    (*paths)[(*count)++] = copy;
     return true;
 }
 
+/* Read one path per line; blank lines and lines starting with '#' are skipped. */
+static bool asmopt_read_batch_list(const char* list_path, char*** paths, size_t* count, size_t* capacity) {
+    FILE* handle = fopen(list_path, "r");
+    if (!handle) {
+        return false;
+    }
+    char line[4096];
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), handle)) {
+        const char* start = line;
+        while (*start == ' ' || *start == '\t') {
+            start++;
+        }
+        size_t len = strlen(start);
+        while (len > 0 && (start[len - 1] == '\n' || start[len - 1] == '\r' || start[len - 1] == ' ' ||
+                           start[len - 1] == '\t')) {
+            len--;
+        }
+        if (len == 0 || start[0] == '#') {
+            continue;
+        }
+        ok = asmopt_add_path(paths, count, capacity, start, len);
+    }
+    fclose(handle);
+    return ok;
+}
+
+static const char* asmopt_base_name(const char* path) {
+    const char* base = path;
+    for (const char* ptr = path; *ptr; ptr++) {
+        if (*ptr == '/' || *ptr == '\\') {
+            base = ptr + 1;
+        }
+    }
+    return base;
+}
+
+/* The first option given that has no per-file meaning in a batch, or NULL. */
+static const char* asmopt_batch_unsupported(const asmopt_cli_options* options) {
+    if (options->output_path) {
+        return "--output";
+    }
+    if (options->report_path) {
+        return "--report";
+    }
+    if (options->report_format) {
+        return "--report-format";
+    }
+    if (options->profile) {
+        return "--profile";
+    }
+    if (options->cfg_path) {
+        return "--cfg";
+    }
+    if (options->dump_ir) {
+        return "--dump-ir";
+    }
+    if (options->dump_cfg) {
+        return "--dump-cfg";
+    }
+    return options->stream ? "--stream" : NULL;
+}
+
+static int asmopt_compare_outputs(const void* a, const void* b) {
+    return strcmp(**(char** const*)a, **(char** const*)b);
+}
+
+/* Report every pair of inputs whose outputs would overwrite each other; true if there are none. */
+static bool asmopt_unique_outputs(char** inputs, char** outputs, size_t count) {
+    char*** sorted = malloc(sizeof(char**) * (count ? count : 1));
+    if (!sorted) {
+        return false;
+    }
+    for (size_t i = 0; i < count; i++) {
+        sorted[i] = &outputs[i];
+    }
+    qsort(sorted, count, sizeof(char**), asmopt_compare_outputs);
+    bool unique = true;
+    for (size_t i = 1; i < count; i++) {
+        if (strcmp(*sorted[i - 1], *sorted[i]) == 0) {
+            fprintf(stderr, "%s and %s would both be written to %s\n", inputs[sorted[i - 1] - outputs],
+                    inputs[sorted[i] - outputs], *sorted[i]);
+            unique = false;
+        }
+    }
+    free(sorted);
+    return unique;
+}
+
+static int asmopt_run_batch(asmopt_context* ctx, const asmopt_cli_options* options) {
+    if (!options->outdir) {
+        fprintf(stderr, "--batch requires --outdir\n");
+        return 1;
+    }
+    const char* unsupported = asmopt_batch_unsupported(options);
+    if (unsupported) {
+        fprintf(stderr, "%s cannot be combined with --batch or --outdir\n", unsupported);
+        return 1;
+    }
+    char** inputs = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    bool ok = true;
+    for (size_t i = 0; ok && i < options->input_count; i++) {
+        ok = asmopt_add_path(&inputs, &count, &capacity, options->inputs[i], strlen(options->inputs[i]));
+    }
+    if (ok && options->batch_path) {
+        ok = asmopt_read_batch_list(options->batch_path, &inputs, &count, &capacity);
+        if (!ok) {
+            fprintf(stderr, "Failed to read batch list\n");
+        }
+    }
+    char** outputs = count > 0 ? calloc(count, sizeof(char*)) : NULL;
+    if (count > 0 && !outputs) {
+        ok = false;
+    }
+    for (size_t i = 0; ok && i < count; i++) {
+        const char* base = asmopt_base_name(inputs[i]);
+        size_t len = strlen(options->outdir) + strlen(base) + 2;
+        outputs[i] = malloc(len);
+        if (!outputs[i]) {
+            ok = false;
+            break;
+        }
+        snprintf(outputs[i], len, "%s/%s", options->outdir, base);
+    }
+    ok = ok && asmopt_unique_outputs(inputs, outputs, count);
+    if (ok && asmopt_mkdir(options->outdir) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Failed to create %s: %s\n", options->outdir, strerror(errno));
+        ok = false;
+    }
+    int exit_code = 1;
+    if (ok) {
+        int failures = asmopt_optimize_files(ctx, (const char* const*)inputs, (const char* const*)outputs, count);
+        for (size_t i = 0; failures > 0 && i < count; i++) {
+            if (asmopt_get_file_result(ctx, i) != 0) {
+                fprintf(stderr, "Failed to optimize %s\n", inputs[i]);
+            }
+        }
+        if (failures != 0) {
+            fprintf(stderr, "Failed to optimize %d file(s)\n", failures < 0 ? (int)count : failures);
+        } else {
+            exit_code = 0;
+        }
+        if (options->stats) {
+            asmopt_print_stats(ctx);
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        free(inputs[i]);
+        if (outputs) {
+            free(outputs[i]);
+        }
+    }
+    free(inputs);
+    free(outputs);
+    return exit_code;
+}
+
+/* Window-at-a-time optimization; output starts before the input has been read to the end. */
+static int asmopt_run_stream(asmopt_context* ctx, const asmopt_cli_options* options) {
+    if (options->dump_ir || options->dump_cfg || options->cfg_path) {
+        fprintf(stderr, "--stream cannot be combined with IR or CFG dumps\n");
+        return 1;
+    }
+    bool from_stdin = !options->input_path || strcmp(options->input_path, "-") == 0;
+    bool to_stdout = !options->output_path || strcmp(options->output_path, "-") == 0;
+    FILE* input = from_stdin ? stdin : fopen(options->input_path, "rb");
+    if (!input) {
+        fprintf(stderr, "Failed to read input\n");
+        return 1;
+    }
+    FILE* output = to_stdout ? stdout : fopen(options->output_path, "w");
+    if (!output) {
+        fprintf(stderr, "Failed to write output\n");
+        if (!from_stdin) {
+            fclose(input);
+        }
+        return 1;
+    }
+    int result = asmopt_optimize_stream(ctx, input, output);
+    if (!from_stdin) {
+        fclose(input);
+    }
+    if (!to_stdout && fclose(output) != 0) {
+        result = -1;
+    }
+    if (result != 0) {
+        fprintf(stderr, "Streaming optimization failed\n");
+        return 1;
+    }
+    if (options->report_path && !asmopt_emit_report(ctx, options)) {
+        fprintf(stderr, "Failed to write report\n");
+        return 1;
+    }
+    if (options->stats) {
+        asmopt_print_stats(ctx);
+    }
+    if (options->profile) {
+        asmopt_print_profile(ctx);
+    }
+    return 0;
+}
+
 int main(int argc, char** argv) {
     asmopt_cli_options options = {0};
     asmopt_context* ctx = asmopt_create("x86-64");
-    if (!ctx) {
+    options.inputs = calloc((size_t)argc, sizeof(char*));
+    if (!ctx || !options.inputs) {
         fprintf(stderr, "Failed to initialize asmopt\n");
+        free(options.inputs);
+        asmopt_destroy(ctx);
         return 1;
     }
     if (!asmopt_parse_args(argc, argv, &options, ctx)) {
         asmopt_print_usage(argv[0]);
+        free(options.inputs);
         asmopt_destroy(ctx);
         return 1;
     }
+    if (options.batch_path || options.outdir) {
+        int exit_code = asmopt_run_batch(ctx, &options);
+        free(options.inputs);
+        asmopt_destroy(ctx);
+        return exit_code;
+    }
+    free(options.inputs);
     if (!options.input_path && !options.quiet) {
         asmopt_set_option(ctx, "stdin", "1");
     }
@@ -239,19 +564,14 @@ int main(int argc, char** argv) {
         return 1;
     }
 
-    int parse_result = 0;
-    if (!options.input_path || strcmp(options.input_path, "-") == 0) {
-        char* input = asmopt_read_stdin();
-        if (!input) {
-            fprintf(stderr, "Failed to read stdin\n");
-            asmopt_destroy(ctx);
-            return 1;
-        }
-        parse_result = asmopt_parse_string(ctx, input);
-        free(input);
-    } else {
-        parse_result = asmopt_parse_file(ctx, options.input_path);
+    if (options.stream) {
+        int exit_code = asmopt_run_stream(ctx, &options);
+        asmopt_destroy(ctx);
+        return exit_code;
     }
+
+    const char* input_path = options.input_path ? options.input_path : "-";
+    int parse_result = asmopt_parse_file(ctx, input_path);
     if (parse_result != 0) {
         fprintf(stderr, "Failed to read input\n");
         asmopt_destroy(ctx);
@@ -288,29 +608,13 @@ int main(int argc, char** argv) {
         }
         free(dot);
     }
-    if (options.report_path) {
-        char* report = asmopt_generate_report(ctx);
-        if (!report || !asmopt_write_report(options.report_path, report)) {
-            fprintf(stderr, "Failed to write report\n");
-            free(report);
-            asmopt_destroy(ctx);
-            return 1;
-        }
-        free(report);
+    if (options.report_path && !asmopt_emit_report(ctx, &options)) {
+        fprintf(stderr, "Failed to write report\n");
+        asmopt_destroy(ctx);
+        return 1;
     }
     if (options.stats) {
-        size_t original = 0;
-        size_t optimized = 0;
-        size_t replacements = 0;
-        size_t removals = 0;
-        asmopt_get_stats(ctx, &original, &optimized, &replacements, &removals);
-        fprintf(stderr,
-                "Statistics:\n"
-                "  original_lines: %zu\n"
-                "  optimized_lines: %zu\n"
-                "  replacements: %zu\n"
-                "  removals: %zu\n",
-                original, optimized, replacements, removals);
+        asmopt_print_stats(ctx);
     }
 
     char* output = asmopt_generate_assembly(ctx);
@@ -326,6 +630,9 @@ int main(int argc, char** argv) {
         return 1;
     }
     free(output);
+    if (options.profile) {
+        asmopt_print_profile(ctx);
+    }
     asmopt_destroy(ctx);
     return 0;
 }
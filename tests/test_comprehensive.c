@@ -248,6 +248,47 @@ static int test_cfg_dump_dot() {
     TEST_PASS("test_cfg_dump_dot");
 }
 
+/* Test that dumps build the IR and CFG on demand, whether or not optimization ran */
+static int test_lazy_dumps() {
+    const char* input = "main:\n    mov rax, 0\n    jne main\n.L2:\n    ret\n";
+    asmopt_context* optimized = asmopt_create("x86-64");
+    asmopt_context* passthrough = asmopt_create("x86-64");
+    asmopt_context* parsed = asmopt_create("x86-64");
+    TEST_ASSERT(optimized != NULL && passthrough != NULL && parsed != NULL, "Failed to create context");
+    asmopt_parse_string(optimized, input);
+    asmopt_optimize(optimized);
+    asmopt_set_no_optimize(passthrough, 1);
+    asmopt_parse_string(passthrough, input);
+    asmopt_optimize(passthrough);
+    asmopt_parse_string(parsed, input);
+    
+    char* ir = asmopt_dump_ir_text(optimized);
+    char* cfg = asmopt_dump_cfg_text(optimized);
+    TEST_ASSERT(ir != NULL && strcmp(ir,
+                                    "IR:\n0001: label main\n0002: instr mov rax, 0\n0003: instr jne main\n"
+                                    "0004: label .L2\n0005: instr ret \n0006: blank \n") == 0,
+                "Unexpected IR dump");
+    TEST_ASSERT(cfg != NULL && strcmp(cfg, "CFG:\nmain:\n  mov rax, 0\n  jne main\n  -> main\n  -> .L2\n"
+                                           ".L2:\n  ret\n") == 0,
+                "Unexpected CFG dump");
+    asmopt_context* others[] = {passthrough, parsed};
+    for (size_t i = 0; i < 2; i++) {
+        char* other_ir = asmopt_dump_ir_text(others[i]);
+        char* other_cfg = asmopt_dump_cfg_text(others[i]);
+        TEST_ASSERT(other_ir != NULL && strcmp(other_ir, ir) == 0, "IR dump differs without optimization");
+        TEST_ASSERT(other_cfg != NULL && strcmp(other_cfg, cfg) == 0, "CFG dump differs without optimization");
+        free(other_ir);
+        free(other_cfg);
+    }
+    
+    free(ir);
+    free(cfg);
+    asmopt_destroy(optimized);
+    asmopt_destroy(passthrough);
+    asmopt_destroy(parsed);
+    TEST_PASS("test_lazy_dumps");
+}
+
 /* Test multiple directives */
 static int test_multiple_directives() {
     asmopt_context* ctx = asmopt_create("x86-64");
@@ -444,7 +485,8 @@ static int test_load_modify_store_optimization() {
     const char* input =
         "mov rax, [rbx]\n"
         "add rax, 5\n"
-        "mov [rbx], rax\n";
+        "mov [rbx], rax\n"
+        "xor eax, eax\n";
     
     asmopt_parse_string(ctx, input);
     asmopt_optimize(ctx);
@@ -758,6 +800,1209 @@ static int test_bsf_to_tzcnt() {
 
 /* Test Pattern 26 removed: bsr -> lzcnt not applied */
 
+/* Test generating output into a caller-owned buffer */
+static int test_generate_assembly_into() {
+    asmopt_context* ctx = asmopt_create("x86-64");
+    TEST_ASSERT(ctx != NULL, "Failed to create context");
+    
+    asmopt_parse_string(ctx, "mov rax, 0\nnop\n");
+    asmopt_optimize(ctx);
+    
+    char* expected = asmopt_generate_assembly(ctx);
+    TEST_ASSERT(expected != NULL, "Failed to generate output");
+    
+    size_t length = 0;
+    char small[4];
+    TEST_ASSERT(asmopt_generate_assembly_into(ctx, small, sizeof(small), &length) == -1, "Small buffer accepted");
+    TEST_ASSERT(length == strlen(expected), "Required length not reported");
+    
+    char buffer[64];
+    TEST_ASSERT(asmopt_generate_assembly_into(ctx, buffer, sizeof(buffer), &length) == 0, "Buffer rejected");
+    TEST_ASSERT(strcmp(buffer, expected) == 0, "Buffer output differs from allocated output");
+    
+    /* Reuse the same buffer for a second input */
+    asmopt_parse_string(ctx, "add rbx, 0\nret");
+    asmopt_optimize(ctx);
+    TEST_ASSERT(asmopt_generate_assembly_into(ctx, buffer, sizeof(buffer), &length) == 0, "Buffer reuse failed");
+    TEST_ASSERT(length == 3 && strcmp(buffer, "ret") == 0, "Reused buffer has stale output");
+    
+    free(expected);
+    asmopt_destroy(ctx);
+    TEST_PASS("test_generate_assembly_into");
+}
+
+/* Test per-phase profile counters */
+static int test_profile_counters() {
+    asmopt_context* ctx = asmopt_create("x86-64");
+    TEST_ASSERT(ctx != NULL, "Failed to create context");
+    asmopt_profile profile;
+    
+    asmopt_parse_string(ctx, "mov rax, 0\n");
+    asmopt_optimize(ctx);
+    TEST_ASSERT(asmopt_get_profile(ctx, &profile) == -1, "Profile reported while disabled");
+    TEST_ASSERT(profile.lines_examined == 0, "Disabled profile has counters");
+    
+    asmopt_set_option(ctx, "profile", "1");
+    /* A single pass, so every line is examined exactly once. */
+    asmopt_set_optimization_level(ctx, 1);
+    asmopt_parse_string(ctx, "mov rax, 0\nmov rbx, rcx\nmov rdx, rsi\njmp done\ndone:\n    ret\n");
+    asmopt_optimize(ctx);
+    char* output = asmopt_generate_assembly(ctx);
+    TEST_ASSERT(output != NULL, "Failed to generate output");
+    free(output);
+    if (asmopt_get_profile(ctx, &profile) != 0) {
+        /* Built with ASMOPT_PROFILE=OFF. */
+        asmopt_destroy(ctx);
+        TEST_PASS("test_profile_counters (profiling compiled out)");
+    }
+    TEST_ASSERT(profile.pattern_count > 0 && profile.pattern_count <= ASMOPT_PROFILE_MAX_PATTERNS,
+                "Bad pattern count");
+    
+    size_t xor_index = profile.pattern_count;
+    size_t swap_index = profile.pattern_count;
+    for (size_t i = 0; i < profile.pattern_count; i++) {
+        TEST_ASSERT(profile.pattern_hits[i] <= profile.pattern_attempts[i], "More hits than attempts");
+        if (strcmp(profile.pattern_names[i], "mov_zero_to_xor") == 0) {
+            xor_index = i;
+        } else if (strcmp(profile.pattern_names[i], "schedule_swap_move") == 0) {
+            swap_index = i;
+        }
+    }
+    TEST_ASSERT(xor_index < profile.pattern_count && profile.pattern_hits[xor_index] == 1, "mov_zero_to_xor not counted");
+    TEST_ASSERT(swap_index < profile.pattern_count && profile.pattern_hits[swap_index] == 1,
+                "schedule_swap_move not counted");
+    /* fallthrough_jump and schedule_swap_move both look ahead. */
+    TEST_ASSERT(profile.lookahead_hits == 2, "Lookahead hits incorrect");
+    TEST_ASSERT(profile.lookahead_attempts >= profile.lookahead_hits, "Lookahead attempts incorrect");
+    TEST_ASSERT(profile.lines_examined == 6, "Lines examined incorrect");
+    TEST_ASSERT(profile.bytes_allocated > 0, "No allocations recorded");
+    TEST_ASSERT(profile.parse_seconds >= 0 && profile.ir_seconds >= 0 && profile.emit_seconds >= 0,
+                "Negative phase time");
+    
+    asmopt_destroy(ctx);
+    TEST_PASS("test_profile_counters");
+}
+
+/* Test that asmopt_reset clears results, keeps the configuration and reuses storage */
+static int test_context_reset() {
+    const char* first =
+        "loop:\n"
+        "    mov rax, 0\n"
+        "    mov rbx, rbx\n"
+        "    add rcx, 1\n"
+        "    imul rdx, 1\n"
+        "    cmp rcx, 10\n"
+        "    jne loop\n"
+        "    ret\n";
+    const char* second = "    sub rsi, 1\n    mov rax, 0\n";
+    asmopt_context* ctx = asmopt_create("x86-64");
+    asmopt_context* fresh = asmopt_create("x86-64");
+    TEST_ASSERT(ctx != NULL && fresh != NULL, "Failed to create context");
+    asmopt_set_target_cpu(ctx, "zen4");
+    asmopt_disable_optimization(ctx, "mov_zero_to_xor");
+    asmopt_set_option(ctx, "profile", "1");
+    asmopt_set_target_cpu(fresh, "zen4");
+    asmopt_disable_optimization(fresh, "mov_zero_to_xor");
+    
+    asmopt_parse_string(ctx, first);
+    asmopt_optimize(ctx);
+    char* first_output = asmopt_generate_assembly(ctx);
+    char* first_report = asmopt_generate_report(ctx);
+    asmopt_profile profile;
+    int profiled = asmopt_get_profile(ctx, &profile) == 0;
+    size_t first_bytes = profile.bytes_allocated;
+    
+    asmopt_reset(ctx);
+    size_t original = 1, optimized = 1, replacements = 1, removals = 1;
+    asmopt_get_stats(ctx, &original, &optimized, &replacements, &removals);
+    TEST_ASSERT(original == 0 && optimized == 0 && replacements == 0 && removals == 0, "Stats survived reset");
+    char* empty = asmopt_generate_assembly(ctx);
+    TEST_ASSERT(empty != NULL && empty[0] == '\0', "Output survived reset");
+    free(empty);
+    TEST_ASSERT(asmopt_optimize(ctx) == -1, "Optimized without input");
+    
+    /* The configuration carries over: the result matches a fresh context with the same settings. */
+    asmopt_parse_string(ctx, second);
+    asmopt_optimize(ctx);
+    asmopt_parse_string(fresh, second);
+    asmopt_optimize(fresh);
+    char* output = asmopt_generate_assembly(ctx);
+    char* expected = asmopt_generate_assembly(fresh);
+    TEST_ASSERT(output != NULL && expected != NULL && strcmp(output, expected) == 0, "Reset lost the configuration");
+    TEST_ASSERT(strstr(output, "mov rax, 0") != NULL && strstr(output, "dec rsi") != NULL,
+                "Disabled pattern or default pattern wrong after reset");
+    free(output);
+    free(expected);
+    
+    /* A longer input after a shorter one still fits the kept storage. */
+    asmopt_reset(ctx);
+    asmopt_parse_string(ctx, first);
+    asmopt_optimize(ctx);
+    output = asmopt_generate_assembly(ctx);
+    char* report = asmopt_generate_report(ctx);
+    TEST_ASSERT(output != NULL && strcmp(output, first_output) == 0, "Output differs after reset");
+    TEST_ASSERT(report != NULL && strcmp(report, first_report) == 0, "Report differs after reset");
+    if (profiled && asmopt_get_profile(ctx, &profile) == 0) {
+        TEST_ASSERT(profile.bytes_allocated < first_bytes, "Reused context allocated as much as a new one");
+    }
+    free(output);
+    free(report);
+    free(first_output);
+    free(first_report);
+    asmopt_destroy(ctx);
+    asmopt_destroy(fresh);
+    TEST_PASS("test_context_reset");
+}
+
+/* Test that vector and scalar scanners split lines and comments identically */
+static int test_simd_scanning() {
+    /* Lines of every length up to 80 bytes put newlines and comments at every vector offset. */
+    char input[8192];
+    size_t used = 0;
+    for (int i = 0; i < 80; i++) {
+        used += (size_t)snprintf(input + used, sizeof(input) - used, "    add rax, 1 %c%.*s\n", i % 2 ? ';' : '#', i,
+                                 "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx");
+        used += (size_t)snprintf(input + used, sizeof(input) - used, "%.*s\n", i, "\n\n\n\n\n");
+    }
+    snprintf(input + used, sizeof(input) - used, "    add rbx, 1 ; no newline at the end");
+    
+    const char* modes[] = {"0", "sse2", "1"};
+    char* outputs[3] = {NULL, NULL, NULL};
+    char* reports[3] = {NULL, NULL, NULL};
+    for (int m = 0; m < 3; m++) {
+        asmopt_context* ctx = asmopt_create("x86-64");
+        TEST_ASSERT(ctx != NULL, "Failed to create context");
+        asmopt_set_option(ctx, "simd", modes[m]);
+        asmopt_parse_string(ctx, input);
+        asmopt_optimize(ctx);
+        outputs[m] = asmopt_generate_assembly(ctx);
+        reports[m] = asmopt_generate_report(ctx);
+        asmopt_destroy(ctx);
+        TEST_ASSERT(outputs[m] != NULL && reports[m] != NULL, "Failed to generate output");
+    }
+    TEST_ASSERT(strstr(outputs[0], "    inc rax #\n") != NULL, "Comment not kept");
+    TEST_ASSERT(strstr(outputs[0], "    inc rbx ; no newline at the end") != NULL, "Last line lost");
+    for (int m = 1; m < 3; m++) {
+        TEST_ASSERT(strcmp(outputs[m], outputs[0]) == 0, "Vector scan output differs from scalar");
+        TEST_ASSERT(strcmp(reports[m], reports[0]) == 0, "Vector scan report differs from scalar");
+    }
+    for (int m = 0; m < 3; m++) {
+        free(outputs[m]);
+        free(reports[m]);
+    }
+    TEST_PASS("test_simd_scanning");
+}
+
+/* Test that the syntax is decided from the head of the file */
+static int test_syntax_detection() {
+    asmopt_context* ctx = asmopt_create("x86-64");
+    TEST_ASSERT(ctx != NULL, "Failed to create context");
+    /* An Intel file whose string data contains '%'. */
+    asmopt_parse_string(ctx, "    .intel_syntax noprefix\n    mov rax, 0\n.LC0:\n    .string \"%d\"\n");
+    asmopt_optimize(ctx);
+    char* output = asmopt_generate_assembly(ctx);
+    TEST_ASSERT(output != NULL && strstr(output, "xor rax, rax") != NULL, "Intel directive ignored");
+    free(output);
+    
+    asmopt_parse_string(ctx, "    .att_syntax\n    movq $0, %rax\n");
+    asmopt_optimize(ctx);
+    output = asmopt_generate_assembly(ctx);
+    TEST_ASSERT(output != NULL && strstr(output, "xorq %rax, %rax") != NULL, "AT&T directive ignored");
+    free(output);
+    asmopt_destroy(ctx);
+    TEST_PASS("test_syntax_detection");
+}
+
+/*
+ * Optimize input at level for cpu (NULL for the default model), with one
+ * optimization disabled and a "threads" option when given; fills *report when
+ * report is not NULL.
+ */
+static char* optimize_with(const char* input, const char* cpu, int level, const char* disabled, const char* threads,
+                           char** report) {
+    asmopt_context* ctx = asmopt_create("x86-64");
+    if (!ctx) {
+        return NULL;
+    }
+    if (cpu) {
+        asmopt_set_target_cpu(ctx, cpu);
+    }
+    asmopt_set_optimization_level(ctx, level);
+    if (disabled) {
+        asmopt_disable_optimization(ctx, disabled);
+    }
+    if (threads) {
+        asmopt_set_option(ctx, "threads", threads);
+    }
+    asmopt_parse_string(ctx, input);
+    asmopt_optimize(ctx);
+    char* output = asmopt_generate_assembly(ctx);
+    if (report) {
+        *report = asmopt_generate_report(ctx);
+    }
+    asmopt_destroy(ctx);
+    return output;
+}
+
+static int test_fixpoint_cascade() {
+    /* Each rewrite exposes the next pattern: dead store twice, fallthrough jump then inversion. */
+    const char* input =
+        "    mov rax, rbx\n"
+        "    mov rax, rcx\n"
+        "    mov rax, rdx\n"
+        "    jne L1\n"
+        "    jmp L2\n"
+        "    jmp L1\n"
+        "L1:\n"
+        "    mov rbx, rdi\n"
+        "    mov r12, r9\n"
+        "L2:\n"
+        "    ret\n";
+    
+    char* single = optimize_with(input, NULL, 1, NULL, NULL, NULL);
+    TEST_ASSERT(single != NULL, "Failed to generate -O1 output");
+    TEST_ASSERT(strstr(single, "mov rax, rcx") != NULL, "-O1 ran more than one pass");
+    TEST_ASSERT(strstr(single, "jne L1") != NULL, "-O1 inverted the exposed branch");
+    
+    char* report = NULL;
+    char* output = optimize_with(input, NULL, 2, NULL, NULL, &report);
+    TEST_ASSERT(output != NULL && report != NULL, "Failed to generate -O2 output");
+    TEST_ASSERT(strstr(output, "mov rax, rdx") != NULL, "Cascaded dead store kept the wrong move");
+    TEST_ASSERT(strstr(output, "mov rax, rcx") == NULL, "Cascaded dead store not removed");
+    TEST_ASSERT(strstr(output, "je L2") != NULL, "Branch exposed by fallthrough removal not inverted");
+    TEST_ASSERT(strstr(output, "jmp") == NULL, "Jumps left after inversion");
+    /* The swap is not idempotent: it must happen once, not be undone by the next pass. */
+    TEST_ASSERT(strstr(output, "mov r12, r9\n    mov rbx, rdi") != NULL, "Swapped moves reordered again");
+    /* Later-pass events report the line the rewritten text came from. */
+    const char* first = strstr(report, "Line 1: dead_store_move");
+    TEST_ASSERT(first != NULL && strstr(first + 1, "Line 1: dead_store_move") != NULL,
+                "Second-pass dead store not reported at its original line");
+    TEST_ASSERT(strstr(report, "Line 4: invert_conditional_jump") != NULL, "Inversion reported at wrong line");
+    
+    char* deep = optimize_with(input, NULL, 4, NULL, NULL, NULL);
+    TEST_ASSERT(deep != NULL && strcmp(deep, output) == 0, "More passes changed a converged result");
+    
+    free(single);
+    free(output);
+    free(report);
+    free(deep);
+    TEST_PASS("test_fixpoint_cascade");
+}
+
+static int test_cost_model_selection() {
+    const char* input =
+        "add rax, 1\n"
+        "test rbx, rbx\n"
+        "jz .skip\n"
+        "bsf rcx, rbx\n"
+        ".skip:\n"
+        "cmp rdx, 0\n";
+    
+    /* Balanced weighting: the saved byte pays for the generic flags merge. */
+    char* generic_o2 = optimize_with(input, "generic", 2, NULL, NULL, NULL);
+    /* Cycle weighting: the flags merge makes inc slower than add on generic. */
+    char* generic_o3 = optimize_with(input, "generic", 3, NULL, NULL, NULL);
+    char* zen_o3 = optimize_with(input, "zen3", 3, NULL, NULL, NULL);
+    char* zen_later = optimize_with(input, "zen5", 3, NULL, NULL, NULL);
+    TEST_ASSERT(generic_o2 && generic_o3 && zen_o3 && zen_later, "Failed to generate output");
+    
+    TEST_ASSERT(strstr(generic_o2, "inc rax") != NULL, "-O2 generic rejected inc");
+    TEST_ASSERT(strstr(generic_o3, "add rax, 1") != NULL, "-O3 generic accepted inc");
+    TEST_ASSERT(strstr(zen_o3, "inc rax") != NULL, "-O3 zen3 rejected inc");
+    /* tzcnt needs BMI1, which the generic model lacks. */
+    TEST_ASSERT(strstr(generic_o3, "bsf rcx, rbx") != NULL, "generic used tzcnt");
+    TEST_ASSERT(strstr(zen_o3, "tzcnt rcx, rbx") != NULL, "zen3 kept bsf");
+    TEST_ASSERT(strstr(zen_later, "tzcnt rcx, rbx") != NULL, "Later Zen parts not mapped to a Zen model");
+    TEST_ASSERT(strstr(generic_o3, "test rdx, rdx") != NULL, "Zero compare not rewritten");
+    
+    free(generic_o2);
+    free(generic_o3);
+    free(zen_o3);
+    free(zen_later);
+    TEST_PASS("test_cost_model_selection");
+}
+
+static int test_list_scheduler() {
+    /* Two independent multiply chains written back to back. */
+    const char* input =
+        "f:\n"
+        "    imul rax, rbx\n"
+        "    add rax, rcx\n"
+        "    imul rdx, rsi\n"
+        "    add rdx, rcx\n"
+        "    mov [rdi], rax\n"
+        "    mov [rdi+8], rdx\n"
+        "    ret\n";
+    
+    char* single = optimize_with(input, NULL, 1, NULL, NULL, NULL);
+    TEST_ASSERT(single != NULL && strstr(single, "add rax, rcx\n    imul rdx, rsi\n") != NULL,
+                "-O1 scheduled instructions");
+    
+    char* report = NULL;
+    char* output = optimize_with(input, NULL, 2, NULL, NULL, &report);
+    TEST_ASSERT(output != NULL && report != NULL, "Failed to generate -O2 output");
+    TEST_ASSERT(strstr(output, "imul rax, rbx\n    imul rdx, rsi\n    add rax, rcx\n    add rdx, rcx\n") != NULL,
+                "Independent multiplies not interleaved");
+    /* Stores keep their order; the block still ends at ret. */
+    TEST_ASSERT(strstr(output, "mov [rdi], rax\n    mov [rdi+8], rdx\n    ret\n") != NULL, "Stores reordered");
+    TEST_ASSERT(strstr(report, "Scheduling:\n  Lines 2-7: 8 -> 6 cycles (2 saved)") != NULL,
+                "Scheduled block not reported");
+    
+    /* A label splits the block and the flags read by jne pin the last flag write. */
+    const char* barriers =
+        "    imul rax, rbx\n"
+        "    add rax, rcx\n"
+        "L1:\n"
+        "    imul rdx, rsi\n"
+        "    add rdx, rcx\n"
+        "    imul r8, r9\n"
+        "    sub r8, rcx\n"
+        "    jne L1\n";
+    char* kept = optimize_with(barriers, NULL, 2, NULL, NULL, NULL);
+    TEST_ASSERT(kept != NULL, "Failed to generate output");
+    TEST_ASSERT(strstr(kept, "    imul rax, rbx\n    add rax, rcx\n    .p2align 5,,15\nL1:\n") != NULL,
+                "Moved across a label");
+    TEST_ASSERT(strstr(kept, "    sub r8, rcx\n    jne L1\n") != NULL, "Flag producer moved away from its reader");
+    TEST_ASSERT(strstr(kept, "    imul rdx, rsi\n    imul r8, r9\n") != NULL, "Block after the label not scheduled");
+    
+    asmopt_context* ctx = asmopt_create("x86-64");
+    TEST_ASSERT(ctx != NULL, "Failed to create context");
+    asmopt_disable_optimization(ctx, "schedule");
+    asmopt_parse_string(ctx, input);
+    asmopt_optimize(ctx);
+    char* disabled = asmopt_generate_assembly(ctx);
+    TEST_ASSERT(disabled != NULL && strstr(disabled, "add rax, rcx\n    imul rdx, rsi\n") != NULL,
+                "Disabled scheduler still ran");
+    asmopt_destroy(ctx);
+    
+    free(single);
+    free(output);
+    free(report);
+    free(kept);
+    free(disabled);
+    TEST_PASS("test_list_scheduler");
+}
+
+/* Test that patterns consult liveness over the CFG, not just the adjacent lines */
+static int test_liveness_guards() {
+    /* jl reads the flags cmp left, so mov rax, 0 must not become xor. */
+    const char* flags_live =
+        "    cmp rdi, rsi\n"
+        "    mov rax, 0\n"
+        "    jl .less\n"
+        "    ret\n"
+        ".less:\n"
+        "    ret\n";
+    char* kept = optimize_with(flags_live, NULL, 2, NULL, NULL, NULL);
+    TEST_ASSERT(kept != NULL && strstr(kept, "mov rax, 0") != NULL, "Flags clobbered before jl");
+    
+    /* rcx is rewritten on the far side of the jump before anything reads it. */
+    const char* dead_across_blocks =
+        "    mov rcx, 5\n"
+        "    jmp .next\n"
+        ".next:\n"
+        "    mov rcx, rdi\n"
+        "    lea rax, [rcx+1]\n"
+        "    ret\n";
+    char* removed = optimize_with(dead_across_blocks, NULL, 2, NULL, NULL, NULL);
+    TEST_ASSERT(removed != NULL && strstr(removed, "mov rcx, 5") == NULL, "Dead move across blocks kept");
+    TEST_ASSERT(strstr(removed, "mov rcx, rdi") != NULL, "Live move removed");
+    
+    /* rax is the return value, so the load cannot be folded into the store. */
+    const char* returned = "    mov rax, [rbx]\n    add rax, 5\n    mov [rbx], rax\n    ret\n";
+    char* returned_output = optimize_with(returned, NULL, 2, NULL, NULL, NULL);
+    TEST_ASSERT(returned_output != NULL && strstr(returned_output, "add [rbx], 5") == NULL,
+                "Folded a load whose value is returned");
+    
+    /* The zero guard is found through the CFG even when jz is not two lines up. */
+    asmopt_context* ctx = asmopt_create("x86-64");
+    TEST_ASSERT(ctx != NULL, "Failed to create context");
+    asmopt_set_target_cpu(ctx, "zen4");
+    asmopt_parse_string(ctx,
+                        "    test rbx, rbx\n"
+                        "    jz .zero\n"
+                        "    mov rcx, rdx\n"
+                        "    bsf rax, rbx\n"
+                        "    ret\n"
+                        ".zero:\n"
+                        "    ret\n");
+    asmopt_optimize(ctx);
+    char* guarded = asmopt_generate_assembly(ctx);
+    TEST_ASSERT(guarded != NULL && strstr(guarded, "tzcnt rax, rbx") != NULL, "CFG zero guard not found");
+    asmopt_destroy(ctx);
+    
+    /* A second way into the block loses the guard. */
+    ctx = asmopt_create("x86-64");
+    TEST_ASSERT(ctx != NULL, "Failed to create context");
+    asmopt_set_target_cpu(ctx, "zen4");
+    asmopt_parse_string(ctx,
+                        "    test rbx, rbx\n"
+                        "    jz .zero\n"
+                        ".again:\n"
+                        "    bsf rax, rbx\n"
+                        "    jmp .again\n"
+                        ".zero:\n"
+                        "    ret\n");
+    asmopt_optimize(ctx);
+    char* unguarded = asmopt_generate_assembly(ctx);
+    TEST_ASSERT(unguarded != NULL && strstr(unguarded, "bsf rax, rbx") != NULL, "Guard assumed on a loop edge");
+    asmopt_destroy(ctx);
+    
+    free(kept);
+    free(removed);
+    free(returned_output);
+    free(guarded);
+    free(unguarded);
+    TEST_PASS("test_liveness_guards");
+}
+
+/* Test that the abi option decides which registers calls and returns read */
+static int test_abi_exit_liveness() {
+    /* rsi and xmm6 survive a Win64 call and return; r10 does not. */
+    const char* input =
+        "    mov r10d, 1\n"
+        "    call foo\n"
+        "    mov esi, 2\n"
+        "    movaps xmm6, xmm7\n"
+        "    ret\n";
+    const char* abis[] = {NULL, "sysv", "win64", "none"};
+    char* outputs[4];
+    for (int i = 0; i < 4; i++) {
+        asmopt_context* ctx = asmopt_create("x86-64");
+        TEST_ASSERT(ctx != NULL, "Failed to create context");
+        if (abis[i]) {
+            asmopt_set_option(ctx, "abi", abis[i]);
+        }
+        asmopt_parse_string(ctx, input);
+        asmopt_optimize(ctx);
+        outputs[i] = asmopt_generate_assembly(ctx);
+        asmopt_destroy(ctx);
+        TEST_ASSERT(outputs[i] != NULL, "Failed to generate output");
+    }
+    TEST_ASSERT(strcmp(outputs[0], outputs[1]) == 0, "System V is not the default");
+    
+    /* System V: r10 carries the static chain into the call; nothing else is read. */
+    TEST_ASSERT(strstr(outputs[1], "mov r10d, 1") != NULL, "Call argument removed");
+    TEST_ASSERT(strstr(outputs[1], "esi") == NULL && strstr(outputs[1], "xmm6") == NULL,
+                "Dead System V writes kept");
+    
+    TEST_ASSERT(strstr(outputs[2], "r10d") == NULL, "Win64 volatile write kept");
+    TEST_ASSERT(strstr(outputs[2], "mov esi, 2") != NULL && strstr(outputs[2], "movaps xmm6, xmm7") != NULL,
+                "Win64 callee-saved writes removed");
+    
+    TEST_ASSERT(strstr(outputs[3], "mov r10d, 1") != NULL && strstr(outputs[3], "mov esi, 2") != NULL &&
+                strstr(outputs[3], "movaps xmm6, xmm7") != NULL,
+                "Write removed with every register live at exits");
+    
+    for (int i = 0; i < 4; i++) {
+        free(outputs[i]);
+    }
+    TEST_PASS("test_abi_exit_liveness");
+}
+
+static int test_loop_alignment() {
+    /* Only the inner loop of a nest is aligned; padding executed on entry is capped. */
+    const char* nested =
+        "    xor eax, eax\n"
+        "    jmp .L7\n"
+        ".L8:\n"
+        "    xor edx, edx\n"
+        ".L6:\n"
+        "    add edx, DWORD PTR [rdi+rcx*4]\n"
+        "    cmp edx, 10\n"
+        "    jl .L6\n"
+        "    inc eax\n"
+        ".L7:\n"
+        "    cmp eax, 100\n"
+        "    jl .L8\n"
+        "    ret\n";
+    char* report = NULL;
+    char* output = optimize_with(nested, NULL, 2, NULL, NULL, &report);
+    TEST_ASSERT(output != NULL && report != NULL, "Failed to generate output");
+    TEST_ASSERT(strstr(output, "    xor edx, edx\n    .p2align 5,,15\n.L6:\n") != NULL, "Inner loop not aligned");
+    TEST_ASSERT(strstr(output, "    jmp .L7\n.L8:\n") != NULL, "Outer loop aligned");
+    TEST_ASSERT(strstr(report, "Loop alignment:\n  Line 5: .L6 (8 bytes) -> .p2align 5,,15\n") != NULL,
+                "Aligned loop not reported");
+    
+    /* A rotated loop is entered by a jump, so padding above its top is never executed. */
+    const char* rotated =
+        "    jmp .L2\n"
+        ".L3:\n"
+        "    add rax, QWORD PTR [rdi+rcx*8+256]\n"
+        "    add rax, QWORD PTR [rsi+rcx*8+256]\n"
+        "    add rax, QWORD PTR [rdx+rcx*8+256]\n"
+        "    add rax, QWORD PTR [r8+rcx*8+256]\n"
+        "    add rax, QWORD PTR [r9+rcx*8+256]\n"
+        "    inc rcx\n"
+        ".L2:\n"
+        "    cmp rcx, r10\n"
+        "    jb .L3\n"
+        "    ret\n";
+    char* rotated_output = optimize_with(rotated, NULL, 2, NULL, NULL, NULL);
+    TEST_ASSERT(rotated_output != NULL && strstr(rotated_output, "    jmp .L2\n    .p2align 6\n.L3:\n") != NULL,
+                "Op-cache sized loop not aligned to 64 bytes");
+    
+    /* Existing alignment is kept, straight-line labels are left alone, and the pass can be disabled. */
+    const char* aligned = "    mov ecx, 8\n    .p2align 6\n.L1:\n    dec ecx\n    jnz .L1\n.L9:\n    ret\n";
+    char* aligned_output = optimize_with(aligned, NULL, 2, NULL, NULL, NULL);
+    TEST_ASSERT(aligned_output != NULL && strstr(aligned_output, "    .p2align 6\n.L1:\n") != NULL &&
+                strstr(aligned_output, ".p2align 5") == NULL, "Existing alignment not respected");
+    char* disabled = optimize_with(nested, NULL, 2, "loop_align", NULL, NULL);
+    TEST_ASSERT(disabled != NULL && strstr(disabled, ".p2align") == NULL, "Disabled loop alignment ran");
+    
+    free(output);
+    free(report);
+    free(rotated_output);
+    free(aligned_output);
+    free(disabled);
+    TEST_PASS("test_loop_alignment");
+}
+
+/* Test that the scheduler keeps and forms macro-fused flag producer + jcc pairs */
+static int test_macro_fusion() {
+    /* Nothing after cmp depends on it, so it moves down to jne at no cost. */
+    const char* split =
+        "    cmp rdi, rsi\n"
+        "    mov rax, rdx\n"
+        "    mov rcx, [rdi]\n"
+        "    jne .L1\n"
+        "    ret\n"
+        ".L1:\n"
+        "    ret\n";
+    char* report = NULL;
+    char* output = optimize_with(split, "zen2", 2, NULL, NULL, &report);
+    TEST_ASSERT(output != NULL && report != NULL, "Failed to generate output");
+    TEST_ASSERT(strstr(output, "    cmp rdi, rsi\n    jne .L1\n") != NULL, "cmp not moved next to jne");
+    TEST_ASSERT(strstr(report, "Macro-op fusion:\n  Line 4: jne .L1 now fused\n") != NULL, "Gained pair not reported");
+    TEST_ASSERT(strstr(report, "Fused pairs: 0 -> 1 (1 gained, 0 lost)") != NULL, "Pair counts wrong");
+    
+    char* disabled_report = NULL;
+    char* disabled = optimize_with(split, "zen2", 2, "fusion", NULL, &disabled_report);
+    TEST_ASSERT(disabled != NULL && strstr(disabled, "    cmp rdi, rsi\n    mov rax, rdx\n") != NULL,
+                "Disabled fusion still moved cmp");
+    
+    /* A load of the register cmp reads keeps it in place. */
+    const char* blocked = "    cmp rdi, rsi\n    mov rdi, [rdx]\n    jne .L1\n.L1:\n    ret\n";
+    char* blocked_report = NULL;
+    char* blocked_output = optimize_with(blocked, "zen2", 2, NULL, NULL, &blocked_report);
+    TEST_ASSERT(blocked_output != NULL && strstr(blocked_output, "    cmp rdi, rsi\n    mov rdi, [rdx]\n") != NULL,
+                "cmp moved past a write of its source");
+    
+    /* Only Zen 3 and later fuse dec with the jump; cmp with memory and an immediate never fuses. */
+    const char* alu = "L2:\n    dec ecx\n    jnz L2\n    cmp DWORD PTR [rdi], 1\n    je L2\n    ret\n";
+    char* zen1_report = NULL;
+    char* zen3_report = NULL;
+    char* zen1 = optimize_with(alu, "zen1", 2, NULL, NULL, &zen1_report);
+    char* zen3 = optimize_with(alu, "zen3", 2, NULL, NULL, &zen3_report);
+    TEST_ASSERT(zen1_report && zen3_report, "Failed to generate reports");
+    TEST_ASSERT(strstr(zen1_report, "Macro-op fusion:") == NULL, "zen1 fused an ALU op");
+    TEST_ASSERT(strstr(zen3_report, "Fused pairs: 1 -> 1 (0 gained, 0 lost)") != NULL, "zen3 ALU fusion missed");
+    
+    free(output);
+    free(report);
+    free(disabled);
+    free(disabled_report);
+    free(blocked_output);
+    free(blocked_report);
+    free(zen1);
+    free(zen1_report);
+    free(zen3);
+    free(zen3_report);
+    TEST_PASS("test_macro_fusion");
+}
+
+static int test_address_modes() {
+    /* The chain becomes an lea, which then folds into the load once rax is dead. */
+    const char* chain =
+        "f:\n"
+        "    mov rax, rbx\n"
+        "    shl rax, 2\n"
+        "    add rax, rcx\n"
+        "    mov rdx, QWORD PTR [rax+8]\n"
+        "    mov rax, rdx\n"
+        "    ret\n";
+    char* folded = optimize_with(chain, "zen3", 2, NULL, NULL, NULL);
+    TEST_ASSERT(folded != NULL, "Failed to generate output");
+    TEST_ASSERT(strstr(folded, "    mov rdx, QWORD PTR [rcx+rbx*4+8]\n") != NULL, "Chain not folded into the load");
+    TEST_ASSERT(strstr(folded, "shl") == NULL && strstr(folded, "lea") == NULL, "Chain left behind");
+    
+    /* A three-component lea right after its index is loaded splits on Zen 2 only. */
+    const char* late =
+        "f:\n"
+        "    mov rcx, [rdi]\n"
+        "    lea rax, [rsi+rcx+24]\n"
+        "    ret\n";
+    char* zen2 = optimize_with(late, "zen2", 2, NULL, NULL, NULL);
+    char* zen3 = optimize_with(late, "zen3", 2, NULL, NULL, NULL);
+    TEST_ASSERT(zen2 != NULL && zen3 != NULL, "Failed to generate output");
+    TEST_ASSERT(strstr(zen2, "    lea rax, [rsi+24]\n    add rax, rcx\n") != NULL, "zen2 lea not split");
+    TEST_ASSERT(strstr(zen3, "    lea rax, [rsi+rcx+24]\n") != NULL, "zen3 lea split");
+    
+    /* AT&T operands come out in AT&T order. */
+    const char* att = "f:\n    movq %rbx, %rax\n    shlq $3, %rax\n    addq %rcx, %rax\n    ret\n";
+    char* att_output = optimize_with(att, "zen3", 2, NULL, NULL, NULL);
+    TEST_ASSERT(att_output != NULL && strstr(att_output, "    leaq (%rcx,%rbx,8), %rax\n") != NULL,
+                "AT&T chain not merged");
+    
+    free(folded);
+    free(zen2);
+    free(zen3);
+    free(att_output);
+    TEST_PASS("test_address_modes");
+}
+
+static int test_if_conversion() {
+    /* A one-move triangle becomes a cmov on the inverted condition. */
+    const char* triangle =
+        "max:\n"
+        "    mov rax, rdi\n"
+        "    cmp rdi, rsi\n"
+        "    jge .L1\n"
+        "    mov rax, rsi\n"
+        ".L1:\n"
+        "    ret\n";
+    char* report = NULL;
+    char* max = optimize_with(triangle, "zen2", 2, NULL, NULL, &report);
+    TEST_ASSERT(max != NULL && report != NULL, "Failed to generate output");
+    TEST_ASSERT(strstr(max, "    cmp rdi, rsi\n    cmovl rax, rsi\n") != NULL, "Triangle not converted");
+    TEST_ASSERT(strstr(max, "jge") == NULL, "Branch left behind");
+    TEST_ASSERT(strstr(report, "If-conversion:") != NULL, "Report missing if-conversion section");
+    
+    /* A diamond choosing between 1 and 0 becomes setcc + movzx. */
+    const char* diamond =
+        "nz:\n"
+        "    test rdi, rdi\n"
+        "    je .L2\n"
+        "    mov eax, 1\n"
+        "    jmp .L3\n"
+        ".L2:\n"
+        "    mov eax, 0\n"
+        ".L3:\n"
+        "    ret\n";
+    char* nz = optimize_with(diamond, "zen3", 2, NULL, NULL, NULL);
+    TEST_ASSERT(nz != NULL, "Failed to generate output");
+    TEST_ASSERT(strstr(nz, "    setne al\n    movzx eax, al\n") != NULL, "Diamond not converted");
+    TEST_ASSERT(strstr(nz, ".L2:") == NULL && strstr(nz, "jmp") == NULL, "Diamond arms left behind");
+    
+    /* The imul arm fits Zen 2's budget but not Zen 3's cheaper mispredict. */
+    const char* costly =
+        "f:\n"
+        "    mov rax, rdi\n"
+        "    cmp rdi, rsi\n"
+        "    jle .L4\n"
+        "    imul rax, rsi\n"
+        ".L4:\n"
+        "    ret\n";
+    char* zen2 = optimize_with(costly, "zen2", 2, NULL, NULL, NULL);
+    char* zen3 = optimize_with(costly, "zen3", 2, NULL, NULL, NULL);
+    TEST_ASSERT(zen2 != NULL && zen3 != NULL, "Failed to generate output");
+    TEST_ASSERT(strstr(zen2, "    cmovg rax, rcx\n") != NULL, "zen2 branch not converted");
+    TEST_ASSERT(strstr(zen3, "    jle .L4\n") != NULL, "zen3 branch converted");
+    
+    /* --disable if_convert keeps the branch. */
+    char* kept = optimize_with(triangle, NULL, 2, "if_convert", NULL, NULL);
+    TEST_ASSERT(kept != NULL && strstr(kept, "    jge .L1\n") != NULL, "Disabled pass still converted");
+    
+    free(max);
+    free(report);
+    free(nz);
+    free(zen2);
+    free(zen3);
+    free(kept);
+    TEST_PASS("test_if_conversion");
+}
+
+/* Test that lines removed ahead of a branch do not hide it from if-conversion */
+static int test_if_conversion_after_removals() {
+    /* Four self-moves go first, so every later output line sits four lines above its input line. */
+    const char* shifted =
+        "nz:\n"
+        "    mov rbx, rbx\n"
+        "    mov rcx, rcx\n"
+        "    mov rdx, rdx\n"
+        "    mov r8, r8\n"
+        "    test rdi, rdi\n"
+        "    je .L2\n"
+        "    mov eax, 1\n"
+        "    jmp .L3\n"
+        ".L2:\n"
+        "    mov eax, 0\n"
+        ".L3:\n"
+        "    ret\n";
+    char* report = NULL;
+    char* nz = optimize_with(shifted, "zen3", 2, NULL, NULL, &report);
+    TEST_ASSERT(nz != NULL && report != NULL, "Failed to generate output");
+    TEST_ASSERT(strstr(nz, "nz:\n    test rdi, rdi\n    setne al\n    movzx eax, al\n") != NULL,
+                "Diamond after removals not converted");
+    TEST_ASSERT(strstr(report, "  Line 7: je .L2 -> ") != NULL, "Conversion reported on the wrong line");
+    
+    free(nz);
+    free(report);
+    TEST_PASS("test_if_conversion_after_removals");
+}
+
+/* Test that cmov temporaries are only taken from registers dead under the abi option */
+static int test_if_conversion_temporaries() {
+    const char* triangle =
+        "f:\n"
+        "    xor eax, eax\n"
+        "    test ecx, ecx\n"
+        "    je .L1\n"
+        "    mov eax, 5\n"
+        ".L1:\n"
+        "    ret\n";
+    const char* abis[] = {"sysv", "win64", "none"};
+    char* outputs[3];
+    for (int i = 0; i < 3; i++) {
+        asmopt_context* ctx = asmopt_create("x86-64");
+        TEST_ASSERT(ctx != NULL, "Failed to create context");
+        asmopt_set_option(ctx, "abi", abis[i]);
+        asmopt_parse_string(ctx, triangle);
+        asmopt_optimize(ctx);
+        outputs[i] = asmopt_generate_assembly(ctx);
+        asmopt_destroy(ctx);
+        TEST_ASSERT(outputs[i] != NULL, "Failed to generate output");
+    }
+    TEST_ASSERT(strstr(outputs[0], "    cmovne rax, rsi\n") != NULL, "System V temporary not used");
+    /* rsi and rdi are callee-saved on Win64, so a volatile register carries the constant. */
+    TEST_ASSERT(strstr(outputs[1], "cmovne") != NULL && strstr(outputs[1], "rsi") == NULL &&
+                strstr(outputs[1], "esi") == NULL && strstr(outputs[1], "edi") == NULL,
+                "Win64 callee-saved register clobbered");
+    TEST_ASSERT(strstr(outputs[2], "    je .L1\n") != NULL && strstr(outputs[2], "cmov") == NULL,
+                "Converted with no register known to be free");
+    
+    for (int i = 0; i < 3; i++) {
+        free(outputs[i]);
+    }
+    TEST_PASS("test_if_conversion_temporaries");
+}
+
+static int test_size_levels() {
+    /* On the generic model inc pays a flags merge: -O3 keeps the add, -Os takes the shorter inc. */
+    const char* increment = "f:\n    add rax, 1\n    ret\n";
+    char* fast = optimize_with(increment, "generic", 3, NULL, NULL, NULL);
+    char* small = optimize_with(increment, "generic", ASMOPT_LEVEL_SIZE, NULL, NULL, NULL);
+    TEST_ASSERT(fast != NULL && small != NULL, "Failed to generate output");
+    TEST_ASSERT(strstr(fast, "    add rax, 1\n") != NULL, "-O3 took the slower inc");
+    TEST_ASSERT(strstr(small, "    inc rax\n") != NULL, "-Os kept the longer add");
+    
+    /* Splitting a slow lea costs an instruction, so -Os leaves it. */
+    const char* late =
+        "f:\n"
+        "    mov rcx, [rdi]\n"
+        "    lea rax, [rsi+rcx+24]\n"
+        "    ret\n";
+    char* split = optimize_with(late, "zen2", 2, NULL, NULL, NULL);
+    char* kept = optimize_with(late, "zen2", ASMOPT_LEVEL_SIZE, NULL, NULL, NULL);
+    TEST_ASSERT(split != NULL && kept != NULL, "Failed to generate output");
+    TEST_ASSERT(strstr(split, "    add rax, rcx\n") != NULL, "-O2 lea not split");
+    TEST_ASSERT(strstr(kept, "    lea rax, [rsi+rcx+24]\n") != NULL, "-Os lea split");
+    
+    /* Sizes count accumulator short forms and the 0x67 prefix: 7+5+5+4+1 bytes before. */
+    const char* sized =
+        "g:\n"
+        "    mov rax, 0\n"
+        "    add eax, 1000\n"
+        "    test eax, 4096\n"
+        "    mov edx, [eax+8]\n"
+        "    ret\n";
+    asmopt_context* ctx = asmopt_create("x86-64");
+    TEST_ASSERT(ctx != NULL, "Failed to create context");
+    asmopt_set_optimization_level(ctx, ASMOPT_LEVEL_SIZE);
+    asmopt_parse_string(ctx, sized);
+    asmopt_optimize(ctx);
+    char* report = asmopt_generate_report(ctx);
+    asmopt_destroy(ctx);
+    TEST_ASSERT(report != NULL && strstr(report, "Code size:\n  Line 1: g 22 -> 15 bytes (7 saved)\n") != NULL,
+                "Per-function size missing");
+    TEST_ASSERT(strstr(report, "  Total: 22 -> 15 bytes (7 saved)\n") != NULL, "Size total missing");
+    
+    free(fast);
+    free(small);
+    free(split);
+    free(kept);
+    free(report);
+    TEST_PASS("test_size_levels");
+}
+
+static int test_loop_optimizations() {
+    /* The constant load leaves the loop; rcx*4 becomes an add-stepped register, as in SPECIFICATION.md 4.7.3. */
+    const char* scaled =
+        "f:\n"
+        "    xor ecx, ecx\n"
+        ".loop:\n"
+        "    mov rax, rcx\n"
+        "    imul rax, 4\n"
+        "    mov rbx, [rdi + rax]\n"
+        "    mov r8, 100\n"
+        "    add rdx, rbx\n"
+        "    add rdx, r8\n"
+        "    inc rcx\n"
+        "    cmp rcx, 100\n"
+        "    jl .loop\n"
+        "    mov rax, rdx\n"
+        "    ret\n";
+    char* report = NULL;
+    char* f = optimize_with(scaled, "zen3", 2, NULL, NULL, &report);
+    TEST_ASSERT(f != NULL && report != NULL, "Failed to generate output");
+    TEST_ASSERT(strstr(f, "f:\n"
+                          "    xor ecx, ecx\n"
+                          "    mov r8, 100\n"
+                          "    lea rax, [rcx*4]\n"
+                          "    .p2align 6,,15\n"
+                          ".loop:\n"
+                          "    mov rbx, [rdi + rax]\n"
+                          "    add rdx, rbx\n"
+                          "    add rdx, r8\n"
+                          "    inc rcx\n"
+                          "    add rax, 4\n"
+                          "    cmp rcx, 100\n"
+                          "    jl .loop\n"
+                          "    mov rax, rdx\n"
+                          "    ret\n") == f,
+                "Loop not hoisted and strength-reduced");
+    TEST_ASSERT(strstr(report, "Loop optimizations:\n  Line 7: mov r8, 100 hoisted above .loop\n") != NULL,
+                "Hoist not reported");
+    TEST_ASSERT(strstr(report, "  Hoisted: 1, strength-reduced: 1\n") != NULL, "Loop summary missing");
+    
+    /* Three-operand imuls: 24 keeps imul above the loop, 3 becomes an lea; rax is returned, so it stays. */
+    const char* strided =
+        "g:\n"
+        ".L2:\n"
+        "    imul r10, rsi, 24\n"
+        "    mov r11, [rdi + r10]\n"
+        "    imul rcx, rsi, 3\n"
+        "    add r11, rcx\n"
+        "    add [rdx], r11\n"
+        "    imul rax, rsi, 5\n"
+        "    add [rdx+8], rax\n"
+        "    sub rsi, 2\n"
+        "    jne .L2\n"
+        "    ret\n";
+    char* g = optimize_with(strided, "zen2", 2, NULL, NULL, NULL);
+    TEST_ASSERT(g != NULL, "Failed to generate output");
+    TEST_ASSERT(strstr(g, "g:\n    imul r10, rsi, 24\n    lea rcx, [rsi+rsi*2]\n") != NULL, "Strided preheader");
+    TEST_ASSERT(strstr(g, "    add r10, -48\n    add rcx, -6\n    sub rsi, 2\n    jne .L2\n") != NULL,
+                "Strides not stepped ahead of the sub");
+    TEST_ASSERT(strstr(g, "    imul rax, rsi, 5\n") != NULL, "Register live after the loop reduced");
+    
+    /* A second way into the loop, or a value still needed after it, leaves the loop alone. */
+    const char* entered =
+        "h:\n"
+        "    test rdi, rdi\n"
+        "    je .L4\n"
+        ".L3:\n"
+        "    mov r9, 5\n"
+        "    imul r10, rsi, 8\n"
+        "    add rax, r10\n"
+        "    add rax, r9\n"
+        "    inc rsi\n"
+        "    cmp rsi, rdx\n"
+        "    jne .L3\n"
+        ".L4:\n"
+        "    jmp .L3\n";
+    char* h = optimize_with(entered, "zen3", 2, NULL, NULL, NULL);
+    TEST_ASSERT(h != NULL, "Failed to generate output");
+    TEST_ASSERT(strstr(h, ".L3:\n    mov r9, 5\n    imul r10, rsi, 8\n") != NULL, "Loop with two entries changed");
+    
+    /* -Os keeps the multiply; --disable licm keeps the mov in the loop. */
+    char* small = optimize_with(scaled, "zen3", ASMOPT_LEVEL_SIZE, NULL, NULL, NULL);
+    char* kept = optimize_with(scaled, NULL, 2, "licm", NULL, NULL);
+    TEST_ASSERT(small != NULL && strstr(small, "    shl rax, 2\n") != NULL, "-Os reduced the multiply");
+    TEST_ASSERT(strstr(small, "    xor ecx, ecx\n    mov r8, 100\n") != NULL, "-Os did not hoist");
+    TEST_ASSERT(kept != NULL && strstr(kept, ".loop:\n") != NULL && strstr(kept, "    xor ecx, ecx\n    mov r8") == NULL,
+                "Disabled hoist still ran");
+    
+    free(f);
+    free(report);
+    free(g);
+    free(h);
+    free(small);
+    free(kept);
+    TEST_PASS("test_loop_optimizations");
+}
+
+/* Test that lines removed ahead of a loop do not hide it from the loop pass */
+static int test_loop_optimizations_after_removals() {
+    const char* scaled =
+        "f:\n"
+        "    xor ecx, ecx\n"
+        ".loop:\n"
+        "    mov rax, rcx\n"
+        "    imul rax, 4\n"
+        "    mov rbx, [rdi + rax]\n"
+        "    mov r8, 100\n"
+        "    add rdx, rbx\n"
+        "    add rdx, r8\n"
+        "    inc rcx\n"
+        "    cmp rcx, 100\n"
+        "    jl .loop\n"
+        "    mov rax, rdx\n"
+        "    ret\n";
+    /* The same function behind three self-moves, which the peephole passes drop. */
+    const char* shifted =
+        "f:\n"
+        "    mov r9, r9\n"
+        "    mov r10, r10\n"
+        "    mov r11, r11\n"
+        "    xor ecx, ecx\n"
+        ".loop:\n"
+        "    mov rax, rcx\n"
+        "    imul rax, 4\n"
+        "    mov rbx, [rdi + rax]\n"
+        "    mov r8, 100\n"
+        "    add rdx, rbx\n"
+        "    add rdx, r8\n"
+        "    inc rcx\n"
+        "    cmp rcx, 100\n"
+        "    jl .loop\n"
+        "    mov rax, rdx\n"
+        "    ret\n";
+    char* expected = optimize_with(scaled, "zen3", 2, NULL, NULL, NULL);
+    char* report = NULL;
+    char* output = optimize_with(shifted, "zen3", 2, NULL, NULL, &report);
+    TEST_ASSERT(expected != NULL && output != NULL && report != NULL, "Failed to generate output");
+    TEST_ASSERT(strcmp(output, expected) == 0, "Removals ahead of the loop changed the loop pass");
+    TEST_ASSERT(strstr(report, "  Line 10: mov r8, 100 hoisted above .loop\n") != NULL,
+                "Hoist reported on the wrong line");
+    
+    /* An empty edit re-optimizes every unit and must reproduce the fresh run. */
+    asmopt_context* ctx = asmopt_create("x86-64");
+    TEST_ASSERT(ctx != NULL, "Failed to create context");
+    asmopt_set_target_cpu(ctx, "zen3");
+    asmopt_parse_string(ctx, shifted);
+    asmopt_optimize(ctx);
+    TEST_ASSERT(asmopt_apply_edit(ctx, 2, 0, NULL) == 0, "Empty edit failed");
+    char* edited = asmopt_generate_assembly(ctx);
+    asmopt_destroy(ctx);
+    TEST_ASSERT(edited != NULL && strcmp(edited, expected) == 0, "Empty edit differs from a fresh run");
+    
+    free(expected);
+    free(output);
+    free(report);
+    free(edited);
+    TEST_PASS("test_loop_optimizations_after_removals");
+}
+
+/* Test that asmopt_apply_edit matches a fresh run over the edited text */
+static int test_incremental_edit() {
+    const char* before =
+        ".globl f\n"
+        "f:\n"
+        "    mov rax, 0\n"
+        "    ret\n"
+        ".globl g\n"
+        "g:\n"
+        "    mov rbx, rbx\n"
+        "    add rcx, -1\n"
+        "    ret";
+    const char* after =
+        ".globl f\n"
+        "f:\n"
+        "    mov rax, 0\n"
+        "    mov rdx, 0\n"
+        "    sub rdx, 1\n"
+        "    ret\n"
+        ".globl g\n"
+        "g:\n"
+        "    mov rbx, rbx\n"
+        "    ret";
+    asmopt_context* ctx = asmopt_create("x86-64");
+    asmopt_context* fresh = asmopt_create("x86-64");
+    TEST_ASSERT(ctx != NULL && fresh != NULL, "Failed to create context");
+    asmopt_parse_string(ctx, before);
+    asmopt_optimize(ctx);
+    TEST_ASSERT(asmopt_apply_edit(ctx, 4, 0, "    mov rdx, 0\n    sub rdx, 1\n") == 0, "Insertion failed");
+    TEST_ASSERT(asmopt_apply_edit(ctx, 10, 1, NULL) == 0, "Removal failed");
+    TEST_ASSERT(asmopt_apply_edit(ctx, 10, 2, "x") == -1, "Range past the end accepted");
+    asmopt_parse_string(fresh, after);
+    TEST_ASSERT(asmopt_apply_edit(fresh, 1, 0, NULL) == 0, "Empty edit failed");
+    
+    char* edited = asmopt_generate_assembly(ctx);
+    char* expected = asmopt_generate_assembly(fresh);
+    char* report = asmopt_generate_report(ctx);
+    char* expected_report = asmopt_generate_report(fresh);
+    size_t original = 0, optimized = 0, replacements = 0, removals = 0;
+    asmopt_get_stats(ctx, &original, &optimized, &replacements, &removals);
+    TEST_ASSERT(edited != NULL && expected != NULL && strcmp(edited, expected) == 0, "Edited output differs");
+    TEST_ASSERT(report != NULL && expected_report != NULL && strcmp(report, expected_report) == 0,
+                "Edited report differs");
+    TEST_ASSERT(strstr(edited, "    xor rax, rax\n    mov rdx, -1\n    ret\n") != NULL, "Inserted lines not optimized");
+    TEST_ASSERT(strstr(edited, "add rcx") == NULL, "Removed line still emitted");
+    TEST_ASSERT(strstr(report, "  Line 9: redundant_mov\n") != NULL, "Event lines not renumbered");
+    TEST_ASSERT(original == 10 && replacements == 2 && removals == 2, "Stats not updated");
+    
+    /* The kept IR follows the edit as well. */
+    char* ir = asmopt_dump_ir_text(ctx);
+    TEST_ASSERT(ir != NULL && strstr(ir, "0005: instr sub rdx, 1\n") != NULL, "IR not updated");
+    
+    free(edited);
+    free(expected);
+    free(report);
+    free(expected_report);
+    free(ir);
+    asmopt_destroy(ctx);
+    asmopt_destroy(fresh);
+    TEST_PASS("test_incremental_edit");
+}
+
+static int test_vector_idioms() {
+    const char* input =
+        "f:\n"
+        "    vpxor ymm2, ymm2, ymm2\n"
+        "    vpxord zmm3, zmm3, zmm3\n"
+        "    vmovdqa ymm4, ymm4\n"
+        "    movq xmm0, xmm0\n"
+        "    vmovd xmm5, DWORD PTR [rdi]\n"
+        "    vpbroadcastd ymm1, xmm5\n"
+        "    vaddps ymm0, ymm0, ymm1\n"
+        "    vaddps ymm0, ymm0, ymm2\n"
+        "    vaddps ymm0, ymm0, ymm3\n"
+        "    vaddps ymm0, ymm0, ymm4\n"
+        "    vzeroupper\n"
+        "    ret\n";
+    char* zen1 = optimize_with(input, "zen1", 2, NULL, NULL, NULL);
+    char* zen3 = optimize_with(input, "zen3", 2, NULL, NULL, NULL);
+    char* zen4 = optimize_with(input, "zen4", 2, NULL, NULL, NULL);
+    char* generic = optimize_with(input, "generic", 2, NULL, NULL, NULL);
+    TEST_ASSERT(zen1 && zen3 && zen4 && generic, "Failed to generate output");
+    
+    /* ymm zeroing only narrows where 256-bit operations are split; zmm always loses its EVEX prefix. */
+    TEST_ASSERT(strstr(zen1, "vpxor xmm2, xmm2, xmm2") != NULL, "zen1 kept the ymm zero idiom");
+    TEST_ASSERT(strstr(zen3, "vpxor ymm2, ymm2, ymm2") != NULL, "zen3 narrowed the ymm zero idiom");
+    TEST_ASSERT(strstr(zen3, "vpxor xmm3, xmm3, xmm3") != NULL, "zmm zero idiom not narrowed");
+    /* A VEX.256 self-move clears bits 256-511 wherever AVX-512 may exist. */
+    TEST_ASSERT(strstr(zen3, "vmovdqa ymm4") == NULL, "zen3 kept the ymm self-move");
+    TEST_ASSERT(strstr(zen4, "vmovdqa ymm4, ymm4") != NULL, "zen4 removed the ymm self-move");
+    TEST_ASSERT(strstr(generic, "vmovdqa ymm4, ymm4") != NULL, "generic removed the ymm self-move");
+    /* movq zeroes the upper bits of xmm0, so it is not a no-op. */
+    TEST_ASSERT(strstr(zen3, "movq xmm0, xmm0") != NULL, "Vector movq self-move removed");
+    TEST_ASSERT(strstr(zen3, "    vpbroadcastd ymm1, DWORD PTR [rdi]\n") != NULL, "Broadcast load not folded");
+    TEST_ASSERT(strstr(zen3, "vmovd") == NULL, "Folded load still emitted");
+    
+    const char* att =
+        "    vpxor %ymm2, %ymm2, %ymm2\n"
+        "    vmovd (%rdi), %xmm5\n"
+        "    vpbroadcastd %xmm5, %ymm1\n"
+        "    vaddps %ymm1, %ymm2, %ymm0\n"
+        "    ret\n";
+    char* att_zen1 = optimize_with(att, "zen1", 2, NULL, NULL, NULL);
+    TEST_ASSERT(att_zen1 != NULL, "Failed to generate AT&T output");
+    TEST_ASSERT(strstr(att_zen1, "vpxor %xmm2, %xmm2, %xmm2") != NULL, "AT&T zero idiom not narrowed");
+    TEST_ASSERT(strstr(att_zen1, "vpbroadcastd (%rdi), %ymm1") != NULL, "AT&T broadcast load not folded");
+    
+    /* Legacy SSE after 256-bit AVX without vzeroupper is reported, once per dirty stretch. */
+    const char* mixed =
+        "f:\n"
+        "    vaddps ymm0, ymm0, ymm1\n"
+        "    addps xmm2, xmm3\n"
+        "    addps xmm2, xmm3\n"
+        "    ret\n"
+        "g:\n"
+        "    vaddps ymm0, ymm0, ymm1\n"
+        "    vzeroupper\n"
+        "    addps xmm2, xmm3\n"
+        "    vmulps ymm4, ymm4, ymm4\n"
+        "    ret\n";
+    asmopt_context* ctx = asmopt_create("x86-64");
+    TEST_ASSERT(ctx != NULL, "Failed to create context");
+    asmopt_parse_string(ctx, mixed);
+    asmopt_optimize(ctx);
+    char* report = asmopt_generate_report(ctx);
+    TEST_ASSERT(report != NULL, "Failed to generate report");
+    TEST_ASSERT(strstr(report, "  Line 3: addps xmm2, xmm3 with upper halves dirty since line 2, no vzeroupper\n") !=
+                NULL, "Transition not reported");
+    TEST_ASSERT(strstr(report, "  Line 4:") == NULL && strstr(report, "  Line 9:") == NULL,
+                "Clean state reported as a transition");
+    TEST_ASSERT(strstr(report, "  Line 11: ret with upper halves dirty since line 10") != NULL,
+                "Dirty return not reported");
+    asmopt_disable_optimization(ctx, "vex_transition");
+    asmopt_parse_string(ctx, mixed);
+    asmopt_optimize(ctx);
+    char* disabled = asmopt_generate_report(ctx);
+    TEST_ASSERT(disabled != NULL && strstr(disabled, "AVX-SSE transitions:") == NULL, "Disabled check still ran");
+    
+    free(zen1);
+    free(zen3);
+    free(zen4);
+    free(generic);
+    free(att_zen1);
+    free(report);
+    free(disabled);
+    asmopt_destroy(ctx);
+    TEST_PASS("test_vector_idioms");
+}
+
+/* Test that dead vector copies go as dead stores, under the abi option */
+static int test_vector_dead_copy() {
+    const char* input = "f:\n    movaps xmm6, xmm7\n    ret\n";
+    char* report = NULL;
+    char* sysv = optimize_with(input, NULL, 2, NULL, NULL, &report);
+    TEST_ASSERT(sysv != NULL && report != NULL, "Failed to generate output");
+    TEST_ASSERT(strstr(sysv, "xmm6") == NULL, "Dead System V vector copy kept");
+    TEST_ASSERT(strstr(report, "Line 2: dead_store_move") != NULL, "Dead copy not reported as a dead store");
+    TEST_ASSERT(strstr(report, "vector_redundant_move") == NULL, "Dead copy reported as a redundant move");
+    
+    char* disabled = optimize_with(input, NULL, 2, "dead_store_move", NULL, NULL);
+    TEST_ASSERT(disabled != NULL && strstr(disabled, "movaps xmm6, xmm7") != NULL, "Disabled dead store removed");
+    
+    /* xmm6-xmm15 are callee-saved on Win64. */
+    asmopt_context* ctx = asmopt_create("x86-64");
+    TEST_ASSERT(ctx != NULL, "Failed to create context");
+    asmopt_set_option(ctx, "abi", "win64");
+    asmopt_parse_string(ctx, input);
+    asmopt_optimize(ctx);
+    char* win64 = asmopt_generate_assembly(ctx);
+    asmopt_destroy(ctx);
+    TEST_ASSERT(win64 != NULL && strstr(win64, "movaps xmm6, xmm7") != NULL, "Win64 callee-saved xmm6 dropped");
+    
+    free(sysv);
+    free(report);
+    free(disabled);
+    free(win64);
+    TEST_PASS("test_vector_dead_copy");
+}
+
+/* Test that threads=N produces the same output and report as the serial path */
+static int test_parallel_matches_serial() {
+    const char* block =
+        "loop:\n"
+        "    mov rax, 0\n"
+        "    mov rbx, rcx\n"
+        "    mov rcx, rbx\n"
+        "    add rdx, 1\n"
+        "    jne done\n"
+        "    jmp loop\n"
+        "done:\n"
+        "    mov rsi, [rdi]\n"
+        "    add rsi, 4\n"
+        "    mov [rdi], rsi\n";
+    size_t block_len = strlen(block);
+    size_t repeats = 2000;
+    char* input = malloc(block_len * repeats + 1);
+    TEST_ASSERT(input != NULL, "Failed to allocate input");
+    for (size_t i = 0; i < repeats; i++) {
+        memcpy(input + i * block_len, block, block_len);
+    }
+    input[block_len * repeats] = '\0';
+    
+    char* serial_report = NULL;
+    char* parallel_report = NULL;
+    char* serial = optimize_with(input, NULL, 2, NULL, NULL, &serial_report);
+    char* parallel = optimize_with(input, NULL, 2, NULL, "4", &parallel_report);
+    TEST_ASSERT(serial != NULL && parallel != NULL, "Failed to generate output");
+    TEST_ASSERT(serial_report != NULL && parallel_report != NULL, "Failed to generate report");
+    TEST_ASSERT(strcmp(serial, parallel) == 0, "Parallel output differs from serial output");
+    TEST_ASSERT(strcmp(serial_report, parallel_report) == 0, "Parallel report differs from serial report");
+    
+    free(serial);
+    free(parallel);
+    free(serial_report);
+    free(parallel_report);
+    free(input);
+    TEST_PASS("test_parallel_matches_serial");
+}
+
 int main() {
     int passed = 0;
     int total = 0;
@@ -778,6 +2023,7 @@ int main() {
     total++; passed += test_ir_dump();
     total++; passed += test_cfg_dump_text();
     total++; passed += test_cfg_dump_dot();
+    total++; passed += test_lazy_dumps();
     total++; passed += test_multiple_directives();
     total++; passed += test_complex_control_flow();
     total++; passed += test_whitespace_handling();
@@ -799,6 +2045,29 @@ int main() {
     total++; passed += test_fallthrough_jump_optimization();
     total++; passed += test_hot_loop_alignment();
     total++; passed += test_bsf_to_tzcnt();
+    total++; passed += test_generate_assembly_into();
+    total++; passed += test_parallel_matches_serial();
+    total++; passed += test_profile_counters();
+    total++; passed += test_context_reset();
+    total++; passed += test_simd_scanning();
+    total++; passed += test_syntax_detection();
+    total++; passed += test_fixpoint_cascade();
+    total++; passed += test_cost_model_selection();
+    total++; passed += test_list_scheduler();
+    total++; passed += test_liveness_guards();
+    total++; passed += test_abi_exit_liveness();
+    total++; passed += test_loop_alignment();
+    total++; passed += test_macro_fusion();
+    total++; passed += test_address_modes();
+    total++; passed += test_if_conversion();
+    total++; passed += test_if_conversion_after_removals();
+    total++; passed += test_if_conversion_temporaries();
+    total++; passed += test_size_levels();
+    total++; passed += test_loop_optimizations();
+    total++; passed += test_loop_optimizations_after_removals();
+    total++; passed += test_incremental_edit();
+    total++; passed += test_vector_idioms();
+    total++; passed += test_vector_dead_copy();
     
     printf("\n========================================\n");
     printf("Test Results: %d/%d tests passed\n", passed, total);
@@ -3,9 +3,11 @@
  */
 
 #include "../include/asmopt.h"
+#include <dirent.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #define TEST_ASSERT(condition, message) do { \
     if (!(condition)) { \
@@ -167,6 +169,329 @@ static int test_file_io() {
     TEST_PASS("test_file_io");
 }
 
+/* Test batch optimization of several files with one configured context */
+static int test_optimize_files() {
+    const char* inputs[] = {"/tmp/test_asmopt_batch1.s", "/tmp/test_asmopt_batch2.s", "/tmp/test_asmopt_batch3.s"};
+    const char* outputs[] = {"/tmp/test_asmopt_batch1.out", "/tmp/test_asmopt_batch2.out", "/tmp/test_asmopt_batch3.out"};
+    const char* sources[] = {"mov rax, 0\n", "add rbx, 1\n", "add rcx, 1\n"};
+    
+    for (int i = 0; i < 3; i++) {
+        FILE* f = fopen(inputs[i], "w");
+        TEST_ASSERT(f != NULL, "Failed to create batch input");
+        fputs(sources[i], f);
+        fclose(f);
+    }
+    
+    asmopt_context* ctx = asmopt_create("x86-64");
+    TEST_ASSERT(ctx != NULL, "Failed to create context");
+    asmopt_set_option(ctx, "threads", "2");
+    asmopt_disable_optimization(ctx, "add_one_to_inc");
+    
+    int failures = asmopt_optimize_files(ctx, inputs, outputs, 3);
+    TEST_ASSERT(failures == 0, "Batch optimization failed");
+    
+    char buffer[256];
+    FILE* f = fopen(outputs[0], "r");
+    TEST_ASSERT(f != NULL, "Missing batch output");
+    size_t read_size = fread(buffer, 1, sizeof(buffer) - 1, f);
+    buffer[read_size] = '\0';
+    fclose(f);
+    TEST_ASSERT(strstr(buffer, "xor rax, rax") != NULL, "Batch output not optimized");
+    
+    f = fopen(outputs[2], "r");
+    TEST_ASSERT(f != NULL, "Missing batch output");
+    read_size = fread(buffer, 1, sizeof(buffer) - 1, f);
+    buffer[read_size] = '\0';
+    fclose(f);
+    TEST_ASSERT(strstr(buffer, "add rcx, 1") != NULL, "Template settings not applied to batch files");
+    
+    size_t original = 0, replacements = 0;
+    asmopt_get_stats(ctx, &original, NULL, &replacements, NULL);
+    TEST_ASSERT(replacements == 1, "Aggregate replacements incorrect");
+    
+    TEST_ASSERT(asmopt_get_file_result(ctx, 2) == 0, "Written file not reported");
+    const char* missing[] = {inputs[0], "/tmp/test_asmopt_batch_missing.s"};
+    TEST_ASSERT(asmopt_optimize_files(ctx, missing, outputs, 2) == 1, "Missing input not reported");
+    TEST_ASSERT(asmopt_get_file_result(ctx, 0) == 0 && asmopt_get_file_result(ctx, 1) == -1,
+                "Failing file not identified");
+    TEST_ASSERT(asmopt_get_file_result(ctx, 2) == -1, "Result kept from the earlier batch");
+    
+    for (int i = 0; i < 3; i++) {
+        remove(inputs[i]);
+        remove(outputs[i]);
+    }
+    asmopt_destroy(ctx);
+    TEST_PASS("test_optimize_files");
+}
+
+/* Optimize source with a result cache in dir (NULL for none); fills *report when given. */
+static char* optimize_cached(const char* source, const char* dir, const char* disabled, char** report) {
+    asmopt_context* ctx = asmopt_create("x86-64");
+    if (!ctx) {
+        return NULL;
+    }
+    asmopt_set_target_cpu(ctx, "zen3");
+    if (dir) {
+        asmopt_set_option(ctx, "cache_dir", dir);
+    }
+    if (disabled) {
+        asmopt_disable_optimization(ctx, disabled);
+    }
+    asmopt_parse_string(ctx, source);
+    asmopt_optimize(ctx);
+    char* output = asmopt_generate_assembly(ctx);
+    if (report) {
+        *report = asmopt_generate_report(ctx);
+    }
+    asmopt_destroy(ctx);
+    return output;
+}
+
+/* Apply edit to every entry in dir, or just count them when edit is NULL; returns the entry count. */
+static size_t edit_cache_entries(const char* dir, const char* find, const char* replace) {
+    DIR* handle = opendir(dir);
+    if (!handle) {
+        return 0;
+    }
+    size_t count = 0;
+    struct dirent* item;
+    while ((item = readdir(handle)) != NULL) {
+        if (item->d_name[0] == '.') {
+            continue;
+        }
+        count++;
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", dir, item->d_name);
+        if (!find) {
+            if (replace) {
+                remove(path);
+            }
+            continue;
+        }
+        static char data[65536];
+        FILE* f = fopen(path, "rb");
+        size_t length = f ? fread(data, 1, sizeof(data), f) : 0;
+        if (f) {
+            fclose(f);
+        }
+        size_t find_len = strlen(find);
+        for (size_t i = 0; i + find_len <= length; i++) {
+            if (memcmp(data + i, find, find_len) == 0) {
+                memcpy(data + i, replace, find_len);
+            }
+        }
+        f = fopen(path, "wb");
+        if (f) {
+            fwrite(data, 1, length, f);
+            fclose(f);
+        }
+    }
+    closedir(handle);
+    return count;
+}
+
+/* Test that cached results match a fresh run and are reused for unchanged functions */
+static int test_result_cache() {
+    const char* dir = "/tmp/test_asmopt_cache";
+    const char* source =
+        "    .text\n"
+        "    .globl f\n"
+        "    .type f, @function\n"
+        "f:\n"
+        "    mov rax, 0\n"
+        "    ret\n"
+        "    .globl g\n"
+        "    .type g, @function\n"
+        "g:\n"
+        "    mov rcx, rcx\n"
+        "    xor ecx, ecx\n"
+        "    add rax, 1\n"
+        "    ret\n";
+    edit_cache_entries(dir, NULL, "");
+    
+    char* expected_report = NULL;
+    char* expected = optimize_cached(source, NULL, NULL, &expected_report);
+    char* filled_report = NULL;
+    char* filled = optimize_cached(source, dir, NULL, &filled_report);
+    TEST_ASSERT(expected != NULL && filled != NULL && expected_report != NULL && filled_report != NULL,
+                "Failed to generate output");
+    TEST_ASSERT(strcmp(expected, filled) == 0, "Cached output differs from a fresh run");
+    TEST_ASSERT(strcmp(expected_report, filled_report) == 0, "Cached report differs from a fresh run");
+    TEST_ASSERT(edit_cache_entries(dir, NULL, NULL) == 2, "Expected one cache entry per function");
+    
+    /* A hit is used as stored: an edited entry shows up in the output. */
+    TEST_ASSERT(edit_cache_entries(dir, "inc rax", "INC rax") == 2, "Entries missing");
+    char* hit_report = NULL;
+    char* hit = optimize_cached(source, dir, NULL, &hit_report);
+    TEST_ASSERT(hit != NULL && strstr(hit, "INC rax") != NULL, "Cache entry not reused");
+    TEST_ASSERT(hit_report != NULL && strstr(hit_report, "Line 12: add_one_to_inc") != NULL,
+                "Cached event line numbers not offset");
+    
+    /* Other settings use other entries. */
+    char* other = optimize_cached(source, dir, "add_one_to_inc", NULL);
+    TEST_ASSERT(other != NULL && strstr(other, "add rax, 1") != NULL && strstr(other, "INC") == NULL,
+                "Entry reused across settings");
+    TEST_ASSERT(edit_cache_entries(dir, NULL, NULL) == 4, "Settings not part of the key");
+    
+    /* The ABI decides what is live at ret, so it is part of the key too. */
+    asmopt_context* win64 = asmopt_create("x86-64");
+    TEST_ASSERT(win64 != NULL, "Failed to create context");
+    asmopt_set_target_cpu(win64, "zen3");
+    asmopt_set_option(win64, "cache_dir", dir);
+    asmopt_set_option(win64, "abi", "win64");
+    asmopt_parse_string(win64, source);
+    asmopt_optimize(win64);
+    char* win64_output = asmopt_generate_assembly(win64);
+    asmopt_destroy(win64);
+    TEST_ASSERT(win64_output != NULL && strstr(win64_output, "INC") == NULL, "Entry reused across ABIs");
+    TEST_ASSERT(edit_cache_entries(dir, NULL, NULL) == 6, "ABI not part of the key");
+    free(win64_output);
+    
+    /* Removals ahead of a branch shift the whole-file output more than the per-function one. */
+    const char* shifted =
+        "    .globl h\n"
+        "h:\n"
+        "    mov rbx, rbx\n"
+        "    mov rcx, rcx\n"
+        "    mov rdx, rdx\n"
+        "    mov rax, rdi\n"
+        "    cmp rdi, rsi\n"
+        "    jge .L1\n"
+        "    mov rax, rsi\n"
+        ".L1:\n"
+        "    ret\n";
+    char* plain = optimize_cached(shifted, NULL, NULL, NULL);
+    char* split = optimize_cached(shifted, dir, NULL, NULL);
+    TEST_ASSERT(plain != NULL && split != NULL && strstr(plain, "    cmovl rax, rsi\n") != NULL,
+                "Branch after removals not converted");
+    TEST_ASSERT(strcmp(plain, split) == 0, "Cached output differs after removals");
+    
+    edit_cache_entries(dir, NULL, "");
+    rmdir(dir);
+    free(expected);
+    free(expected_report);
+    free(filled);
+    free(filled_report);
+    free(hit);
+    free(hit_report);
+    free(other);
+    free(plain);
+    free(split);
+    TEST_PASS("test_result_cache");
+}
+
+/* Test that mapped and buffered file reads match parse_string */
+static int test_file_read_paths() {
+    const char* path = "/tmp/test_asmopt_paths.s";
+    static char source[8192 + 1];
+    size_t sizes[] = {4096, 4095, 8192};
+    
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        size_t size = sizes[s];
+        size_t used = 0;
+        while (used + 11 <= size) {
+            memcpy(source + used, "mov rax, 0\n", 11);
+            used += 11;
+        }
+        memset(source + used, ' ', size - used);
+        source[size] = '\0';
+        /* Drop the final newline so the last line ends at end of file. */
+        if (used > 0 && used == size) {
+            source[size - 1] = ' ';
+        }
+        
+        FILE* f = fopen(path, "wb");
+        TEST_ASSERT(f != NULL, "Failed to create test file");
+        fwrite(source, 1, size, f);
+        fclose(f);
+        
+        asmopt_context* from_file = asmopt_create("x86-64");
+        asmopt_context* from_string = asmopt_create("x86-64");
+        TEST_ASSERT(from_file != NULL && from_string != NULL, "Failed to create context");
+        TEST_ASSERT(asmopt_parse_file(from_file, path) == 0, "Failed to parse file");
+        TEST_ASSERT(asmopt_parse_string(from_string, source) == 0, "Failed to parse string");
+        asmopt_optimize(from_file);
+        asmopt_optimize(from_string);
+        
+        char* file_output = asmopt_generate_assembly(from_file);
+        char* string_output = asmopt_generate_assembly(from_string);
+        TEST_ASSERT(file_output != NULL && string_output != NULL, "Failed to generate output");
+        TEST_ASSERT(strcmp(file_output, string_output) == 0, "File and string input differ");
+        
+        free(file_output);
+        free(string_output);
+        asmopt_destroy(from_file);
+        asmopt_destroy(from_string);
+    }
+    remove(path);
+    
+    TEST_PASS("test_file_read_paths");
+}
+
+/* Test that the streaming window produces the same output and stats as a whole-file run */
+static int test_optimize_stream() {
+    const char* block =
+        "test rax, rax\n"
+        "jz .done\n"
+        "mov rax, 0\n"
+        "mov rbx, rcx\n"
+        "mov rcx, rbx\n"
+        "mov rdx, [rbp]\n"
+        "add rdx, 4\n"
+        "mov [rbp], rdx\n"
+        ".done:\n"
+        "mov rsi, rsi\n"
+        "xor edx, edx\n";
+    size_t block_len = strlen(block);
+    size_t repeats = 301;
+    char* source = malloc(block_len * repeats + 1);
+    TEST_ASSERT(source != NULL, "Allocation failed");
+    for (size_t i = 0; i < repeats; i++) {
+        memcpy(source + i * block_len, block, block_len);
+    }
+    /* No trailing newline, so the last line ends at EOF. */
+    source[block_len * repeats - 1] = '\0';
+    
+    asmopt_context* whole = asmopt_create("x86-64");
+    asmopt_context* streamed = asmopt_create("x86-64");
+    TEST_ASSERT(whole != NULL && streamed != NULL, "Failed to create context");
+    asmopt_parse_string(whole, source);
+    asmopt_optimize(whole);
+    char* expected = asmopt_generate_assembly(whole);
+    TEST_ASSERT(expected != NULL, "Failed to generate output");
+    
+    FILE* input = tmpfile();
+    FILE* output = tmpfile();
+    TEST_ASSERT(input != NULL && output != NULL, "Failed to create temp files");
+    fputs(source, input);
+    rewind(input);
+    TEST_ASSERT(asmopt_optimize_stream(streamed, input, output) == 0, "Streaming optimization failed");
+    
+    size_t expected_len = strlen(expected);
+    char* actual = malloc(expected_len + 2);
+    TEST_ASSERT(actual != NULL, "Allocation failed");
+    rewind(output);
+    size_t actual_len = fread(actual, 1, expected_len + 1, output);
+    TEST_ASSERT(actual_len == expected_len && memcmp(actual, expected, expected_len) == 0,
+                "Streamed output differs from whole-file output");
+    
+    size_t whole_stats[4];
+    size_t stream_stats[4];
+    asmopt_get_stats(whole, &whole_stats[0], &whole_stats[1], &whole_stats[2], &whole_stats[3]);
+    asmopt_get_stats(streamed, &stream_stats[0], &stream_stats[1], &stream_stats[2], &stream_stats[3]);
+    TEST_ASSERT(memcmp(whole_stats, stream_stats, sizeof(whole_stats)) == 0, "Streamed stats differ");
+    
+    fclose(input);
+    fclose(output);
+    free(actual);
+    free(expected);
+    free(source);
+    asmopt_destroy(whole);
+    asmopt_destroy(streamed);
+    
+    TEST_PASS("test_optimize_stream");
+}
+
 /* Test optimization levels */
 static int test_optimization_levels() {
     asmopt_context* ctx = asmopt_create("x86-64");
@@ -252,6 +577,42 @@ static int test_ir_cfg_dump() {
     TEST_PASS("test_ir_cfg_dump");
 }
 
+/* Test CFG edges on many labels, including backward jumps and repeated names */
+static int test_cfg_many_labels() {
+    asmopt_context* ctx = asmopt_create("x86-64");
+    TEST_ASSERT(ctx != NULL, "Failed to create context");
+    
+    size_t label_count = 5000;
+    char* input = malloc(label_count * 48 + 64);
+    TEST_ASSERT(input != NULL, "Allocation failed");
+    size_t used = 0;
+    for (size_t i = 0; i < label_count; i++) {
+        used += (size_t)sprintf(input + used, "L%zu:\n    dec rcx\n    jnz L%zu\n", i, label_count - 1 - i);
+    }
+    sprintf(input + used, "L0:\n    ret\n");
+    asmopt_parse_string(ctx, input);
+    asmopt_optimize(ctx);
+    
+    char* cfg_dot = asmopt_dump_cfg_dot(ctx);
+    TEST_ASSERT(cfg_dot != NULL, "Failed to dump CFG dot");
+    TEST_ASSERT(strstr(cfg_dot, "  L0 -> L4999;\n  L0 -> L1;\n") != NULL, "Forward jump edge missing");
+    TEST_ASSERT(strstr(cfg_dot, "  L4999 -> L0;\n") != NULL, "Backward jump edge missing");
+    TEST_ASSERT(strstr(cfg_dot, "  L2500 -> L2499;\n  L2500 -> L2501;\n") != NULL, "Middle edges missing");
+    free(cfg_dot);
+    
+    /* The repeated L0 block lists the edges of every block named L0. */
+    char* cfg_text = asmopt_dump_cfg_text(ctx);
+    TEST_ASSERT(cfg_text != NULL, "Failed to dump CFG text");
+    const char* last = strstr(cfg_text, "\nL0:\n  ret\n");
+    TEST_ASSERT(last != NULL && strncmp(last + strlen("\nL0:\n  ret\n"), "  -> L4999\n", 11) == 0,
+                "Repeated label does not share edges");
+    free(cfg_text);
+    
+    free(input);
+    asmopt_destroy(ctx);
+    TEST_PASS("test_cfg_many_labels");
+}
+
 /* Test large input handling */
 static int test_large_input() {
     asmopt_context* ctx = asmopt_create("x86-64");
@@ -353,6 +714,7 @@ static int test_comprehensive_report() {
         "mov r15, r13\n"    /* Pattern 26 */
         "mov r10, r11\n"    /* Pattern 27 */
         "mov r12, r9\n"     /* Pattern 27 */
+        "test r12, r12\n"
         "jne .branch_true\n"
         "jmp .branch_false\n"
         ".branch_true:\n"
@@ -402,6 +764,99 @@ static int test_comprehensive_report() {
     TEST_PASS("test_comprehensive_report");
 }
 
+/* Read all of a temp file written by asmopt_write_report; *length gets its size. */
+static char* read_report(asmopt_context* ctx, const char* format, size_t* length) {
+    FILE* file = tmpfile();
+    if (!file) {
+        return NULL;
+    }
+    char* data = NULL;
+    if (asmopt_write_report(ctx, file, format) == 0) {
+        long size = ftell(file);
+        data = size >= 0 ? malloc((size_t)size + 1) : NULL;
+        rewind(file);
+        if (data) {
+            *length = fread(data, 1, (size_t)size, file);
+            data[*length] = '\0';
+        }
+    }
+    fclose(file);
+    return data;
+}
+
+static unsigned long long read_le(const unsigned char* data, size_t bytes) {
+    unsigned long long value = 0;
+    for (size_t i = bytes; i > 0; i--) {
+        value = (value << 8) | data[i - 1];
+    }
+    return value;
+}
+
+static int test_report_formats() {
+    const char* source =
+        "f:\n"
+        "    mov rax, rdi\n"
+        "    mov rax, rdi\n"
+        "    mov rbx, 0\n"
+        "    ret\n";
+    asmopt_context* ctx = asmopt_create("x86-64");
+    TEST_ASSERT(ctx != NULL, "Failed to create context");
+    asmopt_parse_string(ctx, source);
+    asmopt_optimize(ctx);
+    
+    size_t length = 0;
+    char* text = read_report(ctx, "text", &length);
+    char* expected = asmopt_generate_report(ctx);
+    TEST_ASSERT(text != NULL && expected != NULL && strcmp(text, expected) == 0, "Text report differs");
+    
+    char* json = read_report(ctx, "json", &length);
+    TEST_ASSERT(json != NULL && json[0] == '{', "JSON report missing");
+    TEST_ASSERT(strstr(json, "\"summary\":{\"original_lines\":") != NULL, "JSON summary missing");
+    const char* removal = "{\"line\":2,\"pattern\":\"dead_store_move\",\"before\":\"    mov rax, rdi\",\"after\":null}";
+    TEST_ASSERT(strstr(json, removal) != NULL, "JSON removal missing");
+    TEST_ASSERT(strstr(json, "\"scheduling\":[]") != NULL, "Empty JSON section missing");
+    
+    char* jsonl = read_report(ctx, "jsonl", &length);
+    TEST_ASSERT(jsonl != NULL && strncmp(jsonl, "{\"type\":\"summary\",", 18) == 0, "JSONL summary not first");
+    size_t lines = 0;
+    for (const char* ptr = jsonl; *ptr; ptr++) {
+        lines += *ptr == '\n';
+    }
+    TEST_ASSERT(lines == 4, "Expected a summary, two optimizations and f's size");
+    
+    /* Binary records point back into the source instead of copying the text. */
+    unsigned char* binary = (unsigned char*)read_report(ctx, "binary", &length);
+    TEST_ASSERT(binary != NULL && length >= 96 && memcmp(binary, "ASMOPTRB", 8) == 0, "Binary header missing");
+    size_t record_size = (size_t)read_le(binary + 12, 4);
+    size_t records = (size_t)read_le(binary + 16, 8);
+    size_t names_size = (size_t)read_le(binary + 92, 4);
+    TEST_ASSERT(record_size == 32 && records == 3 && length == 96 + names_size + records * record_size,
+                "Binary layout wrong");
+    const unsigned char* record = binary + 96 + names_size;
+    size_t pattern = (size_t)read_le(record + 6, 2);
+    const char* name = (const char*)binary + 96;
+    for (size_t i = 0; i < pattern; i++) {
+        name += strlen(name) + 1;
+    }
+    TEST_ASSERT(strcmp(name, "dead_store_move") == 0, "Pattern id does not name the pattern");
+    size_t offset = (size_t)read_le(record + 16, 8);
+    size_t span = (size_t)read_le(record + 24, 4);
+    TEST_ASSERT(read_le(record + 8, 4) == 1 && offset + span <= strlen(source) &&
+                strncmp(source + offset, "    mov rax, rdi", span) == 0, "Record does not point at its source line");
+    
+    FILE* sink = tmpfile();
+    TEST_ASSERT(sink != NULL && asmopt_write_report(ctx, sink, "xml") == -1, "Unknown format accepted");
+    fclose(sink);
+    
+    free(text);
+    free(expected);
+    free(json);
+    free(jsonl);
+    free(binary);
+    asmopt_destroy(ctx);
+    TEST_PASS("test_report_formats");
+}
+
 int main() {
     int passed = 0;
     int total = 0;
@@ -413,9 +868,15 @@ int main() {
     total++; passed += test_optimization_levels();
     total++; passed += test_option_setting();
     total++; passed += test_ir_cfg_dump();
+    total++; passed += test_cfg_many_labels();
     total++; passed += test_large_input();
     total++; passed += test_edge_cases();
     total++; passed += test_comprehensive_report();
+    total++; passed += test_optimize_files();
+    total++; passed += test_file_read_paths();
+    total++; passed += test_result_cache();
+    total++; passed += test_optimize_stream();
+    total++; passed += test_report_formats();
     
     printf("\n========================================\n");
     printf("Test Results: %d/%d tests passed\n", passed, total);
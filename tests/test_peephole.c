@@ -585,7 +585,8 @@ static int test_load_modify_store() {
     asmopt_context* ctx = asmopt_create("x86-64");
     TEST_ASSERT(ctx != NULL, "Failed to create context");
     
-    const char* input = "mov rax, [rbx]\nadd rax, 5\nmov [rbx], rax\n";
+    /* rax is overwritten afterwards, so the loaded value is dead after the store. */
+    const char* input = "mov rax, [rbx]\nadd rax, 5\nmov [rbx], rax\nxor eax, eax\n";
     asmopt_parse_string(ctx, input);
     asmopt_optimize(ctx);
     
@@ -601,7 +602,7 @@ static int test_load_modify_store() {
     ctx = asmopt_create("x86-64");
     TEST_ASSERT(ctx != NULL, "Failed to create context");
     asmopt_set_format(ctx, "att");
-    const char* att_input = "movq (%rbx,%rcx,4), %rax\naddq $5, %rax\nmovq %rax, (%rbx,%rcx,4)\n";
+    const char* att_input = "movq (%rbx,%rcx,4), %rax\naddq $5, %rax\nmovq %rax, (%rbx,%rcx,4)\nxorl %eax, %eax\n";
     asmopt_parse_string(ctx, att_input);
     asmopt_optimize(ctx);
 
@@ -653,6 +654,162 @@ static int test_sub_one_to_dec() {
     TEST_PASS("test_sub_one_to_dec");
 }
 
+static int test_register_case_insensitive() {
+    asmopt_context* ctx = asmopt_create("x86-64");
+    TEST_ASSERT(ctx != NULL, "Failed to create context");
+    
+    const char* input = "mov RAX, rbx\nmov rbx, rax\nsub Rcx, rcx\n";
+    asmopt_parse_string(ctx, input);
+    asmopt_optimize(ctx);
+    
+    char* output = asmopt_generate_assembly(ctx);
+    TEST_ASSERT(output != NULL, "Failed to generate output");
+    TEST_ASSERT(strstr(output, "mov RAX, rbx") != NULL, "First move of pair was removed");
+    TEST_ASSERT(strstr(output, "mov rbx, rax") == NULL, "Mixed-case move pair not folded");
+    TEST_ASSERT(strstr(output, "xor Rcx, Rcx") != NULL, "Mixed-case sub not converted to xor");
+    
+    free(output);
+    asmopt_destroy(ctx);
+    TEST_PASS("test_register_case_insensitive");
+}
+
+/* eax, ax and al are parts of rax: the move patterns must see them overlap. */
+static int test_register_aliases() {
+    asmopt_context* ctx = asmopt_create("x86-64");
+    TEST_ASSERT(ctx != NULL, "Failed to create context");
+    
+    /* Callee-saved destinations stay live at the ret. */
+    const char* input = "mov eax, esi\nmov rbx, rax\nnop\n"
+                        "mov r12, rsi\nmov r12, r12\nnop\n"
+                        "mov r13d, edi\nmov r13, r8\nnop\n"
+                        "mov r14d, r14d\nnop\n"
+                        "lea r15d, [r15d]\nlea rbp, [rbp+0]\n"
+                        "ret\n";
+    asmopt_parse_string(ctx, input);
+    asmopt_optimize(ctx);
+    
+    char* output = asmopt_generate_assembly(ctx);
+    TEST_ASSERT(output != NULL, "Failed to generate output");
+    TEST_ASSERT(strstr(output, "mov eax, esi\nmov rbx, rax") != NULL, "Moves through eax/rax were reordered");
+    TEST_ASSERT(strstr(output, "mov r12, rsi") != NULL, "Move read by the next one was removed");
+    TEST_ASSERT(strstr(output, "mov r13d, edi") == NULL, "Move overwritten by a wider one was kept");
+    TEST_ASSERT(strstr(output, "mov r14d, r14d") != NULL, "Zero-extending move was removed");
+    TEST_ASSERT(strstr(output, "lea r15d, [r15d]") != NULL, "Zero-extending lea was removed");
+    TEST_ASSERT(strstr(output, "lea rbp") == NULL, "Identity lea with zero displacement not removed");
+    
+    free(output);
+    asmopt_destroy(ctx);
+    TEST_PASS("test_register_aliases");
+}
+
+/* ah/bh/ch/dh look like MASM hex immediates ("0ah"), but are the high bytes of rax-rdx. */
+static int test_high_byte_registers() {
+    const char* names[][2] = {{"eax", "ah"}, {"ebx", "bh"}, {"ecx", "ch"}, {"edx", "dh"}};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        const char* full = names[i][0];
+        const char* high = names[i][1];
+        char input[256];
+        char expected[128];
+        snprintf(input, sizeof(input),
+                 "mov %s, 0x1234\nmov %s, 0\nadd %s, 1\nmov [rdi], %s\n"
+                 "mov %s, esi\nmov %s, r8b\nmov r10d, %s\nmov [rsi], r10d\nret\n",
+                 full, high, full, full, full, high, full);
+        asmopt_context* ctx = asmopt_create("x86-64");
+        TEST_ASSERT(ctx != NULL, "Failed to create context");
+        asmopt_set_optimization_level(ctx, 2);
+        asmopt_parse_string(ctx, input);
+        asmopt_optimize(ctx);
+        char* output = asmopt_generate_assembly(ctx);
+        TEST_ASSERT(output != NULL, "Failed to generate output");
+        snprintf(expected, sizeof(expected), "mov %s, 0x1234\n", full);
+        const char* write = strstr(output, expected);
+        snprintf(expected, sizeof(expected), "%s, %s\n", high, high);
+        const char* zero = strstr(output, expected);
+        TEST_ASSERT(write != NULL && zero != NULL && write < zero, "High-byte write moved above the full write");
+        snprintf(expected, sizeof(expected), "mov %s, r8b\n", high);
+        const char* partial = strstr(output, expected);
+        snprintf(expected, sizeof(expected), "mov r10d, %s\n", full);
+        const char* read = strstr(output, expected);
+        TEST_ASSERT(partial != NULL && read != NULL && partial < read, "Read moved above the high-byte write");
+        free(output);
+        asmopt_destroy(ctx);
+    }
+    TEST_PASS("test_high_byte_registers");
+}
+
+static int test_constant_fold() {
+    asmopt_context* ctx = asmopt_create("x86-64");
+    TEST_ASSERT(ctx != NULL, "Failed to create context");
+    
+    /* The jz reads the flags the last add leaves, so that chain has to stay. */
+    const char* input = "mov eax, 4\nshl eax, 2\nadd eax, 3\nnop\n"
+                        "xor ecx, ecx\nmov ebx, ecx\nnop\n"
+                        "mov edx, 1\nadd edx, 2\njz done\n"
+                        "done:\nret\n";
+    asmopt_parse_string(ctx, input);
+    asmopt_optimize(ctx);
+    
+    char* output = asmopt_generate_assembly(ctx);
+    TEST_ASSERT(output != NULL, "Failed to generate output");
+    TEST_ASSERT(strstr(output, "mov eax, 19\nnop") != NULL, "Constant chain not folded");
+    TEST_ASSERT(strstr(output, "shl") == NULL, "Folded shift was kept");
+    TEST_ASSERT(strstr(output, "xor ebx, ebx") != NULL, "Known zero not turned into a zero idiom");
+    TEST_ASSERT(strstr(output, "mov edx, 1\nadd edx, 2\njz done") != NULL, "Chain feeding a jz was folded");
+    
+    free(output);
+    asmopt_destroy(ctx);
+    TEST_PASS("test_constant_fold");
+}
+
+/* 32-bit identity ALU ops zero-extend too: they go only when the full register is dead. */
+static int test_zero_extending_identities() {
+    asmopt_context* ctx = asmopt_create("x86-64");
+    TEST_ASSERT(ctx != NULL, "Failed to create context");
+    asmopt_set_optimization_level(ctx, 2);
+    
+    /* r12 and r14 are callee-saved, so their upper halves are live at the ret; r10 is not. */
+    const char* input = "and r12d, -1\n"
+                        "add r14d, 0\n"
+                        "add r10d, 0\n"
+                        "and r12, -1\n"
+                        "ret\n";
+    asmopt_parse_string(ctx, input);
+    asmopt_optimize(ctx);
+    
+    char* output = asmopt_generate_assembly(ctx);
+    TEST_ASSERT(output != NULL, "Failed to generate output");
+    TEST_ASSERT(strstr(output, "and r12d, -1\n") != NULL, "Zero-extending and was removed");
+    TEST_ASSERT(strstr(output, "add r14d, 0\n") != NULL, "Zero-extending add was removed");
+    TEST_ASSERT(strstr(output, "r10d") == NULL, "Identity add on a dead register was kept");
+    TEST_ASSERT(strstr(output, "and r12, -1") == NULL, "64-bit identity and was kept");
+    
+    free(output);
+    asmopt_destroy(ctx);
+    TEST_PASS("test_zero_extending_identities");
+}
+
+static int test_disable_single_pattern() {
+    asmopt_context* ctx = asmopt_create("x86-64");
+    TEST_ASSERT(ctx != NULL, "Failed to create context");
+    
+    asmopt_disable_optimization(ctx, "redundant_mov");
+    asmopt_disable_optimization(ctx, "add_one_to_inc");
+    asmopt_enable_optimization(ctx, "add_one_to_inc");
+    const char* input = "mov rbx, 0\nmov rax, rax\nadd rcx, 1\n";
+    asmopt_parse_string(ctx, input);
+    asmopt_optimize(ctx);
+    
+    char* output = asmopt_generate_assembly(ctx);
+    TEST_ASSERT(output != NULL, "Failed to generate output");
+    TEST_ASSERT(strstr(output, "mov rax, rax") != NULL, "Disabled pattern was applied");
+    TEST_ASSERT(strstr(output, "xor rbx, rbx") != NULL, "Other patterns stopped applying");
+    TEST_ASSERT(strstr(output, "inc rcx") != NULL, "Re-enabled pattern not applied");
+    
+    free(output);
+    asmopt_destroy(ctx);
+    TEST_PASS("test_disable_single_pattern");
+}
+
 int main() {
     int passed = 0;
     int total = 0;
@@ -691,6 +848,12 @@ int main() {
     total++; passed += test_context_lifecycle();
     total++; passed += test_comments_preservation();
     total++; passed += test_directives_and_labels();
+    total++; passed += test_register_case_insensitive();
+    total++; passed += test_register_aliases();
+    total++; passed += test_zero_extending_identities();
+    total++; passed += test_high_byte_registers();
+    total++; passed += test_constant_fold();
+    total++; passed += test_disable_single_pattern();
     
     printf("\n========================================\n");
     printf("Test Results: %d/%d tests passed\n", passed, total);